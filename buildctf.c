@@ -17,33 +17,45 @@
 
 void usage(void)
 {
-  fprintf(stderr, "Usage: buildctf [-s size_in_bytes] [-d] directory outputfile\n"); exit(1);
+  fprintf(stderr, "Usage: buildctf [-s size_in_bytes] [-j jobs] [-d] [-D] [--update old.ctf]\n");
+  fprintf(stderr, "\t\tdirectory outputfile\n"); exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-  int write_to_db=0;
-  int ssize=0;
+  Buildparam b;
   int err;
 
-  /* Get the optional argument */
-  if (argc < 3) usage();
+  init_buildparams(&b);
 
-  if (!strcmp(argv[1], "-s")) {
-    ssize=atoi(argv[2]);
-    argc-=2; argv+=2;
-  }
+  /* Get the optional arguments */
+  if (argc < 3) usage();
 
-  if (!strcmp(argv[1], "-d")) {
-    write_to_db=1;
-    argc--; argv++;
+  while ((argc > 3) && (argv[1][0] == '-')) {
+    if (!strcmp(argv[1], "-s")) {
+      b.splitsize=atoi(argv[2]);
+      argc-=2; argv+=2;
+    } else if (!strcmp(argv[1], "-j")) {
+      b.numjobs=atoi(argv[2]);
+      if (b.numjobs < 1) usage();
+      argc-=2; argv+=2;
+    } else if (!strcmp(argv[1], "--update")) {
+      b.update_file=argv[2];
+      argc-=2; argv+=2;
+    } else if (!strcmp(argv[1], "-d")) {
+      b.ondisk=1;
+      argc--; argv++;
+    } else if (!strcmp(argv[1], "-D")) {
+      b.dedup=1;
+      argc--; argv++;
+    } else usage();
   }
 
   /* Check the mandatory arguments */
   if (argc != 3) usage();
 
   /* Do the tokenising */
-  err = tokenise_tree(argv[1], argv[2], write_to_db,ssize);
+  err = tokenise_tree_withparams(argv[1], argv[2], &b);
   if (err == -1) {
     fprintf(stderr, "Error tokenising %s to %s: %s\n", argv[1], argv[2],
 	    strerror(errno));
@@ -9,14 +9,24 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "libctf.h"
 #include "libtdn.h"
 
 void usage(void)
 {
   fprintf(stderr,
-	  "Usage: ctcompare [-n nnn] [-rstxiaqp] [-I nnn] [CTF file] [CTF file...]\n");
+	  "Usage: ctcompare [-n nnn] [-rstxiaqp] [-I nnn] [-j nnn] [-P nnn]\n");
+  fprintf(stderr, "\t\t[--mem-limit nnn] [--sort-merge] [--file-pairs|--tree-matrix]\n");
+  fprintf(stderr, "\t\t[--index file] [--check-index] [--save-index file]\n");
+  fprintf(stderr, "\t\t[--format text|binary|jsonl]\n");
+  fprintf(stderr, "\t\t[--min-len nnn] [--max-len nnn] [--exclude-path regex]\n");
+  fprintf(stderr, "\t\t[--save-results file] [--group-pairs] [--stats]\n");
+  fprintf(stderr, "\t\t[--shards file,file...]\n");
+  fprintf(stderr, "\t\t[CTF file] [CTF file...]\n");
   fprintf(stderr, "\t-n nnn: set the minimum matching run length to nnn\n");
   fprintf(stderr,
 	  "\t-r:     print results sorted by run length descending\n");
@@ -35,6 +45,41 @@ void usage(void)
 	  "\t-p      print partial results, incompatible with -q -r\n");
   fprintf(stderr,
 	  "\t-u      enable heuristics to reduce unwanted comparisons\n");
+  fprintf(stderr,
+	  "\t-j nnn: walk the shards of a split tree, and print -x/-s/-t\n"
+	  "\t        results, with nnn threads\n");
+  fprintf(stderr,
+	  "\t-P nnn: split the in-memory tuples between nnn processes\n");
+  fprintf(stderr,
+	  "\t--mem-limit nnn: use at most about nnn Mbytes (or nnnG Gbytes)\n");
+  fprintf(stderr,
+	  "\t--sort-merge: find matches by sorting the tuples on disk\n");
+  fprintf(stderr,
+	  "\t--file-pairs: only print the # tokens in common per file pair\n");
+  fprintf(stderr,
+	  "\t--tree-matrix: only print the # tokens in common per tree pair\n");
+  fprintf(stderr,
+	  "\t--index file: map the tuples of the first CTF files from file\n");
+  fprintf(stderr,
+	  "\t--check-index: check all of the --index file as it is loaded\n");
+  fprintf(stderr,
+	  "\t--save-index file: save the tuples of the CTF files in file\n");
+  fprintf(stderr,
+	  "\t--format fmt: print the runs as text, binary records or JSON\n");
+  fprintf(stderr,
+	  "\t--min-len nnn, --max-len nnn: drop runs outside these lengths\n");
+  fprintf(stderr,
+	  "\t--exclude-path regex: drop runs in files matching regex\n");
+  fprintf(stderr,
+	  "\t--save-results file: save the runs in file for ctresults\n");
+  fprintf(stderr,
+	  "\t--group-pairs: print the runs grouped by pair of files\n");
+  fprintf(stderr,
+	  "\t--stats: print the time taken by each phase and the shape\n"
+	  "\t         of the in-memory tuples on stderr\n");
+  fprintf(stderr,
+	  "\t--shards file,file...: compare the CTF files made by buildctf -s\n"
+	  "\t         as one tree\n");
   fprintf(stderr, "    CTF file arguments augment those in the %s file\n",
 	  CTFLIST_DB);
   exit(1);
@@ -43,12 +88,41 @@ void usage(void)
 int main(int argc, char *argv[])
 {
   int numctf;			/* Number of CTF files to process */
-  int i, ch;
+  int i, n, ch;
   int quiet = 0;
   Ctfhandle *C;
   Ctfparam *p;
   Run *run, *foundruns = NULL;	/* Matching runs of code that were found */
-  int runcount=0;
+  Dupfile *dup, *dupfiles;	/* Identical files found by buildctf -D */
+  uint64_t runcount=0, dupcount=0;
+  int first = 1;			/* First CTF file not in the index */
+  char *indexname = NULL, *savename = NULL;
+  char **shards;		/* The --shards lists, */
+  int numshards = 0;		/* and how many there are */
+  char *name;
+  int summary = 0;		/* 'f' or 't' to sum the runs per file or */
+  Pairsums *sums = NULL;	/* tree pair, in this table */
+  char *resultsname = NULL;	/* Save the runs in this file */
+  Results *results = NULL;	/* instead of printing them */
+  char *end;
+  static struct option longopts[] = {
+    {"mem-limit", required_argument, NULL, 'M'},
+    {"sort-merge", no_argument, NULL, 'S'},
+    {"file-pairs", no_argument, NULL, 'F'},
+    {"tree-matrix", no_argument, NULL, 'T'},
+    {"index", required_argument, NULL, 'X'},
+    {"save-index", required_argument, NULL, 'W'},
+    {"format", required_argument, NULL, 'O'},
+    {"min-len", required_argument, NULL, 'L'},
+    {"max-len", required_argument, NULL, 'H'},
+    {"exclude-path", required_argument, NULL, 'E'},
+    {"save-results", required_argument, NULL, 'R'},
+    {"group-pairs", no_argument, NULL, 'G'},
+    {"stats", no_argument, NULL, 'Z'},
+    {"shards", required_argument, NULL, 'K'},
+    {"check-index", no_argument, NULL, 'C'},
+    {NULL, 0, NULL, 0}
+  };
 
   /* Initialise the params structure */
   p = init_ctfparams(NULL);
@@ -56,8 +130,13 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Unable to initialise ctfparams structure\n"); exit(1);
   }
 
+  if ((shards = (char **) malloc(argc * sizeof(char *))) == NULL) {
+    fprintf(stderr, "Unable to malloc the --shards lists\n"); exit(1);
+  }
+
   /* Process options */
-  while ((ch = getopt(argc, argv, "an:iI:rstxqpu")) != -1) {
+  while ((ch = getopt_long(argc, argv, "an:iI:rstxqpuj:P:", longopts,
+			   NULL)) != -1) {
 
     switch (ch) {
     case 'I':
@@ -70,8 +149,11 @@ int main(int argc, char *argv[])
     case 'i':
       p->flags |= CTP_ISOMORPHIC; break;
     case 'r':
-      p->flags &= ~CTP_PARTPRINT;
+      p->flags &= ~(CTP_PARTPRINT | CTP_GROUPPAIRS);
       p->flags |= CTP_SORTRESULTS; break;
+    case 'G':
+      p->flags &= ~CTP_SORTRESULTS;
+      p->flags |= CTP_GROUPPAIRS; break;
     case 't':
       p->flags |= CTP_PRINTTOKENS; break;
     case 's':
@@ -84,16 +166,97 @@ int main(int argc, char *argv[])
       i = atoi(optarg);
       if (i < 16) {
 	fprintf(stderr, "Bad value for -n, must be 16 or greater\n");
-      } else
-	p->tuple_size = i; break;
+      } else {
+	p->tuple_size = i;
+      }
+      break;
     case 'q':
       p->flags &= ~CTP_PARTPRINT;
-      quiet = 1; break;
+      p->flags |= CTP_NOLINES;
+      quiet = 1; summary = 0; break;
     case 'p':
       p->flags |= CTP_PARTPRINT;
-      quiet = 0; break;
+      p->flags &= ~CTP_NOLINES;
+      quiet = 0; summary = 0; break;
+    case 'F':
+    case 'T':
+      p->flags &= ~CTP_PARTPRINT;
+      p->flags |= CTP_NOLINES;
+      quiet = 0; summary = (ch == 'F') ? 'f' : 't'; break;
     case 'u':
       p->flags |= CTP_COMPHEUR; break;
+    case 'j':
+      i = atoi(optarg);
+      if (i < 1) {
+	fprintf(stderr, "Bad value for -j, must be 1 or greater\n");
+      } else {
+	p->numthreads = i;
+      }
+      break;
+    case 'P':
+      i = atoi(optarg);
+      if (i < 1) {
+	fprintf(stderr, "Bad value for -P, must be 1 or greater\n");
+      } else {
+	p->numparts = i;
+      }
+      break;
+    case 'M':
+      p->memlimit = strtoul(optarg, &end, 10) << 20;
+      if ((*end == 'G') || (*end == 'g')) {
+	p->memlimit <<= 10; end++;
+      } else if ((*end == 'M') || (*end == 'm')) end++;
+      if ((*end != '\0') || (p->memlimit == 0)) {
+	fprintf(stderr, "Bad value for --mem-limit, must be 1 or greater\n");
+	p->memlimit = 0;
+      }
+      break;
+    case 'S':
+      p->flags |= CTP_SORTMERGE; break;
+    case 'X':
+      indexname = optarg; break;
+    case 'W':
+      savename = optarg; break;
+    case 'O':
+      if (!strcmp(optarg, "text"))
+	p->format = CTF_FORMAT_TEXT;
+      else if (!strcmp(optarg, "binary"))
+	p->format = CTF_FORMAT_BINARY;
+      else if (!strcmp(optarg, "jsonl"))
+	p->format = CTF_FORMAT_JSONL;
+      else
+	usage();
+      break;
+    case 'L':
+    case 'H':
+      i = atoi(optarg);
+      if (i < 1) {
+	fprintf(stderr, "Bad value for --%s-len, must be 1 or greater\n",
+		(ch == 'L') ? "min" : "max");
+      } else if (ch == 'L')
+	p->minlen = i;
+      else
+	p->maxlen = i;
+      break;
+    case 'R':
+      p->flags &= ~(CTP_PARTPRINT | CTP_NOLINES);
+      resultsname = optarg; quiet = 0; summary = 0; break;
+    case 'E':
+      if (add_exclude_path(p, optarg) == -1) {
+	fprintf(stderr, "Bad --exclude-path pattern %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'Z':
+      if (enable_ctfstats(p) == -1) {
+	fprintf(stderr, "Unable to keep statistics: %s\n", strerror(errno));
+	exit(1);
+      }
+      break;
+    case 'K':
+      shards[numshards++] = optarg; break;
+    case 'C':
+      p->flags |= CTP_CHECKINDEX; break;
     default:
       usage();
     }
@@ -102,9 +265,19 @@ int main(int argc, char *argv[])
   argv += optind;
 
   /* Get the list of CTF files in the on-disk list */
+  begin_ctfphase(p, CTS_OPEN);
   load_ctflist();
 
-  /* Add on any extra CTF files from the command line */
+  /* Add on the trees split into shards, then any extra CTF files
+   * from the command line.
+   */
+  for (i = 0; i < numshards; i++) {
+    name = strtok(shards[i], ",");
+    for (n = 0; name != NULL; n++, name = strtok(NULL, ","))
+      if (n == 0) add_ctffile(name, 0);
+      else add_ctfshard(name, 0);
+  }
+  free(shards);
   for (i = 0; i < argc; i++)
     add_ctffile(argv[i], 0);
 
@@ -114,36 +287,158 @@ int main(int argc, char *argv[])
     fprintf(stderr, "No CTF files found as arguments or in %s\n", CTFLIST_DB);
     exit(1);
   }
+  end_ctfphase(p, CTS_OPEN);
 
   /* Initialise the TDN structures */
   init_libtdn(p);
 
-  /* Process each CTF file in the list */
-  for (i = 1; i < numctf; i++) {
+  /* An index holds the in-memory tuples, which the other ways of
+   * searching don't use.
+   */
+  if (((indexname != NULL) || (savename != NULL)) &&
+      ((p->numparts > 1) || p->memlimit || (p->flags & CTP_SORTMERGE))) {
+    fprintf(stderr, "--index and --save-index can't be used with -P, "
+	    "--mem-limit or --sort-merge\n");
+    exit(1);
+  }
+
+  /* Map the tuples of the CTF files in the index. These files are
+   * not compared against each other.
+   */
+  if (indexname != NULL) {
+    begin_ctfphase(p, CTS_OPEN);
+    if ((first = load_index(indexname, p)) == -1) {
+      fprintf(stderr, "Unable to load index %s: %s\n", indexname,
+	      strerror(errno));
+      exit(1);
+    }
+    end_ctfphase(p, CTS_OPEN);
+    first++;
+  }
 
-    C = ctfopen(get_ctfname(i));
-    if (C == NULL) {
-      fprintf(stderr, "Can't open CTF file %s\n", get_ctfname(i)); exit(1);
+  /* To save an index, only load the tuples */
+  if (savename != NULL)
+    p->flags |= CTP_NOSEARCH;
+
+  /* Process each tree in the list. The n shards of a split tree are
+   * processed together. With -P, --mem-limit or --sort-merge, all the
+   * trees are processed at once.
+   */
+  for (i = first; i < numctf; i += n) {
+    begin_ctfphase(p, CTS_OPEN);
+    for (n = 0; (i + n < numctf) && (get_ctftree(i + n) == i); n++) {
+      C = ctfopen(get_ctfname(i + n));
+      if (C == NULL) {
+	fprintf(stderr, "Can't open CTF file %s\n", get_ctfname(i + n));
+	exit(1);
+      }
+      ctfclose(C);
     }
+    end_ctfphase(p, CTS_OPEN);
+    if ((p->numparts > 1) || p->memlimit || (p->flags & CTP_SORTMERGE))
+      continue;
 
-    /* Mark when we reach the last file */
-    if (i== (numctf-1))
+    /* Mark when we reach the last tree */
+    if (i + n == numctf)
       p->flags |= CTP_LASTFILE;
 
-    foundruns = find_runs_from_ctf(i, p);
-    ctfclose(C);
+    begin_ctfphase(p, CTS_SEARCH);
+    foundruns = find_runs_from_shards(i, n, p);
+    end_ctfphase(p, CTS_SEARCH);
   }
+  if (savename != NULL) {
+    if (save_index(savename, p) == -1) {
+      fprintf(stderr, "Unable to save index %s: %s\n", savename,
+	      strerror(errno));
+      exit(1);
+    }
+    print_ctfstats(p, stderr);
+    exit(0);
+  }
+
+  begin_ctfphase(p, CTS_SEARCH);
+  if (p->flags & CTP_SORTMERGE)
+    foundruns = find_runs_by_sorting(p);
+  else if ((p->numparts > 1) || p->memlimit)
+    foundruns = find_runs_from_parts(p);
+  end_ctfphase(p, CTS_SEARCH);
 
+  begin_ctfphase(p, CTS_PRINT);
+
+  /* Files stored as copies of an earlier file by buildctf -D have no
+   * tuples, so find them to report the runs of the earlier file for
+   * them too.
+   */
+  if (index_dupfiles(p) == -1) {
+    fprintf(stderr, "Unable to find the duplicate files: %s\n",
+	    strerror(errno));
+    exit(1);
+  }
   if (quiet) {
     /* Count the number of runs ourselves */
     for (run= foundruns; run != NULL; run = run->next)
-      if (run->length >= p->tuple_size) runcount++;
-    printf("Number of runs found:       %d\n", runcount);
-    printf("Number of TDNs used:        %d\n", p->tdncount);
-    printf("Number of TDN comparisons:  %d\n", p->tdncmpcnt);
+      if (run->length >= p->tuple_size) runcount += 1 + run_dupcount(run);
+    printf("Number of runs found:       %llu\n",
+	   (unsigned long long) runcount);
+    printf("Number of TDNs used:        %llu\n",
+	   (unsigned long long) p->tdncount);
+    printf("Number of TDN comparisons:  %llu\n",
+	   (unsigned long long) p->tdncmpcnt);
+  } else if (summary) {
+    /* Sum up the runs instead of printing them */
+    if ((sums = new_pairsums()) == NULL) {
+      fprintf(stderr, "Unable to make the file pair table\n"); exit(1);
+    }
+    add_runs_to_pairsums(sums, foundruns, p);
+  } else if (resultsname != NULL) {
+    if ((results = new_results()) == NULL) {
+      fprintf(stderr, "Unable to make the results store\n"); exit(1);
+    }
+    add_runs_to_results(results, foundruns, p);
   } else
     print_listruns(foundruns, p);
 
+  /* Files removed as duplicates by buildctf -D are only identical to
+   * files in the same tree, so report them when we show those matches.
+   */
+  if (p->flags & CTP_WITHINTREE) {
+    for (i = 1; i < numctf; i++) {
+      dupfiles = find_dupfiles_from_ctf(i);
+      if (quiet) {
+	for (dup = dupfiles; dup != NULL; dup = dup->next)
+	  if (!dupfile_filtered(dup, p)) dupcount++;
+      } else if (summary)
+	add_dups_to_pairsums(sums, dupfiles, i, p);
+      else if (results != NULL)
+	add_dups_to_results(results, dupfiles, i, p);
+      else
+	print_dupfiles(dupfiles, p);
+      free_dupfiles(dupfiles);
+    }
+    if (quiet)
+      printf("Number of duplicate files:  %llu\n",
+	     (unsigned long long) dupcount);
+  }
+
+  /* Write out the runs still buffered in the binary or JSON format */
+  if (results != NULL) {
+    if (save_results(results, resultsname) == -1) {
+      fprintf(stderr, "Unable to save results %s: %s\n", resultsname,
+	      strerror(errno));
+      exit(1);
+    }
+    free_results(results);
+  } else if (!quiet && !summary)
+    flush_listruns(p);
+
+  if (summary == 'f')
+    print_filepairs(sums, p);
+  else if (summary == 't')
+    print_treematrix(sums, p);
+  free_pairsums(sums);
+  end_ctfphase(p, CTS_PRINT);
+  print_ctfstats(p, stderr);
+
 #ifdef FREE_MEM
   init_ctfparams(p);		/* free() any malloc()d memory */
   free(p);
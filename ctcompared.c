@@ -0,0 +1,549 @@
+/*
+ * Hold the TDNs of a set of CTF files in memory, and answer queries for
+ * the code similarities between them and a CTF file or a source file
+ * sent over a Unix socket.
+ * Copyright (c) Warren Toomey, under the GPL3 license.
+ *
+ * $Revision: 1.1 $
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "libctf.h"
+#include "libtdn.h"
+#include "liblexer.h"
+#include "libtokens.h"
+
+/*
+ * The server loads the CTF files once, and then forks a pool of worker
+ * processes which share the in-memory TDNs copy-on-write. Each worker
+ * accepts one query, adds the query's CTF file to the end of its copy of
+ * the ctflist, walks it against the in-memory TDNs, prints the runs found
+ * to the socket and exits. The server forks a new worker to replace it,
+ * so forking is not part of the time taken to answer a query, and a
+ * worker never has to undo what a query did to its memory.
+ *
+ * A query is one line followed by its data:
+ *	ctf <nbytes>\n		followed by a CTF file of nbytes
+ *	src <nbytes> <name>\n	followed by a source file of nbytes
+ *	stats\n			no data
+ * The answer is the runs, in the same format as ctcompare, and the end
+ * of the answer is the end of the connection.
+ */
+#define MAXHEADER	4096	/* Longest query line */
+#define LATBUCKETS	100000	/* Latencies are kept in 100us buckets */
+#define LATUNIT		100000	/* Width of a bucket in nanoseconds */
+
+/* The number of queries answered and their latencies. This is shared
+ * between all the workers. A query's latency runs from when a worker
+ * accepts its connection until the answer is sent: the time the query
+ * waits in the listen queue for a free worker is not seen, so it is
+ * not counted.
+ */
+typedef struct _latency
+{
+  uint64_t count;			/* Number of queries answered */
+  uint32_t bucket[LATBUCKETS + 1];	/* # in each bucket, & the rest */
+} Latency;
+
+static Latency *lat;
+static volatile sig_atomic_t stopping = 0;
+
+void usage(void)
+{
+  fprintf(stderr,
+	  "Usage: ctcompared [-n nnn] [-rstxiu] [-I nnn] [-j nnn] [-w nnn]\n");
+  fprintf(stderr, "\t\tsocket [CTF file] [CTF file...]\n");
+  fprintf(stderr, "       ctcompared -c socket [file] [file...]\n");
+  fprintf(stderr, "\t-n nnn: set the minimum matching run length to nnn\n");
+  fprintf(stderr,
+	  "\t-r:     print results sorted by run length descending\n");
+  fprintf(stderr, "\t-s:     print results side by side on same line\n");
+  fprintf(stderr,
+	  "\t-x:     show matching source lines when match is found\n");
+  fprintf(stderr, "\t-t:     show matching tokens when match is found\n");
+  fprintf(stderr, "\t-i:     enable isomorphic code comparison\n");
+  fprintf(stderr,
+	  "\t-I nnn: limit the # isomorphic relations to nnn, implies -i\n");
+  fprintf(stderr,
+	  "\t-u      enable heuristics to reduce unwanted comparisons\n");
+  fprintf(stderr,
+	  "\t-j nnn: load the shards of a split tree with nnn threads\n");
+  fprintf(stderr,
+	  "\t-w nnn: answer up to nnn queries at the same time\n");
+  fprintf(stderr,
+	  "\t-c:     send each file (CTF or source) to the server at socket\n");
+  fprintf(stderr,
+	  "\t        and print the runs found, or with no files the latency\n");
+  fprintf(stderr, "    CTF file arguments augment those in the %s file\n",
+	  CTFLIST_DB);
+  exit(1);
+}
+
+/* Return the time now in nanoseconds */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Return the latency in milliseconds which frac of the queries
+ * answered so far were no slower than.
+ */
+static double latency_at(double frac)
+{
+  uint64_t want = (uint64_t) (frac * lat->count + 0.999999), sum = 0;
+  int i;
+
+  for (i = 0; i < LATBUCKETS; i++) {
+    sum += lat->bucket[i];
+    if (sum >= want) break;
+  }
+  return ((i + 1) * (double) LATUNIT / 1000000.0);
+}
+
+static void print_latency(FILE * out)
+{
+  fprintf(out, "Number of queries answered: %llu\n",
+	  (unsigned long long) lat->count);
+  if (lat->count == 0) return;
+  fprintf(out, "Latency p50:                %.1f ms\n", latency_at(0.50));
+  fprintf(out, "Latency p99:                %.1f ms\n", latency_at(0.99));
+}
+
+/* Copy nbytes from in to the file out. Returns 0 if OK, -1 on error */
+static int copy_bytes(FILE * in, FILE * out, uint64_t nbytes)
+{
+  char buf[65536];
+  size_t n;
+
+  while (nbytes > 0) {
+    n = (nbytes < sizeof(buf)) ? nbytes : sizeof(buf);
+    if (fread(buf, 1, n, in) != n) return (-1);
+    if (fwrite(buf, 1, n, out) != n) return (-1);
+    nbytes -= n;
+  }
+  return (0);
+}
+
+/* Put the name of a temporary file or directory made from template,
+ * in $TMPDIR or /tmp, into name.
+ */
+static void tmp_name(char *name, size_t size, char *template)
+{
+  char *dir = getenv("TMPDIR");
+
+  if ((dir == NULL) || (*dir == '\0')) dir = "/tmp";
+  snprintf(name, size, "%s/%s", dir, template);
+}
+
+/* Tokenise the nbytes of source from in, named name, into the CTF file
+ * out. The source is tokenised in a directory of its own, so the name
+ * of the file in the CTF file is the last part of name. Returns 0 if
+ * OK, -1 on error.
+ */
+static int tokenize_query(FILE * in, FILE * out, uint64_t nbytes, char *name)
+{
+  char dir[MAXCTFNAME], *base = basename(name);
+  FILE *src;
+  int cwd, err = -1;
+
+  if ((*base == '\0') || !strcmp(base, ".") || !strcmp(base, ".."))
+    return (-1);
+  tmp_name(dir, sizeof(dir), "ctcdXXXXXX");
+  if (mkdtemp(dir) == NULL) return (-1);
+  if ((cwd = open(".", O_RDONLY)) == -1) {
+    rmdir(dir); return (-1);
+  }
+
+  if (chdir(dir) == 0) {
+    if ((src = fopen(base, "w")) != NULL) {
+      err = copy_bytes(in, src, nbytes);
+      if (fclose(src) != 0) err = -1;
+      if (err == 0) {
+	fputs(CTF_HEADER, out);
+	zout = out;
+	tokenize(base);
+	putc(EOFTOKEN, out);
+      }
+      unlink(base);
+    }
+    if (fchdir(cwd) == -1) err = -1;
+  }
+  close(cwd);
+  rmdir(dir);
+  return (err);
+}
+
+/* Read one query from the connection conn and answer it */
+static void answer_query(int conn, Ctfparam * p)
+{
+  char line[MAXHEADER], ctfname[MAXCTFNAME], *name;
+  unsigned long long nbytes;
+  uint64_t start = now_ns(), t;
+  FILE *in, *out;
+  Ctfhandle *C;
+  Run *foundruns;
+  int fd, id, err, n;
+
+  if ((in = fdopen(conn, "r")) == NULL) return;
+  if (fgets(line, sizeof(line), in) == NULL) return;
+  line[strcspn(line, "\n")] = '\0';
+
+  /* Send everything we print to the connection */
+  if (dup2(conn, 1) == -1) return;
+
+  if (!strcmp(line, "stats")) {
+    print_latency(stdout);
+    fflush(stdout);
+    return;
+  }
+
+  /* Save the CTF file of the query to a temporary file */
+  tmp_name(ctfname, sizeof(ctfname), "ctcqXXXXXX");
+  if ((fd = mkstemp(ctfname)) == -1) {
+    printf("Unable to make a temporary file: %s\n", strerror(errno));
+    fflush(stdout); return;
+  }
+  out = fdopen(fd, "w");
+  err = -1;
+  if ((sscanf(line, "ctf %llu%n", &nbytes, &n) == 1) && (line[n] == '\0'))
+    err = copy_bytes(in, out, nbytes);
+  else if ((sscanf(line, "src %llu %n", &nbytes, &n) == 1) && (n > 4)) {
+    name = &line[n];
+    err = tokenize_query(in, out, nbytes, name);
+  }
+  if (fclose(out) != 0) err = -1;
+
+  /* Add it to the end of the ctflist and check that it is valid */
+  if ((err == 0) && ((C = ctfopen(ctfname)) != NULL)) {
+    ctfclose(C);
+    add_ctffile(ctfname, 0);
+    load_ctflist();
+    id = id_of_ctffile(ctfname);
+  } else
+    id = -1;
+  unlink(ctfname);
+  if (id == -1) {
+    printf("Bad query: %s\n", line);
+    fflush(stdout); return;
+  }
+
+  /* Search the in-memory TDNs for the query's TDNs and print the runs */
+  foundruns = find_runs_from_ctf(id, p);
+  print_listruns(foundruns, p);
+  fflush(stdout);
+
+  /* Count the query's latency */
+  t = (now_ns() - start) / LATUNIT;
+  if (t > LATBUCKETS) t = LATBUCKETS;
+  __sync_fetch_and_add(&lat->bucket[t], 1);
+  __sync_fetch_and_add(&lat->count, 1);
+}
+
+/* The body of each worker: wait for one query and answer it */
+static void worker(int sock, Ctfparam * p)
+{
+  int conn;
+
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  while ((conn = accept(sock, NULL, NULL)) == -1)
+    if (errno != EINTR) {
+      fprintf(stderr, "Unable to accept a connection: %s\n",
+	      strerror(errno));
+      exit(1);
+    }
+  answer_query(conn, p);
+  exit(0);
+}
+
+/* Start a new worker, and return its process id or -1 on error */
+static pid_t start_worker(int sock, Ctfparam * p)
+{
+  pid_t pid;
+
+  fflush(stdout);
+  fflush(stderr);
+  if ((pid = fork()) == 0) worker(sock, p);
+  return (pid);
+}
+
+static void stop(int sig)
+{
+  stopping = 1;
+}
+
+/* Connect to the server at the socket path, send it the query line and
+ * the file (if any), and print out the answer. Returns 0 if OK, -1 on
+ * error.
+ */
+static int send_query(char *path, char *file)
+{
+  struct sockaddr_un addr;
+  char buf[65536];
+  FILE *fin = NULL;
+  struct stat sb;
+  size_t n;
+  int sock;
+
+  if (file != NULL) {
+    if ((fin = fopen(file, "r")) == NULL) {
+      fprintf(stderr, "Cannot open %s\n", file); return (-1);
+    }
+    fstat(fileno(fin), &sb);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) ||
+      (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)) {
+    fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+    if (fin != NULL) fclose(fin);
+    return (-1);
+  }
+
+  /* A file that starts with the CTF header is sent as a CTF file */
+  if (fin == NULL)
+    n = snprintf(buf, sizeof(buf), "stats\n");
+  else if ((fread(buf, 1, 6, fin) == 6) &&
+	   (!strncmp(buf, CTF_HEADER, 6) || !strncmp(buf, CTF_DUPHEADER, 6)))
+    n = snprintf(buf, sizeof(buf), "ctf %llu\n",
+		 (unsigned long long) sb.st_size);
+  else
+    n = snprintf(buf, sizeof(buf), "src %llu %s\n",
+		 (unsigned long long) sb.st_size, file);
+  if (write(sock, buf, n) != n) n = 0;
+
+  if (fin != NULL) {
+    rewind(fin);
+    while ((n = fread(buf, 1, sizeof(buf), fin)) > 0)
+      if (write(sock, buf, n) != n) break;
+    fclose(fin);
+  }
+  shutdown(sock, SHUT_WR);
+
+  /* Copy the answer to stdout */
+  while ((n = read(sock, buf, sizeof(buf))) > 0)
+    fwrite(buf, 1, n, stdout);
+  fflush(stdout);
+  close(sock);
+  return (0);
+}
+
+int main(int argc, char *argv[])
+{
+  int numctf;			/* Number of CTF files to load */
+  int i, n, ch, sock, err = 0;
+  int numworkers = 0;
+  char *client = NULL;
+  pid_t *workers, pid;
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  Ctfhandle *C;
+  Ctfparam *p;
+  uint64_t start = now_ns();
+
+  /* Initialise the params structure */
+  p = init_ctfparams(NULL);
+  if (p == NULL) {
+    fprintf(stderr, "Unable to initialise ctfparams structure\n"); exit(1);
+  }
+
+  /* Process options */
+  while ((ch = getopt(argc, argv, "n:iI:rstxuj:w:c:")) != -1) {
+
+    switch (ch) {
+    case 'I':
+      i = atoi(optarg);
+      if (i < 2) {
+	fprintf(stderr, "Bad value for -I, must be 1 or greater\n");
+      } else {
+	p->isomorph_count_threshold = i;
+      }
+    case 'i':
+      p->flags |= CTP_ISOMORPHIC; break;
+    case 'r':
+      p->flags |= CTP_SORTRESULTS; break;
+    case 't':
+      p->flags |= CTP_PRINTTOKENS; break;
+    case 's':
+      p->flags |= CTP_SIDEBYSIDE; break;
+    case 'x':
+      p->flags |= CTP_PRINTCODE; break;
+    case 'n':
+      i = atoi(optarg);
+      if (i < 16) {
+	fprintf(stderr, "Bad value for -n, must be 16 or greater\n");
+      } else {
+	p->tuple_size = i;
+      }
+      break;
+    case 'u':
+      p->flags |= CTP_COMPHEUR; break;
+    case 'j':
+      i = atoi(optarg);
+      if (i < 1) {
+	fprintf(stderr, "Bad value for -j, must be 1 or greater\n");
+      } else {
+	p->numthreads = i;
+      }
+      break;
+    case 'w':
+      i = atoi(optarg);
+      if (i < 1) {
+	fprintf(stderr, "Bad value for -w, must be 1 or greater\n");
+      } else {
+	numworkers = i;
+      }
+      break;
+    case 'c':
+      client = optarg; break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  /* As a client, send each file to the server */
+  if (client != NULL) {
+    if (argc == 0)
+      err = send_query(client, NULL);
+    for (i = 0; i < argc; i++)
+      err |= send_query(client, argv[i]);
+    exit(err ? 1 : 0);
+  }
+  if (argc < 1) usage();
+
+  /* Get the list of CTF files in the on-disk list */
+  load_ctflist();
+
+  /* Add on any extra CTF files from the command line */
+  for (i = 1; i < argc; i++)
+    add_ctffile(argv[i], 0);
+
+  numctf = load_ctflist();
+  if (numctf < 1) {
+    fprintf(stderr, "No CTF files found as arguments or in %s\n", CTFLIST_DB);
+    exit(1);
+  }
+
+  /* Initialise the TDN structures */
+  init_libtdn(p);
+
+  /* Load the TDNs of each tree in the list, without searching
+   * for runs between them.
+   */
+  p->flags |= CTP_NOSEARCH;
+  for (i = 1; i < numctf; i += n) {
+    for (n = 0; (i + n < numctf) && (get_ctftree(i + n) == i); n++) {
+      C = ctfopen(get_ctfname(i + n));
+      if (C == NULL) {
+	fprintf(stderr, "Can't open CTF file %s\n", get_ctfname(i + n));
+	exit(1);
+      }
+      ctfclose(C);
+    }
+    find_runs_from_shards(i, n, p);
+  }
+
+  /* Make the line tables of the CTF files now, so that the workers
+   * don't each have to make them to print the runs.
+   */
+  for (i = 1; i < numctf; i++)
+    get_linenum(get_ctfhandle(i), 0);
+
+  /* and find the copies made by buildctf -D, to report the runs of the
+   * files that they copy for them too.
+   */
+  if (index_dupfiles(p) == -1) {
+    fprintf(stderr, "Unable to find the duplicate files: %s\n",
+	    strerror(errno));
+    exit(1);
+  }
+
+  /* A query is the last CTF file, so its TDNs are not added */
+  p->flags &= ~CTP_NOSEARCH;
+  p->flags |= CTP_LASTFILE;
+
+  /* Keep the latencies where all the workers can update them */
+  lat = mmap(NULL, sizeof(Latency), PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (lat == MAP_FAILED) {
+    fprintf(stderr, "Unable to map the latency table: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  /* Listen on the socket */
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(argv[0]) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket name %s is too long\n", argv[0]); exit(1);
+  }
+  strcpy(addr.sun_path, argv[0]);
+  unlink(argv[0]);
+  if (((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) ||
+      (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) ||
+      (listen(sock, SOMAXCONN) == -1)) {
+    fprintf(stderr, "Cannot listen on %s: %s\n", argv[0], strerror(errno));
+    exit(1);
+  }
+
+  /* Stop when we are told to, and tidy up */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "Loaded %d CTF files, %llu TDNs in %.1f seconds\n",
+	  numctf - 1, (unsigned long long) p->tdncount,
+	  (now_ns() - start) / 1e9);
+
+  /* Start the workers, and replace each one as it exits */
+  if (numworkers < 1) numworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (numworkers < 2) numworkers = 2;
+  workers = (pid_t *) calloc(numworkers, sizeof(pid_t));
+  if (workers == NULL) {
+    fprintf(stderr, "Unable to malloc worker list: %s\n", strerror(errno));
+    exit(1);
+  }
+  for (i = 0; i < numworkers; i++)
+    workers[i] = start_worker(sock, p);
+
+  while (!stopping) {
+    if ((pid = waitpid(-1, NULL, 0)) == -1) {
+      if (errno == EINTR) continue;
+      sleep(1);
+    }
+    for (i = 0; i < numworkers; i++)
+      if ((workers[i] == -1) || (workers[i] == pid))
+	workers[i] = stopping ? -1 : start_worker(sock, p);
+  }
+
+  /* Stop the workers, and report the latencies */
+  for (i = 0; i < numworkers; i++)
+    if (workers[i] > 0) kill(workers[i], SIGTERM);
+  while (wait(NULL) != -1);
+  unlink(argv[0]);
+  print_latency(stderr);
+  exit(0);
+}
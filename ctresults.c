@@ -0,0 +1,246 @@
+/*
+ * ctresults: Filter, sort, sum and print the runs saved by
+ * ctcompare --save-results, without searching for them again.
+ * Copyright (c) Warren Toomey, under the GPL3 license.
+ *
+ * $Revision: 1.1 $
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <regex.h>
+#include "libctf.h"
+
+static Results *R;		/* The runs, for the sort comparisons */
+static int sortkey;		/* 'l', 's', 'd' or 'p' to sort by length, */
+				/* source or destination file, or file pair */
+
+void usage(void)
+{
+  fprintf(stderr,
+	  "Usage: ctresults [-rstx] [--min-len nnn] [--max-len nnn]\n");
+  fprintf(stderr, "\t\t[--include-path regex] [--exclude-path regex]\n");
+  fprintf(stderr, "\t\t[--sort len|src|dst|pair] [--file-pairs|--tree-matrix]\n");
+  fprintf(stderr, "\t\t[--format text|binary|jsonl] results_file\n");
+  fprintf(stderr,
+	  "\t-r:     print results sorted by run length descending\n");
+  fprintf(stderr, "\t-s:     print results side by side on same line\n");
+  fprintf(stderr,
+	  "\t-x:     show matching source lines when match is found\n");
+  fprintf(stderr, "\t-t:     show matching tokens when match is found\n");
+  fprintf(stderr,
+	  "\t--min-len nnn, --max-len nnn: only print runs within these lengths\n");
+  fprintf(stderr,
+	  "\t--include-path regex: only print runs with a file matching regex\n");
+  fprintf(stderr,
+	  "\t--exclude-path regex: don't print runs with a file matching regex\n");
+  fprintf(stderr,
+	  "\t--sort key: sort by run length, source or destination file,\n"
+	  "\t            or group by file pair\n");
+  fprintf(stderr,
+	  "\t--file-pairs: only print the # tokens in common per file pair\n");
+  fprintf(stderr,
+	  "\t--tree-matrix: only print the # tokens in common per tree pair\n");
+  fprintf(stderr,
+	  "\t--format fmt: print the runs as text, binary records or JSON\n");
+  exit(1);
+}
+
+/* Add the pattern to the list of count patterns */
+static regex_t *add_pattern(regex_t * list, int *count, char *pattern)
+{
+  list = (regex_t *) realloc(list, (*count + 1) * sizeof(regex_t));
+  if (list == NULL) {
+    fprintf(stderr, "Unable to malloc pattern: %s\n", strerror(errno));
+    exit(1);
+  }
+  if (regcomp(&list[*count], pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+    fprintf(stderr, "Bad pattern %s\n", pattern); exit(1);
+  }
+  (*count)++;
+  return (list);
+}
+
+/* Return 1 if the name matches any of the count patterns */
+static int matches(regex_t * list, int count, char *name)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    if (!regexec(&list[i], name, 0, NULL, 0)) return (1);
+  return (0);
+}
+
+/* Comparison function for qsort: sort the run numbers by the sort key,
+ * then by run number so that equal runs keep their order.
+ */
+static int result_compare(const void *aa, const void *bb)
+{
+  uint64_t a = *((const uint64_t *) aa);
+  uint64_t b = *((const uint64_t *) bb);
+  uint32_t *file = NULL, *start = NULL;
+  int c;
+
+  switch (sortkey) {
+  case 'p':
+    /* Group the runs by file pair, then sort them by position */
+    if (R->src_file[a] != R->src_file[b])
+      return ((R->src_file[a] < R->src_file[b]) ? -1 : 1);
+    if (R->dst_file[a] != R->dst_file[b])
+      return ((R->dst_file[a] < R->dst_file[b]) ? -1 : 1);
+    if (R->src_offset[a] != R->src_offset[b])
+      return ((R->src_offset[a] < R->src_offset[b]) ? -1 : 1);
+    if (R->dst_offset[a] != R->dst_offset[b])
+      return ((R->dst_offset[a] < R->dst_offset[b]) ? -1 : 1);
+    break;
+  case 's':
+    file = R->src_file; start = R->src_start; break;
+  case 'd':
+    file = R->dst_file; start = R->dst_start; break;
+  default:
+    if (R->length[a] != R->length[b])
+      return ((R->length[a] > R->length[b]) ? -1 : 1);
+  }
+  if (file != NULL) {
+    if ((c = strcmp(R->names[file[a]], R->names[file[b]])) != 0) return (c);
+    if (start[a] != start[b]) return ((start[a] < start[b]) ? -1 : 1);
+  }
+  return ((a < b) ? -1 : (a > b));
+}
+
+int main(int argc, char *argv[])
+{
+  Ctfparam *p;
+  Pairsums *sums = NULL;
+  uint64_t i, n, *runs;
+  uint8_t *keep;		/* Flags for each source file name */
+  regex_t *include = NULL, *exclude = NULL;
+  int numinclude = 0, numexclude = 0;
+  int minlen = 0, maxlen = 0;
+  int ch, summary = 0;
+  static struct option longopts[] = {
+    {"min-len", required_argument, NULL, 'L'},
+    {"max-len", required_argument, NULL, 'H'},
+    {"include-path", required_argument, NULL, 'I'},
+    {"exclude-path", required_argument, NULL, 'E'},
+    {"sort", required_argument, NULL, 'K'},
+    {"file-pairs", no_argument, NULL, 'F'},
+    {"tree-matrix", no_argument, NULL, 'T'},
+    {"format", required_argument, NULL, 'O'},
+    {NULL, 0, NULL, 0}
+  };
+
+  /* Initialise the params structure */
+  p = init_ctfparams(NULL);
+  if (p == NULL) {
+    fprintf(stderr, "Unable to initialise ctfparams structure\n"); exit(1);
+  }
+
+  /* Process options */
+  while ((ch = getopt_long(argc, argv, "rstx", longopts, NULL)) != -1) {
+    switch (ch) {
+    case 'r':
+      sortkey = 'l'; break;
+    case 't':
+      p->flags |= CTP_PRINTTOKENS; break;
+    case 's':
+      p->flags |= CTP_SIDEBYSIDE; break;
+    case 'x':
+      p->flags |= CTP_PRINTCODE; break;
+    case 'L':
+      minlen = atoi(optarg); break;
+    case 'H':
+      maxlen = atoi(optarg); break;
+    case 'I':
+      include = add_pattern(include, &numinclude, optarg); break;
+    case 'E':
+      exclude = add_pattern(exclude, &numexclude, optarg); break;
+    case 'K':
+      if (!strcmp(optarg, "len")) sortkey = 'l';
+      else if (!strcmp(optarg, "src")) sortkey = 's';
+      else if (!strcmp(optarg, "dst")) sortkey = 'd';
+      else if (!strcmp(optarg, "pair")) sortkey = 'p';
+      else usage();
+      break;
+    case 'F':
+    case 'T':
+      summary = (ch == 'F') ? 'f' : 't'; break;
+    case 'O':
+      if (!strcmp(optarg, "text"))
+	p->format = CTF_FORMAT_TEXT;
+      else if (!strcmp(optarg, "binary"))
+	p->format = CTF_FORMAT_BINARY;
+      else if (!strcmp(optarg, "jsonl"))
+	p->format = CTF_FORMAT_JSONL;
+      else
+	usage();
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1) usage();
+
+  if ((R = load_results(argv[optind])) == NULL) {
+    fprintf(stderr, "Unable to load results %s: %s\n", argv[optind],
+	    strerror(errno));
+    exit(1);
+  }
+
+  /* Match each source file name against the patterns once: bit 0 is
+   * set if it is included, bit 1 if it is excluded.
+   */
+  keep = (uint8_t *) malloc(R->numnames + 1);
+  runs = (uint64_t *) malloc((R->numruns + 1) * sizeof(uint64_t));
+  if ((keep == NULL) || (runs == NULL)) {
+    fprintf(stderr, "Unable to malloc run list: %s\n", strerror(errno));
+    exit(1);
+  }
+  for (i = 0; i < R->numnames; i++)
+    keep[i] = ((numinclude == 0) || matches(include, numinclude, R->names[i]))
+      | (matches(exclude, numexclude, R->names[i]) << 1);
+
+  /* Make the list of runs that we want */
+  for (i = n = 0; i < R->numruns; i++) {
+    if ((minlen && (R->length[i] < minlen)) ||
+	(maxlen && (R->length[i] > maxlen)) ||
+	((keep[R->src_file[i]] | keep[R->dst_file[i]]) & 2) ||
+	!((keep[R->src_file[i]] | keep[R->dst_file[i]]) & 1))
+      continue;
+    runs[n++] = i;
+  }
+  if (sortkey)
+    qsort(runs, n, sizeof(uint64_t), result_compare);
+
+  if (summary) {
+    if ((sums = new_pairsums()) == NULL) {
+      fprintf(stderr, "Unable to make the file pair table\n"); exit(1);
+    }
+    for (i = 0; i < n; i++)
+      add_result_to_pairsums(sums, R, runs[i]);
+    if (summary == 'f')
+      print_filepairs(sums, p);
+    else
+      print_treematrix(sums, p);
+    free_pairsums(sums);
+  } else {
+    for (i = 0; i < n; i++)
+      print_result(R, runs[i], p);
+    flush_listruns(p);
+  }
+
+#ifdef FREE_MEM
+  free_results(R);
+  free(runs);
+  free(keep);
+  init_ctfparams(p);		/* free() any malloc()d memory */
+  free(p);
+#endif
+  exit(0);
+}
@@ -1,45 +1,183 @@
 /*
  * detok: Detokenise a C token file into something a programmer can read.
  * Copyright (c) Warren Toomey, under the GPL3 license.
- * 
- * $Revision: 1.23 $
+ *
+ * $Revision: 1.24 $
  */
 #include <sys/types.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include "libctf.h"
 #include "libtokens.h"
 
-int main(int argc, char *argv[])
+#define OUTBUFSIZE	(1024 * 1024)
+
+static char *outbuf;		/* Buffer of the text to print, */
+static size_t outsize;		/* its size, */
+static size_t outlen;		/* and the number of bytes in it */
+static uint32_t firstline = 0;	/* Only print the lines from firstline */
+static uint32_t lastline = UINT32_MAX;	/* to lastline of each file */
+
+void usage(void)
 {
-  unsigned int ch, linenum = 0;
-  uint32_t val;
-  Ctfhandle *ctf;
-  char **name;
-  uint32_t offset;
+  fprintf(stderr, "Usage: detok [-f filename] [-l first[-last]] ctf_file\n");
+  fprintf(stderr, "\t-f filename: only print the files with this name\n");
+  fprintf(stderr, "\t-l first[-last]: only print these lines of each file\n");
+  exit(1);
+}
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: detok cft_file\n"); exit(1);
+/* Make room for len more bytes in the output buffer, writing it out
+ * first if needed, and return a pointer to the room.
+ */
+static char *outspace(size_t len)
+{
+  if (outlen + len > outsize) {
+    fwrite(outbuf, 1, outlen, stdout);
+    outlen = 0;
+    if (len > outsize) {
+      outsize = len;
+      if ((outbuf = (char *) realloc(outbuf, outsize)) == NULL) {
+	fprintf(stderr, "Unable to malloc output buffer: %s\n",
+		strerror(errno));
+	exit(1);
+      }
+    }
   }
-  ctf = ctfopen(argv[1]);
+  return (outbuf + outlen);
+}
 
-  /* Initialise the name and offsets to after the header */
-  name = (char **) malloc(sizeof(char *));
-  offset = get_ctf_offset(ctf);
+/* Add the text of a token to the output buffer */
+static void put_token(unsigned int ch, uint32_t linenum, uint32_t val,
+		      char *name)
+{
+  size_t len = MAXTOKENTEXT;
 
-  /* While there is a token to be found */
-  while ((ch = get_token(ctf, &offset, &val, name)) != -1) {
+  if ((ch == FILENAME) || (ch == DUPFILE)) {
+    len += strlen(name);
+    if (ch == DUPFILE) len += strlen(name + strlen(name) + 1);
+  }
+  outlen += format_token(outspace(len), ch, linenum, val, name);
+}
+
+/* Print the tokens from the given offset on. If onefile is set, stop
+ * at the file record after the first one, and only print the lines
+ * from firstline to lastline.
+ */
+static void print_tokens(Ctfhandle * ctf, uint64_t offset, int onefile)
+{
+  uint32_t linenum = 0, val, fileval = 0;
+  char *name, *filename = NULL, *buf;
+  int ch;
+
+  while ((ch = get_token(ctf, &offset, &val, &name)) != -1) {
     switch (ch) {
     case FILENAME:
+      if (onefile && (filename != NULL)) return;
+      filename = name;
+      fileval = val;
       linenum = 1;
-      print_token(ch, linenum, val, *name);
+      if (firstline <= 1) put_token(ch, linenum, val, name);
+      break;
+    case DUPFILE:
+      if (onefile && (filename != NULL)) return;
+      filename = name;
+      put_token(ch, linenum, val, name);
       break;
     case LINE:
       linenum++;
+      if (linenum > lastline) {
+	if (onefile) return;
+      } else if ((linenum == firstline) && (filename != NULL))
+	/* Print the file's name before the first line we want */
+	put_token(FILENAME, linenum, fileval, filename);
+      else if (linenum > firstline)
+	put_token(ch, linenum, val, name);
+      break;
+    default:
+      if ((linenum >= firstline) && (linenum <= lastline))
+	put_token(ch, linenum, val, name);
+    }
+
+    /* Once we are in the lines we want, format the tokens up to the
+     * next file record or the last line in bulk.
+     */
+    if ((linenum >= firstline) && (linenum <= lastline)) {
+      buf = outspace(MAXTOKENTEXT);
+      outlen += format_tokens(ctf, &offset, &linenum, lastline, buf,
+			      outsize - outlen);
+    }
+  }
+}
+
+/* Return 1 if the name of a file in the CTF file is want, or ends in
+ * a '/' followed by want, otherwise 0.
+ */
+static int name_matches(char *name, char *want)
+{
+  size_t namelen = strlen(name), wantlen = strlen(want);
+
+  if (namelen < wantlen) return (0);
+  if (namelen == wantlen) return (!strcmp(name, want));
+  return ((name[namelen - wantlen - 1] == '/') &&
+	  !strcmp(name + namelen - wantlen, want));
+}
+
+int main(int argc, char *argv[])
+{
+  Ctfhandle *ctf;
+  char *want = NULL, *end;
+  uint64_t offset;
+  int ch;
+
+  while ((ch = getopt(argc, argv, "f:l:")) != -1) {
+    switch (ch) {
+    case 'f':
+      want = optarg; break;
+    case 'l':
+      firstline = lastline = strtoul(optarg, &end, 10);
+      if (*end == '-')
+	lastline = (end[1] == '\0') ? UINT32_MAX : strtoul(end + 1, &end, 10);
+      if ((*end != '\0') || (firstline == 0) || (lastline < firstline))
+	usage();
+      break;
     default:
-      print_token(ch, linenum, val, *name);
+      usage();
     }
   }
+  if (optind != argc - 1) usage();
+
+  if ((ctf = ctfopen(argv[optind])) == NULL) {
+    fprintf(stderr, "Unable to open %s: %s\n", argv[optind], strerror(errno));
+    exit(1);
+  }
+  outsize = OUTBUFSIZE;
+  if ((outbuf = (char *) malloc(outsize)) == NULL) {
+    fprintf(stderr, "Unable to malloc output buffer: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  /* Start after the header */
+  offset = get_ctf_offset(ctf);
+
+  if ((want == NULL) && (firstline == 0))
+    print_tokens(ctf, offset, 0);
+  else {
+    /* Skip from one file record to the next without decoding the tokens
+     * in between, and print the ones we want.
+     */
+    while (next_filerecord(ctf, &offset) != -1) {
+      if ((want == NULL) ||
+	  name_matches((char *) ctf->start + offset + 5, want))
+	print_tokens(ctf, offset, 1);
+      get_token(ctf, &offset, NULL, NULL);
+    }
+    *outspace(1) = '\n'; outlen++;
+  }
+
+  fwrite(outbuf, 1, outlen, stdout);
   exit(0);
 }
@@ -13,7 +13,11 @@
 
 #define CTFLIST_DB "ctflist.db"	/* Name of the Ctf list created */
 #define MAXCTFNAME 1024		/* Maximum size of any CTF filename */
+#define CTF_HEADER "ctf2.1"	/* Header of a CTF file, and of one which */
+#define CTF_DUPHEADER "ctf2.2"	/* can hold DUPFILE records: buildctf -D */
 #define TUPLE_SIZE 16	   /* By default, each tuple has TUPLE_SIZE tokens */
+#define MAXTOKENTEXT 64	   /* Longest text of a token, not counting the */
+			   /* filenames, from format_token() */
 
 
 /*** Structures defined by the library ***/
@@ -26,11 +30,24 @@ typedef struct _ctfparam
   char *dbname;			/* Name of disk file with list of CTF files */
   int isomorph_count_threshold;	/* Maximum # of isomorphic relations */
   int flags;			/* Search & printing flags; see below */
+  int numthreads;		/* Max # of threads walking the shards of a */
+				/* split tree, or 0 for one per CPU */
+  int numparts;			/* If > 1, # of processes to split the */
+				/* in-memory TDNs between */
+  size_t memlimit;		/* If not 0, the most bytes of memory that */
+				/* the in-memory TDNs should make us use */
+  int format;			/* Format of the runs printed; see below */
+  int minlen;			/* If not 0, drop runs shorter than this */
+  int maxlen;			/* If not 0, drop runs longer than this */
+  struct _pathfilter *exclude;	/* Drop runs in files whose names match */
+				/* these, see add_exclude_path() */
 
   /* Statistics counters */
-  int runcount;			/* Number of runs of similarity found */
-  int tdncount;			/* Number of TDNs used to find similarities */
-  int tdncmpcnt;		/* Number of TDN comparisons made */
+  uint64_t runcount;		/* Number of runs of similarity found */
+  uint64_t tdncount;		/* Number of TDNs used to find similarities */
+  uint64_t tdncmpcnt;		/* Number of TDN comparisons made */
+  struct _ctfstats *stats;	/* If not NULL, time the phases of the */
+				/* search, see enable_ctfstats() */
 } Ctfparam;
 
 				/* Available flag bits & their meaning */
@@ -52,6 +69,59 @@ typedef struct _ctfparam
 				/* the runs itself and returns NULL */
 #define CTP_COMPHEUR	0x200	/* Enable some heuristics which remove */
 				/* certain unwanted matches: see the Readme */
+#define CTP_SORTMERGE	0x400	/* Find the matches by sorting the tuples */
+				/* on disk: see find_runs_by_sorting() */
+#define CTP_NOLINES	0x800	/* The runs won't be printed, so don't */
+				/* find the end lines of each run */
+#define CTP_GROUPPAIRS	0x1000	/* Print results grouped by file pair, */
+				/* in file order: see runpair_compare() */
+#define CTP_CHECKINDEX	0x2000	/* Check every TDN and group of an index */
+				/* image as it is loaded: see load_index() */
+
+				/* Formats that the runs are printed in */
+#define CTF_FORMAT_TEXT		0	/* len name:a-b name:c-d lines */
+#define CTF_FORMAT_BINARY	1	/* Runrecs, see below */
+#define CTF_FORMAT_JSONL	2	/* A JSON object on each line */
+
+
+/* The phases of a comparison timed by the Ctfstats */
+#define CTS_OPEN	0	/* Opening the CTF files and the index */
+#define CTS_SEARCH	1	/* Searching for runs, which includes: */
+#define CTS_EXTRACT	2	/*   making the TDNs from the tokens, */
+#define CTS_PROBE	3	/*   finding the TDNs which match each TDN, */
+#define CTS_RUNS	4	/*   making, extending & completing runs, */
+#define CTS_ISOMORPH	5	/*   and the isomorphic checks on the runs */
+#define CTS_PRINT	6	/* Printing, summing or saving the runs */
+#define CTS_NUMPHASES	7
+
+#define CTS_CHAINBUCKETS 24	/* Buckets in the chain length histogram */
+
+/* Statistics about a comparison, kept when p->stats is not NULL */
+typedef struct _ctfstats
+{
+  uint64_t wall[CTS_NUMPHASES];	/* Nanoseconds of wall clock time and */
+  uint64_t cpu[CTS_NUMPHASES];	/* of CPU time spent in each phase. The */
+				/* CPU time is only kept for the phases */
+				/* timed by begin_ctfphase() */
+  uint64_t wallstart[CTS_NUMPHASES];	/* When the phases were begun */
+  uint64_t cpustart[CTS_NUMPHASES];
+  uint64_t peakruns;		/* Most incomplete runs at any one time */
+  uint64_t *ctfwall;		/* Nanoseconds spent walking each CTF */
+  int numctfwall;		/* file, and the size of the array */
+} Ctfstats;
+
+
+/* List of parameters passed to tokenise_tree_withparams() */
+typedef struct _buildparam
+{
+  int ondisk;			/* If 1, add the CTF file names to ctflist.db */
+  int splitsize;		/* If non-zero, split the output at this size */
+  int numjobs;			/* Number of worker processes tokenising files */
+  char *update_file;		/* If not NULL, copy the records of unchanged */
+				/* files from this old CTF file */
+  int dedup;			/* If 1, write DUPFILE records for files */
+				/* with the same tokens as an earlier file */
+} Buildparam;
 
 
 /* Handle to an open and mmap()d CTF file */
@@ -61,33 +131,57 @@ typedef struct _ctfhandle
   uint8_t *start;	/* Starting address of the mmap */
   uint8_t *end;		/* End address of the mmap +1 (i.e 1st outside) */
   uint8_t *cursor;	/* Current position in the map, used internally */
-  uint32_t name_offset;	/* Offset of the last filename found */
-  uint32_t linenum;	/* Linenumber of the last line found */
+  struct _ctffile *files;	/* Table of the file records found so far */
+  uint32_t numfiles;	/* Number of entries in the table */
+  uint32_t maxfiles;	/* Size of the table */
+  struct _tdn *tdns;	/* Array of the TDNs made from the file */
+  uint32_t numtdns;	/* Number of TDNs in the array */
+  size_t tdnmapsize;	/* Size of the mmap holding the array */
+  struct _linetable *lines;	/* Table of line numbers, made when needed */
+  int inimage;		/* Set if the TDNs and the file record table */
+			/* are in a mapped index image, see load_index() */
+  uint8_t *excluded;	/* Bitmap of the file record table entries */
+			/* excluded by add_exclude_path(), and the */
+  uint32_t numexcluded;	/* number of entries in it, made when needed */
+  int hasdups;		/* Set if the header is CTF_DUPHEADER, so the */
+			/* file can hold DUPFILE records */
 } Ctfhandle;
 
 
+/* As a CTF file can be larger than 4 Gbytes, the offsets in it are 64
+ * bits. To keep the TDNs small, each CTF file has a table of the file
+ * records found in it, and a TDN holds an index into this table and a
+ * 32-bit offset from the entry's base. Normally the base is the offset of
+ * the file record. If a file record is so large that the offset from its
+ * start won't fit in 32 bits, another entry for the same file record is
+ * added with a later base.
+ */
+typedef struct _ctffile
+{
+  uint64_t name_offset;		/* Offset of the file record */
+  uint64_t base;		/* Offset which TDN offsets are relative to */
+} Ctffile;
+
+
 /* The TDN represents the details of one tuple of TUPLE_SIZE tokens from
- * a CTF file: which TDN preceded this one, the tuple's CRC, the offset
- * of the first token in the CTF file, and the offset of the source code
- * filename which contains the tokens in this tuple.
+ * a CTF file: the tuple's CRC, the offset of the first token in the CTF
+ * file, the entry in the CTF file's table of file records which holds the
+ * source code filename of the tokens in this tuple, and the id of the CTF
+ * file. Use tdn_offset() and tdn_name_offset() to get the offsets in full.
  *
- * The top 12 bits of file_line_id represent the CTF file identity, i.e.
- * there can be up to 4096 CTF files in the database. The bottom 20 bits
- * represent the line number where the first token in the TDN occurred, i.e.
- * source code files can be up to 1,048,576 lines long.
+ * The TDNs made from a CTF file are kept in order in one array, so the
+ * TDN which preceded a TDN in its CTF file is the one before it in the
+ * array. The line number where the first token in the TDN occurred is not
+ * stored: get_linenum() finds it from the offset.
  */
 typedef struct _tdn
 {
-  struct _tdn *previnctf;     /* Previous TDN from the CTF file */
   uint32_t tuple_crc;	      /* CRC of the tokens in this tuple */
-  uint32_t offset;	      /* Offset where this tuple of tokens occurs */
-  uint32_t name_offset;	      /* Offset of the filename which has this tuple */
-  uint32_t file_line_id;    /* Two bitfields containing CTF file id & line # */
+  uint32_t offset;	      /* Offset of the tuple from the entry's base */
+  uint32_t fileidx;	      /* Entry in the CTF file's file record table */
+  uint32_t ctfid;	      /* Id of the CTF file which has this tuple */
 } TDN;
 
-#define NUMCTFFILES (1 << 12)
-#define MAXSRCLINES (1 << 20)
-
 
 /*
  * We build up runs of code similarity by walking the TDNs of a single CTF
@@ -96,7 +190,9 @@ typedef struct _tdn
  * represent each run with the Run node. The fields are the starting and
  * ending TDNs from each tree, the length of the run in tokens, and a
  * next pointer used to build a singly-linked list of runs found. The
- * touched flag is used internally and should not be modified.
+ * touched flag is used internally and should not be modified. When the
+ * run is complete, the line of the last token on each side is saved,
+ * so that printing the run doesn't have to walk the CTF files again.
  */
 
 typedef struct _run
@@ -105,12 +201,123 @@ typedef struct _run
   TDN *dst_startnode;		/* 1st TDN from the other tree */
   TDN *src_endnode;		/* Currently last TDN from walking tree */
   TDN *dst_endnode;		/* Currently last TDN from other tree */
-  uint32_t length;		/* Length of the run so far */
   struct _run *next;		/* Linked list of all incomplete runs */
+  uint32_t length;		/* Length of the run so far */
   uint32_t touched;		/* Flag to indicate if the run was touched */
+  uint32_t src_endline;		/* Line of the last token on each side, */
+  uint32_t dst_endline;		/* set once the run is complete */
 } Run;
 
 
+/*
+ * With CTF_FORMAT_BINARY, the runs are written in the native byte order
+ * as a Runshdr, then a Runrec for each run, then the filename table, then
+ * a Runstrailer. The filename table is an array of the 64-bit offsets in
+ * the output of numnames NUL-terminated names, followed by the names. The
+ * srcname and dstname of each Runrec are indexes into the table. Files
+ * found by buildctf -D are written as runs from the duplicate file to the
+ * earlier file, as in the text format.
+ */
+#define RUNS_MAGIC	"ctfrun1"	/* Includes the NUL to make 8 bytes */
+
+typedef struct _runshdr
+{
+  char magic[8];		/* RUNS_MAGIC */
+  uint32_t recsize;		/* sizeof(Runrec), to check the output */
+  uint32_t unused;
+} Runshdr;
+
+typedef struct _runrec
+{
+  uint32_t length;		/* Length of the run in tokens */
+  uint32_t srcname;		/* Index of the source file's name, and */
+  uint32_t srcstart;		/* the first and last lines of the run */
+  uint32_t srcend;		/* in it, in the tree we walked */
+  uint32_t dstname;		/* The same for the other tree */
+  uint32_t dststart;
+  uint32_t dstend;
+} Runrec;
+
+typedef struct _runstrailer
+{
+  uint64_t numruns;		/* Number of Runrecs */
+  uint64_t numnames;		/* Number of names in the filename table */
+  uint64_t namesoff;		/* Offset of the filename table */
+} Runstrailer;
+
+
+/*
+ * A source file which buildctf -D found to have the same tokens as an
+ * earlier file in the same CTF tree is stored as a DUPFILE record. Each
+ * one is described by a Dupfile node: the names of both files, the
+ * number of tokens they hold, and the lines of the first and last token.
+ * The names point into the mmap()d CTF file.
+ */
+typedef struct _dupfile
+{
+  char *name;			/* Name of the duplicate file */
+  char *origname;		/* Name of the earlier file it duplicates */
+  uint32_t ntokens;		/* Number of tokens in each file */
+  uint32_t firstline;		/* Line number of the first token */
+  uint32_t lastline;		/* Line number of the last token */
+  struct _dupfile *next;	/* Linked list of duplicate files */
+} Dupfile;
+
+
+/*
+ * The number of tokens in common between each pair of source files, as
+ * found in runs and duplicate files, is summed in a Pairsums table so
+ * that the pairs, or the trees they are in, can be ranked without
+ * printing each run. Use new_pairsums() to make one; its contents are
+ * private to the library.
+ */
+typedef struct _pairsums Pairsums;
+
+
+/*
+ * The runs found by a comparison, and the files found by buildctf -D,
+ * can be kept in a Results store and saved to a file with save_results(),
+ * so that load_results() can filter, sort, sum and print them later
+ * without searching for them again. Each field of the runs is held in an
+ * array of its own, indexed by run number, so that a program need only
+ * look at the fields it uses. The CTF file ids are those in the ctflist
+ * when the runs were found; ctfids[] gives each one's id in the ctflist
+ * now. Use new_results() to make one; data is private to the library.
+ */
+typedef struct _results
+{
+  uint64_t numruns;		/* Number of runs */
+  uint32_t *length;		/* Length of each run in tokens */
+  uint32_t *src_ctfid;		/* For the walked tree and the other tree: */
+  uint32_t *dst_ctfid;		/* the CTF file id, */
+  uint32_t *src_file;		/* the index in names of the source file, */
+  uint32_t *dst_file;
+  uint32_t *src_start;		/* the first and last lines of the run, */
+  uint32_t *src_end;
+  uint32_t *dst_start;
+  uint32_t *dst_end;
+  uint64_t *src_offset;		/* and the offset in the CTF file of its */
+  uint64_t *dst_offset;		/* first token, 0 for a duplicate file */
+  uint32_t numnames;		/* Number of source file names */
+  char **names;			/* The source file names */
+  uint32_t numctf;		/* Number of CTF files, ids 1 to numctf */
+  char **ctfnames;		/* Name of each CTF file, by id */
+  int *ctfids;			/* Id in the ctflist of each, by id */
+  struct _resultsdata *data;	/* Private to the library */
+} Results;
+
+
+/*
+ * All the state of a comparison: the CTF list, the in-memory TDNs and
+ * the runs being built, is held in a Ctfsession. A program which only
+ * does one comparison at a time can ignore sessions, as every thread
+ * starts off using the default session. Otherwise, use new_ctfsession()
+ * to make one and use_ctfsession() to make it the current session of the
+ * calling thread; its contents are private to the library.
+ */
+typedef struct _ctfsession Ctfsession;
+
+
 /*** Functions exported by the library ***/
 
 #endif /* LIBCTF_H */
@@ -14,11 +14,14 @@
 #include <fts.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "liblexer.h"
+#include "crc32.h"
 
 FILE *zin, *zout;		/* XXX: Make these not globals */
 
-void output_filename(char *name)
+void output_filename(char *name, FILE * out)
 {
   struct stat sb;
   uint32_t timestamp = 0;
@@ -28,13 +31,714 @@ void output_filename(char *name)
     timestamp = sb.st_mtime;
 
   /* Output the FILENAME token, the timestamp, the filename and a NUL */
-  fputc(FILENAME, zout);
-  fputc((timestamp >> 24) & 0xff, zout);
-  fputc((timestamp >> 16) & 0xff, zout);
-  fputc((timestamp >> 8) & 0xff, zout);
-  fputc(timestamp & 0xff, zout);
+  fputc(FILENAME, out);
+  fputc((timestamp >> 24) & 0xff, out);
+  fputc((timestamp >> 16) & 0xff, out);
+  fputc((timestamp >> 8) & 0xff, out);
+  fputc(timestamp & 0xff, out);
+  fputs(name, out);
+  fputc('\0', out);
+}
+
+/*
+ * When tokenising with several jobs, each worker process is fed file
+ * names down a pipe and sends back the tokenised file record on another
+ * pipe. Files are handed out to the workers round-robin, and so the
+ * results can be collected back in exactly the order fts gave them to us.
+ */
+typedef struct _worker
+{
+  pid_t pid;			/* Process id of the worker */
+  int tofd;			/* Pipe to send file names to the worker */
+  int fromfd;			/* Pipe to get the file records back */
+} Worker;
+
+/* Write or read exactly len bytes on a pipe. Returns 0 if OK, -1 on error */
+static int write_all(int fd, void *buf, size_t len)
+{
+  uint8_t *ptr = buf;
+  ssize_t cnt;
+
+  while (len > 0) {
+    cnt = write(fd, ptr, len);
+    if (cnt == -1 && errno == EINTR) continue;
+    if (cnt <= 0) return (-1);
+    ptr += cnt; len -= cnt;
+  }
+  return (0);
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+  uint8_t *ptr = buf;
+  ssize_t cnt;
+
+  while (len > 0) {
+    cnt = read(fd, ptr, len);
+    if (cnt == -1 && errno == EINTR) continue;
+    if (cnt <= 0) return (-1);
+    ptr += cnt; len -= cnt;
+  }
+  return (0);
+}
+
+/* The body of a worker process. Read each file name from fd, tokenise
+ * the file into a memory buffer and write the buffer's length and
+ * contents to outfd. Exit when the file name pipe is closed.
+ */
+static void worker_loop(int fd, int outfd)
+{
+  char *name;
+  uint32_t len;
+  char *buf;
+  size_t size;
+  Lexctx lc;
+
+  while (read_all(fd, &len, sizeof(len)) == 0) {
+    if ((name = malloc(len + 1)) == NULL) break;
+    if (read_all(fd, name, len) == -1) break;
+    name[len] = '\0';
+
+    /* Tokenise the file into a memory buffer */
+    lc.out = open_memstream(&buf, &size);
+    if (lc.out == NULL) break;
+    tokenize_ctx(&lc, name);
+    fclose(lc.out);
+
+    /* And send the file record back to the parent */
+    len = size;
+    if ((write_all(outfd, &len, sizeof(len)) == -1) ||
+        (write_all(outfd, buf, size) == -1)) break;
+    free(buf);
+    free(name);
+  }
+  _exit(0);
+}
+
+/* Start up numjobs worker processes. Returns 0 if OK, -1 on error */
+static int start_workers(Worker * w, int numjobs)
+{
+  int tofd[2], fromfd[2];
+  int i, j;
+
+  for (i = 0; i < numjobs; i++) {
+    if (pipe(tofd) == -1) return (-1);
+    if (pipe(fromfd) == -1) return (-1);
+
+    w[i].pid = fork();
+    if (w[i].pid == -1) return (-1);
+
+    if (w[i].pid == 0) {
+      /* Close the other workers' pipes and our parent ends */
+      for (j = 0; j < i; j++) {
+	close(w[j].tofd); close(w[j].fromfd);
+      }
+      close(tofd[1]); close(fromfd[0]);
+      worker_loop(tofd[0], fromfd[1]);
+    }
+
+    close(tofd[0]); close(fromfd[1]);
+    w[i].tofd = tofd[1];
+    w[i].fromfd = fromfd[0];
+  }
+  return (0);
+}
+
+/* Close the workers' pipes, wait for them to exit and free the
+ * worker list. Always returns -1 so that it can be used on the error
+ * paths, and errno is preserved for the caller.
+ */
+static int stop_workers(Worker * w, int numjobs)
+{
+  int i, saverr = errno;
+
+  for (i = 0; i < numjobs; i++)
+    if (w[i].pid > 0) {
+      close(w[i].tofd); close(w[i].fromfd);
+    }
+  for (i = 0; i < numjobs; i++)
+    if (w[i].pid > 0) waitpid(w[i].pid, NULL, 0);
+  free(w);
+  errno = saverr;
+  return (-1);
+}
+
+/*
+ * When updating a CTF file, the file records in the old CTF file(s) are
+ * indexed by filename. The tokens of a source file which has the same
+ * timestamp as the one in the old record can be copied over verbatim.
+ * A DUPFILE record has no tokens of its own, so it borrows the tokens
+ * of the earlier file that it duplicates.
+ */
+typedef struct _oldrec
+{
+  char *name;			/* Filename in the old record */
+  uint32_t timestamp;		/* Timestamp in the old record */
+  uint8_t *tokens;		/* Start of the file's tokens in the old */
+  size_t toklen;		/* CTF file, and their length in bytes */
+  char *origname;		/* For DUPFILE records, the earlier file */
+  struct _oldrec *next;		/* Next record on the same hash chain */
+} Oldrec;
+
+typedef struct _oldctf
+{
+  int numctf;			/* Number of old CTF files */
+  Ctfhandle **ctf;		/* and their handles */
+  uint32_t hashmask;		/* Size of the hash table - 1 */
+  Oldrec **hash;		/* Hash table of Oldrec chains */
+} Oldctf;
+
+/* Find the old record with the given filename, or NULL if none */
+static Oldrec *lookup_oldrec(Oldctf * old, char *name)
+{
+  Oldrec *rec;
+
+  rec = old->hash[crc32(name, strlen(name)) & old->hashmask];
+  for (; rec != NULL; rec = rec->next)
+    if (!strcmp(rec->name, name))
+      return (rec);
+  return (NULL);
+}
+
+/* Return the position after the NUL-terminated string at posn,
+ * or NULL if the string runs off the end of the CTF file.
+ */
+static uint8_t *skip_string(uint8_t * posn, uint8_t * end)
+{
+  while ((posn < end) && (*posn != '\0')) posn++;
+  return ((posn < end) ? posn + 1 : NULL);
+}
+
+/* Walk the file records in the given old CTF file and add them
+ * to the index. Returns 0 if OK, -1 on error.
+ */
+static int index_oldctf(Oldctf * old, Ctfhandle * ctf)
+{
+  uint8_t *posn = ctf->cursor;
+  uint8_t token;
+  Oldrec *rec = NULL;
+  uint32_t h;
+
+  while ((posn < ctf->end) && (*posn != EOFTOKEN)) {
+    switch (*posn) {
+    case FILENAME:
+    case DUPFILE:
+      /* Finish off the previous record */
+      if (rec != NULL) rec->toklen = posn - rec->tokens;
+      if (posn + 5 >= ctf->end) return (-1);
+
+      rec = (Oldrec *) malloc(sizeof(Oldrec));
+      if (rec == NULL) return (-1);
+      rec->timestamp = (posn[1] << 24) | (posn[2] << 16) |
+			(posn[3] << 8) | posn[4];
+      rec->name = (char *) posn + 5;
+      rec->origname = NULL;
+
+      /* Move the position up past the name(s) and the three 4-byte
+       * values in a DUPFILE record.
+       */
+      token = *posn;
+      posn = skip_string(posn + 5, ctf->end);
+      if ((posn != NULL) && (token == DUPFILE)) {
+	rec->origname = (char *) posn;
+	posn = skip_string(posn, ctf->end);
+	if (posn != NULL) posn += 3 * sizeof(uint32_t);
+      }
+      if ((posn == NULL) || (posn > ctf->end)) {
+	free(rec); return (-1);
+      }
+      rec->tokens = posn;
+
+      /* Add the record to the front of its hash chain */
+      h = crc32(rec->name, strlen(rec->name)) & old->hashmask;
+      rec->next = old->hash[h];
+      old->hash[h] = rec;
+      break;
+
+    case STRINGLIT:
+    case CHARCONST:
+    case LABEL:
+    case IDENTIFIER:
+    case INTVAL:
+      posn += 3;		/* Skip the token + the 2-byte id value */
+      break;
+
+    default:
+      posn++;
+    }
+  }
+  if (rec != NULL) rec->toklen = posn - rec->tokens;
+  return (0);
+}
+
+/* Point each DUPFILE record at the tokens of the earlier file that
+ * it duplicates. If there is no such file, the DUPFILE record can't
+ * be used, so it gets no tokens.
+ */
+static void resolve_olddups(Oldctf * old)
+{
+  Oldrec *rec, *orig;
+  uint32_t h;
+
+  for (h = 0; h <= old->hashmask; h++)
+    for (rec = old->hash[h]; rec != NULL; rec = rec->next) {
+      if (rec->origname == NULL) continue;
+      orig = lookup_oldrec(old, rec->origname);
+      if ((orig != NULL) && (orig->origname == NULL)) {
+	rec->tokens = orig->tokens;
+	rec->toklen = orig->toklen;
+      } else
+	rec->tokens = NULL;
+    }
+}
+
+/* Open and index the old CTF file called name. If it does not exist,
+ * see if it was split into name0001.ctf, name0002.ctf etc. and index
+ * all of those. The first split file can also be named, as name0001.ctf:
+ * the 0001 is then dropped and all of the split files are indexed, not
+ * just the first. Returns 0 if OK, -1 on error.
+ */
+static int load_oldctf(Oldctf * old, char *name)
+{
+  char buf[1024];
+  Ctfhandle *ctf;
+  size_t totalsize = 0;
+  int i, len, first = 0;
+
+  old->numctf = 0;
+  old->ctf = NULL;
+  old->hash = NULL;
+
+  /* Find the name without .ctf, and without the 0001 of a first split file */
+  len = strlen(name);
+  if (len >= 4 && !strcmp(&(name[len - 4]), ".ctf")) len -= 4;
+  if (len >= 4 && !strncmp(&(name[len - 4]), "0001", 4)) {
+    len -= 4; first = 1;
+  }
+
+  /* Open the CTF file, or all of the split CTF files */
+  for (i = first;; i++) {
+    if (i == 0)
+      snprintf(buf, 1024, "%s", name);
+    else
+      snprintf(buf, 1024, "%.*s%04d.ctf", len, name, i);
+
+    ctf = ctfopen(buf);
+    if (ctf == NULL) {
+      if ((i == 0) && (errno == ENOENT)) continue;
+      break;
+    }
+    old->ctf = (Ctfhandle **) realloc(old->ctf,
+				(old->numctf + 1) * sizeof(Ctfhandle *));
+    if (old->ctf == NULL) return (-1);
+    old->ctf[old->numctf++] = ctf;
+    totalsize += ctf->end - ctf->start;
+
+    /* An unsplit file has no split siblings */
+    if (i == 0) break;
+  }
+  if (old->numctf == 0) {
+    errno = ENOENT; return (-1);
+  }
+
+  /* Size the hash table at about one chain per 4K of CTF file */
+  for (old->hashmask = 1023; old->hashmask < totalsize / 4096;)
+    old->hashmask = (old->hashmask << 1) | 1;
+  old->hash = (Oldrec **) calloc(old->hashmask + 1, sizeof(Oldrec *));
+  if (old->hash == NULL) return (-1);
+
+  for (i = 0; i < old->numctf; i++)
+    if (index_oldctf(old, old->ctf[i]) == -1) {
+      errno = EINVAL; return (-1);
+    }
+  resolve_olddups(old);
+  return (0);
+}
+
+/* Free the index and close the old CTF files */
+static void free_oldctf(Oldctf * old)
+{
+  Oldrec *rec, *next;
+  uint32_t h;
+  int i, saverr = errno;
+
+  if (old->hash != NULL)
+    for (h = 0; h <= old->hashmask; h++)
+      for (rec = old->hash[h]; rec != NULL; rec = next) {
+	next = rec->next; free(rec);
+      }
+  free(old->hash);
+  for (i = 0; i < old->numctf; i++)
+    ctfclose(old->ctf[i]);
+  free(old->ctf);
+  old->numctf = 0;
+  old->hash = NULL;
+  errno = saverr;
+}
+
+/* Find the old record for the source file described by the fts entry.
+ * Return NULL if there is none, or if the file's timestamp has changed.
+ */
+static Oldrec *find_oldrec(Oldctf * old, FTSENT * entry)
+{
+  uint32_t timestamp = entry->fts_statp->st_mtime;
+  Oldrec *rec;
+
+  rec = lookup_oldrec(old, entry->fts_accpath);
+  if ((rec == NULL) || (rec->tokens == NULL) || (rec->timestamp != timestamp))
+    return (NULL);
+  return (rec);
+}
+
+/* The old CTF files are mmap()d. If we are about to overwrite one of
+ * them, unlink it first so that the mapping stays valid.
+ */
+static void unlink_if_oldctf(Oldctf * old, char *name)
+{
+  struct stat sb, oldsb;
+  int i;
+
+  if (stat(name, &sb) == -1) return;
+  for (i = 0; i < old->numctf; i++)
+    if ((fstat(old->ctf[i]->fd, &oldsb) == 0) &&
+	(sb.st_dev == oldsb.st_dev) && (sb.st_ino == oldsb.st_ino)) {
+      unlink(name); return;
+    }
+}
+
+/* Remove the split CTF files output_file%04d.ctf from number first
+ * onwards, which are left over from an earlier run that wrote more of
+ * them, so that they are not taken for part of the new tree.
+ */
+static void remove_oldshards(char *output_file, int first)
+{
+  char buf[1024];
+
+  for (;; first++) {
+    snprintf(buf, 1024, "%s%04d.ctf", output_file, first);
+    if (unlink(buf) == -1) break;
+  }
+}
+
+/*
+ * When removing duplicate files, each file written out is recorded by a
+ * fingerprint of its tokens and where they were written. A later file
+ * with the same fingerprint and token length has its tokens compared
+ * with those written out, and is written out as a DUPFILE record instead
+ * if they are the same.
+ */
+typedef struct _fprint
+{
+  uint64_t hash;		/* FNV-1a hash of the file's tokens */
+  size_t toklen;		/* Length of the tokens in bytes */
+  char *name;			/* Name of the first file with these tokens */
+  char *ctfname;		/* CTF file its tokens were written to, */
+  off_t offset;			/* and their offset in it */
+  struct _fprint *next;		/* Next fingerprint on the same hash chain */
+} Fprint;
+
+typedef struct _fptable
+{
+  uint32_t hashmask;		/* Size of the hash table - 1 */
+  uint32_t count;		/* Number of fingerprints in the table */
+  Fprint **hash;		/* Hash table of Fprint chains */
+} Fptable;
+
+/* The state of the CTF output file(s) as we write file records out */
+typedef struct _ctfout
+{
+  char *output_file;		/* Base name of the output file */
+  char outnamebuf[1024];	/* Name of the current output file */
+  int filenum;			/* Unique file number for each output file */
+  Buildparam *b;
+  Oldctf *old;			/* Index of old records, or NULL */
+  Fptable *fp;			/* Fingerprints of files written, or NULL */
+} Ctfout;
+
+/* Calculate the 64-bit FNV-1a hash of the given tokens */
+static uint64_t fnv1a_hash(uint8_t * tokens, size_t toklen)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < toklen; i++) {
+    h ^= tokens[i];
+    h *= 0x100000001b3ULL;
+  }
+  return (h);
+}
+
+/* Double the size of the fingerprint hash table. Returns 0 if OK,
+ * -1 on error.
+ */
+static int grow_fptable(Fptable * fp)
+{
+  uint32_t h, newmask = (fp->hashmask << 1) | 1;
+  Fprint **newhash, *f, *next;
+
+  newhash = (Fprint **) calloc(newmask + 1, sizeof(Fprint *));
+  if (newhash == NULL) return (-1);
+  for (h = 0; h <= fp->hashmask; h++)
+    for (f = fp->hash[h]; f != NULL; f = next) {
+      next = f->next;
+      f->next = newhash[f->hash & newmask];
+      newhash[f->hash & newmask] = f;
+    }
+  free(fp->hash);
+  fp->hash = newhash;
+  fp->hashmask = newmask;
+  return (0);
+}
+
+/* Free the fingerprint table */
+static void free_fptable(Fptable * fp)
+{
+  Fprint *f, *next;
+  uint32_t h;
+
+  if (fp->hash != NULL)
+    for (h = 0; h <= fp->hashmask; h++)
+      for (f = fp->hash[h]; f != NULL; f = next) {
+	next = f->next; free(f->name); free(f->ctfname); free(f);
+      }
+  free(fp->hash);
+  fp->hash = NULL;
+}
+
+/* Return 1 if the tokens written out for the fingerprint f are the same
+ * as the given tokens, or 0 if not. The tokens are not kept in memory,
+ * so they are read back from the CTF file they were written to.
+ */
+static int same_tokens(Fprint * f, uint8_t * tokens, size_t toklen)
+{
+  uint8_t buf[4096];
+  size_t n, done;
+  FILE *in;
+  int same = 1;
+
+  if ((zout != NULL) && (fflush(zout) == EOF)) return (0);
+  if ((in = fopen(f->ctfname, "r")) == NULL) return (0);
+  if (fseeko(in, f->offset, SEEK_SET) == -1) same = 0;
+  for (done = 0; same && (done < toklen); done += n) {
+    n = toklen - done;
+    if (n > sizeof(buf)) n = sizeof(buf);
+    if ((fread(buf, 1, n, in) != n) || memcmp(buf, tokens + done, n))
+      same = 0;
+  }
+  fclose(in);
+  return (same);
+}
+
+/*
+ * Look for an earlier file with the same tokens as the given ones.
+ * Return the earlier file's name, or NULL if there is none, in which case
+ * the given name is added to the fingerprint table, along with the CTF
+ * file and offset that the tokens are about to be written to.
+ */
+static char *find_dupfile(Fptable * fp, char *name, uint8_t * tokens,
+			  size_t toklen, char *ctfname, off_t offset)
+{
+  uint64_t h = fnv1a_hash(tokens, toklen);
+  Fprint *f;
+
+  for (f = fp->hash[h & fp->hashmask]; f != NULL; f = f->next)
+    if ((f->hash == h) && (f->toklen == toklen) &&
+	same_tokens(f, tokens, toklen))
+      return (f->name);
+
+  /* No match, so remember this file */
+  if ((fp->count > fp->hashmask) && (grow_fptable(fp) == -1)) return (NULL);
+  f = (Fprint *) malloc(sizeof(Fprint));
+  if (f == NULL) return (NULL);
+  f->name = strdup(name);
+  f->ctfname = strdup(ctfname);
+  if ((f->name == NULL) || (f->ctfname == NULL)) {
+    free(f->name); free(f->ctfname); free(f); return (NULL);
+  }
+  f->hash = h;
+  f->toklen = toklen;
+  f->offset = offset;
+  f->next = fp->hash[h & fp->hashmask];
+  fp->hash[h & fp->hashmask] = f;
+  fp->count++;
+  return (NULL);
+}
+
+/* Add the name of the output file just closed to ctflist.db. The
+ * shards after the first one of a split tree are marked as being in
+ * the same tree as the first.
+ */
+static void add_outname(Ctfout * o)
+{
+  if (o->filenum > 2)
+    add_ctfshard(o->outnamebuf, 1);
+  else
+    add_ctffile(o->outnamebuf, 1);
+}
+
+/*
+ * Get the output file ready for the next file record. If we have reached
+ * or exceeded the splitsize for the current output file, then close it
+ * and open the next one. Returns 0 if OK, -1 on error.
+ */
+static int prepare_output(Ctfout * o)
+{
+  Buildparam *b = o->b;
+
+  if (b->splitsize > 0 && zout != NULL && (ftell(zout) >= b->splitsize)) {
+    putc(EOFTOKEN, zout);
+    fclose(zout);
+    if (b->ondisk == 1) add_outname(o);
+    zout = NULL;
+  }
+
+  /* Open up the output file if we need to */
+  if (zout == NULL) {
+    if (b->splitsize > 0)
+      snprintf(o->outnamebuf, 1024, "%s%04d.ctf", o->output_file,
+	       o->filenum++);
+    else
+      snprintf(o->outnamebuf, 1024, "%s.ctf", o->output_file);
+
+    if (o->old != NULL) unlink_if_oldctf(o->old, o->outnamebuf);
+    zout = fopen(o->outnamebuf, "w");
+    if (zout == NULL) return (-1);
+
+    /* Output the ctf header and version 2.1 */
+    fputs(b->dedup ? CTF_DUPHEADER : CTF_HEADER, zout);
+  }
+  return (0);
+}
+
+/* Output a 32-bit value in big-endian order */
+static void put_be32(uint32_t val, FILE * out)
+{
+  putc((val >> 24) & 0xff, out);
+  putc((val >> 16) & 0xff, out);
+  putc((val >> 8) & 0xff, out);
+  putc(val & 0xff, out);
+}
+
+/*
+ * Write out a file record with the given name, timestamp and tokens. If
+ * we are removing duplicate files and an earlier file had the same tokens,
+ * write a DUPFILE record instead. This holds the number of tokens in the
+ * file and the line numbers of its first and last tokens, so that the
+ * duplication can be reported without the tokens. Returns 0 if OK, -1 on
+ * error.
+ */
+static int write_record(Ctfout * o, char *name, uint32_t timestamp,
+			uint8_t * tokens, size_t toklen)
+{
+  uint32_t ntokens = 0, firstline = 0, lastline = 0, linenum = 1;
+  char *origname = NULL;
+  size_t i;
+
+  if (prepare_output(o) == -1) return (-1);
+
+  /* The tokens of a FILENAME record follow the token, the timestamp,
+   * the name and its NUL.
+   */
+  if ((o->fp != NULL) && (toklen > 0))
+    origname = find_dupfile(o->fp, name, tokens, toklen, o->outnamebuf,
+			    ftello(zout) + 6 + strlen(name));
+
+  if (origname == NULL) {
+    putc(FILENAME, zout);
+    put_be32(timestamp, zout);
+    fputs(name, zout);
+    putc('\0', zout);
+    fwrite(tokens, 1, toklen, zout);
+    return (0);
+  }
+
+  /* Count the tokens and find the lines that they span */
+  for (i = 0; i < toklen; i++) {
+    if (tokens[i] == LINE) {
+      linenum++; continue;
+    }
+    if (firstline == 0) firstline = linenum;
+    lastline = linenum;
+    ntokens++;
+    switch (tokens[i]) {
+    case STRINGLIT:
+    case CHARCONST:
+    case LABEL:
+    case IDENTIFIER:
+    case INTVAL:
+      i += 2;			/* Skip the 2-byte id value */
+    }
+  }
+
+  putc(DUPFILE, zout);
+  put_be32(timestamp, zout);
   fputs(name, zout);
-  fputc('\0', zout);
+  putc('\0', zout);
+  fputs(origname, zout);
+  putc('\0', zout);
+  put_be32(ntokens, zout);
+  put_be32(firstline, zout);
+  put_be32(lastline, zout);
+  return (0);
+}
+
+/*
+ * Write out the file record which the lexer made in the given buffer,
+ * splitting it into its FILENAME header and its tokens. An empty buffer
+ * (the file was not tokenised) writes nothing. Returns 0 if OK, -1 on
+ * error.
+ */
+static int write_buffer(Ctfout * o, uint8_t * buf, size_t len)
+{
+  uint32_t timestamp;
+  uint8_t *tokens;
+
+  if (len == 0) return (prepare_output(o));
+  if ((len < 6) || (buf[0] != FILENAME) ||
+      ((tokens = skip_string(buf + 5, buf + len)) == NULL)) {
+    errno = EIO; return (-1);
+  }
+  timestamp = (buf[1] << 24) | (buf[2] << 16) | (buf[3] << 8) | buf[4];
+  return (write_record(o, (char *) buf + 5, timestamp, tokens,
+		       len - (tokens - buf)));
+}
+
+/*
+ * A file record waiting to be written out in the parallel case. It is
+ * either being made by a worker, or it will be copied from an old CTF.
+ */
+typedef struct _pending
+{
+  Worker *worker;		/* Worker tokenising the file, or NULL */
+  Oldrec *rec;			/* Old record to copy if worker is NULL */
+} Pending;
+
+/*
+ * Write out the given file record, or collect the file record from the
+ * worker, and write it out. Returns 0 if OK, -1 on error.
+ */
+static int collect_record(Ctfout * o, Pending * pend)
+{
+  Worker *w = pend->worker;
+  uint32_t len;
+  uint8_t *buf;
+  int err;
+
+  if (w == NULL)
+    return (write_record(o, pend->rec->name, pend->rec->timestamp,
+			 pend->rec->tokens, pend->rec->toklen));
+
+  if (read_all(w->fromfd, &len, sizeof(len)) == -1) {
+    errno = EIO; return (-1);
+  }
+  if (len == 0) return (prepare_output(o));
+  if ((buf = malloc(len)) == NULL) return (-1);
+  if (read_all(w->fromfd, buf, len) == -1) {
+    free(buf); errno = EIO; return (-1);
+  }
+  err = write_buffer(o, buf, len);
+  free(buf);
+  return (err);
 }
 
 /** Functions to tokenise a source code tree.
@@ -54,24 +758,73 @@ void output_filename(char *name)
  * "abc.ctf", then the files will be "abc0001.ctf", "abc0002.ctf", etc.
  */
 int tokenise_tree(char *directory_name, char *output_file, int ondisk, int splitsize)
+{
+  Buildparam b;
+
+  init_buildparams(&b);
+  b.ondisk = ondisk;
+  b.splitsize = splitsize;
+  return (tokenise_tree_withparams(directory_name, output_file, &b));
+}
+
+/** init_buildparams(): fill in the given Buildparam structure with
+ * default values: no ctflist.db update, no splitting, one job and
+ * no duplicate file removal.
+ */
+void init_buildparams(Buildparam * b)
+{
+  b->ondisk = 0;
+  b->splitsize = 0;
+  b->numjobs = 1;
+  b->update_file = NULL;
+  b->dedup = 0;
+}
+
+/** tokenise_tree_withparams(): as for tokenise_tree(), but with the
+ * options given in a Buildparam structure. If b->numjobs is greater than
+ * 1, the source files are tokenised by that many worker processes. The
+ * file records are written out in the same order as a single job would
+ * write them, so the CTF output is identical regardless of b->numjobs.
+ *
+ * If b->update_file names an existing CTF file (or a set of split CTF
+ * files, by their name without or with the 0001 suffix), any source file whose name and timestamp match a
+ * file record in it is not tokenised again: the old record is copied
+ * to the output instead. The old and new CTF names can be the same.
+ *
+ * If b->dedup is 1, a source file whose tokens are the same as those of
+ * an earlier file is written out as a DUPFILE record which names the
+ * earlier file, instead of having its tokens written out again.
+ */
+int tokenise_tree_withparams(char *directory_name, char *output_file, Buildparam * b)
 {
   struct stat sb;
   int err;
   char *dirlist[2];
-  char outnamebuf[1024];	/* Used to generate output filenames */
-  FTS *ftsptr;
+  FTS *ftsptr = NULL;
   FTSENT *entry;
-  int filenum=1;	/* Unique file number for each output file */
-  int len;
+  Ctfout out;
+  Oldctf old;
+  Oldrec *rec;
+  Worker *workers = NULL;
+  Pending *pending = NULL;	/* Ring of records waiting to be written */
+  int numjobs, qsize = 0;
+  int qhead = 0, qcount = 0;	/* Head of the ring & # of records in it */
+  uint32_t len;
+  long dispatched = 0;		/* Number of files handed to the workers */
+  long collected = 0;		/* Number of worker records written out */
+  Fptable fp;
+  Lexctx lc;
+  char *buf;
+  size_t size;
 
   /* Check that we have an output file name */
-  if (output_file == NULL) {
+  if ((output_file == NULL) || (b == NULL)) {
     errno = EINVAL; return (-1);
   }
 
   /* Find and remove any trailing .ctf */
   len= strlen(output_file);
-  if (!strcmp(&(output_file[len-4]), ".ctf"))
+  if (len >= 4 && !strcmp(&(output_file[len-4]), ".ctf"))
     output_file[len-4]= '\0';
 
   /* Check that the directory exists and is a directory */
@@ -85,11 +838,46 @@ int tokenise_tree(char *directory_name, char *output_file, int ondisk, int split
     errno = ENOTDIR; return (-1);
   }
 
+  out.output_file = output_file;
+  out.filenum = 1;
+  out.b = b;
+  out.old = NULL;
+  out.fp = NULL;
+  zout=NULL;
+
+  /* Set up the fingerprint table if we are removing duplicate files */
+  if (b->dedup) {
+    fp.hashmask = 1023;
+    fp.count = 0;
+    fp.hash = (Fprint **) calloc(fp.hashmask + 1, sizeof(Fprint *));
+    if (fp.hash == NULL) return (-1);
+    out.fp = &fp;
+  }
+
+  /* Index the records in the old CTF file if we are updating */
+  if (b->update_file != NULL) {
+    if (load_oldctf(&old, b->update_file) == -1) {
+      free_oldctf(&old);
+      if (out.fp != NULL) free_fptable(out.fp);
+      return (-1);
+    }
+    out.old = &old;
+  }
+
+  /* Start up any worker processes before we open anything else */
+  numjobs = b->numjobs;
+  if (numjobs > 1) {
+    qsize = 4 * numjobs;
+    workers = (Worker *) calloc(numjobs, sizeof(Worker));
+    pending = (Pending *) calloc(qsize, sizeof(Pending));
+    if ((workers == NULL) || (pending == NULL)) goto fail;
+    if (start_workers(workers, numjobs) == -1) goto fail;
+  }
+
   /* Search for files to tokenise */
   dirlist[0] = directory_name;
   dirlist[1] = NULL;
   ftsptr = fts_open(dirlist, FTS_LOGICAL, NULL);
-  zout=NULL;
 
   /* Process each entry that is a file */
   while (1) {
@@ -97,40 +885,107 @@ int tokenise_tree(char *directory_name, char *output_file, int ondisk, int split
     if (entry == NULL) break;
     if (entry->fts_info != FTS_F) continue;
 
-    /* If we have reached or exceeded the splitsize for the
-     * current output file, then close it.
-     */
-    if (splitsize>0 && zout!=NULL && (ftell(zout) >= splitsize)) {
-      putc(EOFTOKEN, zout);
-      fclose(zout);
-      if (ondisk==1) add_ctffile(outnamebuf, 1);
-      zout=NULL;
+    /* See if we can reuse the file's old record */
+    rec = (out.old != NULL) ? find_oldrec(out.old, entry) : NULL;
+
+    if (numjobs <= 1) {
+      if (rec != NULL) {
+	if (write_record(&out, rec->name, rec->timestamp,
+			 rec->tokens, rec->toklen) == -1) goto fail;
+	continue;
+      }
+
+      /* Without duplicate removal, tokenise straight into the output */
+      if (out.fp == NULL) {
+	if (prepare_output(&out) == -1) goto fail;
+	tokenize(entry->fts_accpath);
+	continue;
+      }
+
+      /* Otherwise tokenise into a buffer and write that out */
+      lc.out = open_memstream(&buf, &size);
+      if (lc.out == NULL) goto fail;
+      tokenize_ctx(&lc, entry->fts_accpath);
+      fclose(lc.out);
+      err = write_buffer(&out, (uint8_t *) buf, size);
+      free(buf);
+      if (err == -1) goto fail;
+      continue;
     }
 
-    /* Open up the output file if we need to */
-    if (zout==NULL) {
-      if (splitsize>0)
-        snprintf(outnamebuf, 1024, "%s%04d.ctf", output_file, filenum++);
-      else
-        snprintf(outnamebuf, 1024, "%s.ctf", output_file);
+    /* Keep at most two files outstanding with each worker, so that
+     * the writes to the name pipes never block. Write out the oldest
+     * records until we are under that limit and the ring has room.
+     */
+    while ((qcount == qsize) ||
+	   ((rec == NULL) && (dispatched - collected == 2 * numjobs))) {
+      if (collect_record(&out, &pending[qhead]) == -1) goto fail;
+      if (pending[qhead].worker != NULL) collected++;
+      qhead = (qhead + 1) % qsize;
+      qcount--;
+    }
 
-      zout = fopen(outnamebuf, "w");
-      if (zout == NULL) return (-1);
+    /* Queue up the old record, or hand the file to the
+     * next worker in round-robin order.
+     */
+    pending[(qhead + qcount) % qsize].rec = rec;
+    pending[(qhead + qcount) % qsize].worker = NULL;
+    if (rec == NULL) {
+      Worker *w = &workers[dispatched % numjobs];
 
-      /* Output the ctf header and version 2.1 */
-      fputs("ctf2.1", zout);
+      len = strlen(entry->fts_accpath);
+      if ((write_all(w->tofd, &len, sizeof(len)) == -1)
+	  || (write_all(w->tofd, entry->fts_accpath, len) == -1)) {
+	errno = EIO; goto fail;
+      }
+      pending[(qhead + qcount) % qsize].worker = w;
+      dispatched++;
     }
+    qcount++;
+  }
+  fts_close(ftsptr);
+  ftsptr = NULL;
 
-    /* After all that rigmarole, now tokenise the source file found. */
-    tokenize(entry->fts_accpath);
+  /* Write out the records still waiting in the ring */
+  if (numjobs > 1) {
+    while (qcount > 0) {
+      if (collect_record(&out, &pending[qhead]) == -1) goto fail;
+      qhead = (qhead + 1) % qsize;
+      qcount--;
+    }
+    stop_workers(workers, numjobs);
+    free(pending);
   }
 
-  /* No source files left, so close the last output file */
-  fts_close(ftsptr);
+  /* No source files left, so close the last output file. Remove any
+   * split files past the last one we wrote: when updating an unsplit
+   * tree, those are all of them.
+   */
+  if (out.old != NULL) free_oldctf(out.old);
+  if (out.fp != NULL) free_fptable(out.fp);
+  if (b->splitsize > 0)
+    remove_oldshards(output_file, out.filenum);
+  else if (b->update_file != NULL)
+    remove_oldshards(output_file, 1);
+  if (zout == NULL) return (0);
   putc(EOFTOKEN, zout);
   fclose(zout);
+  zout = NULL;
 
-  if (ondisk==1) add_ctffile(outnamebuf, 1);
+  if (b->ondisk==1) add_outname(&out);
 
   return (0);
+
+fail:
+  /* Clean up on an error, leaving errno as it was */
+  err = errno;
+  if (ftsptr != NULL) fts_close(ftsptr);
+  if (zout != NULL) fclose(zout);
+  zout = NULL;
+  errno = err;
+  if (workers != NULL) stop_workers(workers, numjobs);
+  free(pending);
+  if (out.old != NULL) free_oldctf(out.old);
+  if (out.fp != NULL) free_fptable(out.fp);
+  return (-1);
 }
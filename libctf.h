@@ -13,7 +13,11 @@
 
 #define CTFLIST_DB "ctflist.db"	/* Name of the Ctf list created */
 #define MAXCTFNAME 1024		/* Maximum size of any CTF filename */
+#define CTF_HEADER "ctf2.1"	/* Header of a CTF file, and of one which */
+#define CTF_DUPHEADER "ctf2.2"	/* can hold DUPFILE records: buildctf -D */
 #define TUPLE_SIZE 16	   /* By default, each tuple has TUPLE_SIZE tokens */
+#define MAXTOKENTEXT 64	   /* Longest text of a token, not counting the */
+			   /* filenames, from format_token() */
 
 
 /*** Structures defined by the library ***/
@@ -26,11 +30,24 @@ typedef struct _ctfparam
   char *dbname;			/* Name of disk file with list of CTF files */
   int isomorph_count_threshold;	/* Maximum # of isomorphic relations */
   int flags;			/* Search & printing flags; see below */
+  int numthreads;		/* Max # of threads walking the shards of a */
+				/* split tree, or 0 for one per CPU */
+  int numparts;			/* If > 1, # of processes to split the */
+				/* in-memory TDNs between */
+  size_t memlimit;		/* If not 0, the most bytes of memory that */
+				/* the in-memory TDNs should make us use */
+  int format;			/* Format of the runs printed; see below */
+  int minlen;			/* If not 0, drop runs shorter than this */
+  int maxlen;			/* If not 0, drop runs longer than this */
+  struct _pathfilter *exclude;	/* Drop runs in files whose names match */
+				/* these, see add_exclude_path() */
 
   /* Statistics counters */
-  int runcount;			/* Number of runs of similarity found */
-  int tdncount;			/* Number of TDNs used to find similarities */
-  int tdncmpcnt;		/* Number of TDN comparisons made */
+  uint64_t runcount;		/* Number of runs of similarity found */
+  uint64_t tdncount;		/* Number of TDNs used to find similarities */
+  uint64_t tdncmpcnt;		/* Number of TDN comparisons made */
+  struct _ctfstats *stats;	/* If not NULL, time the phases of the */
+				/* search, see enable_ctfstats() */
 } Ctfparam;
 
 				/* Available flag bits & their meaning */
@@ -52,6 +69,59 @@ typedef struct _ctfparam
 				/* the runs itself and returns NULL */
 #define CTP_COMPHEUR	0x200	/* Enable some heuristics which remove */
 				/* certain unwanted matches: see the Readme */
+#define CTP_SORTMERGE	0x400	/* Find the matches by sorting the tuples */
+				/* on disk: see find_runs_by_sorting() */
+#define CTP_NOLINES	0x800	/* The runs won't be printed, so don't */
+				/* find the end lines of each run */
+#define CTP_GROUPPAIRS	0x1000	/* Print results grouped by file pair, */
+				/* in file order: see runpair_compare() */
+#define CTP_CHECKINDEX	0x2000	/* Check every TDN and group of an index */
+				/* image as it is loaded: see load_index() */
+
+				/* Formats that the runs are printed in */
+#define CTF_FORMAT_TEXT		0	/* len name:a-b name:c-d lines */
+#define CTF_FORMAT_BINARY	1	/* Runrecs, see below */
+#define CTF_FORMAT_JSONL	2	/* A JSON object on each line */
+
+
+/* The phases of a comparison timed by the Ctfstats */
+#define CTS_OPEN	0	/* Opening the CTF files and the index */
+#define CTS_SEARCH	1	/* Searching for runs, which includes: */
+#define CTS_EXTRACT	2	/*   making the TDNs from the tokens, */
+#define CTS_PROBE	3	/*   finding the TDNs which match each TDN, */
+#define CTS_RUNS	4	/*   making, extending & completing runs, */
+#define CTS_ISOMORPH	5	/*   and the isomorphic checks on the runs */
+#define CTS_PRINT	6	/* Printing, summing or saving the runs */
+#define CTS_NUMPHASES	7
+
+#define CTS_CHAINBUCKETS 24	/* Buckets in the chain length histogram */
+
+/* Statistics about a comparison, kept when p->stats is not NULL */
+typedef struct _ctfstats
+{
+  uint64_t wall[CTS_NUMPHASES];	/* Nanoseconds of wall clock time and */
+  uint64_t cpu[CTS_NUMPHASES];	/* of CPU time spent in each phase. The */
+				/* CPU time is only kept for the phases */
+				/* timed by begin_ctfphase() */
+  uint64_t wallstart[CTS_NUMPHASES];	/* When the phases were begun */
+  uint64_t cpustart[CTS_NUMPHASES];
+  uint64_t peakruns;		/* Most incomplete runs at any one time */
+  uint64_t *ctfwall;		/* Nanoseconds spent walking each CTF */
+  int numctfwall;		/* file, and the size of the array */
+} Ctfstats;
+
+
+/* List of parameters passed to tokenise_tree_withparams() */
+typedef struct _buildparam
+{
+  int ondisk;			/* If 1, add the CTF file names to ctflist.db */
+  int splitsize;		/* If non-zero, split the output at this size */
+  int numjobs;			/* Number of worker processes tokenising files */
+  char *update_file;		/* If not NULL, copy the records of unchanged */
+				/* files from this old CTF file */
+  int dedup;			/* If 1, write DUPFILE records for files */
+				/* with the same tokens as an earlier file */
+} Buildparam;
 
 
 /* Handle to an open and mmap()d CTF file */
@@ -61,33 +131,57 @@ typedef struct _ctfhandle
   uint8_t *start;	/* Starting address of the mmap */
   uint8_t *end;		/* End address of the mmap +1 (i.e 1st outside) */
   uint8_t *cursor;	/* Current position in the map, used internally */
-  uint32_t name_offset;	/* Offset of the last filename found */
-  uint32_t linenum;	/* Linenumber of the last line found */
+  struct _ctffile *files;	/* Table of the file records found so far */
+  uint32_t numfiles;	/* Number of entries in the table */
+  uint32_t maxfiles;	/* Size of the table */
+  struct _tdn *tdns;	/* Array of the TDNs made from the file */
+  uint32_t numtdns;	/* Number of TDNs in the array */
+  size_t tdnmapsize;	/* Size of the mmap holding the array */
+  struct _linetable *lines;	/* Table of line numbers, made when needed */
+  int inimage;		/* Set if the TDNs and the file record table */
+			/* are in a mapped index image, see load_index() */
+  uint8_t *excluded;	/* Bitmap of the file record table entries */
+			/* excluded by add_exclude_path(), and the */
+  uint32_t numexcluded;	/* number of entries in it, made when needed */
+  int hasdups;		/* Set if the header is CTF_DUPHEADER, so the */
+			/* file can hold DUPFILE records */
 } Ctfhandle;
 
 
+/* As a CTF file can be larger than 4 Gbytes, the offsets in it are 64
+ * bits. To keep the TDNs small, each CTF file has a table of the file
+ * records found in it, and a TDN holds an index into this table and a
+ * 32-bit offset from the entry's base. Normally the base is the offset of
+ * the file record. If a file record is so large that the offset from its
+ * start won't fit in 32 bits, another entry for the same file record is
+ * added with a later base.
+ */
+typedef struct _ctffile
+{
+  uint64_t name_offset;		/* Offset of the file record */
+  uint64_t base;		/* Offset which TDN offsets are relative to */
+} Ctffile;
+
+
 /* The TDN represents the details of one tuple of TUPLE_SIZE tokens from
- * a CTF file: which TDN preceded this one, the tuple's CRC, the offset
- * of the first token in the CTF file, and the offset of the source code
- * filename which contains the tokens in this tuple.
+ * a CTF file: the tuple's CRC, the offset of the first token in the CTF
+ * file, the entry in the CTF file's table of file records which holds the
+ * source code filename of the tokens in this tuple, and the id of the CTF
+ * file. Use tdn_offset() and tdn_name_offset() to get the offsets in full.
  *
- * The top 12 bits of file_line_id represent the CTF file identity, i.e.
- * there can be up to 4096 CTF files in the database. The bottom 20 bits
- * represent the line number where the first token in the TDN occurred, i.e.
- * source code files can be up to 1,048,576 lines long.
+ * The TDNs made from a CTF file are kept in order in one array, so the
+ * TDN which preceded a TDN in its CTF file is the one before it in the
+ * array. The line number where the first token in the TDN occurred is not
+ * stored: get_linenum() finds it from the offset.
  */
 typedef struct _tdn
 {
-  struct _tdn *previnctf;     /* Previous TDN from the CTF file */
   uint32_t tuple_crc;	      /* CRC of the tokens in this tuple */
-  uint32_t offset;	      /* Offset where this tuple of tokens occurs */
-  uint32_t name_offset;	      /* Offset of the filename which has this tuple */
-  uint32_t file_line_id;    /* Two bitfields containing CTF file id & line # */
+  uint32_t offset;	      /* Offset of the tuple from the entry's base */
+  uint32_t fileidx;	      /* Entry in the CTF file's file record table */
+  uint32_t ctfid;	      /* Id of the CTF file which has this tuple */
 } TDN;
 
-#define NUMCTFFILES (1 << 12)
-#define MAXSRCLINES (1 << 20)
-
 
 /*
  * We build up runs of code similarity by walking the TDNs of a single CTF
@@ -96,7 +190,9 @@ typedef struct _tdn
  * represent each run with the Run node. The fields are the starting and
  * ending TDNs from each tree, the length of the run in tokens, and a
  * next pointer used to build a singly-linked list of runs found. The
- * touched flag is used internally and should not be modified.
+ * touched flag is used internally and should not be modified. When the
+ * run is complete, the line of the last token on each side is saved,
+ * so that printing the run doesn't have to walk the CTF files again.
  */
 
 typedef struct _run
@@ -105,12 +201,123 @@ typedef struct _run
   TDN *dst_startnode;		/* 1st TDN from the other tree */
   TDN *src_endnode;		/* Currently last TDN from walking tree */
   TDN *dst_endnode;		/* Currently last TDN from other tree */
-  uint32_t length;		/* Length of the run so far */
   struct _run *next;		/* Linked list of all incomplete runs */
+  uint32_t length;		/* Length of the run so far */
   uint32_t touched;		/* Flag to indicate if the run was touched */
+  uint32_t src_endline;		/* Line of the last token on each side, */
+  uint32_t dst_endline;		/* set once the run is complete */
 } Run;
 
 
+/*
+ * With CTF_FORMAT_BINARY, the runs are written in the native byte order
+ * as a Runshdr, then a Runrec for each run, then the filename table, then
+ * a Runstrailer. The filename table is an array of the 64-bit offsets in
+ * the output of numnames NUL-terminated names, followed by the names. The
+ * srcname and dstname of each Runrec are indexes into the table. Files
+ * found by buildctf -D are written as runs from the duplicate file to the
+ * earlier file, as in the text format.
+ */
+#define RUNS_MAGIC	"ctfrun1"	/* Includes the NUL to make 8 bytes */
+
+typedef struct _runshdr
+{
+  char magic[8];		/* RUNS_MAGIC */
+  uint32_t recsize;		/* sizeof(Runrec), to check the output */
+  uint32_t unused;
+} Runshdr;
+
+typedef struct _runrec
+{
+  uint32_t length;		/* Length of the run in tokens */
+  uint32_t srcname;		/* Index of the source file's name, and */
+  uint32_t srcstart;		/* the first and last lines of the run */
+  uint32_t srcend;		/* in it, in the tree we walked */
+  uint32_t dstname;		/* The same for the other tree */
+  uint32_t dststart;
+  uint32_t dstend;
+} Runrec;
+
+typedef struct _runstrailer
+{
+  uint64_t numruns;		/* Number of Runrecs */
+  uint64_t numnames;		/* Number of names in the filename table */
+  uint64_t namesoff;		/* Offset of the filename table */
+} Runstrailer;
+
+
+/*
+ * A source file which buildctf -D found to have the same tokens as an
+ * earlier file in the same CTF tree is stored as a DUPFILE record. Each
+ * one is described by a Dupfile node: the names of both files, the
+ * number of tokens they hold, and the lines of the first and last token.
+ * The names point into the mmap()d CTF file.
+ */
+typedef struct _dupfile
+{
+  char *name;			/* Name of the duplicate file */
+  char *origname;		/* Name of the earlier file it duplicates */
+  uint32_t ntokens;		/* Number of tokens in each file */
+  uint32_t firstline;		/* Line number of the first token */
+  uint32_t lastline;		/* Line number of the last token */
+  struct _dupfile *next;	/* Linked list of duplicate files */
+} Dupfile;
+
+
+/*
+ * The number of tokens in common between each pair of source files, as
+ * found in runs and duplicate files, is summed in a Pairsums table so
+ * that the pairs, or the trees they are in, can be ranked without
+ * printing each run. Use new_pairsums() to make one; its contents are
+ * private to the library.
+ */
+typedef struct _pairsums Pairsums;
+
+
+/*
+ * The runs found by a comparison, and the files found by buildctf -D,
+ * can be kept in a Results store and saved to a file with save_results(),
+ * so that load_results() can filter, sort, sum and print them later
+ * without searching for them again. Each field of the runs is held in an
+ * array of its own, indexed by run number, so that a program need only
+ * look at the fields it uses. The CTF file ids are those in the ctflist
+ * when the runs were found; ctfids[] gives each one's id in the ctflist
+ * now. Use new_results() to make one; data is private to the library.
+ */
+typedef struct _results
+{
+  uint64_t numruns;		/* Number of runs */
+  uint32_t *length;		/* Length of each run in tokens */
+  uint32_t *src_ctfid;		/* For the walked tree and the other tree: */
+  uint32_t *dst_ctfid;		/* the CTF file id, */
+  uint32_t *src_file;		/* the index in names of the source file, */
+  uint32_t *dst_file;
+  uint32_t *src_start;		/* the first and last lines of the run, */
+  uint32_t *src_end;
+  uint32_t *dst_start;
+  uint32_t *dst_end;
+  uint64_t *src_offset;		/* and the offset in the CTF file of its */
+  uint64_t *dst_offset;		/* first token, 0 for a duplicate file */
+  uint32_t numnames;		/* Number of source file names */
+  char **names;			/* The source file names */
+  uint32_t numctf;		/* Number of CTF files, ids 1 to numctf */
+  char **ctfnames;		/* Name of each CTF file, by id */
+  int *ctfids;			/* Id in the ctflist of each, by id */
+  struct _resultsdata *data;	/* Private to the library */
+} Results;
+
+
+/*
+ * All the state of a comparison: the CTF list, the in-memory TDNs and
+ * the runs being built, is held in a Ctfsession. A program which only
+ * does one comparison at a time can ignore sessions, as every thread
+ * starts off using the default session. Otherwise, use new_ctfsession()
+ * to make one and use_ctfsession() to make it the current session of the
+ * calling thread; its contents are private to the library.
+ */
+typedef struct _ctfsession Ctfsession;
+
+
 /*** Functions exported by the library ***/
 
 /** Functions to tokenise a source code tree.
@@ -131,6 +338,29 @@ typedef struct _run
  */
 int tokenise_tree(char *directory_name, char *output_file, int ondisk, int splitsize);
 
+/** init_buildparams(): fill in the given Buildparam structure with
+ * default values: no ctflist.db update, no splitting, one job and
+ * no duplicate file removal.
+ */
+void init_buildparams(Buildparam * b);
+
+/** tokenise_tree_withparams(): as for tokenise_tree(), but with the
+ * options given in a Buildparam structure. If b->numjobs is greater than
+ * 1, the source files are tokenised by that many worker processes. The
+ * file records are written out in the same order as a single job would
+ * write them, so the CTF output is identical regardless of b->numjobs.
+ *
+ * If b->update_file names an existing CTF file (or the first of a set
+ * of split CTF files), any source file whose name and timestamp match a
+ * file record in it is not tokenised again: the old record is copied
+ * to the output instead. The old and new CTF names can be the same.
+ *
+ * If b->dedup is 1, a source file whose tokens are the same as those of
+ * an earlier file is written out as a DUPFILE record which names the
+ * earlier file, instead of having its tokens written out again.
+ */
+int tokenise_tree_withparams(char *directory_name, char *output_file, Buildparam * b);
+
 
 /** Functions dealing with the token stream stored in a CTF file.
  *
@@ -145,6 +375,19 @@ Ctfhandle *ctfopen(char *name);
  */
 int ctfclose(Ctfhandle * ctf);
 
+/** next_filerecord(): given a Ctfhandle and a file offset, find the next
+ * file record at or after the token at the offset, without decoding the
+ * tokens in between. The offset is updated to point at the record's
+ * FILENAME or DUPFILE token, which is returned, or -1 if there are no more.
+ */
+int next_filerecord(Ctfhandle * ctf, uint64_t * offset);
+
+/** count_tokens(): return the number of tokens in the CTF file other
+ * than line numbers and file records, without decoding them. No more
+ * TDNs than this can be made from the file.
+ */
+uint64_t count_tokens(Ctfhandle * ctf);
+
 /** get_token(): given a Ctfhandle and a file offset, return the next
  * token from the file at the given offset. The offset is updated to point
  * at the next token. Any id-value associated with the the token is
@@ -152,9 +395,18 @@ int ctfclose(Ctfhandle * ctf);
  * associated with a FILENAME token is returned in name, and the id
  * parameter is used to return the timestamp. On any error, -1 is returned.
  * The space for the filename is malloc'd here; the caller takes
- * responsibility for freeing it.
+ * responsibility for freeing it. A DUPFILE token is treated like a
+ * FILENAME token, and the name of the file that it duplicates follows
+ * the NUL at the end of the filename.
+ */
+int get_token(Ctfhandle * ctf, uint64_t * offset, uint32_t * id, char **name);
+
+/** get_linenum(): given a Ctfhandle and the offset of a token in the
+ * CTF file, return the line number in its source file where the token
+ * occurs. Returns 0 on error, e.g. if the offset is before the first
+ * file record.
  */
-int get_token(Ctfhandle * ctf, uint32_t * offset, uint32_t * id, char **name);
+uint32_t get_linenum(Ctfhandle * ctf, uint64_t offset);
 
 /** tok2str(): given a token value, return a pointer to a
  * string constant which represents that token value.
@@ -169,6 +421,25 @@ char *tok2str(unsigned int ch);
  */
 void print_token(unsigned int ch, uint32_t linenum, uint32_t id, char *filename);
 
+/** fprint_token(): as for print_token(), but print the token on the
+ * given stdio stream. It can be called by several threads at once.
+ */
+void fprint_token(FILE * out, unsigned int ch, uint32_t linenum, uint32_t id, char *filename);
+
+/** format_token(): as for print_token(), but write the text of the token
+ * into buf, which must have room for MAXTOKENTEXT bytes plus the length of
+ * the filename(s). Returns the number of bytes written; no NUL is added.
+ */
+size_t format_token(char *buf, unsigned int ch, uint32_t linenum, uint32_t id, char *filename);
+
+/** format_tokens(): given a Ctfhandle, a file offset and the line number
+ * there, write the text of the tokens from the offset into buf, which holds
+ * size bytes, as format_token() would. Stops at the next file record, at
+ * the LINE token after lastline, or when buf is full. The offset and line
+ * number are updated, and the number of bytes written is returned.
+ */
+size_t format_tokens(Ctfhandle * ctf, uint64_t * offset, uint32_t * linenum, uint32_t lastline, char *buf, size_t size);
+
 
 /** Functions to find runs of code similarity.
  *
@@ -188,18 +459,180 @@ void print_token(unsigned int ch, uint32_t linenum, uint32_t id, char *filename)
  *
  * If p->flags has CTP_NOSEARCH set, only create and add the CTF file's
  * TDNs to the in-memory TDNs, do no perform the run search.
+ *
+ * The shards of a split tree (see get_ctftree()) count as one tree, so
+ * without CTP_WITHINTREE they are not compared against each other.
  */
 Run *find_runs_from_ctf(int ctfid, Ctfparam * p);
 
+/** find_runs_from_shards(): as for find_runs_from_ctf(), but process the
+ * count CTF files from ctfid onwards, which are the shards of one tree.
+ * The shards are walked concurrently by up to p->numthreads threads (or
+ * one per CPU if p->numthreads is 0); their TDNs are added to the
+ * in-memory TDNs once all the shards have been walked. The runs are
+ * returned in the same order as calling find_runs_from_ctf() on each
+ * shard in turn. With CTP_WITHINTREE set, each shard must be compared
+ * against the ones before it, so the shards are walked one at a time.
+ */
+Run *find_runs_from_shards(int ctfid, int count, Ctfparam * p);
+
+/** find_runs_from_parts(): as for calling find_runs_from_shards() on each
+ * tree in the ctflist in turn, but split the in-memory TDNs by CRC value
+ * into parts, so that no one process has to hold all of them. With
+ * p->numparts > 1, the parts are held by that many worker processes, so
+ * each needs about 1/numparts of the memory that one process would. If
+ * p->memlimit is not 0 and the in-memory TDNs would make the search use
+ * more than p->memlimit bytes, they are split into enough parts to fit.
+ * These are searched one after the other (by the p->numparts workers, if
+ * any), and each part's matches are spilled to a temporary file. The
+ * matches are then read back by this process, which builds the runs from
+ * them. The runs are returned in the same order as the one-process
+ * search. Any CTP_LASTFILE flag is ignored: the last tree is found here.
+ */
+Run *find_runs_from_parts(Ctfparam * p);
+
+/** find_runs_by_sorting(): as for find_runs_from_parts(), but without
+ * the in-memory TDNs. Instead, a record for each TDN is sorted by CRC,
+ * using temporary files. The groups of TDNs which could match are then
+ * searched one at a time, the matches are sorted back into the order of
+ * the CTF files, and the runs are built from them. The sorts use at most
+ * about p->memlimit bytes of memory, or 256 Mbytes if this is 0, and use
+ * temporary files in $TMPDIR for the rest. Apart from the TDN arrays,
+ * the memory used does not grow with the size of the CTF files. The runs
+ * are the same as the other searches find, in the same order.
+ */
+Run *find_runs_by_sorting(Ctfparam * p);
+
+/** find_dupfiles_from_ctf(): return a singly-linked list of the DUPFILE
+ * records in the given CTF file, in the order that they appear, or NULL
+ * if there are none. These are files which buildctf -D found to be
+ * identical to an earlier file, and so they have no TDNs of their own.
+ * Free the list with free_dupfiles().
+ */
+Dupfile *find_dupfiles_from_ctf(int ctfid);
+
+/** dupfile_filtered(): return 1 if the pair of identical files in the
+ * Dupfile should not be reported: the files are shorter than the tuple
+ * size in p, or they are dropped by p's filters in the same way as a run
+ * is, by their length and the names of the two files. Otherwise return 0.
+ */
+int dupfile_filtered(Dupfile * dup, Ctfparam * p);
+
+/** index_dupfiles(): find the files which buildctf -D stored as copies
+ * of an earlier file in the CTF files in the ctflist, so that each run
+ * found in the earlier file is also reported for its copies, which have
+ * no TDNs of their own. print_listruns(), add_runs_to_pairsums() and
+ * add_runs_to_results() do this after index_dupfiles() has been called,
+ * and run_dupcount() gives the number of extra runs. Copies whose names
+ * are dropped by p's path patterns are left out. Only CTF files with the
+ * CTF_DUPHEADER header are read. Returns the number of copies found, or
+ * -1 with errno set on error.
+ */
+int index_dupfiles(Ctfparam * p);
+
+/** run_dupcount(): return the number of extra times that the run is
+ * reported because of the copies of its files found by index_dupfiles():
+ * once for each pairing of the two files or their copies, other than the
+ * two files themselves.
+ */
+int run_dupcount(Run * run);
+
+/** free_dupfiles(): free the list of Dupfile nodes returned by
+ * find_dupfiles_from_ctf().
+ */
+void free_dupfiles(Dupfile * dup);
+
+/** add_exclude_path(): add a POSIX extended regular expression to the
+ * patterns in p. When a run is completed, it is dropped if the name of
+ * the source file in either tree matches one of the patterns. Returns 0
+ * if OK, or -1 with errno set to EINVAL if the pattern isn't valid.
+ */
+int add_exclude_path(Ctfparam * p, char *pattern);
+
 
 /** Functions to print out code similarity.
  *
  * print_listruns(): given the head of a singly-linked list of runs
  * an a pointer to a Ctfparam struct, print out the runs of code
  * similarity following the print options specified in the Ctfparam struct.
+ * The runs are printed in the Ctfparam's format; with CTF_FORMAT_BINARY or
+ * CTF_FORMAT_JSONL they are buffered until flush_listruns() is called.
+ * After index_dupfiles(), each run is also printed for the copies of its
+ * files that buildctf -D found, straight after the run itself.
+ * When the source lines or tokens of the runs are printed, this is done
+ * by up to p->numthreads threads (or one per CPU if it is 0), but the
+ * output is the same as with one thread. With CTP_GROUPPAIRS, the runs
+ * between each pair of files are printed together, in file order.
  */
 void print_listruns(Run * run, Ctfparam * p);
 
+/** print_result(): print out run i of the Results store in the same way
+ * as print_listruns() prints a run, following the print options in p.
+ * The source files are read again to print their lines, and the CTF
+ * files to print the tokens.
+ */
+void print_result(Results * r, uint64_t i, Ctfparam * p);
+
+/** flush_listruns(): write out any runs printed in the binary or JSON
+ * Lines format which are still buffered. For the binary format, the
+ * filename table and trailer are written after the runs, so this must be
+ * called once all the runs have been printed, even if there were none.
+ */
+void flush_listruns(Ctfparam * p);
+
+/** print_dupfiles(): given the head of a singly-linked list of Dupfile
+ * nodes, print out each pair of identical files in the same format as a
+ * run of code similarity. The length is the number of tokens in the files,
+ * and files dropped by dupfile_filtered() are not printed.
+ */
+void print_dupfiles(Dupfile * dup, Ctfparam * p);
+
+/** Functions to sum the code similarity between files and trees.
+ *
+ * new_pairsums(): return a new, empty Pairsums table, or NULL if
+ * there is no memory for it.
+ */
+Pairsums *new_pairsums(void);
+
+/** add_runs_to_pairsums(): given the head of a singly-linked list of
+ * runs, add the length of each run to the count for the pair of files
+ * that it is between, and to the pairs of their copies found by
+ * index_dupfiles(). As with print_listruns(), runs shorter than the
+ * tuple size in p are ignored.
+ */
+void add_runs_to_pairsums(Pairsums * ps, Run * run, Ctfparam * p);
+
+/** add_dups_to_pairsums(): given the head of a singly-linked list of
+ * Dupfile nodes from CTF file ctfid, add the number of tokens in each
+ * pair of identical files to the count for that pair. As with
+ * print_dupfiles(), files dropped by dupfile_filtered() are ignored.
+ */
+void add_dups_to_pairsums(Pairsums * ps, Dupfile * dup, int ctfid, Ctfparam * p);
+
+/** add_result_to_pairsums(): add the length of run i of the Results
+ * store to the count for the pair of files that it is between.
+ */
+void add_result_to_pairsums(Pairsums * ps, Results * r, uint64_t i);
+
+/** print_filepairs(): print out each pair of files in the Pairsums table
+ * and the number of tokens in common between them, in descending order
+ * of that number, one pair per line as "count: file1  file2". This is
+ * the same as the output of Scripts/sum_filepairs.
+ */
+void print_filepairs(Pairsums * ps, Ctfparam * p);
+
+/** print_treematrix(): print out a matrix of the number of tokens in
+ * common between each pair of trees, summed over the pairs of files in
+ * the Pairsums table. Each tree is named by its first CTF file. The
+ * first line holds the tree names, and each line after that holds a
+ * tree name and its counts, all separated by tabs. The matrix is
+ * symmetric; the diagonal only has counts from searches within a tree.
+ */
+void print_treematrix(Pairsums * ps, Ctfparam * p);
+
+/** free_pairsums(): free a Pairsums table */
+void free_pairsums(Pairsums * ps);
+
 
 /** Functions dealing with the on-disk list of CTF files: ctflist.db.
  *
@@ -209,7 +642,8 @@ void print_listruns(Run * run, Ctfparam * p);
  * called multiple times, and the list will only be loaded from disk once.
  * If the in-memory list is updated using other functions, the function will
  * always return the number of entries in the in-memory list, regardless of
- * the state of the on-disk list.
+ * the state of the on-disk list. A line which starts with a '+' names a
+ * shard of the same tree as the CTF file on the line before it.
  */
 int load_ctflist(void);
 
@@ -219,6 +653,20 @@ int load_ctflist(void);
  */
 char *get_ctfname(int id);
 
+/** get_ctfhandle(): given a specific CTF file id (1 or greater), return
+ * the CTF file's handle. Returns NULL if there is no entry in the list
+ * with the given id, or the CTF file has not been opened.
+ */
+Ctfhandle *get_ctfhandle(int id);
+
+/** get_ctftree(): given a specific CTF file id (1 or greater), return
+ * the id of the first CTF file in the same tree. The shards of a tree split
+ * by buildctf -s are one tree when they were added with add_ctfshard().
+ * Any other CTF file is a tree on its own, and so its own id is returned.
+ * Returns -1 if there is no entry in the list with the given id.
+ */
+int get_ctftree(int id);
+
 /** id_of_ctffile(): given a CTF filename, find the CTF file id in the
  * ctflist. Returns a number greater than 0 on success, or -1 on failure:
  * either the ctflist is not loaded, or the CTF filename is not represented
@@ -235,17 +683,141 @@ int id_of_ctffile(char *name);
  */
 int add_ctffile(char *name, int ondisk);
 
+/** add_ctfshard(): as for add_ctffile(), but the CTF file is one of the
+ * shards made by buildctf -s, and is in the same tree as the CTF file
+ * added before it. The shards of a tree are not compared against each
+ * other unless CTP_WITHINTREE is set. On disk, the name is written with
+ * a leading '+'. A CTF file already in the list stays in its own tree.
+ */
+int add_ctfshard(char *name, int ondisk);
+
 /** Functions to reset the state of the system to its initial value.
  *
  * init_ctfparams(): reset the state of the system to its initial value.
  * As well, create, initialise and return a pointer to a Ctfparam structure
  * with default values. On failure, NULL is returned. If an old
  * Ctfparam pointer is passed, this will be reinitialised, and all
- * the internal state variables will be reset to their initial values.
+ * the internal state variables of the calling thread's current session
+ * will be reset to their initial values. Other sessions are untouched.
  * Note: the system state resetting may take a while.
  */
 Ctfparam *init_ctfparams(Ctfparam * oldparams);
 
+/** Functions to do several comparisons at the same time.
+ *
+ * new_ctfsession(): create and return a new, empty session, or NULL if
+ * it could not be allocated. The session is not used until it is passed
+ * to use_ctfsession().
+ */
+Ctfsession *new_ctfsession(void);
+
+/** use_ctfsession(): make the given session the current session of the
+ * calling thread, and return the session which was current. All the other
+ * library functions work on the calling thread's current session, which
+ * is the default session until this is called. A NULL session selects
+ * the default session. A session must only be used by one thread at a
+ * time, but different threads can use different sessions at once.
+ */
+Ctfsession *use_ctfsession(Ctfsession * s);
+
+/** free_ctfsession(): close the CTF files in the given session's ctflist,
+ * free its TDNs and runs, unmap the source files it has printed, and then
+ * free the session. The default session is reset instead. If the session
+ * was the calling thread's current session, the thread goes back to using
+ * the default session.
+ */
+void free_ctfsession(Ctfsession * s);
+
+
+/** Functions to save and load an index image of the in-memory TDNs.
+ *
+ * save_index(): save the TDNs of all the CTF files in the ctflist, and
+ * the in-memory TDNs that were made from them, in an index image in the
+ * named file. Returns 0 if OK, or sets errno and returns -1 on error.
+ */
+int save_index(char *name, Ctfparam * p);
+
+/** load_index(): map the index image in the named file made by
+ * save_index(), and use its TDNs as the in-memory TDNs of the CTF files
+ * in it. These must be the first CTF files in the ctflist, and they must
+ * not have been walked yet. The p->tuple_size and p->flags which change
+ * the TDNs must be the same as when the image was saved. The header,
+ * the tables of the CTF files and the offsets of the parts of the image
+ * are always checked, but the TDNs and the groups, which take time in
+ * proportion to the size of the image, are only checked if p->flags has
+ * CTP_CHECKINDEX. Returns the number of CTF files in the image, or sets
+ * errno and returns -1 on error, with EINVAL if the image is not valid.
+ */
+int load_index(char *name, Ctfparam * p);
+
+
+/** Functions to keep the runs found in a Results store.
+ *
+ * new_results(): return a new, empty Results store, or NULL if
+ * there is no memory for it.
+ */
+Results *new_results(void);
+
+/** add_runs_to_results(): given the head of a singly-linked list of runs,
+ * add each run to the Results store, and once more for each pairing of
+ * the copies of its files found by index_dupfiles(). As with
+ * print_listruns(), runs shorter than the tuple size in p are ignored.
+ */
+void add_runs_to_results(Results * r, Run * run, Ctfparam * p);
+
+/** add_dups_to_results(): given the head of a singly-linked list of
+ * Dupfile nodes from CTF file ctfid, add each pair of identical files to
+ * the Results store as a run with no offsets. As with print_dupfiles(),
+ * files dropped by dupfile_filtered() are ignored.
+ */
+void add_dups_to_results(Results * r, Dupfile * dup, int ctfid, Ctfparam * p);
+
+/** save_results(): save the Results store in the named file, along with
+ * the names of the CTF files in the ctflist. Returns 0 if OK, or -1 with
+ * errno set on error.
+ */
+int save_results(Results * r, char *name);
+
+/** load_results(): map in a Results store saved in the named file by
+ * save_results(). Its CTF files are added to the ctflist if they are not
+ * already in it, in the same trees as when the runs were found, and
+ * opened. ctflist.db is not read. Returns the store, or NULL with errno set on
+ * error. The store is read-only: runs can't be added to it.
+ */
+Results *load_results(char *name);
+
+/** free_results(): free a Results store */
+void free_results(Results * r);
+
+
+/** Functions to time the phases of a comparison.
+ *
+ * enable_ctfstats(): start keeping statistics about the comparisons done
+ * with p in p->stats: the time spent in each phase, the most incomplete
+ * runs held at once and the time spent walking each CTF file. The walks
+ * are timed with the wall clock, and are a little slower while they are
+ * timed. Returns 0 if OK, or -1 with errno set on error.
+ */
+int enable_ctfstats(Ctfparam * p);
+
+/** begin_ctfphase(): if p->stats is not NULL, note the wall clock and
+ * CPU time as the start of the given CTS_ phase. The CPU time is that
+ * of the whole process, so it includes all of its threads.
+ */
+void begin_ctfphase(Ctfparam * p, int phase);
+
+/** end_ctfphase(): if p->stats is not NULL, add the wall clock and CPU
+ * time since the call to begin_ctfphase() to the given CTS_ phase.
+ */
+void end_ctfphase(Ctfparam * p, int phase);
+
+/** print_ctfstats(): if p->stats is not NULL, print the statistics kept
+ * in it to out, along with the counters in p, a histogram of the lengths
+ * of the lists which hold the in-memory TDNs and the rate at which each
+ * CTF file was walked.
+ */
+void print_ctfstats(Ctfparam * p, FILE * out);
+
 
 
 #endif /* LIBCTF_H */
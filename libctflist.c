@@ -12,29 +12,109 @@
 #include <string.h>
 #include <ctype.h>
 #include "libctf.h"
+#include "libtdn.h"
+#include "libsession.h"
+#include "crc32.h"
 
 
-/* We keep the CTF list in memory in the following array
- * along with the next free slot in the list, and an 
- * array of CTF handles.
+/* We keep the CTF list in memory in an array in the session, along
+ * with the next free slot in the list, and an array of CTF handles.
+ * The arrays grow as CTF files are added.
  */
-int ctflistnext = 1;
-char *ctflist[NUMCTFFILES];
-Ctfhandle *ctf_handle[NUMCTFFILES];
+static Ctfsession defsession = { .ctflistnext = 1, .ctflistopened = 1 };
+__thread Ctfsession *cursess = &defsession;
+
+/* The ids of the CTF files are also kept in an open hash table
+ * keyed on the filename, so that we can find a filename's id quickly.
+ * An empty slot holds 0.
+ */
+
+/* Return the slot in the name hash table which holds the given
+ * filename, or the empty slot where it should go.
+ */
+static uint32_t namehash_slot(char *name)
+{
+  Ctfsession *s = cursess;
+  uint32_t h = crc32(name, strlen(name)) & s->namehashmask;
+
+  while ((s->namehash[h] != 0) && strcmp(s->ctflist[s->namehash[h]], name))
+    h = (h + 1) & s->namehashmask;
+  return (h);
+}
+
+/* Make room for another CTF file in the arrays, growing them and the
+ * name hash table if required. Returns 0 if OK, -1 on error.
+ */
+static int grow_ctflist(void)
+{
+  Ctfsession *s = cursess;
+  int i, newsize;
+  void *ptr;
+
+  if (s->ctflistnext < s->ctflistsize) return (0);
+
+  newsize = (s->ctflistsize == 0) ? 256 : 2 * s->ctflistsize;
+  if ((ptr = realloc(s->ctflist, newsize * sizeof(char *))) == NULL)
+    return (-1);
+  s->ctflist = ptr;
+  if ((ptr = realloc(s->ctf_handle, newsize * sizeof(Ctfhandle *))) == NULL)
+    return (-1);
+  s->ctf_handle = ptr;
+  if ((ptr = realloc(s->ctftree, newsize * sizeof(int))) == NULL)
+    return (-1);
+  s->ctftree = ptr;
+  for (i = s->ctflistsize; i < newsize; i++) {
+    s->ctflist[i] = NULL; s->ctf_handle[i] = NULL;
+  }
+  s->ctflistsize = newsize;
+
+  /* Keep the hash table at most half full */
+  free(s->namehash);
+  s->namehashmask = 2 * newsize - 1;
+  s->namehash = (int *) calloc(s->namehashmask + 1, sizeof(int));
+  if (s->namehash == NULL) return (-1);
+  for (i = 1; i < s->ctflistnext; i++)
+    s->namehash[namehash_slot(s->ctflist[i])] = i;
+  return (0);
+}
+
+/* Append the CTF filename to the in-memory list. If shard is set, the
+ * CTF file is in the same tree as the one before it in the list, else it
+ * starts a new tree. Returns 0 if OK, -1 on error.
+ */
+static int append_ctfname(char *name, int shard)
+{
+  Ctfsession *s = cursess;
+  char *copy;
+
+  if (grow_ctflist() == -1) return (-1);
+  if ((copy = strdup(name)) == NULL) return (-1);
+  s->ctflist[s->ctflistnext] = copy;
+  s->namehash[namehash_slot(copy)] = s->ctflistnext;
+  if (shard && (s->ctflistnext > 1))
+    s->ctftree[s->ctflistnext] = s->ctftree[s->ctflistnext - 1];
+  else
+    s->ctftree[s->ctflistnext] = s->ctflistnext;
+  s->ctflistnext++;
+  return (0);
+}
 
 /* Reinitialise the global variables */
 void reinit_libctflist(void)
 {
+  Ctfsession *s = cursess;
   int i;
-  for (i = 1; i < ctflistnext; i++) {
-    free(ctflist[i]);
-    ctflist[i]=NULL;
-    if (ctf_handle[i]) {
-      ctfclose(ctf_handle[i]);
-      ctf_handle[i]=NULL;
+  for (i = 1; i < s->ctflistnext; i++) {
+    free(s->ctflist[i]);
+    s->ctflist[i]=NULL;
+    if (s->ctf_handle[i]) {
+      ctfclose(s->ctf_handle[i]);
+      s->ctf_handle[i]=NULL;
     }
   }
-  ctflistnext = 1;
+  s->ctflistnext = s->ctflistopened = 1;
+  if (s->namehash != NULL)
+    memset(s->namehash, 0, (s->namehashmask + 1) * sizeof(int));
   return;
 }
 
@@ -46,38 +126,43 @@ void reinit_libctflist(void)
  * called multiple times, and the list will only be loaded from disk once.
  * If the in-memory list is updated using other functions, the function will
  * always return the number of entries in the in-memory list, regardless of
- * the state of the on-disk list.
+ * the state of the on-disk list. A line which starts with a '+' names a
+ * shard of the same tree as the CTF file on the line before it.
  */
 int load_ctflist(void)
 {
+  Ctfsession *s = cursess;
   char buffer[MAXCTFNAME + 1];	/* Buffer for file input */
   FILE *cin;
   int i;
 
   /* Try to open any unopened ctf handles */
-  for (i = 1; i < ctflistnext; i++)
-    if (ctf_handle[i]==NULL)
-      ctf_handle[i]= ctfopen(ctflist[i]);
+  for (i = s->ctflistopened; i < s->ctflistnext; i++)
+    if (s->ctf_handle[i]==NULL)
+      s->ctf_handle[i]= ctfopen(s->ctflist[i]);
+  s->ctflistopened = s->ctflistnext;
 
-  /* Don't re-read the ctflist file if the list is populated */
-  if (ctflistnext > 1) return (ctflistnext);
+  /* Don't re-read the ctflist file if the list is populated, or it
+   * isn't to be read at all
+   */
+  if ((s->ctflistnext > 1) || s->ctflistnodb) return (s->ctflistnext);
 
   /* Open the ctflist file */
   cin = fopen(CTFLIST_DB, "r");
   if (cin == NULL) return (-1);
 
   /* Read in each entry into the list */
-  while (ctflistnext < NUMCTFFILES) {
-    if (fgets(buffer, MAXCTFNAME, cin) == NULL) break;
-
+  while (fgets(buffer, MAXCTFNAME, cin) != NULL) {
     /* Remove the newline on the end */
     buffer[strlen(buffer) - 1] = '\0';
-    ctflist[ctflistnext++] = strdup(buffer);
+    if (buffer[0] == '+') {
+      if (append_ctfname(buffer + 1, 1) == -1) break;
+    } else if (append_ctfname(buffer, 0) == -1) break;
   }
 
   /* Close the input file and return the number of entries */
   fclose(cin);
-  return (ctflistnext);
+  return (s->ctflistnext);
 }
 
 /** get_ctfname(): given a specific CTF file id (1 or greater), return a
@@ -86,8 +171,30 @@ int load_ctflist(void)
  */
 char *get_ctfname(int id)
 {
-  if (id < 1 || id >= ctflistnext) return (NULL);
-  return (ctflist[id]);
+  if (id < 1 || id >= cursess->ctflistnext) return (NULL);
+  return (cursess->ctflist[id]);
+}
+
+/** get_ctfhandle(): given a specific CTF file id (1 or greater), return
+ * the CTF file's handle. Returns NULL if there is no entry in the list
+ * with the given id, or the CTF file has not been opened.
+ */
+Ctfhandle *get_ctfhandle(int id)
+{
+  if (id < 1 || id >= cursess->ctflistnext) return (NULL);
+  return (cursess->ctf_handle[id]);
+}
+
+/** get_ctftree(): given a specific CTF file id (1 or greater), return
+ * the id of the first CTF file in the same tree. The shards of a tree split
+ * by buildctf -s are one tree when they were added with add_ctfshard().
+ * Any other CTF file is a tree on its own, and so its own id is returned.
+ * Returns -1 if there is no entry in the list with the given id.
+ */
+int get_ctftree(int id)
+{
+  if (id < 1 || id >= cursess->ctflistnext) return (-1);
+  return (cursess->ctftree[id]);
 }
 
 /** id_of_ctffile(): given a CTF filename, find the CTF file id in the
@@ -97,25 +204,19 @@ char *get_ctfname(int id)
  */
 int id_of_ctffile(char *name)
 {
-  /* Walk the ctflist and return the position of the matching string */
-  int i;
-
-  if (name == NULL) return (-1);
-  for (i = 1; i < ctflistnext; i++)
-    if (!strcmp(ctflist[i], name))
-      return (i);
+  /* Look the name up in the hash table */
+  int id;
 
-  return (-1);
+  if ((name == NULL) || (cursess->namehash == NULL)) return (-1);
+  id = cursess->namehash[namehash_slot(name)];
+  return ((id == 0) ? -1 : id);
 }
 
-/** add_ctffile(): given a CTF filename, add the CTF file to the ctflist in
- * memory and on disk if requested. The function ensures that a CTF filename
- * cannot be duplicated in the in-memory list. Returns the CTF file id for
- * the CTF file which is a number greater than 0 on success, or -1 on
- * failure: either the ctflist is not loaded, or the CTF filename is not
- * represented in the ctflist.
+/* Add the CTF filename to the ctflist in memory, and on disk if ondisk
+ * is 1. If shard is set, the CTF file joins the tree of the CTF file
+ * before it. Returns as add_ctffile() does.
  */
-int add_ctffile(char *name, int ondisk)
+static int add_ctfentry(char *name, int ondisk, int shard)
 {
   FILE *cout;
   int id;
@@ -131,20 +232,44 @@ int add_ctffile(char *name, int ondisk)
   if (ondisk == 1) {
     cout = fopen(CTFLIST_DB, "a");
     if (cout == NULL) return (-1);
-    fprintf(cout, "%s\n", name);
+    fprintf(cout, "%s%s\n", shard ? "+" : "", name);
     fclose(cout);
   }
 
   /* Not in the list, so try to copy it into the list */
-  if (ctflistnext == NUMCTFFILES) return (-1);
+  if (append_ctfname(name, shard) == -1) return (-1);
+  return (cursess->ctflistnext);
+}
+
+/** add_ctffile(): given a CTF filename, add the CTF file to the ctflist in
+ * memory and on disk if requested. The function ensures that a CTF filename
+ * cannot be duplicated in the in-memory list. Returns the CTF file id for
+ * the CTF file which is a number greater than 0 on success, or -1 on
+ * failure: either the ctflist is not loaded, or the CTF filename is not
+ * represented in the ctflist.
+ */
+int add_ctffile(char *name, int ondisk)
+{
+  return (add_ctfentry(name, ondisk, 0));
+}
 
-  ctflist[ctflistnext++] = strdup(name);
-  return (ctflistnext);
+/** add_ctfshard(): as for add_ctffile(), but the CTF file is one of the
+ * shards made by buildctf -s, and is in the same tree as the CTF file
+ * added before it. The shards of a tree are not compared against each
+ * other unless CTP_WITHINTREE is set. On disk, the name is written with
+ * a leading '+'. A CTF file already in the list stays in its own tree.
+ */
+int add_ctfshard(char *name, int ondisk)
+{
+  return (add_ctfentry(name, ondisk, 1));
 }
 
 /* This doesn't belong here, but there is no other good place to put it. */
 extern void reinit_libruns(void);
 extern void reinit_libtdn(void);
+extern void reinit_libprintruns(void);
+extern void free_pathfilter(struct _pathfilter *pf);
+extern void free_ctfstats(Ctfstats * stats);
 
 /** Functions to reset the state of the system to its initial value.
  *
@@ -152,7 +277,8 @@ extern void reinit_libtdn(void);
  * As well, create, initialise and return a pointer to a Ctfparam structure
  * with default values. On failure, NULL is returned. If an old
  * Ctfparam pointer is passed, this will be reinitialised, and all
- * the internal state variables will be reset to their initial values.
+ * the internal state variables of the calling thread's current session
+ * will be reset to their initial values. Other sessions are untouched.
  * Note: the system state resetting may take a while.
  */
 Ctfparam *init_ctfparams(Ctfparam * oldparams)
@@ -166,6 +292,9 @@ Ctfparam *init_ctfparams(Ctfparam * oldparams)
     reinit_libctflist();
     reinit_libtdn();
     reinit_libruns();
+    reinit_libprintruns();
+    free_pathfilter(p->exclude);
+    free_ctfstats(p->stats);
   } else {
     p = (Ctfparam *) malloc(sizeof(Ctfparam));
     if (p == NULL) return (NULL);
@@ -176,8 +305,72 @@ Ctfparam *init_ctfparams(Ctfparam * oldparams)
   p->dbname = CTFLIST_DB;
   p->isomorph_count_threshold = 3;
   p->flags = 0;
+  p->numthreads = 0;
+  p->numparts = 0;
+  p->memlimit = 0;
+  p->format = CTF_FORMAT_TEXT;
+  p->minlen = 0;
+  p->maxlen = 0;
+  p->exclude = NULL;
   p->runcount = 0;
   p->tdncount = 0;
   p->tdncmpcnt = 0;
+  p->stats = NULL;
   return (p);
 }
+
+/** Functions to do several comparisons at the same time.
+ *
+ * new_ctfsession(): create and return a new, empty session, or NULL if
+ * it could not be allocated. The session is not used until it is passed
+ * to use_ctfsession().
+ */
+Ctfsession *new_ctfsession(void)
+{
+  Ctfsession *s = (Ctfsession *) calloc(1, sizeof(Ctfsession));
+
+  if (s == NULL) return (NULL);
+  s->ctflistnext = s->ctflistopened = 1;
+  return (s);
+}
+
+/** use_ctfsession(): make the given session the current session of the
+ * calling thread, and return the session which was current. All the other
+ * library functions work on the calling thread's current session, which
+ * is the default session until this is called. A NULL session selects
+ * the default session. A session must only be used by one thread at a
+ * time, but different threads can use different sessions at once.
+ */
+Ctfsession *use_ctfsession(Ctfsession * s)
+{
+  Ctfsession *old = cursess;
+
+  cursess = (s == NULL) ? &defsession : s;
+  return (old);
+}
+
+/** free_ctfsession(): close the CTF files in the given session's ctflist,
+ * free its TDNs and runs, unmap the source files it has printed, and then
+ * free the session. The default session is reset instead. If the session
+ * was the calling thread's current session, the thread goes back to using
+ * the default session.
+ */
+void free_ctfsession(Ctfsession * s)
+{
+  Ctfsession *old;
+
+  if (s == NULL) return;
+  old = use_ctfsession(s);
+  reinit_libctflist();
+  reinit_libtdn();
+  reinit_libruns();
+  reinit_libprintruns();
+  use_ctfsession((old == s) ? NULL : old);
+  if (s == &defsession) return;
+
+  free(s->ctflist);
+  free(s->ctf_handle);
+  free(s->ctftree);
+  free(s->namehash);
+  free(s);
+}
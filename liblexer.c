@@ -9,32 +9,51 @@
  */
 
 #include <stdlib.h>
-#include <time.h>
 #include "liblexer.h"
 
-void py_restart(FILE * input_file);
-int py_lex(void);
-void c_restart(FILE * input_file);
-int c_lex(void);
-void j_restart(FILE * input_file);
-int j_lex(void);
-void hex_restart(FILE * input_file);
-int hex_lex(void);
-void txt_restart(FILE * input_file);
-int txt_lex(void);
-void asm_restart(FILE * input_file);
-int asm_lex(void);
-void perl_restart(FILE * input_file);
-int perl_lex(void);
-
-void reset_lexer(void);
-void output_filename(char *name);
-
-int inside_comment = 0;
-int indent = 0;
-
-int numericvalcount=0;
-int lastnumericvalue=0;
+/*
+ * Each lexer is a reentrant flex scanner, built with its own prefix.
+ * We only need these four functions from each one.
+ */
+typedef struct _scanner
+{
+  int (*init) (Lexctx * lc, void **scanner);
+  void (*set_in) (FILE * input_file, void *scanner);
+  int (*lex) (void *scanner);
+  int (*destroy) (void *scanner);
+} Scanner;
+
+#define SCANNER(pfx) \
+  int pfx##_lex_init_extra(Lexctx * lc, void **scanner); \
+  void pfx##_set_in(FILE * input_file, void *scanner); \
+  int pfx##_lex(void *scanner); \
+  int pfx##_lex_destroy(void *scanner); \
+  static Scanner pfx##_scanner = { pfx##_lex_init_extra, pfx##_set_in, \
+				   pfx##_lex, pfx##_lex_destroy };
+
+SCANNER(c)
+SCANNER(j)
+SCANNER(py)
+SCANNER(perl)
+SCANNER(hex)
+SCANNER(txt)
+SCANNER(asm)
+
+#undef SCANNER
+
+void reset_lexer(Lexctx * lc);
+unsigned int get_hashval(char *t);
+
+/* Run the given scanner over the input file */
+static void run_scanner(Scanner * s, Lexctx * lc, FILE * zin)
+{
+  void *scanner;
+
+  if (s->init(lc, &scanner) != 0) return;
+  s->set_in(zin, scanner);
+  s->lex(scanner);
+  s->destroy(scanner);
+}
 
 #define endswith(suff)	!strcmp(suff, file + strlen(file) - strlen(suff))
 
@@ -61,7 +80,7 @@ int is_textfile(char *file)
   return(0);
 }
 
-void tokenize(char *file)
+void tokenize_ctx(Lexctx * lc, char *file)
 {
   FILE *zin;
 
@@ -70,9 +89,6 @@ void tokenize(char *file)
    * which is (c) Eric Raymond under the GPL.
    */
 
-  /* Seed the random number generator */
-  srand(time(NULL));
-
   if (endswith(".o") || endswith("~") || endswith(".pyc"))
     return;
   else if (strstr(file, "CVS") || strstr(file, "RCS") ||
@@ -84,62 +100,72 @@ void tokenize(char *file)
   if (zin == NULL)
     return;
 
-  reset_lexer();
+  reset_lexer(lc);
+
+  /* Seed the random number generator from the file's name, so that
+   * a file always tokenises the same way no matter which process or
+   * which order it is tokenised in.
+   */
+  lc->randseed = get_hashval(file);
 
   if (endswith(".c") || endswith(".h") ||
       endswith(".C") || endswith(".H") ||
       endswith(".C++") || endswith(".Cpp")) {
-    output_filename(file);
-    c_restart(zin);
-    c_lex();
+    output_filename(file, lc->out);
+    run_scanner(&c_scanner, lc, zin);
   } else if (endswith(".s") || endswith(".S")) {
-    output_filename(file);
-    asm_restart(zin);
-    asm_lex();
+    output_filename(file, lc->out);
+    run_scanner(&asm_scanner, lc, zin);
   } else if (endswith(".py") || endswith(".PY")) {
-    output_filename(file);
-    py_restart(zin);
-    py_lex();
+    output_filename(file, lc->out);
+    run_scanner(&py_scanner, lc, zin);
   } else if (endswith(".java") || endswith(".JAVA")) {
-    output_filename(file);
-    j_restart(zin);
-    j_lex();
+    output_filename(file, lc->out);
+    run_scanner(&j_scanner, lc, zin);
   } else if (endswith(".hex") || endswith(".HEX")) {
-    output_filename(file);
-    hex_restart(zin);
-    hex_lex();
+    output_filename(file, lc->out);
+    run_scanner(&hex_scanner, lc, zin);
   } else if (endswith(".pl") || endswith(".pm") || endswith(".perl")) {
-    output_filename(file);
-    perl_restart(zin);
-    perl_lex();
+    output_filename(file, lc->out);
+    run_scanner(&perl_scanner, lc, zin);
   } else if (is_textfile(file)) {
-    output_filename(file);
-    txt_restart(zin);
-    txt_lex();
+    output_filename(file, lc->out);
+    run_scanner(&txt_scanner, lc, zin);
   }
   fclose(zin);
 }
 
+/* Tokenise the file to zout. This uses a single shared Lexctx,
+ * so it must not be called from more than one thread at a time.
+ */
+void tokenize(char *file)
+{
+  static Lexctx lc;
+
+  lc.out = zout;
+  tokenize_ctx(&lc, file);
+}
+
 #undef endswith
 
-void myputc(char ch, FILE * f)
+void myputc(char ch, Lexctx * lc)
 {
-  if (inside_comment && (ch != LINE))
+  if (lc->inside_comment && (ch != LINE))
     return;
-  putc(ch, f);
+  putc(ch, lc->out);
 }
 
-void myputindent(size_t depth, FILE * f)
+void myputindent(size_t depth, Lexctx * lc)
 {
   size_t i;
-  /* printf("INDENT %i %i", depth, indent); */
-  if (inside_comment)
+  /* printf("INDENT %i %i", depth, lc->indent); */
+  if (lc->inside_comment)
     return;
-  for (i = indent; i < depth; i++)
-    myputc(INDENT, f);
-  for (i = indent; i > depth; i--)
-    myputc(OUTDENT, f);
-  indent = depth;
+  for (i = lc->indent; i < depth; i++)
+    myputc(INDENT, lc);
+  for (i = lc->indent; i > depth; i--)
+    myputc(OUTDENT, lc);
+  lc->indent = depth;
 }
 
 /* CCITT CRC-16 hash:
@@ -164,25 +190,26 @@ unsigned int get_hashval(char *t)
 
 
 /* This function called at the beginning of each input file */
-void reset_lexer(void)
+void reset_lexer(Lexctx * lc)
 {
-  inside_comment = 0;
-  indent = 0;
-  numericvalcount=0;
-  lastnumericvalue=0;
+  lc->inside_comment = 0;
+  lc->indent = 0;
+  lc->numericvalcount=0;
+  lc->lastnumericvalue=0;
 }
 
 
 /* Given a STRINGLIT, CHARCONST, INTVAL, IDENTIFIER or LABEL,
  * output the token followed by a 16-bit hash of the value.
  */
-void myputtokhash(char ch, char *text, FILE * f)
+void myputtokhash(char ch, char *text, Lexctx * lc)
 {
   unsigned int hash;
   char *pos;
+  FILE *f = lc->out;
 
   /* Output the token to start with */
-  if (inside_comment)
+  if (lc->inside_comment)
     return;
   putc(ch, f);
 
@@ -191,18 +218,18 @@ void myputtokhash(char ch, char *text, FILE * f)
   /* Break runs of 15 or more literal ints with the same value */
   if (ch==INTVAL)
   {
-    if (hash==lastnumericvalue) /* Increment if the same litval, else reset */
-      numericvalcount++;
+    if (hash==lc->lastnumericvalue) /* Increment if the same litval, else reset */
+      lc->numericvalcount++;
     else
-      numericvalcount=0;
+      lc->numericvalcount=0;
 
-    lastnumericvalue= hash;     /* Save the litval for next time */
+    lc->lastnumericvalue= hash;     /* Save the litval for next time */
 
     /* If we've seen 15 or more of them, throw in a random hashval */
-    if (numericvalcount>=15) {
+    if (lc->numericvalcount>=15) {
       /* printf("15 in a row for %s %d\n", text, hash); */
-      hash= rand();
-      numericvalcount=0;
+      hash= rand_r(&lc->randseed);
+      lc->numericvalcount=0;
     }
   }
 
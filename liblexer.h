@@ -19,13 +19,28 @@
 #include "libctf.h"
 #include "libtokens.h"
 
+/* The state of one tokenising scanner. The scanners are reentrant, and
+ * each one carries a pointer to a Lexctx as its extra data, so several
+ * files can be tokenised at the same time as long as each has its own
+ * Lexctx. Set the out field before calling tokenize_ctx(); the other
+ * fields are reset at the beginning of each input file.
+ */
+typedef struct _lexctx
+{
+  FILE *out;			/* Where the tokens are written to */
+  int inside_comment;		/* Non-zero if we are inside a comment */
+  int indent;			/* Current indent depth, for Python */
+  int numericvalcount;		/* # of consecutive identical INTVALs */
+  unsigned int lastnumericvalue;	/* Hash value of the last INTVAL */
+  unsigned int randseed;	/* Seed used by rand_r() */
+} Lexctx;
+
 void tokenize(char *filename);
-void myputc(char ch, FILE * f);
-void myputid(char ch, char *text, FILE * f);
-void myputtokhash(char ch, char *text, FILE * f);
-void myputindent(size_t depth, FILE * f);
+void tokenize_ctx(Lexctx * lc, char *filename);
+void myputc(char ch, Lexctx * lc);
+void myputtokhash(char ch, char *text, Lexctx * lc);
+void myputindent(size_t depth, Lexctx * lc);
+void output_filename(char *name, FILE * out);
 extern FILE *zout;
-extern int inside_comment;
-extern int indent;
 
 #endif /* LIBLEXER_H */
@@ -6,35 +6,43 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include "libctf.h"
 #include "libtokens.h"
+#include "libtdn.h"
+#include "libsession.h"
+#include "crc32.h"
 
 #undef NO_PRINTING		/* No printing for performance measurements */
 #undef PRINTOFFSETS		/* Print token offsets, not line numbers */
 
-extern Ctfhandle *ctf_handle[];	/* Array of CTF handles */
-
 
 #ifdef DEBUG
 /* Debug function: can be removed */
 void print_tdn(TDN * tdn)
 {
-  int fileid = tdn->file_line_id >> 20;
-  int linenum = tdn->file_line_id & 0xfffff;
-  printf("crc %08x offset %04x name %04x file %02d line %03d\n",
-	 tdn->tuple_crc, tdn->offset, tdn->name_offset,
-	 fileid, linenum);
+  int fileid = tdn->ctfid;
+  Ctfhandle *ctf = cursess->ctf_handle[fileid];
+  int linenum = get_linenum(ctf, tdn_offset(ctf, tdn));
+  printf("crc %08x offset %04llx name %04llx file %02d line %03d\n",
+	 tdn->tuple_crc, (unsigned long long) tdn_offset(ctf, tdn),
+	 (unsigned long long) tdn_name_offset(ctf, tdn), fileid, linenum);
 }
 #endif
 
 /* Given a TDN and a CTF file handle, return the line number
  * for the last token in the TDN. Returns the line number on
- * success, -1 on error.
+ * success, -1 on error. This is done once for each run, when
+ * the run is complete.
  */
 int last_linenum_for(TDN * tdn, Ctfhandle * ctf, Ctfparam * p)
 {
@@ -45,8 +53,8 @@ int last_linenum_for(TDN * tdn, Ctfhandle * ctf, Ctfparam * p)
    * the location where the token occurs. Make sure
    * that it lies in the mmap'd area.
    */
-  int linenum = tdn->file_line_id & 0xfffff;
-  uint8_t *posn = ctf->start + tdn->offset;
+  int linenum = get_linenum(ctf, tdn_offset(ctf, tdn));
+  uint8_t *posn = ctf->start + tdn_offset(ctf, tdn);
   if ((posn < ctf->start) || (posn >= ctf->end)) return (-1);
 
   /* Skip past tuple_size tokens, counting lines */
@@ -64,6 +72,7 @@ int last_linenum_for(TDN * tdn, Ctfhandle * ctf, Ctfparam * p)
       break;
 
     case FILENAME:
+    case DUPFILE:
       /* We should never hit one of these! */
       return (-1);
 
@@ -84,22 +93,38 @@ int last_linenum_for(TDN * tdn, Ctfhandle * ctf, Ctfparam * p)
 #endif
 }
 
+/*
+ * Everything needed to print a run, found either from a Run or from a
+ * run in a Results store.
+ */
+typedef struct _runview
+{
+  int length;			/* Length of the run in tokens */
+  char *sname;			/* Names of the source files in the walked */
+  char *dname;			/* tree and the other tree */
+  int sstart, send;		/* First and last lines of the run in each */
+  int dstart, dend;
+  Ctfhandle *sctf;		/* CTF file holding the walked tree's tokens */
+  uint64_t soff;		/* Offset of the first token on each side */
+  uint64_t doff;
+} Runview;
+
 /*
  * Given a run, print out the tokens in the run in much the same way as we do
- * in detok.c
+ * in detok.c. Nothing is printed if the CTF file isn't open.
  */
-void print_tokens(Run * node)
+void print_tokens(FILE * out, Runview * v)
 {
   uint32_t val;
   unsigned int ch;
-  int length = node->length;
-  int fid = node->src_startnode->file_line_id >> 20;
-  uint32_t offset = node->src_startnode->offset;
-  uint32_t line = node->src_startnode->file_line_id & 0xfffff;
+  int length = v->length;
+  uint64_t offset = v->soff;
+  uint32_t line = v->sstart;
 
-  printf("%5d:   ", line);
+  if (v->sctf == NULL) return;
+  fprintf(out, "%5d:   ", line);
   while ((length > 0) &&
-	 ((ch = get_token(ctf_handle[fid], &offset, &val, NULL)) != -1)) {
+	 ((ch = get_token(v->sctf, &offset, &val, NULL)) != -1)) {
     switch (ch) {
     case FILENAME:
       line = 1;
@@ -110,58 +135,440 @@ void print_tokens(Run * node)
     default:
       length--;
     }
-    print_token(ch, line, val, "");
+    fprint_token(out, ch, line, val, "");
+  }
+  fprintf(out, "\n\n");
+}
+
+
+/*
+ * To show the source lines of the runs, each source file is mmap()d once
+ * and the offset of the start of each of its lines is found, so that
+ * printing a run only touches the lines in the run. A Srccache keeps the
+ * SRCCACHESIZE most recently used files on a doubly-linked list, most
+ * recent first, and finds them by name with a chained hash table.
+ * The list is long enough that the files of the other tree matched by
+ * one source file are usually still mapped for the next source file.
+ * A file which can't be read is kept on the list with no mapping. The
+ * session has a Srccache, and so does each thread printing runs.
+ */
+#define SRCCACHESIZE	1024	/* Most source files kept on the list */
+#define SRCHASHSIZE	2048	/* Size of the hash table, a power of 2 */
+
+typedef struct _srcfile
+{
+  char *name;			/* Name of the source file */
+  uint32_t hash;		/* and its hash */
+  char *start;			/* The mmap()d file, NULL if none */
+  size_t *lines;		/* Offset of the start of each line, and */
+  int numlines;			/* of the end of the file after the last */
+  int unreadable;		/* Set if the file can't be read */
+  struct _srcfile *next;	/* Next and previous files on the list */
+  struct _srcfile *prev;
+  struct _srcfile *hnext;	/* Next file on the same hash chain */
+} Srcfile;
+
+/* Unmap the source file and free its Srcfile node */
+static void free_srcfile(Srcfile * sf)
+{
+  if (sf->start != NULL) munmap(sf->start, sf->lines[sf->numlines]);
+  free(sf->lines);
+  free(sf->name);
+  free(sf);
+}
+
+/* Map in the named source file and find where its lines start. Returns
+ * 0 if OK, -1 if the file can't be read.
+ */
+static int map_srcfile(Srcfile * sf)
+{
+  struct stat sb;
+  char *posn, *end;
+  int fd, i;
+
+  if ((fd = open(sf->name, O_RDONLY)) == -1) return (-1);
+  if ((fstat(fd, &sb) == -1) || !S_ISREG(sb.st_mode)) {
+    close(fd); return (-1);
+  }
+  if (sb.st_size > 0) {
+    sf->start = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (sf->start == MAP_FAILED) {
+      sf->start = NULL; close(fd); return (-1);
+    }
+  }
+  close(fd);
+
+  /* Count the lines, including a last one with no newline */
+  end = sf->start + sb.st_size;
+  for (posn = sf->start; posn < end; posn++, sf->numlines++)
+    if ((posn = memchr(posn, '\n', end - posn)) == NULL) posn = end - 1;
+
+  sf->lines = (size_t *) malloc((sf->numlines + 1) * sizeof(size_t));
+  if (sf->lines == NULL) {
+    fprintf(stderr, "Unable to malloc line table: %s\n", strerror(errno));
+    exit(1);
+  }
+  for (i = 0, posn = sf->start; posn < end; posn++, i++) {
+    sf->lines[i] = posn - sf->start;
+    if ((posn = memchr(posn, '\n', end - posn)) == NULL) posn = end - 1;
+  }
+  sf->lines[i] = sb.st_size;
+  return (0);
+}
+
+/* Unmap all the source files and empty the list and the hash table */
+static void free_srccache(Srccache * sc)
+{
+  Srcfile *sf;
+
+  while ((sf = sc->srcfiles) != NULL) {
+    sc->srcfiles = sf->next;
+    free_srcfile(sf);
+  }
+  sc->numsrcfiles = 0;
+  sc->oldest = NULL;
+  free(sc->hash);
+  sc->hash = NULL;
+}
+
+/* Take the source file off the list */
+static void unlink_srcfile(Srccache * sc, Srcfile * sf)
+{
+  if (sf->prev != NULL) sf->prev->next = sf->next;
+  else sc->srcfiles = sf->next;
+  if (sf->next != NULL) sf->next->prev = sf->prev;
+  else sc->oldest = sf->prev;
+}
+
+/* Put the source file at the front of the list */
+static void push_srcfile(Srccache * sc, Srcfile * sf)
+{
+  sf->prev = NULL;
+  sf->next = sc->srcfiles;
+  if (sc->srcfiles != NULL) sc->srcfiles->prev = sf;
+  else sc->oldest = sf;
+  sc->srcfiles = sf;
+}
+
+/* Return the Srcfile for the named source file, mapping it in if it
+ * isn't on the list, or NULL if the file can't be read.
+ */
+static Srcfile *get_srcfile(Srccache * sc, char *name)
+{
+  uint32_t h = crc32(name, strlen(name));
+  Srcfile *sf, **prevnext;
+
+  if ((sc->hash == NULL) &&
+      ((sc->hash = (Srcfile **) calloc(SRCHASHSIZE, sizeof(Srcfile *))) ==
+       NULL)) {
+    fprintf(stderr, "Unable to malloc source file table: %s\n",
+	    strerror(errno));
+    exit(1);
+  }
+
+  /* Move the file to the front of the list if it is already on it */
+  for (sf = sc->hash[h & (SRCHASHSIZE - 1)]; sf != NULL; sf = sf->hnext)
+    if ((sf->hash == h) && !strcmp(sf->name, name)) {
+      if (sf != sc->srcfiles) {
+	unlink_srcfile(sc, sf);
+	push_srcfile(sc, sf);
+      }
+      return (sf->unreadable ? NULL : sf);
+    }
+
+  /* Drop the least recently used file if the list is full */
+  if (sc->numsrcfiles == SRCCACHESIZE) {
+    sf = sc->oldest;
+    unlink_srcfile(sc, sf);
+    for (prevnext = &sc->hash[sf->hash & (SRCHASHSIZE - 1)]; *prevnext != sf;
+	 prevnext = &(*prevnext)->hnext);
+    *prevnext = sf->hnext;
+    free_srcfile(sf);
+    sc->numsrcfiles--;
+  }
+
+  sf = (Srcfile *) calloc(1, sizeof(Srcfile));
+  if ((sf == NULL) || ((sf->name = strdup(name)) == NULL)) {
+    fprintf(stderr, "Unable to malloc source file: %s\n", strerror(errno));
+    exit(1);
+  }
+  if (map_srcfile(sf) == -1) {
+    free(sf->lines);
+    sf->lines = NULL;
+    sf->unreadable = 1;
+  }
+  sf->hash = h;
+  sf->hnext = sc->hash[h & (SRCHASHSIZE - 1)];
+  sc->hash[h & (SRCHASHSIZE - 1)] = sf;
+  push_srcfile(sc, sf);
+  sc->numsrcfiles++;
+  return (sf->unreadable ? NULL : sf);
+}
+
+/* Set text to point at the given line (1 upwards) of the source file,
+ * including its newline if it has one, and return its length. Lines
+ * past the end of the file are empty.
+ */
+static size_t get_srcline(Srcfile * sf, int line, char **text)
+{
+  if ((line < 1) || (line > sf->numlines)) return (0);
+  *text = sf->start + sf->lines[line - 1];
+  return (sf->lines[line] - sf->lines[line - 1]);
+}
+
+/* Print numlines lines of the source file from line start onwards */
+static void print_srclines(FILE * out, Srcfile * sf, int start, int numlines)
+{
+  int end = start + numlines;
+
+  if (start < 1) start = 1;
+  if (end > sf->numlines + 1) end = sf->numlines + 1;
+  if (start < end)
+    fwrite(sf->start + sf->lines[start - 1], 1,
+	   sf->lines[end - 1] - sf->lines[start - 1], out);
+}
+
+/*
+ * With the binary and JSON Lines formats, the runs are built up in a
+ * buffer which is written out when it fills, instead of with a printf()
+ * for each run. For the binary format we also keep the table of the
+ * filenames written so far, with a hash table to find a name's index.
+ */
+#define WRITERBUFSIZE	(1 << 20)	/* Size of the output buffer */
+#define NAMEHASHSIZE	1024		/* Starting size of the hash table */
+
+typedef struct _runwriter
+{
+  char *buf;			/* The output buffer */
+  size_t used;			/* Bytes in it */
+  uint64_t offset;		/* Bytes written before the buffer */
+  uint64_t numruns;		/* Number of runs written */
+  char **names;			/* The filename table */
+  uint32_t numnames;		/* Names in it, */
+  uint32_t namessize;		/* and its size */
+  uint32_t *namehash;		/* Hash table of name index + 1 */
+  uint32_t namehashmask;	/* Its size - 1 */
+} Runwriter;
+
+/* Write out and empty the writer's buffer */
+static void flush_writer(Runwriter * w)
+{
+  if (w->used) fwrite(w->buf, 1, w->used, stdout);
+  w->offset += w->used;
+  w->used = 0;
+}
+
+/* Add len bytes of data to the writer's buffer */
+static void writer_put(Runwriter * w, const void *data, size_t len)
+{
+  if (w->used + len > WRITERBUFSIZE) {
+    flush_writer(w);
+    if (len > WRITERBUFSIZE) {
+      fwrite(data, 1, len, stdout);
+      w->offset += len; return;
+    }
+  }
+  memcpy(w->buf + w->used, data, len);
+  w->used += len;
+}
+
+/* Free the writer and its names */
+static void free_writer(Runwriter * w)
+{
+  uint32_t i;
+
+  for (i = 0; i < w->numnames; i++)
+    free(w->names[i]);
+  free(w->names);
+  free(w->namehash);
+  free(w->buf);
+  free(w);
+}
+
+/* Return the session's writer, making it if needed. For the binary
+ * format, the header is written first. Exits if there is no memory.
+ */
+static Runwriter *get_writer(Ctfparam * p)
+{
+  Runwriter *w = cursess->writer;
+  Runshdr hdr;
+
+  if (w != NULL) return (w);
+  w = (Runwriter *) calloc(1, sizeof(Runwriter));
+  if (w != NULL) {
+    w->buf = (char *) malloc(WRITERBUFSIZE);
+    w->namehash = (uint32_t *) calloc(NAMEHASHSIZE, sizeof(uint32_t));
+  }
+  if ((w == NULL) || (w->buf == NULL) || (w->namehash == NULL)) {
+    fprintf(stderr, "Unable to malloc run writer: %s\n", strerror(errno));
+    exit(1);
+  }
+  w->namehashmask = NAMEHASHSIZE - 1;
+  cursess->writer = w;
+
+  if (p->format == CTF_FORMAT_BINARY) {
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RUNS_MAGIC, sizeof(hdr.magic));
+    hdr.recsize = sizeof(Runrec);
+    writer_put(w, &hdr, sizeof(hdr));
+  }
+  return (w);
+}
+
+/* Return the index of the name in the writer's filename table, adding
+ * it if it isn't there. Exits if there is no memory.
+ */
+static uint32_t intern_name(Runwriter * w, char *name)
+{
+  uint32_t h, i, *old, oldmask;
+
+  h = crc32(name, strlen(name));
+  for (i = h & w->namehashmask; w->namehash[i] != 0;
+       i = (i + 1) & w->namehashmask)
+    if (!strcmp(w->names[w->namehash[i] - 1], name))
+      return (w->namehash[i] - 1);
+
+  /* Not there, so add it to the table */
+  if (w->numnames == w->namessize) {
+    w->namessize = w->namessize ? 2 * w->namessize : NAMEHASHSIZE;
+    w->names = (char **) realloc(w->names, w->namessize * sizeof(char *));
+    if (w->names == NULL) {
+      fprintf(stderr, "Unable to malloc filename table: %s\n",
+	      strerror(errno));
+      exit(1);
+    }
+  }
+  if ((w->names[w->numnames] = strdup(name)) == NULL) {
+    fprintf(stderr, "Unable to malloc filename: %s\n", strerror(errno));
+    exit(1);
+  }
+  w->namehash[i] = ++w->numnames;
+
+  /* Keep the hash table no more than half full */
+  if (2 * w->numnames > w->namehashmask) {
+    old = w->namehash;
+    oldmask = w->namehashmask;
+    w->namehashmask = 2 * oldmask + 1;
+    w->namehash = (uint32_t *) calloc(w->namehashmask + 1, sizeof(uint32_t));
+    if (w->namehash == NULL) {
+      fprintf(stderr, "Unable to malloc filename hash: %s\n",
+	      strerror(errno));
+      exit(1);
+    }
+    for (h = 0; h <= oldmask; h++) {
+      if (old[h] == 0) continue;
+      name = w->names[old[h] - 1];
+      for (i = crc32(name, strlen(name)) & w->namehashmask;
+	   w->namehash[i] != 0; i = (i + 1) & w->namehashmask) ;
+      w->namehash[i] = old[h];
+    }
+    free(old);
+  }
+  return (w->numnames - 1);
+}
+
+/* Add the name to the writer's buffer as a JSON string. Filenames are
+ * bytes, not necessarily UTF-8, so control characters, DEL and each byte
+ * of 0x80 or more are written as \u00XX, and the output stays valid
+ * JSON. A reader gets each such byte back as the character U+00XX.
+ */
+static void put_jsonname(Runwriter * w, char *name)
+{
+  char esc[8];
+  unsigned char c;
+
+  writer_put(w, "\"", 1);
+  for (; (c = *name) != '\0'; name++) {
+    if ((c == '"') || (c == '\\')) {
+      esc[0] = '\\'; esc[1] = c;
+      writer_put(w, esc, 2);
+    } else if ((c < 0x20) || (c >= 0x7f)) {
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      writer_put(w, esc, 6);
+    } else
+      writer_put(w, name, 1);
   }
-  printf("\n\n");
+  writer_put(w, "\"", 1);
 }
 
+/* Write one run, as a Runrec or a JSON object, to the session's writer */
+static void write_run(Ctfparam * p, int length, char *sname, int sstart,
+		      int send, char *dname, int dstart, int dend)
+{
+  Runwriter *w = get_writer(p);
+  Runrec rec;
+  char num[64];
+  int len;
+
+  if (p->format == CTF_FORMAT_BINARY) {
+    rec.length = length;
+    rec.srcname = intern_name(w, sname);
+    rec.srcstart = sstart;
+    rec.srcend = send;
+    rec.dstname = intern_name(w, dname);
+    rec.dststart = dstart;
+    rec.dstend = dend;
+    writer_put(w, &rec, sizeof(rec));
+  } else {
+    len = snprintf(num, sizeof(num), "{\"len\":%d,\"src\":", length);
+    writer_put(w, num, len);
+    put_jsonname(w, sname);
+    len = snprintf(num, sizeof(num),
+		   ",\"src_start\":%d,\"src_end\":%d,\"dst\":", sstart, send);
+    writer_put(w, num, len);
+    put_jsonname(w, dname);
+    len = snprintf(num, sizeof(num),
+		   ",\"dst_start\":%d,\"dst_end\":%d}\n", dstart, dend);
+    writer_put(w, num, len);
+  }
+  w->numruns++;
+}
+
+/* Unmap all the source files and empty the session's list, and throw
+ * away any runs not yet written out.
+ */
+void reinit_libprintruns(void)
+{
+  Ctfsession *s = cursess;
+
+  free_srccache(&s->srccache);
+  if (s->writer != NULL) free_writer(s->writer);
+  s->writer = NULL;
+}
 
 /*
  * Print out lines of two files side-by-side. This is best viewed with a
  * terminal window 160 characters wide! If neither file exists, the function
  * simply returns with no error message.
  */
-void paste_files(char *file1, char *file2, Run *node, int side_side,
+void paste_files(FILE * out, Srccache * sc, Runview * v, int side_side,
 		 Ctfparam * p)
 {
-  FILE *f1in, *f2in;
-  char buf[1024];
+  Srcfile *f1in, *f2in;
+  char *text = NULL;
+  char line[81];		/* A left-hand line and the space after it */
+  size_t len, bptr;
   int count_to_eighty = 0;
-  int i, bptr, maxlines;
+  int i, maxlines;
   int numlines1, numlines2;
   int tab_upto = 0;
-  int src_ctfid = node->src_startnode->file_line_id >> 20;
-  int dst_ctfid = node->dst_startnode->file_line_id >> 20;
-  char *err;
+  int start1 = v->sstart, end1 = v->send;
+  int start2 = v->dstart, end2 = v->dend;
 
-  int start1 = node->src_startnode->file_line_id & 0xfffff;
-  int start2 = node->dst_startnode->file_line_id & 0xfffff;
-  int end1 = last_linenum_for(node->src_endnode, ctf_handle[src_ctfid], p);
-  int end2 = last_linenum_for(node->dst_endnode, ctf_handle[dst_ctfid], p);
-
-  f1in = fopen(file1, "r");
+  f1in = get_srcfile(sc, v->sname);
   if (f1in == NULL) side_side = 0;
 
-  f2in = fopen(file2, "r");
+  f2in = get_srcfile(sc, v->dname);
   if (f2in == NULL) side_side = 0;
 
   /* We can't display either file, simply show the tokens */
   if ((f1in == NULL) && (f2in == NULL)) {
-    print_tokens(node); return;
+    print_tokens(out, v); return;
   }
   /* Get maximum number of lines */
   numlines1 = end1 - start1 + 1;
   numlines2 = end2 - start2 + 1;
   maxlines = (numlines1 > numlines2) ? numlines1 : numlines2;
-  start1--; start2--;
-
-  /* Read up to line start1 in file1 */
-  if (f1in != NULL)
-    while (start1--) err = fgets(buf, 1020, f1in);
-
-  /* Read up to line start2 in file2 */
-  if (f2in != NULL)
-    while (start2--) err = fgets(buf, 1020, f2in);
 
   if (side_side) {
     /* Now print out the lines */
@@ -169,119 +576,345 @@ void paste_files(char *file1, char *file2, Run *node, int side_side,
 
       /* Print the left-hand line */
       if (numlines1 > 0) {
-	err = fgets(buf, 1020, f1in);
-	buf[strlen(buf) - 1] = '\0';	/* Remove newline */
+	len = get_srcline(f1in, start1 + i, &text);
+	if ((len > 0) && (text[len - 1] == '\n')) len--;	/* No newline */
 
 	/*
 	 * I used to printf("%-80s",buf); here, but it never did what I
-	 * wanted, so I now print out exactly 80 chars by hand. This is
+	 * wanted, so I now build up exactly 80 chars by hand. This is
 	 * because we have to deal with tabs, dammit!
 	 */
 	tab_upto = 0; bptr = 0;
 	for (count_to_eighty = 0; count_to_eighty < 80; count_to_eighty++) {
 	  if (tab_upto > count_to_eighty) {
-	    fputc(' ', stdout); continue;
+	    line[count_to_eighty] = ' '; continue;
 	  }
-	  if (buf[bptr] == '\0') break;
-	  if (buf[bptr] == '\t') {
+	  if (bptr == len) break;
+	  if (text[bptr] == '\t') {
 
 	    /* Calculate the next highest multiple of 8 */
 	    tab_upto = (count_to_eighty + 8) & ~7;
 	    if (tab_upto >= 80) break;
-	    fputc(' ', stdout);
+	    line[count_to_eighty] = ' ';
 	    bptr++;
 	    continue;
 	  }
-	  fputc(buf[bptr++], stdout);
+	  line[count_to_eighty] = text[bptr++];
 	}
-	for (; count_to_eighty < 80; count_to_eighty++) {
-	  fputc(' ', stdout);
+	for (; count_to_eighty < 81; count_to_eighty++) {
+	  line[count_to_eighty] = ' ';
 	}
-	printf(" ");
+	fwrite(line, 1, 81, out);
       } else
-	printf("%81s", " ");
+	fprintf(out, "%81s", " ");
 
       /* Print the right-hand line */
-      if (numlines2 > 0) {
-	err = fgets(buf, 1020, f2in);
-	fputs(buf, stdout);
-      } else
-	printf("\n");
+      len = (numlines2 > 0) ? get_srcline(f2in, start2 + i, &text) : 0;
+      if (len > 0)
+	fwrite(text, 1, len, out);
+      else
+	fprintf(out, "\n");
     }
   } else {			/* Not side-by-side */
     if (f1in != NULL)
-      for (i = 0; i < numlines1; i++) {
-	err = fgets(buf, 1020, f1in);
-	fputs(buf, stdout);
-    } else
-      print_tokens(node);
-    printf("=====================================\n");
+      print_srclines(out, f1in, start1, numlines1);
+    else
+      print_tokens(out, v);
+    fprintf(out, "=====================================\n");
     if (f2in != NULL)
-      for (i = 0; i < numlines2; i++) {
-	err = fgets(buf, 1020, f2in);
-	fputs(buf, stdout);
-    } else
-      print_tokens(node);
+      print_srclines(out, f2in, start2, numlines2);
+    else
+      print_tokens(out, v);
   }
-  printf("\n");
-  if (numlines1 > numlines2) printf("\n");
-  if (f1in != NULL) fclose(f1in);
-  if (f2in != NULL) fclose(f2in);
+  fprintf(out, "\n");
+  if (numlines1 > numlines2) fprintf(out, "\n");
 }
 
 
-void print_listrun(Run * run, Ctfparam * p)
+/* Return the name of the source file which holds the TDN's tuple. The
+ * name points into the mmap()d CTF file, and each file record has its
+ * own name pointer.
+ */
+char *tdn_filename(TDN * tdn)
 {
-  uint32_t off;
-  int src_lastline, dst_lastline;
+  Ctfhandle *ctf = cursess->ctf_handle[tdn->ctfid];
+
+  /* Find where the filename actually starts: base + offset + skip the
+   * token + skip the 4-byte timestamp
+   */
+  return ((char *) (ctf->start + tdn_name_offset(ctf, tdn) + 1 +
+		    sizeof(uint32_t)));
+}
+
+/* Print the run on out, using the source files in sc. The run details
+ * aren't printed for a duplicate file, which has no offsets.
+ */
+static void print_view(FILE * out, Srccache * sc, Runview * v, Ctfparam * p)
+{
+  /* The other formats have no detailed results */
+  if (p->format != CTF_FORMAT_TEXT) {
+    write_run(p, v->length, v->sname, v->sstart, v->send,
+	      v->dname, v->dstart, v->dend);
+    return;
+  }
+
+#ifdef PRINTOFFSETS
+  fprintf(out, "%d  %s:%llu-%d  %s:%llu-%d\n",
+	 v->length,
+	 v->sname, (unsigned long long) v->soff, v->send,
+	 v->dname, (unsigned long long) v->doff, v->dend);
+#else
+  fprintf(out, "%d  %s:%d-%d  %s:%d-%d\n",
+	 v->length,
+	 v->sname, v->sstart, v->send,
+	 v->dname, v->dstart, v->dend);
+#endif
+  if (v->soff == 0) return;
+
+  /* Now print out more detailed results as required */
+  if (p->flags & CTP_SIDEBYSIDE) paste_files(out, sc, v, 1, p);
+  else if (p->flags & CTP_PRINTCODE) paste_files(out, sc, v, 0, p);
+  else if (p->flags & CTP_PRINTTOKENS) print_tokens(out, v);
+
+  if ((p->flags & CTP_PRINTTOKENS) || (p->flags & CTP_SIDEBYSIDE))
+    fprintf(out, "=====================================\n");
+}
+
+/* Print the run on out, using the source files in sc. The run is then
+ * printed again for each pairing of the copies of its two files found
+ * by index_dupfiles(), which have the same lines as the files.
+ */
+static void print_run(FILE * out, Srccache * sc, Run * run, Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  Ctfhandle *dctf = s->ctf_handle[run->dst_startnode->ctfid];
+  Dupnames *sdups, *ddups;
   char *sname, *dname;
+  Runview v;
+  int i, j;
+
+  v.length = run->length;
+  v.sname = tdn_filename(run->src_startnode);
+  v.dname = tdn_filename(run->dst_startnode);
+  v.sctf = s->ctf_handle[run->src_startnode->ctfid];
+  v.soff = tdn_offset(v.sctf, run->src_startnode);
+  v.doff = tdn_offset(dctf, run->dst_startnode);
+  v.sstart = get_linenum(v.sctf, v.soff);
+  v.dstart = get_linenum(dctf, v.doff);
 
+  /*
+   * The two TDNs are the last where all tuple_size tokens match, but the
+   * line number in the TDN is for the first token, not the last token.
+   * The real end lines were found when the run was completed.
+   */
+  v.send = run->src_endline;
+  v.dend = run->dst_endline;
+  print_view(out, sc, &v, p);
+
+  if (s->duphash == NULL) return;
+  sdups = tdn_dupnames(run->src_startnode);
+  ddups = tdn_dupnames(run->dst_startnode);
+  sname = v.sname;
+  dname = v.dname;
+  for (i = -1; i < dup_count(sdups); i++)
+    for (j = -1; j < dup_count(ddups); j++) {
+      if ((i == -1) && (j == -1)) continue;
+      v.sname = dup_name(sdups, i, sname);
+      v.dname = dup_name(ddups, j, dname);
+      print_view(out, sc, &v, p);
+    }
+}
+
+void print_listrun(Run * run, Ctfparam * p)
+{
   /* Do nothing if the run length < the tuple size */
   if (run->length < p->tuple_size)
     return;
 
 #ifndef NO_PRINTING
-  int src_ctfid = run->src_startnode->file_line_id >> 20;
-  int dst_ctfid = run->dst_startnode->file_line_id >> 20;
+  print_run(stdout, &cursess->srccache, run, p);
+#endif /* NO_PRINTING */
+}
 
-  /* Find where the filenames actually start: base + offset + skip the token
-   * + skip the 4-byte timestamp
-   */
-  off = run->src_startnode->name_offset;
-  sname= (char *)(ctf_handle[src_ctfid]->start + off + 1 + sizeof(uint32_t));
-  off = run->dst_startnode->name_offset;
-  dname= (char *)(ctf_handle[dst_ctfid]->start + off + 1 + sizeof(uint32_t));
-  
-  /*
-   * The two TDNs are the last where all tuple_size tokens match, but the
-   * line number in the TDN is for the first token, not the last token. We
-   * need to manually walk another tuple_size TDNs to get the real end line
-   * numbers.
+/*
+ * Printing the source lines or tokens of each run takes much longer than
+ * finding the runs, so with -x, -s or -t the runs are printed by a pool
+ * of threads. The runs are split into chunks of RENDERCHUNK runs. Each
+ * thread takes the next chunk and prints it into a buffer, and the calling
+ * thread writes out the buffers in chunk order, so the output is the same
+ * as printing the runs one at a time. The threads only get RENDERAHEAD
+ * chunks each ahead of the output, to bound the memory used.
+ */
+#define RENDERCHUNK	64	/* Runs printed into each buffer */
+#define RENDERAHEAD	4	/* Chunks per thread ahead of the output */
+
+typedef struct _renderpool
+{
+  Run **runs;			/* The runs to print */
+  int count;			/* Number of runs */
+  int numchunks;		/* Number of chunks of runs */
+  int next;			/* Next chunk to be printed */
+  int written;			/* Chunks written out so far */
+  int ahead;			/* Most chunks printed ahead of written */
+  char **text;			/* Printed text of each chunk, and its */
+  size_t *textlen;		/* length, text is NULL until printed */
+  pthread_mutex_t lock;		/* Lock on the above */
+  pthread_cond_t printed;	/* Signalled when a chunk is printed */
+  pthread_cond_t room;		/* Signalled when a chunk is written */
+  Ctfsession *sess;		/* Session of the calling thread */
+  Ctfparam *p;
+} Renderpool;
+
+/* Return the number of threads to print the runs with: one unless the
+ * runs' source lines or tokens are printed as text.
+ */
+static int render_threads(Ctfparam * p)
+{
+  int nthreads;
+
+  if ((p->format != CTF_FORMAT_TEXT) ||
+      !(p->flags & (CTP_SIDEBYSIDE | CTP_PRINTCODE | CTP_PRINTTOKENS)))
+    return (1);
+  nthreads = p->numthreads;
+  if (nthreads < 1) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  return (nthreads);
+}
+
+/* The body of each thread: take the next chunk of runs from the pool and
+ * print it into a buffer, until there are none left.
+ */
+static void *render_thread(void *arg)
+{
+  Renderpool *pool = (Renderpool *) arg;
+  Srccache sc = { NULL, 0, NULL, NULL };
+  FILE *out;
+  char *text;
+  size_t len;
+  int c, i, end;
+
+  /* Work on the session of the thread which started us */
+  use_ctfsession(pool->sess);
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while ((pool->next < pool->numchunks) &&
+	   (pool->next >= pool->written + pool->ahead))
+      pthread_cond_wait(&pool->room, &pool->lock);
+    c = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (c >= pool->numchunks) break;
+
+    if ((out = open_memstream(&text, &len)) == NULL) {
+      fprintf(stderr, "Unable to open print buffer: %s\n", strerror(errno));
+      exit(1);
+    }
+    end = (c + 1) * RENDERCHUNK;
+    if (end > pool->count) end = pool->count;
+    for (i = c * RENDERCHUNK; i < end; i++)
+      if (pool->runs[i]->length >= pool->p->tuple_size)
+	print_run(out, &sc, pool->runs[i], pool->p);
+    fclose(out);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->text[c] = text;
+    pool->textlen[c] = len;
+    pthread_cond_broadcast(&pool->printed);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  free_srccache(&sc);
+  return (NULL);
+}
+
+/* Print out the count runs in the array in order, with a pool of threads
+ * if render_threads() says so.
+ */
+static void print_runarray(Run ** runs, int count, Ctfparam * p)
+{
+  Renderpool pool;
+  pthread_t *tid;
+  int i, nthreads, started;
+
+  pool.numchunks = (count + RENDERCHUNK - 1) / RENDERCHUNK;
+  nthreads = render_threads(p);
+  if (nthreads > pool.numchunks) nthreads = pool.numchunks;
+  if (nthreads <= 1) {
+    for (i = 0; i < count; i++)
+      print_listrun(runs[i], p);
+    return;
+  }
+
+  pool.text = (char **) calloc(pool.numchunks, sizeof(char *));
+  pool.textlen = (size_t *) calloc(pool.numchunks, sizeof(size_t));
+  tid = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  if ((pool.text == NULL) || (pool.textlen == NULL) || (tid == NULL)) {
+    fprintf(stderr, "Unable to malloc print buffers: %s\n", strerror(errno));
+    exit(1);
+  }
+  pool.runs = runs;
+  pool.count = count;
+  pool.next = pool.written = 0;
+  pool.ahead = RENDERAHEAD * nthreads;
+  pool.sess = cursess;
+  pool.p = p;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.printed, NULL);
+  pthread_cond_init(&pool.room, NULL);
+
+  for (started = 0; started < nthreads; started++)
+    if (pthread_create(&tid[started], NULL, render_thread, &pool) != 0)
+      break;
+
+  /* Write out each chunk as it is printed. If no threads started,
+   * print them all here instead.
    */
-  src_lastline = last_linenum_for(run->src_endnode, ctf_handle[src_ctfid], p);
-  dst_lastline = last_linenum_for(run->dst_endnode, ctf_handle[dst_ctfid], p);
+  if (started == 0) {
+    pool.ahead = pool.numchunks;
+    render_thread(&pool);
+  }
+  for (i = 0; i < pool.numchunks; i++) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.text[i] == NULL)
+      pthread_cond_wait(&pool.printed, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
 
-#ifdef PRINTOFFSETS
-  printf("%d  %s:%d-%d  %s:%d-%d\n",
-	 run->length,
-	 sname, (int) run->src_startnode->offset, src_lastline,
-	 dname, (int) run->dst_startnode->offset, dst_lastline);
-#else
-  printf("%d  %s:%d-%d  %s:%d-%d\n",
-	 run->length,
-	 sname, run->src_startnode->file_line_id & 0xfffff, src_lastline,
-	 dname, run->dst_startnode->file_line_id & 0xfffff, dst_lastline);
-#endif
+    fwrite(pool.text[i], 1, pool.textlen[i], stdout);
+    free(pool.text[i]);
 
-  /* Now print out more detailed results as required */
-  if (p->flags & CTP_SIDEBYSIDE) paste_files(sname, dname, run, 1, p);
-  else if (p->flags & CTP_PRINTCODE) paste_files(sname, dname, run,0, p);
-  else if (p->flags & CTP_PRINTTOKENS) print_tokens(run);
+    pthread_mutex_lock(&pool.lock);
+    pool.written = i + 1;
+    pthread_cond_broadcast(&pool.room);
+    pthread_mutex_unlock(&pool.lock);
+  }
 
-  if ((p->flags & CTP_PRINTTOKENS) || (p->flags & CTP_SIDEBYSIDE))
-    printf("=====================================\n");
+  for (i = 0; i < started; i++)
+    pthread_join(tid[i], NULL);
+  pthread_cond_destroy(&pool.room);
+  pthread_cond_destroy(&pool.printed);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.textlen);
+  free(pool.text);
+  free(tid);
+}
 
-#endif /* NO_PRINTING */
+/* Return a malloc()d array of the runs on the runlist, and their number
+ * in count, or NULL if there is no memory.
+ */
+static Run **make_runarray(Run * origrun, int *count)
+{
+  int i;
+  Run *run, **runarray;
+
+  /* Count all the runs in the list */
+  for (*count = 0, run = origrun; run != NULL; run = run->next) (*count)++;
+
+  /* Allocate an array to hold all the pointers */
+  runarray = (Run **) malloc(*count * sizeof(Run *));
+  if (runarray == NULL) return (NULL);
+
+  /* Fill the array with the Run pointers */
+  for (i = 0, run = origrun; run != NULL; i++, run = run->next)
+    runarray[i] = run;
+  return (runarray);
 }
 
 /* Comparison function used by qsort below */
@@ -294,30 +927,61 @@ int runlen_compare(const void *aa, const void *bb)
   return (1);
 }
 
-/* Print out all the runs from the runlist in descending runlength order. */
-void print_sorted_listruns(Run * origrun, Ctfparam * p)
+/* Comparison function used with CTP_GROUPPAIRS: sort the runs by the
+ * file records of their source and destination files, in the order that
+ * the files are in the CTF files, and then by their offsets in the files.
+ * So all the runs between one pair of files are printed together, moving
+ * forward through both files, and the files are mapped only once.
+ */
+int runpair_compare(const void *aa, const void *bb)
 {
-  int i, count = 0;
-  Run *run, **runarray;
-  /* This is going to be ugly */
+  Run *a = *((Run **) aa);
+  Run *b = *((Run **) bb);
+  Ctfhandle **handle = cursess->ctf_handle;
+  TDN *atdn, *btdn;
+  uint64_t aoff, boff;
+  int side;
 
-  /* Count all the runs in the list */
-  for (run = origrun; run != NULL; run = run->next) count++;
+  /* Compare the source files, then the destination files */
+  for (side = 0; side < 2; side++) {
+    atdn = (side == 0) ? a->src_startnode : a->dst_startnode;
+    btdn = (side == 0) ? b->src_startnode : b->dst_startnode;
+    if (atdn->ctfid != btdn->ctfid)
+      return ((atdn->ctfid < btdn->ctfid) ? -1 : 1);
+    aoff = tdn_name_offset(handle[atdn->ctfid], atdn);
+    boff = tdn_name_offset(handle[btdn->ctfid], btdn);
+    if (aoff != boff) return ((aoff < boff) ? -1 : 1);
+  }
 
-  /* Allocate an array to hold all the pointers */
-  runarray = (Run **) malloc(count * sizeof(Run *));
-  if (runarray == NULL) return;		/* Should we return an error ? */
+  /* Then the positions of the runs in them */
+  for (side = 0; side < 2; side++) {
+    atdn = (side == 0) ? a->src_startnode : a->dst_startnode;
+    btdn = (side == 0) ? b->src_startnode : b->dst_startnode;
+    aoff = tdn_offset(handle[atdn->ctfid], atdn);
+    boff = tdn_offset(handle[btdn->ctfid], btdn);
+    if (aoff != boff) return ((aoff < boff) ? -1 : 1);
+  }
+  return (0);
+}
 
-  /* Fill the array with the Run pointers */
-  for (i = 0, run = origrun; run != NULL; i++, run = run->next)
-    runarray[i] = run;
+/* Print out all the runs from the runlist in descending runlength order,
+ * or grouped by file pair if CTP_GROUPPAIRS is set.
+ */
+void print_sorted_listruns(Run * origrun, Ctfparam * p)
+{
+  int count;
+  Run **runarray;
+
+  runarray = make_runarray(origrun, &count);
+  if (runarray == NULL) return;		/* Should we return an error ? */
 
   /* Quicksort the array */
-  qsort(runarray, count, sizeof(Run *), runlen_compare);
+  qsort(runarray, count, sizeof(Run *),
+	(p->flags & CTP_GROUPPAIRS) ? runpair_compare : runlen_compare);
 
   /* Now print out the runs */
-  for (i = 0; i < count; i++)
-    print_listrun(runarray[i], p);
+  print_runarray(runarray, count, p);
+  free(runarray);
 }
 
 /** Functions to print out code similarity.
@@ -325,15 +989,374 @@ void print_sorted_listruns(Run * origrun, Ctfparam * p)
  * print_listruns(): given the head of a singly-linked list of runs
  * an a pointer to a Ctfparam struct, print out the runs of code
  * similarity following the print options specified in the Ctfparam struct.
+ * The runs are printed in the Ctfparam's format; with CTF_FORMAT_BINARY or
+ * CTF_FORMAT_JSONL they are buffered until flush_listruns() is called.
+ * After index_dupfiles(), each run is also printed for the copies of its
+ * files that buildctf -D found, straight after the run itself.
+ * When the source lines or tokens of the runs are printed, this is done
+ * by up to p->numthreads threads (or one per CPU if it is 0), but the
+ * output is the same as with one thread. With CTP_GROUPPAIRS, the runs
+ * between each pair of files are printed together, in file order.
  */
 void print_listruns(Run * run, Ctfparam * p)
 {
+  Run **runarray;
+  int count;
+
   if (p == NULL) return;
 
-  if (p->flags & CTP_SORTRESULTS) {
+  if (p->flags & (CTP_SORTRESULTS | CTP_GROUPPAIRS)) {
     print_sorted_listruns(run, p); return;
   }
 
+  if ((render_threads(p) > 1) &&
+      ((runarray = make_runarray(run, &count)) != NULL)) {
+    print_runarray(runarray, count, p);
+    free(runarray);
+    return;
+  }
+
   for (; run != NULL; run = run->next)
     print_listrun(run, p);
 }
+
+/** print_result(): print out run i of the Results store in the same way
+ * as print_listruns() prints a run, following the print options in p.
+ * The source files are read again to print their lines, and the CTF
+ * files to print the tokens.
+ */
+void print_result(Results * r, uint64_t i, Ctfparam * p)
+{
+  Runview v;
+
+  if ((r == NULL) || (p == NULL) || (i >= r->numruns)) return;
+#ifndef NO_PRINTING
+  v.length = r->length[i];
+  v.sname = r->names[r->src_file[i]];
+  v.dname = r->names[r->dst_file[i]];
+  v.sstart = r->src_start[i];
+  v.send = r->src_end[i];
+  v.dstart = r->dst_start[i];
+  v.dend = r->dst_end[i];
+  v.sctf = (r->ctfids != NULL) ? get_ctfhandle(r->ctfids[r->src_ctfid[i]]) :
+    get_ctfhandle(r->src_ctfid[i]);
+  v.soff = r->src_offset[i];
+  v.doff = r->dst_offset[i];
+  print_view(stdout, &cursess->srccache, &v, p);
+#endif
+}
+
+/** flush_listruns(): write out any runs printed in the binary or JSON
+ * Lines format which are still buffered. For the binary format, the
+ * filename table and trailer are written after the runs, so this must be
+ * called once all the runs have been printed, even if there were none.
+ */
+void flush_listruns(Ctfparam * p)
+{
+  Runwriter *w;
+  Runstrailer tr;
+  uint64_t off;
+  uint32_t i;
+
+  if ((p == NULL) || (p->format == CTF_FORMAT_TEXT)) return;
+  w = get_writer(p);
+
+  if (p->format == CTF_FORMAT_BINARY) {
+    tr.numruns = w->numruns;
+    tr.numnames = w->numnames;
+    tr.namesoff = w->offset + w->used;
+
+    /* The offset of each name, then the names */
+    off = tr.namesoff + w->numnames * sizeof(uint64_t);
+    for (i = 0; i < w->numnames; i++) {
+      writer_put(w, &off, sizeof(off));
+      off += strlen(w->names[i]) + 1;
+    }
+    for (i = 0; i < w->numnames; i++)
+      writer_put(w, w->names[i], strlen(w->names[i]) + 1);
+    writer_put(w, &tr, sizeof(tr));
+  }
+  flush_writer(w);
+  fflush(stdout);
+  free_writer(w);
+  cursess->writer = NULL;
+}
+
+/** print_dupfiles(): given the head of a singly-linked list of Dupfile
+ * nodes, print out each pair of identical files in the same format as a
+ * run of code similarity. The length is the number of tokens in the files,
+ * and files dropped by dupfile_filtered() are not printed.
+ */
+void print_dupfiles(Dupfile * dup, Ctfparam * p)
+{
+  if (p == NULL) return;
+#ifndef NO_PRINTING
+  for (; dup != NULL; dup = dup->next)
+    if (dupfile_filtered(dup, p))
+      continue;
+    else if (p->format != CTF_FORMAT_TEXT)
+      write_run(p, dup->ntokens, dup->name, dup->firstline, dup->lastline,
+		dup->origname, dup->firstline, dup->lastline);
+    else
+      printf("%d  %s:%d-%d  %s:%d-%d\n", dup->ntokens,
+	     dup->name, dup->firstline, dup->lastline,
+	     dup->origname, dup->firstline, dup->lastline);
+#endif
+}
+
+
+/*
+ * A Pairsums table is an open-addressed hash table of Filepairs, keyed
+ * on the two filename pointers.
+ */
+typedef struct _filepair
+{
+  char *sname;			/* Name of the file in the walked tree, */
+  char *dname;			/* and in the other tree */
+  int stree;			/* The trees that they are in */
+  int dtree;
+  uint64_t tokens;		/* Tokens in common between the two files */
+} Filepair;
+
+struct _pairsums
+{
+  Filepair *table;		/* The hash table */
+  size_t size;			/* Its size, a power of 2 */
+  size_t count;			/* Number of pairs in it */
+};
+
+#define PAIRSUMS_SIZE 1024	/* Starting size of the hash table */
+
+/* Return the slot for the pair of names in a table of the given size */
+static size_t pair_slot(char *sname, char *dname, size_t size)
+{
+  uint64_t h = (uintptr_t) sname * 0x9e3779b97f4a7c15ULL;
+
+  h ^= (uintptr_t) dname * 0xc2b2ae3d27d4eb4fULL;
+  return ((h ^ (h >> 29)) & (size - 1));
+}
+
+/* Add tokens to the count for the pair of files. Exits if the table
+ * can't be grown.
+ */
+static void add_pair(Pairsums * ps, char *sname, int stree, char *dname,
+		     int dtree, uint64_t tokens)
+{
+  Filepair *fp, *old;
+  size_t i, oldsize;
+
+  /* Keep the table no more than half full */
+  if (2 * (ps->count + 1) > ps->size) {
+    old = ps->table;
+    oldsize = ps->size;
+    ps->size *= 2;
+    ps->table = (Filepair *) calloc(ps->size, sizeof(Filepair));
+    if (ps->table == NULL) {
+      fprintf(stderr, "Unable to malloc file pair table: %s\n",
+	      strerror(errno));
+      exit(1);
+    }
+    for (i = 0; i < oldsize; i++) {
+      if (old[i].sname == NULL) continue;
+      fp = &(ps->table[pair_slot(old[i].sname, old[i].dname, ps->size)]);
+      while (fp->sname != NULL)
+	if (++fp == ps->table + ps->size) fp = ps->table;
+      *fp = old[i];
+    }
+    free(old);
+  }
+
+  fp = &(ps->table[pair_slot(sname, dname, ps->size)]);
+  while ((fp->sname != NULL) &&
+	 ((fp->sname != sname) || (fp->dname != dname)))
+    if (++fp == ps->table + ps->size) fp = ps->table;
+  if (fp->sname == NULL) {
+    fp->sname = sname; fp->stree = stree;
+    fp->dname = dname; fp->dtree = dtree;
+    ps->count++;
+  }
+  fp->tokens += tokens;
+}
+
+/** Functions to sum the code similarity between files and trees.
+ *
+ * new_pairsums(): return a new, empty Pairsums table, or NULL if
+ * there is no memory for it.
+ */
+Pairsums *new_pairsums(void)
+{
+  Pairsums *ps = (Pairsums *) malloc(sizeof(Pairsums));
+
+  if (ps == NULL) return (NULL);
+  ps->size = PAIRSUMS_SIZE;
+  ps->count = 0;
+  ps->table = (Filepair *) calloc(ps->size, sizeof(Filepair));
+  if (ps->table == NULL) {
+    free(ps); return (NULL);
+  }
+  return (ps);
+}
+
+/** add_runs_to_pairsums(): given the head of a singly-linked list of
+ * runs, add the length of each run to the count for the pair of files
+ * that it is between, and to the pairs of their copies found by
+ * index_dupfiles(). As with print_listruns(), runs shorter than the
+ * tuple size in p are ignored.
+ */
+void add_runs_to_pairsums(Pairsums * ps, Run * run, Ctfparam * p)
+{
+  Dupnames *sdups, *ddups;
+  char *sname, *dname;
+  int i, j, stree, dtree;
+
+  if ((ps == NULL) || (p == NULL)) return;
+  for (; run != NULL; run = run->next) {
+    if (run->length < p->tuple_size) continue;
+    sname = tdn_filename(run->src_startnode);
+    dname = tdn_filename(run->dst_startnode);
+    stree = get_ctftree(run->src_startnode->ctfid);
+    dtree = get_ctftree(run->dst_startnode->ctfid);
+    sdups = tdn_dupnames(run->src_startnode);
+    ddups = tdn_dupnames(run->dst_startnode);
+    for (i = -1; i < dup_count(sdups); i++)
+      for (j = -1; j < dup_count(ddups); j++)
+	add_pair(ps, dup_name(sdups, i, sname), stree,
+		 dup_name(ddups, j, dname), dtree, run->length);
+  }
+}
+
+/** add_dups_to_pairsums(): given the head of a singly-linked list of
+ * Dupfile nodes from CTF file ctfid, add the number of tokens in each
+ * pair of identical files to the count for that pair. As with
+ * print_dupfiles(), files dropped by dupfile_filtered() are ignored.
+ */
+void add_dups_to_pairsums(Pairsums * ps, Dupfile * dup, int ctfid, Ctfparam * p)
+{
+  int tree = get_ctftree(ctfid);
+
+  if ((ps == NULL) || (p == NULL)) return;
+  for (; dup != NULL; dup = dup->next)
+    if (!dupfile_filtered(dup, p))
+      add_pair(ps, dup->name, tree, dup->origname, tree, dup->ntokens);
+}
+
+/** add_result_to_pairsums(): add the length of run i of the Results
+ * store to the count for the pair of files that it is between.
+ */
+void add_result_to_pairsums(Pairsums * ps, Results * r, uint64_t i)
+{
+  int stree, dtree;
+
+  if ((ps == NULL) || (r == NULL) || (i >= r->numruns)) return;
+  if (r->ctfids != NULL) {
+    stree = get_ctftree(r->ctfids[r->src_ctfid[i]]);
+    dtree = get_ctftree(r->ctfids[r->dst_ctfid[i]]);
+  } else {
+    stree = get_ctftree(r->src_ctfid[i]);
+    dtree = get_ctftree(r->dst_ctfid[i]);
+  }
+  add_pair(ps, r->names[r->src_file[i]], stree, r->names[r->dst_file[i]],
+	   dtree, r->length[i]);
+}
+
+/* Comparison function to sort Filepairs by descending token count,
+ * then by name.
+ */
+static int filepair_compare(const void *aa, const void *bb)
+{
+  const Filepair *a = *((const Filepair **) aa);
+  const Filepair *b = *((const Filepair **) bb);
+  int c;
+
+  if (a->tokens != b->tokens) return ((a->tokens > b->tokens) ? -1 : 1);
+  if ((c = strcmp(a->sname, b->sname)) != 0) return (c);
+  return (strcmp(a->dname, b->dname));
+}
+
+/** print_filepairs(): print out each pair of files in the Pairsums table
+ * and the number of tokens in common between them, in descending order
+ * of that number, one pair per line as "count: file1  file2". This is
+ * the same as the output of Scripts/sum_filepairs.
+ */
+void print_filepairs(Pairsums * ps, Ctfparam * p)
+{
+  Filepair **pairs;
+  size_t i, n;
+
+  if ((ps == NULL) || (p == NULL)) return;
+  pairs = (Filepair **) malloc((ps->count + 1) * sizeof(Filepair *));
+  if (pairs == NULL) {
+    fprintf(stderr, "Unable to malloc file pair list: %s\n", strerror(errno));
+    exit(1);
+  }
+  for (i = n = 0; i < ps->size; i++)
+    if (ps->table[i].sname != NULL) pairs[n++] = &(ps->table[i]);
+  qsort(pairs, n, sizeof(Filepair *), filepair_compare);
+
+#ifndef NO_PRINTING
+  for (i = 0; i < n; i++)
+    printf("%llu: %s  %s\n", (unsigned long long) pairs[i]->tokens,
+	   pairs[i]->sname, pairs[i]->dname);
+#endif
+  free(pairs);
+}
+
+/** print_treematrix(): print out a matrix of the number of tokens in
+ * common between each pair of trees, summed over the pairs of files in
+ * the Pairsums table. Each tree is named by its first CTF file. The
+ * first line holds the tree names, and each line after that holds a
+ * tree name and its counts, all separated by tabs. The matrix is
+ * symmetric; the diagonal only has counts from searches within a tree.
+ */
+void print_treematrix(Pairsums * ps, Ctfparam * p)
+{
+  uint64_t *matrix;
+  int *treeidx;			/* Row of each tree in the matrix */
+  int i, j, s, d, numtrees = 0;
+  size_t k;
+
+  if ((ps == NULL) || (p == NULL)) return;
+  treeidx = (int *) malloc(cursess->ctflistnext * sizeof(int));
+  if (treeidx == NULL) {
+    fprintf(stderr, "Unable to malloc tree list: %s\n", strerror(errno));
+    exit(1);
+  }
+  for (i = 1; i < cursess->ctflistnext; i++)
+    if (get_ctftree(i) == i) treeidx[i] = numtrees++;
+
+  matrix = (uint64_t *) calloc(numtrees * numtrees, sizeof(uint64_t));
+  if (matrix == NULL) {
+    fprintf(stderr, "Unable to malloc tree matrix: %s\n", strerror(errno));
+    exit(1);
+  }
+  for (k = 0; k < ps->size; k++) {
+    if (ps->table[k].sname == NULL) continue;
+    s = treeidx[ps->table[k].stree];
+    d = treeidx[ps->table[k].dtree];
+    matrix[s * numtrees + d] += ps->table[k].tokens;
+    if (s != d) matrix[d * numtrees + s] += ps->table[k].tokens;
+  }
+
+#ifndef NO_PRINTING
+  for (i = 1; i < cursess->ctflistnext; i++)
+    if (get_ctftree(i) == i) printf("\t%s", get_ctfname(i));
+  printf("\n");
+  for (i = 1; i < cursess->ctflistnext; i++) {
+    if (get_ctftree(i) != i) continue;
+    printf("%s", get_ctfname(i));
+    for (j = 0; j < numtrees; j++)
+      printf("\t%llu", (unsigned long long) matrix[treeidx[i] * numtrees + j]);
+    printf("\n");
+  }
+#endif
+  free(matrix);
+  free(treeidx);
+}
+
+/** free_pairsums(): free a Pairsums table */
+void free_pairsums(Pairsums * ps)
+{
+  if (ps == NULL) return;
+  free(ps->table);
+  free(ps);
+}
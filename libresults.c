@@ -0,0 +1,510 @@
+/*
+ * libresults: Functions to keep the runs found in a Results store, which
+ * can be saved to a file and loaded again later.
+ * Copyright (c) Warren Toomey, under the GPL3 license.
+ *
+ * $Revision: 1.1 $
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "libctf.h"
+#include "libtokens.h"
+#include "libtdn.h"
+#include "libsession.h"
+#include "crc32.h"
+
+/* This doesn't belong here, but there is no other good place to put it. */
+extern char *tdn_filename(TDN * tdn);
+
+/*
+ * A Results file holds, in the native byte order:
+ *  - a Resultshdr,
+ *  - each column of the runs, numruns entries long,
+ *  - the tree of each of the numctf CTF files, in id order, as the id of
+ *    the first CTF file in the same tree,
+ *  - the names of the numctf CTF files, in id order,
+ *  - the numnames source file names.
+ * Each name is followed by a NUL. Each part starts on a 16-byte boundary.
+ */
+#define RESULTS_MAGIC	"ctfres2"	/* Includes the NUL to make 8 bytes */
+#define RESULTS_COLS	11		/* Number of columns */
+
+typedef struct _resultshdr
+{
+  char magic[8];		/* RESULTS_MAGIC */
+  uint32_t numctf;		/* Number of CTF files */
+  uint32_t numnames;		/* Number of source file names */
+  uint64_t numruns;		/* Number of runs */
+  uint64_t coloff[RESULTS_COLS];	/* Offset of each column */
+  uint64_t treeoff;		/* Offset of the CTF file trees */
+  uint64_t ctfoff;		/* Offset of the CTF file names */
+  uint64_t namesoff;		/* Offset of the source file names */
+} Resultshdr;
+
+/* Where each column is in the Results struct, and the size of its entries */
+static const size_t colfield[RESULTS_COLS] = {
+  offsetof(Results, length),
+  offsetof(Results, src_ctfid), offsetof(Results, dst_ctfid),
+  offsetof(Results, src_file), offsetof(Results, dst_file),
+  offsetof(Results, src_start), offsetof(Results, src_end),
+  offsetof(Results, dst_start), offsetof(Results, dst_end),
+  offsetof(Results, src_offset), offsetof(Results, dst_offset)
+};
+static const size_t colsize[RESULTS_COLS] = {
+  sizeof(uint32_t),
+  sizeof(uint32_t), sizeof(uint32_t),
+  sizeof(uint32_t), sizeof(uint32_t),
+  sizeof(uint32_t), sizeof(uint32_t),
+  sizeof(uint32_t), sizeof(uint32_t),
+  sizeof(uint64_t), sizeof(uint64_t)
+};
+#define COLUMN(r, c)	(*(void **) ((char *) (r) + colfield[c]))
+
+#define RESULTS_SIZE	1024	/* Starting size of the arrays */
+
+/*
+ * While runs are being added, the columns are malloc()d arrays which are
+ * doubled in size as needed. Each source file name is kept once for each
+ * CTF file it is in, and a hash table finds its index. A loaded store
+ * points into the mmap()d file instead.
+ */
+struct _resultsdata
+{
+  uint64_t maxruns;		/* Size of the columns */
+  uint32_t maxnames;		/* Size of names and namectf */
+  uint32_t *namectf;		/* CTF file id of each name */
+  uint32_t *namehash;		/* Hash table of name index + 1 */
+  uint32_t namehashmask;	/* Its size - 1 */
+  uint32_t *ctftree;		/* Tree of each CTF file, if loaded */
+  uint8_t *map;			/* The mmap()d file, if loaded */
+  size_t mapsize;
+};
+
+/* Return the hash table slot of the name in the CTF file */
+static uint32_t name_slot(uint32_t ctfid, char *name)
+{
+  return (crc32(name, strlen(name)) ^ (ctfid * 0x9e3779b9));
+}
+
+/* Return the index of the name in the CTF file, adding it to the names
+ * if it isn't there. Exits if there is no memory.
+ */
+static uint32_t add_name(Results * r, uint32_t ctfid, char *name)
+{
+  struct _resultsdata *d = r->data;
+  uint32_t h, i, *old, oldmask;
+
+  for (i = name_slot(ctfid, name) & d->namehashmask; d->namehash[i] != 0;
+       i = (i + 1) & d->namehashmask) {
+    h = d->namehash[i] - 1;
+    if ((d->namectf[h] == ctfid) && !strcmp(r->names[h], name))
+      return (h);
+  }
+
+  /* Not there, so add it */
+  if (r->numnames == d->maxnames) {
+    d->maxnames = d->maxnames ? 2 * d->maxnames : RESULTS_SIZE;
+    r->names = (char **) realloc(r->names, d->maxnames * sizeof(char *));
+    d->namectf = (uint32_t *) realloc(d->namectf,
+				      d->maxnames * sizeof(uint32_t));
+    if ((r->names == NULL) || (d->namectf == NULL)) {
+      fprintf(stderr, "Unable to malloc result names: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+  if ((r->names[r->numnames] = strdup(name)) == NULL) {
+    fprintf(stderr, "Unable to malloc result name: %s\n", strerror(errno));
+    exit(1);
+  }
+  d->namectf[r->numnames] = ctfid;
+  d->namehash[i] = ++r->numnames;
+
+  /* Keep the hash table no more than half full */
+  if (2 * r->numnames > d->namehashmask) {
+    old = d->namehash;
+    oldmask = d->namehashmask;
+    d->namehashmask = 2 * oldmask + 1;
+    d->namehash = (uint32_t *) calloc(d->namehashmask + 1, sizeof(uint32_t));
+    if (d->namehash == NULL) {
+      fprintf(stderr, "Unable to malloc result name hash: %s\n",
+	      strerror(errno));
+      exit(1);
+    }
+    for (h = 0; h <= oldmask; h++) {
+      if (old[h] == 0) continue;
+      for (i = name_slot(d->namectf[old[h] - 1], r->names[old[h] - 1]) &
+	   d->namehashmask; d->namehash[i] != 0;
+	   i = (i + 1) & d->namehashmask);
+      d->namehash[i] = old[h];
+    }
+    free(old);
+  }
+  return (r->numnames - 1);
+}
+
+/* Add a run to the store. Exits if there is no memory. */
+static void add_result(Results * r, uint32_t length,
+		       uint32_t sctf, char *sname, uint32_t sstart,
+		       uint32_t send, uint64_t soff,
+		       uint32_t dctf, char *dname, uint32_t dstart,
+		       uint32_t dend, uint64_t doff)
+{
+  struct _resultsdata *d = r->data;
+  uint64_t n = r->numruns;
+  int c;
+
+  if (n == d->maxruns) {
+    d->maxruns = d->maxruns ? 2 * d->maxruns : RESULTS_SIZE;
+    for (c = 0; c < RESULTS_COLS; c++)
+      if ((COLUMN(r, c) = realloc(COLUMN(r, c),
+				  d->maxruns * colsize[c])) == NULL) {
+	fprintf(stderr, "Unable to malloc results: %s\n", strerror(errno));
+	exit(1);
+      }
+  }
+  r->length[n] = length;
+  r->src_ctfid[n] = sctf;
+  r->dst_ctfid[n] = dctf;
+  r->src_file[n] = add_name(r, sctf, sname);
+  r->dst_file[n] = add_name(r, dctf, dname);
+  r->src_start[n] = sstart;
+  r->src_end[n] = send;
+  r->dst_start[n] = dstart;
+  r->dst_end[n] = dend;
+  r->src_offset[n] = soff;
+  r->dst_offset[n] = doff;
+  r->numruns++;
+}
+
+/** Functions to keep the runs found in a Results store.
+ *
+ * new_results(): return a new, empty Results store, or NULL if
+ * there is no memory for it.
+ */
+Results *new_results(void)
+{
+  Results *r = (Results *) calloc(1, sizeof(Results));
+
+  if (r == NULL) return (NULL);
+  r->data = (struct _resultsdata *) calloc(1, sizeof(struct _resultsdata));
+  if (r->data != NULL)
+    r->data->namehash = (uint32_t *) calloc(RESULTS_SIZE, sizeof(uint32_t));
+  if ((r->data == NULL) || (r->data->namehash == NULL)) {
+    free(r->data); free(r); return (NULL);
+  }
+  r->data->namehashmask = RESULTS_SIZE - 1;
+  return (r);
+}
+
+/** add_runs_to_results(): given the head of a singly-linked list of runs,
+ * add each run to the Results store, and once more for each pairing of
+ * the copies of its files found by index_dupfiles(). As with
+ * print_listruns(), runs shorter than the tuple size in p are ignored.
+ */
+void add_runs_to_results(Results * r, Run * run, Ctfparam * p)
+{
+  Ctfhandle *sctf, *dctf;
+  Dupnames *sdups, *ddups;
+  char *sname, *dname;
+  uint64_t soff, doff;
+  int i, j, sstart, dstart;
+
+  if ((r == NULL) || (r->data->map != NULL) || (p == NULL)) return;
+  for (; run != NULL; run = run->next) {
+    if (run->length < p->tuple_size) continue;
+    sctf = get_ctfhandle(run->src_startnode->ctfid);
+    dctf = get_ctfhandle(run->dst_startnode->ctfid);
+    soff = tdn_offset(sctf, run->src_startnode);
+    doff = tdn_offset(dctf, run->dst_startnode);
+    sstart = get_linenum(sctf, soff);
+    dstart = get_linenum(dctf, doff);
+    sname = tdn_filename(run->src_startnode);
+    dname = tdn_filename(run->dst_startnode);
+    sdups = tdn_dupnames(run->src_startnode);
+    ddups = tdn_dupnames(run->dst_startnode);
+    for (i = -1; i < dup_count(sdups); i++)
+      for (j = -1; j < dup_count(ddups); j++)
+	add_result(r, run->length,
+		   run->src_startnode->ctfid, dup_name(sdups, i, sname),
+		   sstart, run->src_endline, soff,
+		   run->dst_startnode->ctfid, dup_name(ddups, j, dname),
+		   dstart, run->dst_endline, doff);
+  }
+}
+
+/** add_dups_to_results(): given the head of a singly-linked list of
+ * Dupfile nodes from CTF file ctfid, add each pair of identical files to
+ * the Results store as a run with no offsets. As with print_dupfiles(),
+ * files dropped by dupfile_filtered() are ignored.
+ */
+void add_dups_to_results(Results * r, Dupfile * dup, int ctfid, Ctfparam * p)
+{
+  if ((r == NULL) || (r->data->map != NULL) || (p == NULL)) return;
+  for (; dup != NULL; dup = dup->next)
+    if (!dupfile_filtered(dup, p))
+      add_result(r, dup->ntokens, ctfid, dup->name, dup->firstline,
+		 dup->lastline, 0, ctfid, dup->origname, dup->firstline,
+		 dup->lastline, 0);
+}
+
+/* Write size bytes from buf to out, then pad the output to a 16-byte
+ * boundary. The offset is updated. Returns 0 if OK, -1 on error.
+ */
+static int write_padded(FILE * out, void *buf, size_t size, uint64_t * offset)
+{
+  static const uint8_t zeroes[16];
+  size_t pad;
+
+  if ((size > 0) && (fwrite(buf, size, 1, out) != 1)) return (-1);
+  *offset += size;
+  pad = (16 - (*offset & 15)) & 15;
+  if ((pad > 0) && (fwrite(zeroes, pad, 1, out) != 1)) return (-1);
+  *offset += pad;
+  return (0);
+}
+
+/* Write count NUL-terminated names to out, then pad the output. Returns
+ * 0 if OK, -1 on error.
+ */
+static int write_names(FILE * out, char **names, uint32_t count,
+		       uint64_t * offset)
+{
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    if (fwrite(names[i], strlen(names[i]) + 1, 1, out) != 1) return (-1);
+    *offset += strlen(names[i]) + 1;
+  }
+  return (write_padded(out, NULL, 0, offset));
+}
+
+/** save_results(): save the Results store in the named file, along with
+ * the names of the CTF files in the ctflist. Returns 0 if OK, or -1 with
+ * errno set on error.
+ */
+int save_results(Results * r, char *name)
+{
+  Resultshdr hdr;
+  FILE *out;
+  uint64_t offset = 0;
+  char **ctfnames = NULL;
+  uint32_t *ctftree = NULL;
+  int c, err;
+
+  if ((r == NULL) || (name == NULL)) {
+    errno = EINVAL; return (-1);
+  }
+
+  /* Keep a loaded store's CTF files, otherwise use the ctflist */
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, RESULTS_MAGIC, sizeof(hdr.magic));
+  hdr.numruns = r->numruns;
+  hdr.numnames = r->numnames;
+  if (r->ctfnames != NULL) {
+    hdr.numctf = r->numctf;
+    ctfnames = r->ctfnames + 1;
+    ctftree = r->data->ctftree;
+  } else {
+    while (get_ctfname(hdr.numctf + 1) != NULL) hdr.numctf++;
+    ctfnames = (char **) malloc((hdr.numctf + 1) * sizeof(char *));
+    ctftree = (uint32_t *) malloc((hdr.numctf + 1) * sizeof(uint32_t));
+    if ((ctfnames == NULL) || (ctftree == NULL)) {
+      free(ctfnames); free(ctftree); return (-1);
+    }
+    for (c = 0; c < hdr.numctf; c++) {
+      ctfnames[c] = get_ctfname(c + 1);
+      ctftree[c] = get_ctftree(c + 1);
+    }
+  }
+
+  if ((out = fopen(name, "w")) == NULL) {
+    err = errno; goto fail;
+  }
+
+  /* Write the header last, once we know where everything is */
+  if (write_padded(out, &hdr, sizeof(hdr), &offset) == -1) goto bad;
+  for (c = 0; c < RESULTS_COLS; c++) {
+    hdr.coloff[c] = offset;
+    if (write_padded(out, COLUMN(r, c), r->numruns * colsize[c],
+		     &offset) == -1) goto bad;
+  }
+  hdr.treeoff = offset;
+  if (write_padded(out, ctftree, hdr.numctf * sizeof(uint32_t),
+		   &offset) == -1) goto bad;
+  hdr.ctfoff = offset;
+  if (write_names(out, ctfnames, hdr.numctf, &offset) == -1) goto bad;
+  hdr.namesoff = offset;
+  if (write_names(out, r->names, r->numnames, &offset) == -1) goto bad;
+  if ((fseek(out, 0, SEEK_SET) == -1) ||
+      (fwrite(&hdr, sizeof(hdr), 1, out) != 1)) goto bad;
+  if (fclose(out) == EOF) {
+    err = errno; goto fail;
+  }
+  if (r->ctfnames == NULL) {
+    free(ctfnames); free(ctftree);
+  }
+  return (0);
+
+bad:
+  err = errno;
+  fclose(out);
+fail:
+  if (r->ctfnames == NULL) {
+    free(ctfnames); free(ctftree);
+  }
+  errno = err;
+  return (-1);
+}
+
+/* Point count names at the NUL-terminated names from posn onwards, which
+ * must end before end. Returns 0 if OK, -1 if the names run past end.
+ */
+static int find_names(char **names, uint32_t count, char *posn, char *end)
+{
+  uint32_t i;
+  char *nul;
+
+  for (i = 0; i < count; i++) {
+    if ((posn >= end) || ((nul = memchr(posn, '\0', end - posn)) == NULL))
+      return (-1);
+    names[i] = posn;
+    posn = nul + 1;
+  }
+  return (0);
+}
+
+/** load_results(): map in a Results store saved in the named file by
+ * save_results(). Its CTF files are added to the ctflist if they are not
+ * already in it, in the same trees as when the runs were found, and
+ * opened. ctflist.db is not read. Returns the store, or NULL with errno set on
+ * error. The store is read-only: runs can't be added to it.
+ */
+Results *load_results(char *name)
+{
+  Results *r;
+  Resultshdr *hdr;
+  struct stat sb;
+  uint8_t *map;
+  uint32_t *tree;
+  uint64_t n;
+  uint32_t i;
+  int c, fd;
+
+  if (name == NULL) {
+    errno = EINVAL; return (NULL);
+  }
+  if ((fd = open(name, O_RDONLY)) == -1) return (NULL);
+  if (fstat(fd, &sb) == -1) {
+    close(fd); return (NULL);
+  }
+  if ((uint64_t) sb.st_size < sizeof(Resultshdr)) {
+    close(fd); errno = EINVAL; return (NULL);
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return (NULL);
+
+  if ((r = new_results()) == NULL) {
+    munmap(map, sb.st_size); errno = ENOMEM; return (NULL);
+  }
+  r->data->map = map;
+  r->data->mapsize = sb.st_size;
+
+  /* Check the header and point the columns into the file */
+  hdr = (Resultshdr *) map;
+  if (memcmp(hdr->magic, RESULTS_MAGIC, sizeof(hdr->magic)) ||
+      (hdr->numruns > sb.st_size) || (hdr->numctf > sb.st_size) ||
+      (hdr->treeoff & (sizeof(uint32_t) - 1)) ||
+      (hdr->treeoff > sb.st_size) ||
+      (hdr->treeoff + hdr->numctf * sizeof(uint32_t) > sb.st_size) ||
+      (hdr->ctfoff > sb.st_size) || (hdr->namesoff > sb.st_size))
+    goto bad;
+  for (c = 0; c < RESULTS_COLS; c++) {
+    if ((hdr->coloff[c] & (colsize[c] - 1)) ||
+	(hdr->coloff[c] > sb.st_size) ||
+	(hdr->coloff[c] + hdr->numruns * colsize[c] > sb.st_size))
+      goto bad;
+    COLUMN(r, c) = map + hdr->coloff[c];
+  }
+  r->numruns = hdr->numruns;
+
+  /* Find the names */
+  r->numctf = hdr->numctf;
+  r->numnames = hdr->numnames;
+  r->ctfnames = (char **) calloc(r->numctf + 1, sizeof(char *));
+  r->ctfids = (int *) calloc(r->numctf + 1, sizeof(int));
+  r->names = (char **) malloc((r->numnames + 1) * sizeof(char *));
+  if ((r->ctfnames == NULL) || (r->ctfids == NULL) || (r->names == NULL)) {
+    free_results(r); errno = ENOMEM; return (NULL);
+  }
+  if ((find_names(r->ctfnames + 1, r->numctf, (char *) map + hdr->ctfoff,
+		  (char *) map + sb.st_size) == -1) ||
+      (find_names(r->names, r->numnames, (char *) map + hdr->namesoff,
+		  (char *) map + sb.st_size) == -1))
+    goto bad;
+
+  /* Check the runs' CTF file ids and names */
+  for (n = 0; n < r->numruns; n++)
+    if ((r->src_ctfid[n] < 1) || (r->src_ctfid[n] > r->numctf) ||
+	(r->dst_ctfid[n] < 1) || (r->dst_ctfid[n] > r->numctf) ||
+	(r->src_file[n] >= r->numnames) || (r->dst_file[n] >= r->numnames))
+      goto bad;
+
+  /* Check the trees: a shard is in the same tree as the CTF file before it */
+  tree = r->data->ctftree = (uint32_t *) (map + hdr->treeoff);
+  for (i = 0; i < r->numctf; i++)
+    if ((tree[i] < 1) || (tree[i] > i + 1) ||
+	((tree[i] <= i) && (tree[i] != tree[i - 1])))
+      goto bad;
+
+  /* Add the CTF files to the ctflist, not reading ctflist.db, and open them */
+  cursess->ctflistnodb = 1;
+  for (i = 1; i <= r->numctf; i++) {
+    if (tree[i - 1] < i) add_ctfshard(r->ctfnames[i], 0);
+    else add_ctffile(r->ctfnames[i], 0);
+    r->ctfids[i] = id_of_ctffile(r->ctfnames[i]);
+  }
+  load_ctflist();
+  return (r);
+
+bad:
+  free_results(r);
+  errno = EINVAL;
+  return (NULL);
+}
+
+/** free_results(): free a Results store */
+void free_results(Results * r)
+{
+  struct _resultsdata *d;
+  uint32_t i;
+  int c;
+
+  if (r == NULL) return;
+  d = r->data;
+  if (d->map != NULL)
+    munmap(d->map, d->mapsize);
+  else {
+    for (c = 0; c < RESULTS_COLS; c++)
+      free(COLUMN(r, c));
+    for (i = 0; i < r->numnames; i++)
+      free(r->names[i]);
+  }
+  free(r->names);
+  free(r->ctfnames);
+  free(r->ctfids);
+  free(d->namectf);
+  free(d->namehash);
+  free(d);
+  free(r);
+}
@@ -15,29 +15,24 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <regex.h>
 #include "libctf.h"
 #include "libtokens.h"
 #include "libtdn.h"
+#include "libsession.h"
+#include "libsort.h"
+#include "crc32.h"
 
-extern Ctfhandle *ctf_handle[];	/* Array of CTF handles */
-extern int ctflistnext;
+extern char *tdn_filename(TDN * tdn);
 
-/*
- * We have two Run linked lists: one is the list of incomplete runs.
- * The other is the list of completed runs.
- */
-Run *inc_runlist = NULL;	/* Incomplete run list */
-Run *done_runhead = NULL;	/* Complete run list */
+extern int last_linenum_for(TDN * tdn, Ctfhandle * ctf, Ctfparam * p);
 
-int any_tdngrps = 0;		/* Have we got any tdngrps yet? */
-
-#define BITSINTABLE     24	/* 24-bit table */
+#define BITSINTABLE     24	/* Groups are the top 24 bits of the CRC */
 #define TABLE_SIZE (1 << BITSINTABLE)
-
-/* We keep a lookup table to quickly search for runs which
- * can be extended when we find a tuple match on a TDN.
- */
-Run *runLUT[TABLE_SIZE];
+#define MINLUTSIZE	1024	/* Smallest size of a runLUT */
 
 /* Isomorphic comparison tables.
  * We need two tables: one to record the match from a dst value
@@ -63,75 +58,232 @@ Run *runLUT[TABLE_SIZE];
  * everything from the "if" down to the "}" is isomorphic and thus
  * identical.
  */
-uint16_t isodtos[65536];	/* Destination to source isomorphism */
-uint16_t isostod[65536];	/* Source to destination isomorphism */
-uint16_t isoseen[65536];	/* =1 if we have seen this id value */
-int max_isoseen = 0;		/* Number of relationships seen */
 
-/* This function is used to create a hash value for two TDNs in
- * memory, so that we can quickly find any possible runs which
- * can be extended.
+/*
+ * When the shards of a tree are walked at the same time, the in-memory
+ * TDNs can't be changed. Instead, each TDN and the TDNgrp node that it
+ * will be inserted after are saved in a Deflist. The TDNs are inserted
+ * once all the shards have been walked.
+ */
+typedef struct _deferred
+{
+  TDN *tdn;			/* TDN to insert */
+  TDNgrp *after;		/* and the node to insert it after */
+} Deferred;
+
+typedef struct _deflist
+{
+  Deferred *list;		/* Array of deferred TDNs */
+  size_t count;			/* Number in the array */
+  size_t size;			/* Size of the array */
+} Deflist;
+
+/*
+ * With p->numparts > 1, the in-memory TDNs are split by the top bits of
+ * their CRC between numparts worker processes. Each worker only holds
+ * and searches its part of the TDNs, and sends each match it finds to
+ * the parent as a Partmatch. As all the TDNs in a TDN's group are in the
+ * same part, the parent gets the matches for each TDN in the order that
+ * walking the group would find them, and builds the runs from them.
+ * With p->memlimit set, the parts are searched one after the other and
+ * their matches are written to temporary files, which are read back in
+ * the same way as the workers' pipes.
+ */
+#define PARTBUFSIZE	(64 * 1024)	/* Buffer size of the match streams */
+#define MAXSPILLPARTS	256		/* Most parts that --mem-limit will use */
+
+typedef struct _partmatch
+{
+  uint32_t srcctf;		/* CTF file & TDN index of the walked TDN */
+  uint32_t srcidx;
+  uint32_t dstctf;		/* CTF file & TDN index of the TDN it matched */
+  uint32_t dstidx;
+} Partmatch;
+
+typedef struct _partbuf
+{
+  Partmatch buf[PARTBUFSIZE / sizeof(Partmatch)];	/* Matches read in */
+  size_t pos;			/* Byte offset of the next match in buf */
+  size_t len;			/* Number of bytes in buf */
+  int fd;			/* Pipe from the worker, */
+  Sorter *sorter;		/* or the Sorter of the matches */
+} Partbuf;
+
+/* Where match_tdngrp() sends the matches it finds */
+typedef struct _matchout
+{
+  FILE *file;			/* Write them to this file, */
+  Sorter *sorter;		/* or give them to this Sorter */
+} Matchout;
+
+typedef struct _partin
+{
+  int numparts;			/* Number of workers */
+  Partbuf *in;			/* Matches read from each worker */
+} Partin;
+
+/* Lock held while printing partial results */
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* This function is used to create a hash value for two TDNs, so that
+ * we can quickly find any possible runs which can be extended. It uses
+ * the positions of the TDNs, not their addresses, so that the runs found
+ * do not depend on where the TDNs happen to be in memory. A run and its
+ * extension hash to nearby slots, which keeps the LUT cache-friendly.
+ */
+static inline uint32_t runhash(TDN * a, TDN * b)
+{
+  uint32_t ka = a->offset + a->fileidx * 0x9e3779b1u + a->ctfid * 0x85ebca6bu;
+  uint32_t kb = b->offset + b->fileidx * 0xc2b2ae35u + b->ctfid * 0x27d4eb2fu;
+
+  return (ka ^ (kb << 4));
+}
+
+static void grow_lut(Runstate * rs);
+static void free_dupnames(Ctfsession * s);
+
+/* The incomplete runs are found in the runLUT by the hash of their end
+ * nodes. Collisions are resolved by linear probing, so that no run is
+ * lost from the table and the runs found don't depend on the hash.
+ * The runLUT is doubled in size whenever it becomes half full.
+ */
+static void lut_insert(Runstate * rs, Run * run)
+{
+  uint32_t i;
+
+  if ((rs->runLUT == NULL) || (2 * (rs->lutcount + 1) > rs->lutmask + 1))
+    grow_lut(rs);
+  i = runhash(run->src_endnode, run->dst_endnode) & rs->lutmask;
+  while (rs->runLUT[i] != NULL) i = (i + 1) & rs->lutmask;
+  rs->runLUT[i] = run;
+  rs->lutcount++;
+}
+
+/* Return the incomplete run which ends at the src and dst TDNs, or NULL */
+static Run *lut_find(Runstate * rs, TDN * src, TDN * dst)
+{
+  uint32_t i;
+  Run *run;
+
+  if (rs->runLUT == NULL) return (NULL);
+  i = runhash(src, dst) & rs->lutmask;
+  while ((run = rs->runLUT[i]) != NULL) {
+    if ((run->src_endnode == src) && (run->dst_endnode == dst)) return (run);
+    i = (i + 1) & rs->lutmask;
+  }
+  return (NULL);
+}
+
+/* Remove the run from the LUT. The runs after it in the same cluster
+ * are shifted back into the gap, so that lut_find() can still reach them.
  */
-static inline int runhash(TDN * a, TDN * b)
+static void lut_remove(Runstate * rs, Run * run)
 {
-  return(((int)a >> 3 ^ (int)b) & 0xffffff);
+  uint32_t i, j, home, mask = rs->lutmask;
+
+  if (rs->runLUT == NULL) return;
+  i = runhash(run->src_endnode, run->dst_endnode) & mask;
+  while (rs->runLUT[i] != run) {
+    if (rs->runLUT[i] == NULL) return;
+    i = (i + 1) & mask;
+  }
+
+  for (j = (i + 1) & mask; rs->runLUT[j] != NULL; j = (j + 1) & mask) {
+    home = runhash(rs->runLUT[j]->src_endnode,
+		   rs->runLUT[j]->dst_endnode) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      rs->runLUT[i] = rs->runLUT[j];
+      i = j;
+    }
+  }
+  rs->runLUT[i] = NULL;
+  rs->lutcount--;
 }
 
-void clear_isomorph_arrays(void)
+/* Double the size of the runLUT, or make it if there isn't one */
+static void grow_lut(Runstate * rs)
+{
+  Run **old = rs->runLUT;
+  uint32_t i, j, oldsize = (old == NULL) ? 0 : rs->lutmask + 1;
+  uint32_t size = (old == NULL) ? MINLUTSIZE : 2 * oldsize;
+
+  rs->runLUT = (Run **) calloc(size, sizeof(Run *));
+  if (rs->runLUT == NULL) {
+    fprintf(stderr, "Unable to malloc run lookup table: %s\n",
+	    strerror(errno));
+    exit(1);
+  }
+  rs->lutmask = size - 1;
+  for (i = 0; i < oldsize; i++)
+    if (old[i] != NULL) {
+      j = runhash(old[i]->src_endnode, old[i]->dst_endnode) & rs->lutmask;
+      while (rs->runLUT[j] != NULL) j = (j + 1) & rs->lutmask;
+      rs->runLUT[j] = old[i];
+    }
+  free(old);
+}
+
+void clear_isomorph_arrays(Runstate * rs)
 {
   /*
    * Clear the identifer isomorph table for this run. I used to simply
    * memset() both isodtos[] and isostod[], but it is faster to track and
    * delete only those entries that we used.
    */
-  while (--max_isoseen >= 0) {
-    isodtos[isoseen[max_isoseen]] = 0;
-    isostod[isoseen[max_isoseen]] = 0;
+  while (--rs->max_isoseen >= 0) {
+    rs->isodtos[rs->isoseen[rs->max_isoseen]] = 0;
+    rs->isostod[rs->isoseen[rs->max_isoseen]] = 0;
   }
-  max_isoseen = 0;
+  rs->max_isoseen = 0;
 }
 
-void clear_donelist()
+void clear_donelist(Runstate * rs)
 {
 #ifdef FREE_MEM
   Run *run, *nextrun;
-  for (run = done_runhead; run != NULL; run = nextrun) {
+  for (run = rs->done_runhead; run != NULL; run = nextrun) {
     nextrun = run->next; free(run);
   }
 #endif
-  done_runhead = NULL;
+  rs->done_runhead = NULL;
 }
 
-void clear_inclist()
+void clear_inclist(Runstate * rs)
 {
 #ifdef FREE_MEM
   Run *run, *nextrun;
-  for (run = inc_runlist; run != NULL; run = nextrun) {
+  for (run = rs->inc_runlist; run != NULL; run = nextrun) {
     nextrun = run->next; free(run);
   }
 #endif
-  inc_runlist = NULL;
+  rs->inc_runlist = NULL;
 }
 
 
 /* Reinitialise the global variables */
 void reinit_libruns(void)
 {
-  int i;
-
-  /* Walk the runLUT table, freeing any Run nodes */
-  for (i=0; i < TABLE_SIZE; i++)
-    if (runLUT[i] != NULL) {
-      free(runLUT[i]);
-      runLUT[i]= NULL;
-    }
+  Ctfsession *s = cursess;
+  uint32_t i;
+
+  /* Walk the runLUT table, freeing any Run nodes, then the table */
+  for (i=0; (s->defstate.runLUT != NULL) && (i <= s->defstate.lutmask); i++)
+    if (s->defstate.runLUT[i] != NULL)
+      free(s->defstate.runLUT[i]);
+  free(s->defstate.runLUT);
+  s->defstate.runLUT = NULL;
+  s->defstate.lutcount = 0;
+  free(s->defstate.kept);
+  s->defstate.kept = NULL;
+  s->defstate.numkept = s->defstate.maxkept = 0;
  
   /* Clear the two linked lists */
-  clear_donelist();
-  clear_inclist();
-  clear_isomorph_arrays();
+  clear_donelist(&s->defstate);
+  clear_inclist(&s->defstate);
+  clear_isomorph_arrays(&s->defstate);
+  free_dupnames(s);
 
-  any_tdngrps = 0;
+  s->any_tdngrps = 0;
 }
 
 /* Starting at the offset in both ctf files, walk run_length tuples.
@@ -139,22 +291,23 @@ void reinit_libruns(void)
  * if the mapping fails or if we exceed the number of permitted mappings.
  * Return 1 if the mappings were OK, or 0 if the mappings failed.
  */
-int check_isomorphic_run(Run * run, int isomorph_count_threshold)
+int check_isomorphic_run(Runstate * rs, Run * run,
+			 int isomorph_count_threshold)
 {
   /* Get copies of the TDNs and CTF handles involved,
    * plus pointers to the start of the in-memory token runs.
    */
   TDN *src = run->src_startnode;
   TDN *dst = run->dst_startnode;
-  int srcfile = src->file_line_id >> 20;
-  int dstfile = dst->file_line_id >> 20;
-  uint8_t *srcposn = ctf_handle[srcfile]->start + src->offset;
-  uint8_t *dstposn = ctf_handle[dstfile]->start + dst->offset;
+  Ctfhandle *srcctf = cursess->ctf_handle[src->ctfid];
+  Ctfhandle *dstctf = cursess->ctf_handle[dst->ctfid];
+  uint8_t *srcposn = srcctf->start + tdn_offset(srcctf, src);
+  uint8_t *dstposn = dstctf->start + tdn_offset(dstctf, dst);
   int i = 0;
   uint16_t srcid, dstid;	/* The two identifiers to map */
   uint8_t token;
 
-  clear_isomorph_arrays();
+  clear_isomorph_arrays(rs);
 
   /* Walk the run for its whole length */
   while (i < run->length) {
@@ -188,29 +341,30 @@ int check_isomorphic_run(Run * run, int isomorph_count_threshold)
       if ((token != LABEL) && (token != IDENTIFIER)) return(0);
 
       /* First thing, record a mapping each way if there is none */
-      if (isodtos[dstid] == 0) {
-	isodtos[dstid] = srcid;
-	isoseen[max_isoseen++] = dstid;
+      if (rs->isodtos[dstid] == 0) {
+	rs->isodtos[dstid] = srcid;
+	rs->isoseen[rs->max_isoseen++] = dstid;
       }
-      if (isostod[srcid] == 0) {
-	isostod[srcid] = dstid;
-	isoseen[max_isoseen++] = srcid;
+      if (rs->isostod[srcid] == 0) {
+	rs->isostod[srcid] = dstid;
+	rs->isoseen[rs->max_isoseen++] = srcid;
       }
       /* Now reject if the mappings fail in either direction */
-      if (isodtos[dstid] != srcid) return (0);
-      if (isostod[srcid] != dstid) return (0);
+      if (rs->isodtos[dstid] != srcid) return (0);
+      if (rs->isostod[srcid] != dstid) return (0);
 
       /*
        * Stop now if we have reach the threshold on the number of isomorphic
        * relations that we can have. isomorph_count_threshold is always
        * doubled because we always have a 2-way relation.
        */
-      if (max_isoseen > isomorph_count_threshold)
+      if (rs->max_isoseen > isomorph_count_threshold)
 	return (0);
       break;
 
     case LINE:
     case FILENAME:
+    case DUPFILE:
       return (0);		/* We should never hit one of these! */
 
     default:
@@ -222,21 +376,120 @@ int check_isomorphic_run(Run * run, int isomorph_count_threshold)
   return (1);
 }
 
+/*
+ * The patterns given to add_exclude_path(). Whether the name of each entry
+ * in a CTF file's table of file records matches one of them is found the
+ * first time a run in that CTF file is completed, and is kept in a bitmap
+ * in the Ctfhandle, so each name is only matched once.
+ */
+struct _pathfilter
+{
+  regex_t *res;			/* The compiled patterns */
+  int count;			/* and the number of them */
+};
+
+static pthread_mutex_t exclude_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Free the patterns */
+void free_pathfilter(struct _pathfilter *pf)
+{
+  int i;
+
+  if (pf == NULL) return;
+  for (i = 0; i < pf->count; i++)
+    regfree(&(pf->res[i]));
+  free(pf->res);
+  free(pf);
+}
+
+/* Return 1 if the name matches one of the patterns, 0 otherwise */
+static int name_excluded(char *name, struct _pathfilter *pf)
+{
+  int j;
+
+  for (j = 0; j < pf->count; j++)
+    if (!regexec(&(pf->res[j]), name, 0, NULL, 0)) return (1);
+  return (0);
+}
+
+/* Return 1 if the name of the source file which holds the TDN's tuple
+ * matches one of the patterns, 0 otherwise. Exits if there is no memory
+ * for the bitmap.
+ */
+static int path_excluded(TDN * tdn, struct _pathfilter *pf)
+{
+  Ctfhandle *ctf = cursess->ctf_handle[tdn->ctfid];
+  uint8_t *posn;
+  uint32_t i;
+  int excl;
+
+  /* Match the names of any entries not yet in the bitmap */
+  pthread_mutex_lock(&exclude_lock);
+  if (tdn->fileidx >= ctf->numexcluded) {
+    ctf->excluded = (uint8_t *) realloc(ctf->excluded,
+					(ctf->numfiles + 7) / 8);
+    if (ctf->excluded == NULL) {
+      fprintf(stderr, "Unable to malloc exclude bitmap: %s\n",
+	      strerror(errno));
+      exit(1);
+    }
+    for (i = ctf->numexcluded; i < ctf->numfiles; i++) {
+      excl = 0;
+      posn = ctf->start + ctf->files[i].name_offset;
+      if ((i > 0) &&
+	  (ctf->files[i].name_offset == ctf->files[i - 1].name_offset))
+	excl = (ctf->excluded[(i - 1) >> 3] >> ((i - 1) & 7)) & 1;
+      else if (*posn == FILENAME)
+	excl = name_excluded((char *) posn + 1 + sizeof(uint32_t), pf);
+      if (excl)
+	ctf->excluded[i >> 3] |= 1 << (i & 7);
+      else
+	ctf->excluded[i >> 3] &= ~(1 << (i & 7));
+    }
+    ctf->numexcluded = ctf->numfiles;
+  }
+  excl = (ctf->excluded[tdn->fileidx >> 3] >> (tdn->fileidx & 7)) & 1;
+  pthread_mutex_unlock(&exclude_lock);
+  return (excl);
+}
+
+/* Return 1 if the run should be dropped because of its length or
+ * the names of its files, 0 if it should be kept.
+ */
+static int run_filtered(Run * run, Ctfparam * p)
+{
+  if (p->minlen && (run->length < p->minlen)) return (1);
+  if (p->maxlen && (run->length > p->maxlen)) return (1);
+  if ((p->exclude != NULL) &&
+      (path_excluded(run->src_startnode, p->exclude) ||
+       path_excluded(run->dst_startnode, p->exclude)))
+    return (1);
+  return (0);
+}
+
 /*
  * We have compared the TDN against all in the group. Move any untouched
  * runs to the done list, so that we won't have to compare against them
  * in the future. If only_untouched==1, move the untouched runs.
  * If only_untouched==0, move all the runs. Returns # of runs moved.
+ * The end lines of the runs which are long enough to print are found
+ * as they are moved. Runs dropped by the Ctfparam's filters are freed
+ * instead.
  */
-int move_nowcomplete_runs(int only_untouched, int do_isomorph_comparison,
-			   int isomorph_count_threshold)
+int move_nowcomplete_runs(Runstate * rs, int only_untouched,
+			  int do_isomorph_comparison,
+			  int isomorph_count_threshold, Ctfparam * p)
 {
   Run *run, *lastrun, *nextcopy;
-  int endhash;
   int count=0;
+  uint64_t start = 0, isotime = 0;
+
+  if (rs->timing) {
+    start = ctfstats_clock(); isotime = rs->wall[CTS_ISOMORPH];
+  }
 
   /* Walk the list of runs in the incomplete list */
-  for (lastrun = run = inc_runlist; run != NULL;) {
+  for (lastrun = run = rs->inc_runlist; run != NULL;) {
     /* Skip those which were touched, so may still be extended */
     if (only_untouched && (run->touched != 0)) {
       lastrun = run; run = run->next;
@@ -255,40 +508,62 @@ int move_nowcomplete_runs(int only_untouched, int do_isomorph_comparison,
       lastrun = nextcopy;
 
     /* Fix up the head of the incomplete list */
-    if (inc_runlist == run)
-      inc_runlist = nextcopy;
+    if (rs->inc_runlist == run)
+      rs->inc_runlist = nextcopy;
 
-    /* Calculate the endhash for the run, and remove it from LUT */
-    endhash = runhash(run->src_endnode, run->dst_endnode);
-    runLUT[endhash] = NULL;
+    /* Remove the run from the LUT */
+    lut_remove(rs, run);
 
     /* Do an isomorphic check if required */
     if (do_isomorph_comparison) {
+      uint64_t isostart = rs->timing ? ctfstats_clock() : 0;
+      int ok = check_isomorphic_run(rs, run, isomorph_count_threshold);
+
+      if (rs->timing) rs->wall[CTS_ISOMORPH] += ctfstats_clock() - isostart;
+
       /* Don't insert the run if it fails the isomorphic check */
-      if (check_isomorphic_run(run, isomorph_count_threshold) == 0) {
+      if (ok == 0) {
 	goto nextrun;	/* Yuk, a goto! */
       }
     }
 
+    /* Throw the run away if we don't want to see it */
+    if (run_filtered(run, p)) {
+      free(run); goto nextrun;
+    }
+
+    /* The run won't change now, so find its end lines */
+    if ((run->length >= p->tuple_size) && !(p->flags & CTP_NOLINES)) {
+      run->src_endline = last_linenum_for(run->src_endnode,
+			cursess->ctf_handle[run->src_endnode->ctfid], p);
+      run->dst_endline = last_linenum_for(run->dst_endnode,
+			cursess->ctf_handle[run->dst_endnode->ctfid], p);
+    }
+
     /* Insert the run into the completed list */
-    run->next = done_runhead;
-    done_runhead = run;
+    run->next = rs->done_runhead;
+    rs->done_runhead = run;
     count++;
 
   nextrun:
     /* Iterate to the next run in the list */
     run = nextcopy;
   }
+
+  /* The isomorphic checks are timed on their own */
+  if (rs->timing)
+    rs->wall[CTS_RUNS] += ctfstats_clock() - start -
+			  (rs->wall[CTS_ISOMORPH] - isotime);
   return(count);
 }
 
 /* Make a new run */
-void make_new_run(TDN * tdn, TDNgrp * grp, Ctfparam * p)
+void make_new_run(Runstate * rs, TDN * tdn, TDN * dst, Ctfparam * p)
 {
   Run *newrun;
 
   /* Create a new Run
-   * node and set the src nodes to tdn and grp->node. Set the length to
+   * node and set the src nodes to tdn and dst. Set the length to
    * tuple_size-1 (see the NOTE in libtdn.c for explanation of the -1).
    */
   newrun = (Run *) malloc(sizeof(Run));
@@ -297,9 +572,9 @@ void make_new_run(TDN * tdn, TDNgrp * grp, Ctfparam * p)
     exit(1);
   }
   newrun->src_startnode = tdn;
-  newrun->dst_startnode = grp->node;
+  newrun->dst_startnode = dst;
   newrun->src_endnode = tdn;
-  newrun->dst_endnode = grp->node;
+  newrun->dst_endnode = dst;
   newrun->length = p->tuple_size-1;
   newrun->touched = 1;
 #ifdef DEBUG
@@ -307,28 +582,26 @@ void make_new_run(TDN * tdn, TDNgrp * grp, Ctfparam * p)
   print_listrun(newrun);
 #endif
 
-  /* Calculate the endhash for the new run, and add it to the LUT */
-  int endhash = runhash(newrun->src_endnode, newrun->dst_endnode);
-  /* if (runLUT[endhash] != NULL) printf("HASHDUP\n"); */
-  runLUT[endhash] = newrun;
+  /* Add the new run to the LUT */
+  lut_insert(rs, newrun);
+  if (rs->lutcount > rs->peakruns) rs->peakruns = rs->lutcount;
 
   /* Insert the new run into the incomplete runlist */
-  newrun->next = inc_runlist;
-  inc_runlist = newrun;
+  newrun->next = rs->inc_runlist;
+  rs->inc_runlist = newrun;
 }
 
 /* Extend an existing run */
-void extend_run(Run * run, TDN * tdn, TDNgrp * grp)
+void extend_run(Runstate * rs, Run * run, TDN * tdn, TDN * dst)
 {
-  /* Calculate the endhash for the old run, and remove it from LUT */
-  int endhash = runhash(run->src_endnode, run->dst_endnode);
-  runLUT[endhash] = NULL;
+  /* Remove the run from the LUT while its endnodes change */
+  lut_remove(rs, run);
 
   /* Update the Run's endnodes to point at the new
    * TDN pair, and increment the run's length.
    */
   run->src_endnode = tdn;
-  run->dst_endnode = grp->node;
+  run->dst_endnode = dst;
   run->length++;
   run->touched = 1;
 #ifdef DEBUG
@@ -336,67 +609,263 @@ void extend_run(Run * run, TDN * tdn, TDNgrp * grp)
   print_listrun(run);
 #endif
 
-  /* Calculate the endhash for the extended run, and add it to the LUT */
-  endhash = runhash(run->src_endnode, run->dst_endnode);
-  /* if (runLUT[endhash] != NULL) printf("HASHDUP\n"); */
-  runLUT[endhash] = run;
+  /* Add the extended run back to the LUT */
+  lut_insert(rs, run);
 }
 
 /* We now have two TDNs showing code similarity.
  * Try to find an existing run whose endnodes
- * match the previnctf pointers in tdn and grp.
+ * match the TDNs before tdn and dst in their CTF files.
  * If a match, extend the run. If no match, make
  * a new run.
  */
-void add_extend_runs(TDN * tdn, TDNgrp * grp, Ctfparam * p)
+void add_extend_runs(Runstate * rs, TDN * tdn, TDN * dst, Ctfparam * p)
 {
+  Run *run;
+
 #ifdef DEBUG
   printf("Starting add_extend_runs, incomplete run list is:\n");
-  for (run = inc_runlist; run != NULL; run = run->next) {
+  for (run = rs->inc_runlist; run != NULL; run = run->next) {
     printf("  start 0x%x end->next 0x%x\n",
 	   (int) run->src_startnode, (int) run->src_endnode);
   }
 #endif
 
-  /* Shortcut: get our previnctfs as a hash, lookup the LUT.
-   * If a match, it must be the run for us to extend.
+  /* Shortcut: look up the run which ends at the TDNs before us in the
+   * LUT. If there is one, it is the run for us to extend. Strictly
+   * speaking, the TDN before us might come from a different source code
+   * file, but in practice this causes no issues.
    */
-  int endhash = runhash(tdn->previnctf, grp->node->previnctf);
-  if (runLUT[endhash] != NULL) {
-    extend_run(runLUT[endhash], tdn, grp);
+  run = lut_find(rs, tdn - 1, dst - 1);
+  if (run != NULL) {
+    extend_run(rs, run, tdn, dst);
   } else {
     /* If we didn't extend the above run, it's a new run. */
-    make_new_run(tdn, grp, p);
+    make_new_run(rs, tdn, dst, p);
   }
 }
 
 
-/** Functions to find runs of code similarity.
- *
- * find_runs_from_ctf(): given the number of a CTF file in the ctflist.db,
- * and a pointer to a Ctfparam struct, build the TDNs from that CTF file
- * in memory. Compare the TDNs from the specified CTF file to the already
- * in-memory TDNs, find any similarities, and build & extend runs of code
- * similarity in the incomplete run list. Add the TDNs from the specified
- * CTF file to the in-memory TDNs. Return a pointer to the head of a
- * singly-linked list of runs that matched the search criteria given in
- * the Ctfparam struct, or NULL if no runs were found.
- *
- * If  p->flags has CTP_PARTPRINT set, then this function will print the
- * complete runs after each source file and always return NULL. Use this
- * to conserve memory somewhat. This option is incompatible with
- * CTP_SORTRESULTS.
- *
- * If p->flags has CTP_NOSEARCH set, only create and add the CTF file's
- * TDNs to the in-memory TDNs, do no perform the run search.
+/* Add a TDN and the node to insert it after to the deferred list */
+static void defer_tdn(Deflist * defer, TDN * tdn, TDNgrp * after)
+{
+  if (defer->count == defer->size) {
+    defer->size = (defer->size == 0) ? 4096 : 2 * defer->size;
+    defer->list = (Deferred *) realloc(defer->list,
+				       defer->size * sizeof(Deferred));
+    if (defer->list == NULL) {
+      fprintf(stderr, "Unable to malloc deferred TDNs: %s\n",
+	      strerror(errno));
+      exit(1);
+    }
+  }
+  defer->list[defer->count].tdn = tdn;
+  defer->list[defer->count].after = after;
+  defer->count++;
+}
+
+/* Return which of the numparts parts of the in-memory TDNs a TDN is in */
+static inline int tdn_part(TDN * tdn, int numparts)
+{
+  uint32_t index = tdn->tuple_crc >> (32 - BITSINTABLE);
+  return ((int) (((uint64_t) index * numparts) >> BITSINTABLE));
+}
+
+/* Return the next match from worker k */
+static inline Partmatch *next_partmatch(Partin * parts, int k)
+{
+  Partbuf *b = &(parts->in[k]);
+  return ((Partmatch *) ((uint8_t *) b->buf + b->pos));
+}
+
+/* Read at least one more match from worker k into its buffer, keeping
+ * any part of a match left over. Exit if the worker has died.
  */
-Run *find_runs_from_ctf(int ctfid, Ctfparam * p)
+static void fill_partbuf(Partin * parts, int k)
+{
+  Partbuf *b = &(parts->in[k]);
+  ssize_t n;
+
+  b->len -= b->pos;
+  memmove(b->buf, (uint8_t *) b->buf + b->pos, b->len);
+  b->pos = 0;
+  while (b->len < sizeof(Partmatch)) {
+    if (b->sorter != NULL) {
+      /* Read whole matches, as many as will fit */
+      while ((b->len + sizeof(Partmatch) <= sizeof(b->buf)) &&
+	     ((n = sorter_read(b->sorter, (uint8_t *) b->buf + b->len)) == 1))
+	b->len += sizeof(Partmatch);
+      if (b->len >= sizeof(Partmatch)) break;
+      fprintf(stderr, "Lost the sorted matches\n");
+      exit(1);
+    }
+    n = read(b->fd, (uint8_t *) b->buf + b->len, sizeof(b->buf) - b->len);
+    if ((n == -1) && (errno == EINTR)) continue;
+    if (n <= 0) {
+      fprintf(stderr, "Lost the matches from worker %d\n", k);
+      exit(1);
+    }
+    b->len += n;
+  }
+}
+
+/* Move on to the next match from worker k */
+static inline void read_partmatch(Partin * parts, int k)
+{
+  Partbuf *b = &(parts->in[k]);
+
+  b->pos += sizeof(Partmatch);
+  if (b->len - b->pos < sizeof(Partmatch)) fill_partbuf(parts, k);
+}
+
+/*
+ * Add a match between tdn and dst to the runs in rs. While the walk is
+ * being timed, reading the clock for each match would cost more than
+ * adding it, so the matches for tdn are kept in rs until they have all
+ * been found, then added by add_kept_matches().
+ */
+static inline void add_match(Runstate * rs, TDN * tdn, TDN * dst,
+			     Ctfparam * p)
+{
+  rs->tdncmpcnt++;
+  if (!rs->timing) {
+    add_extend_runs(rs, tdn, dst, p);
+    return;
+  }
+  if (rs->numkept == rs->maxkept) {
+    rs->maxkept = (rs->maxkept == 0) ? 64 : 2 * rs->maxkept;
+    rs->kept = (TDN **) realloc(rs->kept, rs->maxkept * sizeof(TDN *));
+    if (rs->kept == NULL) {
+      fprintf(stderr, "Unable to malloc match list: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+  rs->kept[rs->numkept++] = dst;
+}
+
+/* Add the matches for tdn kept by add_match() to the runs in rs */
+static void add_kept_matches(Runstate * rs, TDN * tdn, Ctfparam * p)
+{
+  uint32_t i;
+
+  for (i = 0; i < rs->numkept; i++)
+    add_extend_runs(rs, tdn, rs->kept[i], p);
+  rs->numkept = 0;
+}
+
+/*
+ * We have two TDNs showing code similarity: tdn from CTF file ctfid,
+ * and dst. Pass them on to the parent, or add the TDN as the beginning
+ * of a new run or extend an existing run.
+ */
+static inline void found_match(Runstate * rs, TDN * tdn, int ctfid,
+			       TDN * dst, Ctfparam * p, Matchout * out)
+{
+  Partmatch m;
+
+  if (out != NULL) {
+    m.srcctf = ctfid;
+    m.srcidx = tdn - cursess->ctf_handle[ctfid]->tdns;
+    m.dstctf = dst->ctfid;
+    m.dstidx = dst - cursess->ctf_handle[dst->ctfid]->tdns;
+    if (out->sorter != NULL)
+      sorter_add(out->sorter, &m);
+    else
+      fwrite(&m, sizeof(m), 1, out->file);
+  } else
+    add_match(rs, tdn, dst, p);
+}
+
+/*
+ * Walk the group of in-memory TDNs which could match tdn, which is from
+ * CTF file ctfid in the given tree. Each matching TDN is added to a run
+ * in rs or, if out is not NULL, sent to out as a Partmatch. Returns
+ * the TDNgrp node that tdn should be inserted after.
+ */
+static TDNgrp *match_tdngrp(Runstate * rs, TDN * tdn, int ctfid, int tree,
+			    Ctfparam * p, Matchout * out)
 {
+  TDNgrp *grp, *lastgrp;
+  Idxgrp *ig;
+  uint32_t n;
+  Ctfhandle *ctf = cursess->ctf_handle[ctfid];
+  int all_matches = p->flags & CTP_WITHINTREE;
+  uint32_t our_crc = tdn->tuple_crc;
+  uint8_t our_crcbot = our_crc & 0xff;
+
+  /* The TDNs from an index image come first. Their trees all come
+   * before the one being walked, so none of them are skipped.
+   */
+  for (ig = get_idxgrps_for(tdn, &n); n > 0; ig++, n--)
+    if (ig->crcbot == our_crcbot)
+      found_match(rs, tdn, ctfid,
+		  &(cursess->ctf_handle[ig->ctfid]->tdns[ig->idx]), p, out);
+
+  /* Walk the whole list that holds the tdn's group, so that we know
+   * where to insert the tdn.
+   */
+  for (lastgrp = NULL, grp = get_tdngrp_list(tdn);
+       grp != NULL; lastgrp = grp, grp = grp->next) {
+    /* Stop if from the same tree, when not doing an in-tree search.
+     * All the shards of a split tree have the same tree id.
+     */
+    if ((all_matches == 0) && (grp->treeid == tree)) break;
+
+    /* Skip if the full checksums don't match */
+    if (grp->crc != our_crc) continue;
+
+    /* Skip if the grp comes from the same source file as the tdn */
+    if ((all_matches != 0) && (grp->node->ctfid == ctfid) &&
+	(tdn_name_offset(ctf, tdn) == tdn_name_offset(ctf, grp->node)))
+      continue;
+
+    found_match(rs, tdn, ctfid, grp->node, p, out);
+  }
+  return (lastgrp);
+}
+
+/* Return the TDN at index idx in the CTF file's array of TDNs. If it
+ * hasn't been made yet, make it. Returns NULL when there are no more.
+ */
+static inline TDN *walk_next_tdn(Runstate * rs, Ctfhandle * ctf, int ctfid,
+				 Ctfparam * p, uint32_t idx)
+{
+  uint64_t start;
+  TDN *tdn;
+
+  if (idx < ctf->numtdns) return (&(ctf->tdns[idx]));
+  if (!rs->timing) return (get_next_tdn(ctf, ctfid, p));
+  start = ctfstats_clock();
+  tdn = get_next_tdn(ctf, ctfid, p);
+  rs->wall[CTS_EXTRACT] += ctfstats_clock() - start;
+  return (tdn);
+}
+
+/*
+ * Walk the TDNs from the given CTF file, compare them to the in-memory
+ * TDNs, and build & extend runs of code similarity in the Runstate. If
+ * defer is NULL, each TDN is added to the in-memory TDNs as we go.
+ * Otherwise the in-memory TDNs are left untouched, and the TDNs to add
+ * are saved in defer. If parts is not NULL, the matches come from the
+ * worker processes or the spill files instead.
+ * Returns 1 if the TDNs were only added and no runs were searched for,
+ * 0 otherwise.
+ */
+static int walk_ctf(Runstate * rs, int ctfid, Ctfparam * p, Deflist * defer,
+		    Partin * parts)
+{
+  Ctfsession *s = cursess;
   Run *run;
-  TDN *tdn, *lastdn = NULL;	/* Next TDN obtained from the CTF file */
-  TDNgrp *grp, *lastgrp;	/* Matching tdngrp for the TDN */
-  uint32_t name_offset = 0;
-  int wecan_freetdn;
+  TDN *tdn;			/* Next TDN obtained from the CTF file */
+  TDN *dst;			/* A TDN which matches it */
+  TDNgrp *grp, *lastgrp = NULL;	/* Matching tdngrp for the TDN */
+  Partmatch *m;
+  Ctfhandle *ctf = s->ctf_handle[ctfid];
+  uint64_t name_offset = 0;
+  uint64_t start = 0, now;
+  uint32_t idx;
+  int tree = get_ctftree(ctfid);
+  int k;
 
   /* Cache copies of some of the params from p, as we won't have
    * to follow pointer and will make the code faster. Note that
@@ -408,144 +877,1041 @@ Run *find_runs_from_ctf(int ctfid, Ctfparam * p)
   int isomorph_count_threshold = 2 * p->isomorph_count_threshold;
   int lastfile= p->flags & CTP_LASTFILE;
   int partprint= p->flags & CTP_PARTPRINT;
+  int no_tdngrps= (s->any_tdngrps == 0);
 
-  /* Check for illegal arguments */
-  if ((ctfid < 1) || (ctfid >= ctflistnext) || (p == NULL)) return (NULL);
-
-  clear_inclist();		/* Set the incomplete list empty */
+  clear_inclist(rs);		/* Set the incomplete list empty */
 
   /* Only create/insert the TDNs if TP_NOSEARCH is set */
   if (p->flags & CTP_NOSEARCH) {
-    all_matches= 0; any_tdngrps = 0;
+    all_matches= 0; no_tdngrps = 1;
   }
 
   /* If this is the first CTF file and we are not going to do an in-tree
    * search for runs, don't look for runs. Instead, simply insert the
    * TDNs into the tdngrps.
    */
-  if ((all_matches == 0) && (any_tdngrps == 0)) {
-    while ((tdn = get_next_tdn(ctf_handle[ctfid], ctfid, p)) != NULL) {
+  if ((all_matches == 0) && no_tdngrps && (parts == NULL)) {
+    for (idx = 0; (tdn = walk_next_tdn(rs, ctf, ctfid, p, idx)) != NULL;
+	 idx++) {
       grp = get_tdngrp_for(tdn, p);
 
-      /* Point each TDN at the next one from the CTF file.
-       * Strictly speaking, we should not point a TDN at a TDN from a
-       * different source code file, but in practice this causes no issues.
-       */
-      if (lastdn != NULL) tdn->previnctf = lastdn;
-      lastdn = tdn;
-
       /* Append tdn at the end of the grp matching the top 24 bits of CRC */
-      append_tdn(tdn, grp, p);
+      if (defer != NULL) defer_tdn(defer, tdn, grp);
+      else append_tdn(tdn, grp, p);
     }
-    any_tdngrps = 1;
-    return (NULL);
+    return (1);
   }
 
   /* We do have existing TDNgrps, so now we can look for matching runs */
-  while ((tdn = get_next_tdn(ctf_handle[ctfid], ctfid, p)) != NULL) {
-
-    /* Update the previnctf before we search for a run,
-     * to ensure that any run found is able to point at this tdn.
-     * Strictly speaking, we should not point a TDN at a TDN from a
-     * different source code file, but in practice this causes no issues.
-     */
-    if (lastdn != NULL) tdn->previnctf = lastdn;
-    lastdn = tdn;
+  for (idx = 0; (tdn = walk_next_tdn(rs, ctf, ctfid, p, idx)) != NULL;
+       idx++) {
 
     /*
      * If the name offsets between the adjacent TDNs are different, we have
      * moved to a new source file in the CTF tree. Any incomplete runs are
      * now complete, so move them to the done list.
      */
-    if (name_offset != tdn->name_offset) {
-      p->runcount+= move_nowcomplete_runs(0, do_isomorph_comparison,
-			    isomorph_count_threshold);
+    if (name_offset != tdn_name_offset(ctf, tdn)) {
+      rs->runcount+= move_nowcomplete_runs(rs, 0, do_isomorph_comparison,
+			    isomorph_count_threshold, p);
 #if 0
       printf("End of source file\n");
 #endif
       if (partprint) {
-        print_listruns(done_runhead, p);
-        clear_donelist();
+	pthread_mutex_lock(&print_lock);
+        print_listruns(rs->done_runhead, p);
+	pthread_mutex_unlock(&print_lock);
+        clear_donelist(rs);
       }
-      clear_inclist();          /* Set the incomplete list empty */
-      name_offset = tdn->name_offset;
+      clear_inclist(rs);          /* Set the incomplete list empty */
+      name_offset = tdn_name_offset(ctf, tdn);
     }
 
     /* Mark all the runs as untouched before we work on this TDN */
-    for (run = inc_runlist; run != NULL; run = run->next)
+    for (run = rs->inc_runlist; run != NULL; run = run->next)
       run->touched = 0;
 
 #ifdef DEBUG
     /* Print out the token and offset which starts this TDN */
-    uint32_t o = tdn->offset;
-    int tok = get_token(C, &o, NULL, NULL);
-    printf("Token %s at 0x%x line %d\n", tok2str(tok), tdn->offset,
-	   tdn->file_line_id & 0xfffff);
+    uint64_t o = tdn_offset(ctf, tdn);
+    int tok = get_token(ctf, &o, NULL, NULL);
+    printf("Token %s at 0x%llx line %d\n", tok2str(tok),
+	   (unsigned long long) tdn_offset(ctf, tdn),
+	   get_linenum(ctf, tdn_offset(ctf, tdn)));
 
 #endif
 
     /*
-     * Get the TDN group associated with this TDN and walk all of the TDNs in
-     * the group
+     * Compare the TDN against all the TDNs in its group, or get the
+     * matches from the worker which holds its group.
      */
-    wecan_freetdn= lastfile;	/* Only try to free TDNs on the last file */
-    for (lastgrp = NULL, grp = get_tdngrp_for(tdn, p);
-	 grp != NULL; lastgrp = grp, grp = grp->next) {
-      /*
-       * Skip TDNs that don't match: low crc mismatch, both TDNs are from the
-       * same file.
-       */
-      uint8_t our_crcbot = tdn->tuple_crc & 0xff;
-
-      /* Stop if from the same file, when not doing an in-tree search */
-      if ((all_matches == 0) && (grp->ctfid == ctfid)) break;
-
-      /* Skip if the full checksums don't match */
-      if (grp->crcbot != our_crcbot) continue;
-
-      /* Skip if the grp comes from the same source file as the tdn */
-      if ((all_matches != 0) && (tdn->name_offset == grp->node->name_offset))
-	continue;
-
-      /* We now have two TDNs showing code similarity. Add the TDN
-       * as the beginning of a new run, or extend an existing run.
-       */
-      add_extend_runs(tdn, grp, p);
-      wecan_freetdn=0;
-      p->tdncmpcnt++;
+    if (rs->timing) start = ctfstats_clock();
+    if (parts == NULL)
+      lastgrp = match_tdngrp(rs, tdn, ctfid, tree, p, NULL);
+    else {
+      k = tdn_part(tdn, parts->numparts);
+      for (m = next_partmatch(parts, k);
+	   (m->srcctf == ctfid) && (m->srcidx == idx);
+	   read_partmatch(parts, k), m = next_partmatch(parts, k)) {
+	dst = &(s->ctf_handle[m->dstctf]->tdns[m->dstidx]);
+	add_match(rs, tdn, dst, p);
+      }
+    }
+    if (rs->timing) {
+      now = ctfstats_clock();
+      rs->wall[CTS_PROBE] += now - start;
+      add_kept_matches(rs, tdn, p);
+      rs->wall[CTS_RUNS] += ctfstats_clock() - now;
     }
-
-#ifdef FREE_MEM
-    /* Free the TDN under these circumstances: we are the last CTF file,
-     * the TDN has not been put into a run, and we are not comparing
-     * against ourself.
-     */
-    if ((!all_matches) && wecan_freetdn)
-      free(tdn);
-#endif
 
     /*
      * We have compared the TDN against all in the group. Move any untouched
      * runs to the done list, so that we won't have to compare against them
      * in the future.
      */
-    p->runcount+= move_nowcomplete_runs(1, do_isomorph_comparison,
-			  isomorph_count_threshold);
+    rs->runcount+= move_nowcomplete_runs(rs, 1, do_isomorph_comparison,
+			  isomorph_count_threshold, p);
 
     /* Append the TDN at the end of the grp matching the top 24 bits of CRC.
      * Do this if we are looking for all matches (i.e. within CTF trees), or 
      * if there will be future CTF files that want to compare against us.
+     * The workers hold the in-memory TDNs when we have them.
      */
-    if (all_matches || (!lastfile))
-      append_tdn(tdn, lastgrp, p);
+    if ((parts == NULL) && (all_matches || (!lastfile))) {
+      if (defer != NULL) defer_tdn(defer, tdn, lastgrp);
+      else append_tdn(tdn, lastgrp, p);
+    }
   }
 
   /* Move any incomplete runs to the done list before returning it. */
-  p->runcount+= move_nowcomplete_runs(0, do_isomorph_comparison,
-						isomorph_count_threshold);
+  rs->runcount+= move_nowcomplete_runs(rs, 0, do_isomorph_comparison,
+						isomorph_count_threshold, p);
   if (partprint) {
-    print_listruns(done_runhead, p);
-    clear_donelist();
+    pthread_mutex_lock(&print_lock);
+    print_listruns(rs->done_runhead, p);
+    pthread_mutex_unlock(&print_lock);
+    clear_donelist(rs);
+  }
+  return (0);
+}
+
+/* Walk the CTF file as walk_ctf() does. If p->stats is not NULL, time
+ * the phases of the walk in rs, and the whole walk in p->stats.
+ */
+static int timed_walk_ctf(Runstate * rs, int ctfid, Ctfparam * p,
+			  Deflist * defer, Partin * parts)
+{
+  uint64_t start;
+  int nosearch;
+
+  if (p->stats == NULL) return (walk_ctf(rs, ctfid, p, defer, parts));
+  rs->timing = 1;
+  start = ctfstats_clock();
+  nosearch = walk_ctf(rs, ctfid, p, defer, parts);
+  p->stats->ctfwall[ctfid] += ctfstats_clock() - start;
+  rs->timing = 0;
+  return (nosearch);
+}
+
+/* Add the times and the peak number of runs kept in rs while walking
+ * to p->stats, if any, and clear them in rs.
+ */
+static void add_runstats(Runstate * rs, Ctfparam * p)
+{
+  int i;
+
+  if (p->stats != NULL) {
+    for (i = 0; i < CTS_NUMPHASES; i++)
+      p->stats->wall[i] += rs->wall[i];
+    if (rs->peakruns > p->stats->peakruns)
+      p->stats->peakruns = rs->peakruns;
+  }
+  memset(rs->wall, 0, sizeof(rs->wall));
+  rs->peakruns = 0;
+}
+
+/** Functions to find runs of code similarity.
+ *
+ * find_runs_from_ctf(): given the number of a CTF file in the ctflist.db,
+ * and a pointer to a Ctfparam struct, build the TDNs from that CTF file
+ * in memory. Compare the TDNs from the specified CTF file to the already
+ * in-memory TDNs, find any similarities, and build & extend runs of code
+ * similarity in the incomplete run list. Add the TDNs from the specified
+ * CTF file to the in-memory TDNs. Return a pointer to the head of a
+ * singly-linked list of runs that matched the search criteria given in
+ * the Ctfparam struct, or NULL if no runs were found.
+ *
+ * If  p->flags has CTP_PARTPRINT set, then this function will print the
+ * complete runs after each source file and always return NULL. Use this
+ * to conserve memory somewhat. This option is incompatible with
+ * CTP_SORTRESULTS.
+ *
+ * If p->flags has CTP_NOSEARCH set, only create and add the CTF file's
+ * TDNs to the in-memory TDNs, do no perform the run search.
+ *
+ * The shards of a split tree (see get_ctftree()) count as one tree, so
+ * without CTP_WITHINTREE they are not compared against each other.
+ */
+Run *find_runs_from_ctf(int ctfid, Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  int nosearch;
+
+  /* Check for illegal arguments */
+  if ((ctfid < 1) || (ctfid >= s->ctflistnext) || (p == NULL)) return (NULL);
+
+  /* Make sure there are enough lists for the file's TDNs */
+  reserve_tdngrps((s->ctf_handle[ctfid]->end -
+		   s->ctf_handle[ctfid]->start) / 2);
+  reserve_ctfstats(p, s->ctflistnext);
+  nosearch = timed_walk_ctf(&s->defstate, ctfid, p, NULL, NULL);
+  p->runcount += s->defstate.runcount;
+  p->tdncmpcnt += s->defstate.tdncmpcnt;
+  s->defstate.runcount = s->defstate.tdncmpcnt = 0;
+  add_runstats(&s->defstate, p);
+  if (nosearch) {
+    s->any_tdngrps = 1; return (NULL);
+  }
+  return (s->defstate.done_runhead);
+}
+
+/* A shard of a tree to be walked by one of the threads */
+typedef struct _shardjob
+{
+  int ctfid;			/* Id of the shard's CTF file */
+  int nosearch;			/* Set if the TDNs were only added */
+  Run *runs;			/* Complete runs found in the shard */
+  uint64_t runcount;		/* Number of runs found */
+  uint64_t tdncmpcnt;		/* Number of TDN comparisons made */
+  Deflist defer;		/* TDNs to add to the in-memory TDNs */
+} Shardjob;
+
+typedef struct _shardpool
+{
+  Shardjob *jobs;		/* The shards to walk */
+  int count;			/* Number of shards */
+  int next;			/* Next shard to be walked */
+  pthread_mutex_t lock;		/* Lock on next and on p->stats */
+  Ctfsession *sess;		/* Session of the calling thread */
+  Ctfparam *p;
+} Shardpool;
+
+/* The body of each thread: take the next unwalked shard from the pool
+ * and walk it, until there are none left.
+ */
+static void *shard_thread(void *arg)
+{
+  Shardpool *pool = (Shardpool *) arg;
+  Shardjob *job;
+  Runstate *rs;
+  int i;
+
+  /* Work on the session of the thread which started us */
+  use_ctfsession(pool->sess);
+  rs = (Runstate *) calloc(1, sizeof(Runstate));
+  if (rs == NULL) {
+    fprintf(stderr, "Unable to malloc run state: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->count) break;
+
+    job = &pool->jobs[i];
+    job->nosearch = timed_walk_ctf(rs, job->ctfid, pool->p, &job->defer,
+				   NULL);
+    job->runs = rs->done_runhead;
+    job->runcount = rs->runcount;
+    job->tdncmpcnt = rs->tdncmpcnt;
+    rs->done_runhead = NULL;
+    rs->runcount = rs->tdncmpcnt = 0;
+  }
+  pthread_mutex_lock(&pool->lock);
+  add_runstats(rs, pool->p);
+  pthread_mutex_unlock(&pool->lock);
+  free(rs->kept);
+  free(rs->runLUT);
+  free(rs);
+  return (NULL);
+}
+
+/** find_runs_from_shards(): as for find_runs_from_ctf(), but process the
+ * count CTF files from ctfid onwards, which are the shards of one tree.
+ * The shards are walked concurrently by up to p->numthreads threads (or
+ * one per CPU if p->numthreads is 0); their TDNs are added to the
+ * in-memory TDNs once all the shards have been walked. The runs are
+ * returned in the same order as calling find_runs_from_ctf() on each
+ * shard in turn. With CTP_WITHINTREE set, each shard must be compared
+ * against the ones before it, so the shards are walked one at a time.
+ */
+Run *find_runs_from_shards(int ctfid, int count, Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  Shardpool pool;
+  pthread_t *tid;
+  Run *run = NULL;
+  int i, nthreads, started;
+  int nosearch = 1;
+  size_t j;
+
+  /* Check for illegal arguments */
+  if ((ctfid < 1) || (count < 1) || (ctfid + count > s->ctflistnext)
+      || (p == NULL)) return (NULL);
+
+  nthreads = p->numthreads;
+  if (nthreads < 1) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > count) nthreads = count;
+
+  /* Walk the shards one at a time if we have to */
+  if ((nthreads <= 1) || (p->flags & CTP_WITHINTREE)) {
+    for (i = 0; i < count; i++)
+      run = find_runs_from_ctf(ctfid + i, p);
+    return (run);
+  }
+
+  /* The lists can't be grown while the threads hold pointers into them,
+   * so make room for all the shards' TDNs now.
+   */
+  for (i = 0, j = 0; i < count; i++)
+    j += (s->ctf_handle[ctfid + i]->end -
+	  s->ctf_handle[ctfid + i]->start) / 2;
+  reserve_tdngrps(j);
+  reserve_ctfstats(p, s->ctflistnext);
+
+  pool.jobs = (Shardjob *) calloc(count, sizeof(Shardjob));
+  tid = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  if ((pool.jobs == NULL) || (tid == NULL)) {
+    fprintf(stderr, "Unable to malloc shard list: %s\n", strerror(errno));
+    exit(1);
+  }
+  for (i = 0; i < count; i++)
+    pool.jobs[i].ctfid = ctfid + i;
+  pool.count = count;
+  pool.next = 0;
+  pool.sess = s;
+  pool.p = p;
+  pthread_mutex_init(&pool.lock, NULL);
+
+  /* Start the other threads, and walk shards in this one too */
+  for (started = 0; started < nthreads - 1; started++)
+    if (pthread_create(&tid[started], NULL, shard_thread, &pool) != 0)
+      break;
+  shard_thread(&pool);
+  for (i = 0; i < started; i++)
+    pthread_join(tid[i], NULL);
+  pthread_mutex_destroy(&pool.lock);
+  free(tid);
+
+  /* Now add each shard's TDNs to the in-memory TDNs and its runs to
+   * the done list, in shard order.
+   */
+  for (i = 0; i < count; i++) {
+    Shardjob *job = &pool.jobs[i];
+
+    for (j = 0; j < job->defer.count; j++)
+      append_tdn(job->defer.list[j].tdn, job->defer.list[j].after, p);
+    free(job->defer.list);
+
+    if (job->runs != NULL) {
+      for (run = job->runs; run->next != NULL; run = run->next);
+      run->next = s->defstate.done_runhead;
+      s->defstate.done_runhead = job->runs;
+    }
+    p->runcount += job->runcount;
+    p->tdncmpcnt += job->tdncmpcnt;
+    nosearch &= job->nosearch;
+  }
+  free(pool.jobs);
+
+  if (nosearch) {
+    s->any_tdngrps = 1; return (NULL);
+  }
+  return (s->defstate.done_runhead);
+}
+
+/* Search the in-memory TDNs for tdn, which is from CTF file ctfid, and
+ * send each match found to out. Then add tdn to the in-memory TDNs if
+ * later TDNs could match it. lasttree is the tree of the last CTF file.
+ */
+static void join_tdn(TDN * tdn, int ctfid, int lasttree, Ctfparam * p,
+		     Matchout * out)
+{
+  TDNgrp *lastgrp;
+  int tree = get_ctftree(ctfid);
+  int all_matches = p->flags & CTP_WITHINTREE;
+
+  /* As in walk_ctf(), the first tree's TDNs are simply inserted
+   * unless we are looking for all matches.
+   */
+  if ((all_matches == 0) && (tree == 1)) {
+    append_tdn(tdn, get_tdngrp_for(tdn, p), p);
+    return;
+  }
+  lastgrp = match_tdngrp(NULL, tdn, ctfid, tree, p, out);
+
+  /* As in walk_ctf(), the last tree's TDNs are only added if we
+   * are looking for all matches.
+   */
+  if (all_matches || (tree != lasttree))
+    append_tdn(tdn, lastgrp, p);
+}
+
+/* The body of worker process part: walk the TDNs of all the CTF files,
+ * holding and searching only the TDNs in our part of the in-memory TDNs,
+ * and write each match found to out. The last thing written is a
+ * Partmatch with srcctf 0 and the number of TDNs we added in srcidx.
+ */
+static void part_worker(int part, int numparts, Ctfparam * p, FILE * out)
+{
+  Ctfsession *s = cursess;
+  Ctfparam q = *p;		/* So that we count only our own TDNs */
+  Matchout mo;
+  Ctfhandle *ctf;
+  TDN *tdn;
+  Partmatch m;
+  int ctfid;
+  int lasttree = get_ctftree(s->ctflistnext - 1);
+  uint32_t idx;
+  uint64_t ntdns = 0;
+
+  /* Make room for our part of the in-memory TDNs */
+  for (ctfid = 1; ctfid < s->ctflistnext; ctfid++)
+    ntdns += s->ctf_handle[ctfid]->numtdns;
+  reserve_tdngrps(ntdns / numparts);
+
+  q.tdncount = 0;
+  mo.file = out;
+  mo.sorter = NULL;
+  for (ctfid = 1; ctfid < s->ctflistnext; ctfid++) {
+    ctf = s->ctf_handle[ctfid];
+    for (idx = 0; idx < ctf->numtdns; idx++) {
+      tdn = &(ctf->tdns[idx]);
+      if (tdn_part(tdn, numparts) == part)
+	join_tdn(tdn, ctfid, lasttree, &q, &mo);
+    }
+  }
+
+  m.srcctf = 0;
+  m.srcidx = q.tdncount;
+  m.dstctf = m.dstidx = 0;
+  fwrite(&m, sizeof(m), 1, out);
+}
+
+/* Walk each CTF file in turn, and build the runs from the matches in
+ * parts. Then add each part's count of TDNs to p->tdncount. Returns 0 if
+ * OK, -1 if something other than the counts was left in the parts.
+ */
+static int walk_parts(Partin * parts, Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  int ctfid, k, err = 0;
+
+  reserve_ctfstats(p, s->ctflistnext);
+  for (ctfid = 1; ctfid < s->ctflistnext; ctfid++) {
+    timed_walk_ctf(&s->defstate, ctfid, p, NULL, parts);
+    p->runcount += s->defstate.runcount;
+    p->tdncmpcnt += s->defstate.tdncmpcnt;
+    s->defstate.runcount = s->defstate.tdncmpcnt = 0;
+  }
+  add_runstats(&s->defstate, p);
+
+  for (k = 0; k < parts->numparts; k++) {
+    if (next_partmatch(parts, k)->srcctf != 0) err = -1;
+    p->tdncount += next_partmatch(parts, k)->srcidx;
+  }
+  return (err);
+}
+
+/* Return the first index in the tdngrplist which is in part k of the
+ * numparts parts, i.e. the lowest index that tdn_part() puts in part k.
+ */
+static int part_first_index(int k, int numparts)
+{
+  return ((int) ((((uint64_t) k << BITSINTABLE) + numparts - 1) / numparts));
+}
+
+/* Find the matches for the parts first, first+step, ... of the numparts
+ * parts of the in-memory TDNs one after the other, writing the matches
+ * for part k to spill[k]. Each part's TDNs are freed before the next part
+ * is done. Returns 0 if OK, -1 if a spill file could not be written.
+ */
+static int spill_parts(int first, int step, int numparts, Ctfparam * p,
+		       FILE ** spill)
+{
+  int k;
+
+  for (k = first; k < numparts; k += step) {
+    part_worker(k, numparts, p, spill[k]);
+    if (fflush(spill[k]) == EOF) return (-1);
+    free_tdngrps(part_first_index(k, numparts),
+		 part_first_index(k + 1, numparts));
+  }
+  return (0);
+}
+
+/* Return the number of parts to split the in-memory TDNs into so that
+ * the search uses no more than p->memlimit bytes, or 1 if they all fit.
+ * ntdns is the number of TDNs made from all the CTF files.
+ */
+static int count_spillparts(Ctfparam * p, uint64_t ntdns)
+{
+  uint64_t fixed, index, budget, numparts;
+
+  if (p->memlimit == 0) return (1);
+
+  /* The TDN arrays, the list heads and the run lookup table are needed
+   * whatever we do. Each in-memory TDN costs a malloc()d TDNgrp node.
+   */
+  fixed = ntdns * sizeof(TDN) + tdngrp_listsize(ntdns) * sizeof(TDNgrp *) +
+    sizeof(Runstate);
+  index = ntdns * (sizeof(TDNgrp) + 8);
+
+  budget = (p->memlimit > fixed) ? p->memlimit - fixed : 0;
+  if (budget >= index) return (1);
+  numparts = (budget == 0) ? MAXSPILLPARTS : (index + budget - 1) / budget;
+  if (numparts > MAXSPILLPARTS) {
+    fprintf(stderr, "Memory limit too small, using %d partitions\n",
+	    MAXSPILLPARTS);
+    numparts = MAXSPILLPARTS;
+  }
+  return ((int) numparts);
+}
+
+/** find_runs_from_parts(): as for calling find_runs_from_shards() on each
+ * tree in the ctflist in turn, but split the in-memory TDNs by CRC value
+ * into parts, so that no one process has to hold all of them. With
+ * p->numparts > 1, the parts are held by that many worker processes, so
+ * each needs about 1/numparts of the memory that one process would. If
+ * p->memlimit is not 0 and the in-memory TDNs would make the search use
+ * more than p->memlimit bytes, they are split into enough parts to fit.
+ * These are searched one after the other (by the p->numparts workers, if
+ * any), and each part's matches are spilled to a temporary file. The
+ * matches are then read back by this process, which builds the runs from
+ * them. The runs are returned in the same order as the one-process
+ * search. Any CTP_LASTFILE flag is ignored: the last tree is found here.
+ */
+Run *find_runs_from_parts(Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  Partin parts;
+  pid_t *pid;
+  FILE **spill = NULL;
+  Run *run = NULL;
+  int fd[2];
+  int ctfid, j, k, n, status, failed = 0;
+  int numparts, numworkers;
+  uint64_t ntdns = 0;
+
+  /* Check for illegal arguments */
+  if ((p == NULL) || (s->ctflistnext < 2)) return (NULL);
+
+  /* Make all the TDNs before starting any workers, so that they all
+   * share the TDN arrays with us.
+   */
+  begin_ctfphase(p, CTS_EXTRACT);
+  for (ctfid = 1; ctfid < s->ctflistnext; ctfid++) {
+    while (get_next_tdn(s->ctf_handle[ctfid], ctfid, p) != NULL);
+    ntdns += s->ctf_handle[ctfid]->numtdns;
+  }
+  end_ctfphase(p, CTS_EXTRACT);
+
+  /* If the TDNs fit in memory and we are not splitting them between
+   * workers, search each tree in turn as usual.
+   */
+  numparts = count_spillparts(p, ntdns);
+  if ((numparts == 1) && (p->numparts < 2)) {
+    for (ctfid = 1; ctfid < s->ctflistnext; ctfid += n) {
+      for (n = 1; (ctfid + n < s->ctflistnext) &&
+	   (get_ctftree(ctfid + n) == ctfid); n++);
+      if (ctfid + n == s->ctflistnext)
+	p->flags |= CTP_LASTFILE;
+      run = find_runs_from_shards(ctfid, n, p);
+    }
+    return (run);
+  }
+  if (numparts == 1) numparts = p->numparts;
+  numworkers = (p->numparts < numparts) ? p->numparts : numparts;
+  if (numworkers < 2) numworkers = 0;
+
+  parts.numparts = numparts;
+  parts.in = (Partbuf *) calloc(numparts, sizeof(Partbuf));
+  pid = (pid_t *) calloc(numparts, sizeof(pid_t));
+  if ((parts.in == NULL) || (pid == NULL)) {
+    fprintf(stderr, "Unable to malloc worker list: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  fflush(stdout);
+  if (numparts > numworkers) {
+    /* Spill each part's matches to a temporary file */
+    spill = (FILE **) calloc(numparts, sizeof(FILE *));
+    if (spill == NULL) {
+      fprintf(stderr, "Unable to malloc spill list: %s\n", strerror(errno));
+      exit(1);
+    }
+    for (k = 0; k < numparts; k++)
+      if ((spill[k] = make_tmpfile()) == NULL) {
+	fprintf(stderr, "Unable to make a spill file: %s\n", strerror(errno));
+	exit(1);
+      }
+
+    /* Do the parts here, or share them out between the workers */
+    if (numworkers == 0)
+      failed = spill_parts(0, 1, numparts, p, spill);
+    for (k = 0; k < numworkers; k++) {
+      if ((pid[k] = fork()) == -1) {
+	fprintf(stderr, "Unable to start worker %d: %s\n", k, strerror(errno));
+	exit(1);
+      }
+      if (pid[k] == 0)
+	_exit((spill_parts(k, numworkers, numparts, p, spill) == 0) ? 0 : 1);
+    }
+    for (k = 0; k < numworkers; k++)
+      if ((waitpid(pid[k], &status, 0) == -1) || !WIFEXITED(status) ||
+	  (WEXITSTATUS(status) != 0))
+	failed = 1;
+    if (failed) {
+      fprintf(stderr, "Unable to write the spill files\n");
+      exit(1);
+    }
+    numworkers = 0;
+
+    /* and read the matches back from the start of each file */
+    for (k = 0; k < numparts; k++) {
+      parts.in[k].fd = fileno(spill[k]);
+      if (lseek(parts.in[k].fd, 0, SEEK_SET) == -1) {
+	fprintf(stderr, "Unable to rewind a spill file: %s\n", strerror(errno));
+	exit(1);
+      }
+      fill_partbuf(&parts, k);
+    }
+  } else {
+    /* Start the workers, each with a pipe to send us their matches */
+    for (k = 0; k < numworkers; k++) {
+      if ((pipe(fd) == -1) || ((pid[k] = fork()) == -1)) {
+	fprintf(stderr, "Unable to start worker %d: %s\n", k, strerror(errno));
+	exit(1);
+      }
+      if (pid[k] == 0) {
+	FILE *out;
+
+	for (j = 0; j < k; j++) close(parts.in[j].fd);
+	close(fd[0]);
+	if ((out = fdopen(fd[1], "w")) == NULL) _exit(1);
+	setvbuf(out, NULL, _IOFBF, PARTBUFSIZE);
+	part_worker(k, numparts, p, out);
+	_exit((fclose(out) == 0) ? 0 : 1);
+      }
+      close(fd[1]);
+      parts.in[k].fd = fd[0];
+    }
+
+    /* Only read from the workers once they have all been started, as
+     * the first read waits for a worker's first buffer of matches.
+     */
+    for (k = 0; k < numworkers; k++)
+      fill_partbuf(&parts, k);
+  }
+
+  /* Build the runs from the matches */
+  if (walk_parts(&parts, p) == -1) failed = 1;
+  for (k = 0; k < numparts; k++) {
+    if (spill != NULL)
+      fclose(spill[k]);
+    else
+      close(parts.in[k].fd);
+  }
+  for (k = 0; k < numworkers; k++)
+    if ((waitpid(pid[k], &status, 0) == -1) || !WIFEXITED(status) ||
+	(WEXITSTATUS(status) != 0))
+      failed = 1;
+  if (failed) {
+    fprintf(stderr, "A worker process failed\n");
+    exit(1);
+  }
+  free(spill);
+  free(parts.in);
+  free(pid);
+  s->any_tdngrps = 1;
+  return (s->defstate.done_runhead);
+}
+
+/*
+ * With CTP_SORTMERGE, there are no in-memory TDNs to search. Instead, a
+ * Tuplerec for each TDN is given to a Sorter, so that each group of TDNs
+ * which could match comes together, in the order that the CTF files are
+ * walked. The groups are then searched one at a time, so only one group
+ * is held in memory. The matches are sorted back into the order that the
+ * CTF files are walked, and the runs are built from them just as from
+ * the matches of the -P workers.
+ */
+#define SORTMEMSIZE	(256 * 1024 * 1024)	/* Default memory for sorting */
+
+typedef struct _tuplerec
+{
+  uint32_t group;		/* Top bits of the TDN's CRC */
+  uint32_t ctfid;		/* CTF file & index of the TDN */
+  uint32_t idx;
+  uint32_t unused;
+} Tuplerec;
+
+/* Return the sort key of a Tuplerec. As they are sorted in the order
+ * of walking them, this only has to be the group.
+ */
+static uint64_t tuplerec_key(const void *x)
+{
+  return (((const Tuplerec *) x)->group);
+}
+
+/* Return the sort key of a Partmatch: the order of walking the source
+ * TDN. The matches for one TDN stay in the order that they were found.
+ * The Partmatch with the TDN count goes at the end.
+ */
+static uint64_t partmatch_key(const void *x)
+{
+  const Partmatch *m = (const Partmatch *) x;
+
+  if (m->srcctf == 0) return (UINT64_MAX);
+  return (((uint64_t) m->srcctf << 32) | m->srcidx);
+}
+
+/* Read the sorted Tuplerecs from in, search each group of TDNs in turn,
+ * and give the matches to the Sorter out. Each group's TDNs are freed
+ * once it has been searched. Returns the number of TDNs that were added
+ * to the in-memory TDNs, or -1 on error.
+ */
+static int64_t join_sorted_tdns(Sorter * in, Sorter * out, Ctfparam * p)
+{
+  Ctfparam q = *p;		/* So that we count only these TDNs */
+  Matchout mo;
+  Tuplerec r;
+  int64_t group = -1;
+  int lasttree = get_ctftree(cursess->ctflistnext - 1);
+  int n;
+
+  q.tdncount = 0;
+  mo.file = NULL;
+  mo.sorter = out;
+  while ((n = sorter_read(in, &r)) == 1) {
+    if (r.group != group) {
+      if (group != -1) free_tdngrps(group, group + 1);
+      group = r.group;
+    }
+    join_tdn(&(cursess->ctf_handle[r.ctfid]->tdns[r.idx]), r.ctfid, lasttree,
+	     &q, &mo);
+  }
+  if (group != -1) free_tdngrps(group, group + 1);
+  return ((n == 0) ? q.tdncount : -1);
+}
+
+/* Exit with an error if the sorting could not be done */
+static void sort_failed(void)
+{
+  fprintf(stderr, "Unable to sort the tuples: %s\n", strerror(errno));
+  exit(1);
+}
+
+/** find_runs_by_sorting(): as for find_runs_from_parts(), but without
+ * the in-memory TDNs. Instead, a record for each TDN is sorted by CRC,
+ * using temporary files. The groups of TDNs which could match are then
+ * searched one at a time, the matches are sorted back into the order of
+ * the CTF files, and the runs are built from them. The sorts use at most
+ * about p->memlimit bytes of memory, or 256 Mbytes if this is 0, and use
+ * temporary files in $TMPDIR for the rest. Apart from the TDN arrays,
+ * the memory used does not grow with the size of the CTF files. The runs
+ * are the same as the other searches find, in the same order.
+ */
+Run *find_runs_by_sorting(Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  Partin parts;
+  Partmatch m;
+  Tuplerec r;
+  Sorter *tuples, *matches;
+  Ctfhandle *ctf;
+  size_t memsize;
+  int ctfid;
+  int64_t tdncount;
+
+  /* Check for illegal arguments */
+  if ((p == NULL) || (s->ctflistnext < 2)) return (NULL);
+  memsize = (p->memlimit != 0) ? p->memlimit : SORTMEMSIZE;
+
+  /* Make the TDNs of each CTF file, and sort a record for each */
+  tuples = sorter_new(sizeof(r), tuplerec_key, memsize);
+  if (tuples == NULL) sort_failed();
+  r.unused = 0;
+  for (ctfid = 1; ctfid < s->ctflistnext; ctfid++) {
+    ctf = s->ctf_handle[ctfid];
+    begin_ctfphase(p, CTS_EXTRACT);
+    while (get_next_tdn(ctf, ctfid, p) != NULL);
+    end_ctfphase(p, CTS_EXTRACT);
+    r.ctfid = ctfid;
+    for (r.idx = 0; r.idx < ctf->numtdns; r.idx++) {
+      r.group = ctf->tdns[r.idx].tuple_crc >> (32 - BITSINTABLE);
+      sorter_add(tuples, &r);
+    }
+  }
+  if (sorter_done(tuples) == -1) sort_failed();
+
+  /* Search each group for matches, and sort them into the order of
+   * the CTF files. Add a Partmatch with the TDN count at the end, as
+   * the workers do.
+   */
+  matches = sorter_new(sizeof(m), partmatch_key, memsize);
+  if (matches == NULL) sort_failed();
+  if ((tdncount = join_sorted_tdns(tuples, matches, p)) == -1) sort_failed();
+  sorter_free(tuples);
+  m.srcctf = 0;
+  m.srcidx = tdncount;
+  m.dstctf = m.dstidx = 0;
+  sorter_add(matches, &m);
+  if (sorter_done(matches) == -1) sort_failed();
+
+  /* Build the runs from the matches */
+  parts.numparts = 1;
+  parts.in = (Partbuf *) calloc(1, sizeof(Partbuf));
+  if (parts.in == NULL) {
+    fprintf(stderr, "Unable to malloc match buffer: %s\n", strerror(errno));
+    exit(1);
+  }
+  parts.in[0].sorter = matches;
+  fill_partbuf(&parts, 0);
+  if (walk_parts(&parts, p) == -1) {
+    fprintf(stderr, "The sorted matches were corrupted\n");
+    exit(1);
+  }
+  sorter_free(matches);
+  free(parts.in);
+  s->any_tdngrps = 1;
+  return (s->defstate.done_runhead);
+}
+
+/* Get a big-endian 32-bit value from a CTF file */
+static uint32_t get_be32(uint8_t * posn)
+{
+  return ((posn[0] << 24) | (posn[1] << 16) | (posn[2] << 8) | posn[3]);
+}
+
+/** find_dupfiles_from_ctf(): return a singly-linked list of the DUPFILE
+ * records in the given CTF file, in the order that they appear, or NULL
+ * if there are none. These are files which buildctf -D found to be
+ * identical to an earlier file, and so they have no TDNs of their own.
+ * Free the list with free_dupfiles().
+ */
+Dupfile *find_dupfiles_from_ctf(int ctfid)
+{
+  Dupfile *head = NULL, *tail = NULL, *dup;
+  Ctfhandle *ctf;
+  uint64_t offset = 6;		/* Skip the header */
+  uint8_t *posn;
+  char *name;
+  int token;
+
+  if ((ctfid < 1) || (ctfid >= cursess->ctflistnext)) return (NULL);
+  ctf = cursess->ctf_handle[ctfid];
+  if ((ctf == NULL) || !ctf->hasdups) return (NULL);
+
+  /* Skip from one file record to the next without decoding the tokens */
+  while (next_filerecord(ctf, &offset) != -1) {
+    token = get_token(ctf, &offset, NULL, &name);
+    if (token != DUPFILE) continue;
+
+    /* The three 4-byte values end the record */
+    posn = ctf->start + offset - 3 * sizeof(uint32_t);
+    dup = (Dupfile *) malloc(sizeof(Dupfile));
+    if (dup == NULL) break;
+    dup->name = name;
+    dup->origname = name + strlen(name) + 1;
+    dup->ntokens = get_be32(posn);
+    dup->firstline = get_be32(posn + 4);
+    dup->lastline = get_be32(posn + 8);
+    dup->next = NULL;
+    if (tail == NULL) head = dup;
+    else tail->next = dup;
+    tail = dup;
+  }
+  return (head);
+}
+
+/** dupfile_filtered(): return 1 if the pair of identical files in the
+ * Dupfile should not be reported: the files are shorter than the tuple
+ * size in p, or they are dropped by p's filters in the same way as a run
+ * is, by their length and the names of the two files. Otherwise return 0.
+ */
+int dupfile_filtered(Dupfile * dup, Ctfparam * p)
+{
+  if (dup->ntokens < p->tuple_size) return (1);
+  if (p->minlen && (dup->ntokens < p->minlen)) return (1);
+  if (p->maxlen && (dup->ntokens > p->maxlen)) return (1);
+  if ((p->exclude != NULL) &&
+      (name_excluded(dup->name, p->exclude) ||
+       name_excluded(dup->origname, p->exclude)))
+    return (1);
+  return (0);
+}
+
+/* Return the slot in the hash table of copies for the file with the
+ * given name in the given tree.
+ */
+static uint32_t dupnames_slot(Ctfsession * s, int tree, char *name)
+{
+  return ((crc32(name, strlen(name)) ^ tree) & s->duphashmask);
+}
+
+/* Free the hash table of copies */
+static void free_dupnames(Ctfsession * s)
+{
+  Dupnames *d, *next;
+  uint32_t i;
+
+  for (i = 0; (s->duphash != NULL) && (i <= s->duphashmask); i++)
+    for (d = s->duphash[i]; d != NULL; d = next) {
+      next = d->next; free(d->names); free(d);
+    }
+  free(s->duphash);
+  s->duphash = NULL;
+}
+
+/* Add a copy called name of the file origname in the given tree to the
+ * hash table. Returns 0 if OK, -1 on error.
+ */
+static int add_dupname(Ctfsession * s, int tree, char *origname, char *name)
+{
+  uint32_t h = dupnames_slot(s, tree, origname);
+  Dupnames *d;
+  char **names;
+
+  for (d = s->duphash[h]; d != NULL; d = d->next)
+    if ((d->tree == tree) && !strcmp(d->origname, origname)) break;
+  if (d == NULL) {
+    if ((d = (Dupnames *) calloc(1, sizeof(Dupnames))) == NULL) return (-1);
+    d->tree = tree;
+    d->origname = origname;
+    d->next = s->duphash[h];
+    s->duphash[h] = d;
+  }
+  names = (char **) realloc(d->names, (d->count + 1) * sizeof(char *));
+  if (names == NULL) return (-1);
+  d->names = names;
+  d->names[d->count++] = name;
+  return (0);
+}
+
+/** index_dupfiles(): find the files which buildctf -D stored as copies
+ * of an earlier file in the CTF files in the ctflist, so that each run
+ * found in the earlier file is also reported for its copies, which have
+ * no TDNs of their own. print_listruns(), add_runs_to_pairsums() and
+ * add_runs_to_results() do this after index_dupfiles() has been called,
+ * and run_dupcount() gives the number of extra runs. Copies whose names
+ * are dropped by p's path patterns are left out. Only CTF files with the
+ * CTF_DUPHEADER header are read. Returns the number of copies found, or
+ * -1 with errno set on error.
+ */
+int index_dupfiles(Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  Dupfile *dupfiles, *dup;
+  int id, count = 0, err = 0;
+
+  if (p == NULL) {
+    errno = EINVAL; return (-1);
+  }
+  free_dupnames(s);
+  for (id = 1; (id < s->ctflistnext) && !err; id++) {
+    if ((dupfiles = find_dupfiles_from_ctf(id)) == NULL) continue;
+
+    /* Make the hash table when we find the first copies */
+    if (s->duphash == NULL) {
+      s->duphashmask = 1023;
+      s->duphash = (Dupnames **) calloc(s->duphashmask + 1,
+					 sizeof(Dupnames *));
+      if (s->duphash == NULL) err = 1;
+    }
+    for (dup = dupfiles; (dup != NULL) && !err; dup = dup->next) {
+      if ((p->exclude != NULL) && name_excluded(dup->name, p->exclude))
+	continue;
+      if (add_dupname(s, get_ctftree(id), dup->origname, dup->name) == -1)
+	err = 1;
+      else
+	count++;
+    }
+    free_dupfiles(dupfiles);
+  }
+  if (err) {
+    free_dupnames(s); errno = ENOMEM; return (-1);
+  }
+  return (count);
+}
+
+/* Return the copies of the file holding the TDN's tuple that were found
+ * by index_dupfiles(), or NULL if there are none.
+ */
+Dupnames *tdn_dupnames(TDN * tdn)
+{
+  Ctfsession *s = cursess;
+  int tree;
+  char *name;
+  Dupnames *d;
+
+  if (s->duphash == NULL) return (NULL);
+  tree = get_ctftree(tdn->ctfid);
+  name = tdn_filename(tdn);
+  for (d = s->duphash[dupnames_slot(s, tree, name)]; d != NULL; d = d->next)
+    if ((d->tree == tree) && !strcmp(d->origname, name)) return (d);
+  return (NULL);
+}
+
+/** run_dupcount(): return the number of extra times that the run is
+ * reported because of the copies of its files found by index_dupfiles():
+ * once for each pairing of the two files or their copies, other than the
+ * two files themselves.
+ */
+int run_dupcount(Run * run)
+{
+  return ((dup_count(tdn_dupnames(run->src_startnode)) + 1) *
+	  (dup_count(tdn_dupnames(run->dst_startnode)) + 1) - 1);
+}
+
+/** free_dupfiles(): free the list of Dupfile nodes returned by
+ * find_dupfiles_from_ctf().
+ */
+void free_dupfiles(Dupfile * dup)
+{
+  Dupfile *next;
+
+  for (; dup != NULL; dup = next) {
+    next = dup->next; free(dup);
+  }
+}
+
+/** add_exclude_path(): add a POSIX extended regular expression to the
+ * patterns in p. When a run is completed, it is dropped if the name of
+ * the source file in either tree matches one of the patterns. Returns 0
+ * if OK, or -1 with errno set to EINVAL if the pattern isn't valid.
+ */
+int add_exclude_path(Ctfparam * p, char *pattern)
+{
+  struct _pathfilter *pf;
+  regex_t *res;
+
+  if ((p == NULL) || (pattern == NULL)) {
+    errno = EINVAL; return (-1);
+  }
+  if (p->exclude == NULL) {
+    p->exclude = (struct _pathfilter *) calloc(1, sizeof(struct _pathfilter));
+    if (p->exclude == NULL) return (-1);
+  }
+  pf = p->exclude;
+  res = (regex_t *) realloc(pf->res, (pf->count + 1) * sizeof(regex_t));
+  if (res == NULL) return (-1);
+  pf->res = res;
+  if (regcomp(&(res[pf->count]), pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+    errno = EINVAL; return (-1);
   }
-  return (done_runhead);
+  pf->count++;
+  return (0);
 }
@@ -0,0 +1,129 @@
+/*
+ * libsession: Definition of the session, which holds all the state of
+ * a comparison.
+ * Copyright (c) Warren Toomey, under the GPL3 license.
+ *
+ * $Revision: 1.1 $
+ */
+
+#ifndef LIBSESSION_H
+#define LIBSESSION_H
+
+#include "libtdn.h"
+
+/*
+ * The state used to build up runs while walking the TDNs of a CTF file.
+ * We have two Run linked lists: one is the list of incomplete runs.
+ * The other is the list of completed runs. We also keep a lookup table
+ * to quickly search for runs which can be extended when we find a tuple
+ * match on a TDN. Each session has one, and each thread walking a CTF
+ * shard has its own Runstate.
+ */
+typedef struct _runstate
+{
+  Run *inc_runlist;		/* Incomplete run list */
+  Run *done_runhead;		/* Complete run list */
+  Run **runLUT;			/* Lookup table of the incomplete runs, */
+  uint32_t lutmask;		/* its size - 1, */
+  uint32_t lutcount;		/* and the number of runs in it */
+  uint16_t isodtos[65536];	/* Destination to source isomorphism */
+  uint16_t isostod[65536];	/* Source to destination isomorphism */
+  uint16_t isoseen[65536];	/* =1 if we have seen this id value */
+  int max_isoseen;		/* Number of relationships seen */
+  uint64_t runcount;		/* Number of runs found, and the number */
+  uint64_t tdncmpcnt;		/* of TDN comparisons, while walking */
+  int timing;			/* If set, time the phases of the walk: */
+  uint64_t wall[CTS_NUMPHASES];	/* nanoseconds spent in each phase */
+  TDN **kept;			/* Matches kept while timing the walk, */
+  uint32_t numkept;		/* the number of them, */
+  uint32_t maxkept;		/* and the size of the array */
+  uint64_t peakruns;		/* Most runs in the runLUT at once */
+} Runstate;
+
+/*
+ * A list of mapped source files, most recently used first, which the
+ * runs are printed from, and a hash table to find them by name. See
+ * libprintruns.c.
+ */
+typedef struct _srccache
+{
+  struct _srcfile *srcfiles;	/* Mapped source files, most recent first */
+  int numsrcfiles;		/* Number of files on the list */
+  struct _srcfile *oldest;	/* Last file on the list */
+  struct _srcfile **hash;	/* Hash table of the files, or NULL */
+} Srccache;
+
+/*
+ * The copies that buildctf -D found of a file in a tree, which have no
+ * tokens of their own, so that the runs of the file can be reported for
+ * its copies too. See index_dupfiles() in libruns.c.
+ */
+typedef struct _dupnames
+{
+  int tree;			/* Tree of the files */
+  char *origname;		/* Name of the file which has the tokens */
+  char **names;			/* Names of its copies, */
+  int count;			/* and how many there are */
+  struct _dupnames *next;	/* Next on the same hash chain */
+} Dupnames;
+
+/*
+ * A session holds the CTF list, the in-memory TDNs and the run search
+ * state of one comparison. Each thread works on its current session,
+ * cursess, which is the default session until use_ctfsession() is
+ * called. So the library functions can be called on different sessions
+ * in different threads at the same time, but not on one session.
+ */
+struct _ctfsession
+{
+  /* The CTF list, see libctflist.c */
+  int ctflistnext;		/* Next free slot in the arrays */
+  int ctflistsize;		/* Number of slots in the arrays */
+  char **ctflist;		/* Names of the CTF files */
+  Ctfhandle **ctf_handle;	/* Array of CTF handles */
+  int *ctftree;			/* Id of the first CTF file in each tree */
+  int ctflistopened;		/* Handles below this id have been opened */
+  int ctflistnodb;		/* If set, ctflist.db is not read */
+  int *namehash;		/* Hash table of the CTF file ids */
+  uint32_t namehashmask;	/* by name, and its size - 1 */
+
+  /* The in-memory TDNs, see libtdn.c */
+  TDNgrp **tdngrplist;		/* Array of TDNgrp list heads */
+  int listbits;			/* log2 of the number of lists */
+  uint64_t numtdngrps;		/* Number of TDNgrp nodes */
+  int any_tdngrps;		/* Have we got any tdngrps yet? */
+  uint8_t *image;		/* The mapped index image, if any */
+  size_t imagesize;
+  uint32_t *idxstart;		/* Start of each group in the image */
+  Idxgrp *idxgrps;		/* The image's groups */
+
+  /* The run search, see libruns.c */
+  Runstate defstate;		/* Used when walking one CTF file at a time */
+  Dupnames **duphash;		/* Hash table of the copies of each file, */
+  uint32_t duphashmask;		/* and its size - 1 */
+
+  /* The runs being printed, see libprintruns.c */
+  Srccache srccache;		/* Source files mapped to print the runs */
+  struct _runwriter *writer;	/* Buffer of the runs in binary or JSON */
+};
+
+extern __thread Ctfsession *cursess;	/* The calling thread's session */
+
+uint64_t ctfstats_clock(void);		/* See libstats.c */
+Dupnames *tdn_dupnames(TDN * tdn);	/* See libruns.c */
+
+/* Return name i of the copies d of a file, where -1 is the name of the
+ * file itself, and the number of copies.
+ */
+static inline char *dup_name(Dupnames * d, int i, char *name)
+{
+  return ((i < 0) ? name : d->names[i]);
+}
+
+static inline int dup_count(Dupnames * d)
+{
+  return ((d == NULL) ? 0 : d->count);
+}
+void reserve_ctfstats(Ctfparam * p, int numctf);
+
+#endif /* LIBSESSION_H */
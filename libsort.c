@@ -0,0 +1,402 @@
+/*
+ * libsort: External sort of fixed-size records held in temporary files.
+ * Copyright (c) Warren Toomey, under the GPL3 license.
+ *
+ * $Revision: 1.1 $
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "libsort.h"
+
+#define MAXMERGE	64	/* Most sorted runs merged in one pass */
+#define MINRECS		1024	/* Fewest records sorted in memory at once */
+
+/* Function to get the sort key of a record */
+typedef uint64_t(*Sortkey) (const void *);
+
+/* Open a new temporary file for reading and writing, in $TMPDIR if this
+ * is set or /tmp otherwise. The file is unlinked straight away, so it
+ * goes when it is closed. Returns NULL on error.
+ */
+FILE *make_tmpfile(void)
+{
+  char *dir = getenv("TMPDIR");
+  char *name;
+  FILE *f;
+  int fd;
+
+  if ((dir == NULL) || (*dir == '\0')) dir = "/tmp";
+  name = (char *) malloc(strlen(dir) + 20);
+  if (name == NULL) return (NULL);
+  sprintf(name, "%s/ctfXXXXXX", dir);
+  fd = mkstemp(name);
+  if (fd == -1) {
+    free(name); return (NULL);
+  }
+  unlink(name);
+  free(name);
+  if ((f = fdopen(fd, "w+")) == NULL) close(fd);
+  return (f);
+}
+
+/* Stable sort the count records of size recsize in buf into key order,
+ * using tmp as space for count records. This is a radix sort on 16 bits
+ * of the key at a time, least significant first, which skips the bits
+ * that are the same in all the keys. Returns a pointer to whichever of
+ * buf or tmp holds the sorted records.
+ */
+static uint8_t *radix_sort(uint8_t * buf, uint8_t * tmp, size_t count,
+			   size_t recsize, Sortkey key)
+{
+  size_t *hist;			/* Histogram of each 16 bits of the keys */
+  size_t i, pos, n;
+  uint8_t *from = buf, *to = tmp, *swap, *rec;
+  uint64_t k;
+  int d;
+
+  if (count == 0) return (buf);
+  hist = (size_t *) calloc(4 * 65536, sizeof(size_t));
+  if (hist == NULL) return (NULL);
+  for (i = 0, rec = buf; i < count; i++, rec += recsize) {
+    k = key(rec);
+    for (d = 0; d < 4; d++)
+      hist[d * 65536 + ((k >> (16 * d)) & 0xffff)]++;
+  }
+
+  for (d = 0; d < 4; d++) {
+    size_t *h = hist + d * 65536;
+
+    /* Skip these bits if they are the same in all the keys */
+    if (h[(key(from) >> (16 * d)) & 0xffff] == count) continue;
+
+    /* Turn the histogram into the position of each bucket */
+    for (i = 0, pos = 0; i < 65536; i++) {
+      n = h[i]; h[i] = pos; pos += n;
+    }
+    for (i = 0, rec = from; i < count; i++, rec += recsize)
+      memcpy(to + h[(key(rec) >> (16 * d)) & 0xffff]++ * recsize, rec,
+	     recsize);
+    swap = from; from = to; to = swap;
+  }
+  free(hist);
+  return (from);
+}
+
+/*
+ * A Merge reads the records of up to MAXMERGE sorted runs in sorted
+ * order. Records with equal keys are taken from the earlier run first.
+ */
+typedef struct _merge
+{
+  FILE **run;			/* The runs being merged */
+  size_t recsize;		/* Size of each record */
+  Sortkey key;			/* Function to get a record's key */
+  uint8_t *rec;			/* The next record from each run */
+  uint64_t *k;			/* and its key */
+  int *heap;			/* Heap of the runs with records left */
+  int count;			/* Number of runs in the heap */
+} Merge;
+
+/* Should the next record from run x come before that from run y? */
+#define BEFORE(m, x, y) (((m)->k[x] < (m)->k[y]) || \
+			 (((m)->k[x] == (m)->k[y]) && ((x) < (y))))
+
+/* Start a Merge of the n runs in run[]. Returns 0 if OK, -1 on error */
+static int merge_start(Merge * m, FILE ** run, int n, size_t recsize,
+		       Sortkey key)
+{
+  int child, parent, j;
+
+  m->run = run;
+  m->recsize = recsize;
+  m->key = key;
+  m->rec = (uint8_t *) malloc(n * recsize);
+  m->k = (uint64_t *) malloc(n * sizeof(uint64_t));
+  m->heap = (int *) malloc(n * sizeof(int));
+  if ((m->rec == NULL) || (m->k == NULL) || (m->heap == NULL)) {
+    free(m->rec); free(m->k); free(m->heap);
+    m->rec = NULL; m->k = NULL; m->heap = NULL;
+    return (-1);
+  }
+
+  /* Read the first record from each run, and build the heap */
+  for (m->count = 0, j = 0; j < n; j++) {
+    rewind(run[j]);
+    if (fread(m->rec + j * recsize, recsize, 1, run[j]) != 1) {
+      if (ferror(run[j])) return (-1);
+      continue;
+    }
+    m->k[j] = key(m->rec + j * recsize);
+    for (child = m->count++; child > 0; child = parent) {
+      parent = (child - 1) / 2;
+      if (!BEFORE(m, j, m->heap[parent])) break;
+      m->heap[child] = m->heap[parent];
+    }
+    m->heap[child] = j;
+  }
+  return (0);
+}
+
+/* Copy the next record of a Merge to rec. Returns 1 if there was one,
+ * 0 if there are no more, or -1 on error.
+ */
+static int merge_next(Merge * m, void *rec)
+{
+  int i, j, child;
+
+  if (m->count == 0) return (0);
+
+  /* Take the first record, replace it with the next record from the
+   * same run, or the last run in the heap if that run is empty, and
+   * sift it down the heap.
+   */
+  j = m->heap[0];
+  memcpy(rec, m->rec + j * m->recsize, m->recsize);
+  if (fread(m->rec + j * m->recsize, m->recsize, 1, m->run[j]) == 1)
+    m->k[j] = m->key(m->rec + j * m->recsize);
+  else {
+    if (ferror(m->run[j])) return (-1);
+    if (--m->count == 0) return (1);
+    j = m->heap[m->count];
+  }
+  for (i = 0; (child = 2 * i + 1) < m->count; i = child) {
+    if ((child + 1 < m->count) && BEFORE(m, m->heap[child + 1], m->heap[child]))
+      child++;
+    if (!BEFORE(m, m->heap[child], j)) break;
+    m->heap[i] = m->heap[child];
+  }
+  m->heap[i] = j;
+  return (1);
+}
+
+/* Free the space used by a Merge */
+static void merge_end(Merge * m)
+{
+  free(m->rec);
+  free(m->k);
+  free(m->heap);
+  m->rec = NULL; m->k = NULL; m->heap = NULL;
+}
+
+/* Merge the n sorted runs in the files in run[] into out. Returns 0 if
+ * OK, -1 on error.
+ */
+static int merge_runs(FILE ** run, int n, FILE * out, size_t recsize,
+		      Sortkey key)
+{
+  Merge m;
+  uint8_t rec[recsize];
+  int err;
+
+  if (merge_start(&m, run, n, recsize, key) == -1) {
+    merge_end(&m); return (-1);
+  }
+  while ((err = merge_next(&m, rec)) == 1)
+    if (fwrite(rec, recsize, 1, out) != 1) break;
+  merge_end(&m);
+  if ((err != 0) || ferror(out)) return (-1);
+  return (0);
+}
+
+/*
+ * A Sorter sorts the records given to it by sorter_add(). The records are
+ * gathered in buf; each time it fills, they are sorted and written out as
+ * a run. To keep the number of open runs down, whenever the last MAXMERGE
+ * runs were made by the same number of merges, they are merged into one.
+ * Once all the records have been added, the runs are merged down to at
+ * most MAXMERGE, and these are merged as the records are read back. If
+ * the records all fit in buf, they are read back from memory.
+ */
+struct _sorter
+{
+  size_t recsize;		/* Size of each record */
+  Sortkey key;			/* Function to get a record's key */
+  uint8_t *buf;			/* Records not yet in a run */
+  uint8_t *tmp;			/* Space to sort them */
+  size_t count;			/* Number of records in buf */
+  size_t maxrecs;		/* and the most that it holds */
+  FILE **run;			/* The sorted runs, in order */
+  int *level;			/* # of merges that made each run */
+  int numruns;			/* Number of runs */
+  int maxruns;			/* Size of the run and level arrays */
+  uint8_t *sorted;		/* When reading back from memory, the */
+  size_t pos;			/* sorted records and the next one to read */
+  Merge merge;			/* When reading back from the runs */
+  int done;			/* Set once sorter_done() is called */
+  int err;			/* Set if anything has gone wrong */
+};
+
+/* Merge the nmerge runs of the Sorter from run i onwards into one new
+ * run, which replaces them. Returns 0 if OK, -1 on error.
+ */
+static int merge_sorter_runs(Sorter * s, int i, int nmerge)
+{
+  FILE *f;
+  int j;
+
+  if (((f = make_tmpfile()) == NULL) ||
+      (merge_runs(s->run + i, nmerge, f, s->recsize, s->key) == -1) ||
+      (fflush(f) == EOF)) {
+    if (f != NULL) fclose(f);
+    return (-1);
+  }
+  for (j = i; j < i + nmerge; j++) fclose(s->run[j]);
+  s->run[i] = f;
+  s->level[i]++;
+  for (j = i + nmerge; j < s->numruns; j++) {
+    s->run[j - nmerge + 1] = s->run[j];
+    s->level[j - nmerge + 1] = s->level[j];
+  }
+  s->numruns -= nmerge - 1;
+  return (0);
+}
+
+/* Sort the records in the Sorter's buf and write them out as a new run.
+ * Returns 0 if OK, -1 on error.
+ */
+static int spill_sorter(Sorter * s)
+{
+  uint8_t *sorted;
+  FILE **ptr;
+  int *lptr;
+
+  if (s->numruns == s->maxruns) {
+    s->maxruns = (s->maxruns == 0) ? 16 : 2 * s->maxruns;
+    ptr = (FILE **) realloc(s->run, s->maxruns * sizeof(FILE *));
+    if (ptr != NULL) s->run = ptr;
+    lptr = (int *) realloc(s->level, s->maxruns * sizeof(int));
+    if (lptr != NULL) s->level = lptr;
+    if ((ptr == NULL) || (lptr == NULL)) return (-1);
+  }
+
+  sorted = radix_sort(s->buf, s->tmp, s->count, s->recsize, s->key);
+  if (sorted == NULL) return (-1);
+  if ((s->run[s->numruns] = make_tmpfile()) == NULL) return (-1);
+  s->level[s->numruns++] = 0;
+  if ((fwrite(sorted, s->recsize, s->count, s->run[s->numruns - 1])
+       != s->count) || (fflush(s->run[s->numruns - 1]) == EOF))
+    return (-1);
+  s->count = 0;
+
+  while ((s->numruns >= MAXMERGE) &&
+	 (s->level[s->numruns - MAXMERGE] == s->level[s->numruns - 1]))
+    if (merge_sorter_runs(s, s->numruns - MAXMERGE, MAXMERGE) == -1)
+      return (-1);
+  return (0);
+}
+
+/* sorter_new(): return a new Sorter for records of size recsize, which
+ * sorts them into the order of the 64-bit keys that key() returns for
+ * them. The sort is stable: records with the same key stay in the order
+ * they were added. At most about memsize bytes are used to sort the
+ * records in memory; if there are more records than this, sorted runs
+ * of them are written to temporary files and then merged. Returns NULL
+ * on error.
+ */
+Sorter *sorter_new(size_t recsize, uint64_t(*key) (const void *),
+		   size_t memsize)
+{
+  Sorter *s;
+
+  s = (Sorter *) calloc(1, sizeof(Sorter));
+  if (s == NULL) return (NULL);
+  s->recsize = recsize;
+  s->key = key;
+
+  /* Get space to sort the records in memory, plus as much again */
+  s->maxrecs = memsize / (2 * recsize);
+  if (s->maxrecs < MINRECS) s->maxrecs = MINRECS;
+  s->buf = (uint8_t *) malloc(s->maxrecs * recsize);
+  s->tmp = (uint8_t *) malloc(s->maxrecs * recsize);
+  if ((s->buf == NULL) || (s->tmp == NULL)) {
+    free(s->buf); free(s->tmp); free(s);
+    return (NULL);
+  }
+  return (s);
+}
+
+/* sorter_add(): give the Sorter another record to sort. Returns 0 if OK,
+ * -1 on error. After an error, sorter_done() will return -1.
+ */
+int sorter_add(Sorter * s, const void *rec)
+{
+  if (s->err || s->done) return (-1);
+  memcpy(s->buf + s->count * s->recsize, rec, s->recsize);
+  if ((++s->count == s->maxrecs) && (spill_sorter(s) == -1)) s->err = 1;
+  return (s->err ? -1 : 0);
+}
+
+/* sorter_done(): tell the Sorter that all the records have been added,
+ * so that they can be read back with sorter_read(). Returns 0 if OK, -1
+ * on error.
+ */
+int sorter_done(Sorter * s)
+{
+  int i, nmerge;
+
+  if (s->err || s->done) return (-1);
+  s->done = 1;
+
+  /* If there are no runs, read the records back from memory */
+  if (s->numruns == 0) {
+    s->sorted = radix_sort(s->buf, s->tmp, s->count, s->recsize, s->key);
+    if (s->sorted == NULL) s->err = 1;
+    return (s->err ? -1 : 0);
+  }
+
+  /* Otherwise write out the last records, and merge the runs MAXMERGE
+   * at a time until there are few enough to merge as they are read.
+   * Runs are merged in order, which keeps the sort stable.
+   */
+  if ((s->count > 0) && (spill_sorter(s) == -1)) s->err = 1;
+  free(s->buf); free(s->tmp);
+  s->buf = s->tmp = NULL;
+  while ((s->err == 0) && (s->numruns > MAXMERGE)) {
+    for (i = 0; (s->err == 0) && (i < s->numruns); i++) {
+      nmerge = (s->numruns - i < MAXMERGE) ? s->numruns - i : MAXMERGE;
+      if ((nmerge > 1) && (merge_sorter_runs(s, i, nmerge) == -1))
+	s->err = 1;
+    }
+  }
+  if ((s->err == 0) &&
+      (merge_start(&s->merge, s->run, s->numruns, s->recsize, s->key) == -1))
+    s->err = 1;
+  return (s->err ? -1 : 0);
+}
+
+/* sorter_read(): copy the next record in sorted order to rec. Returns 1
+ * if there was one, 0 if there are no more, or -1 on error.
+ */
+int sorter_read(Sorter * s, void *rec)
+{
+  int n;
+
+  if (s->err || !s->done) return (-1);
+  if (s->sorted != NULL) {
+    if (s->pos == s->count) return (0);
+    memcpy(rec, s->sorted + s->pos++ * s->recsize, s->recsize);
+    return (1);
+  }
+  if ((n = merge_next(&s->merge, rec)) == -1) s->err = 1;
+  return (n);
+}
+
+/* sorter_free(): free the Sorter and close its temporary files */
+void sorter_free(Sorter * s)
+{
+  int i;
+
+  if (s == NULL) return;
+  merge_end(&s->merge);
+  for (i = 0; i < s->numruns; i++) fclose(s->run[i]);
+  free(s->run);
+  free(s->level);
+  free(s->buf);
+  free(s->tmp);
+  free(s);
+}
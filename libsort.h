@@ -0,0 +1,22 @@
+/*
+ * libsort: Definition of the Sorter, and function prototypes for the
+ * external sort of fixed-size records held in temporary files.
+ * Copyright (c) Warren Toomey, under the GPL3 license.
+ * 
+ * $Revision: 1.1 $
+ */
+
+#ifndef LIBSORT_H
+#define LIBSORT_H
+
+typedef struct _sorter Sorter;
+
+FILE *make_tmpfile(void);
+Sorter *sorter_new(size_t recsize, uint64_t(*key) (const void *),
+		   size_t memsize);
+int sorter_add(Sorter * s, const void *rec);
+int sorter_done(Sorter * s);
+int sorter_read(Sorter * s, void *rec);
+void sorter_free(Sorter * s);
+
+#endif /* LIBSORT_H */
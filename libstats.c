@@ -0,0 +1,178 @@
+/*
+ * libstats: Functions to time the phases of a comparison, and to print
+ * the times along with the shape of the in-memory TDNs.
+ * Copyright (c) Warren Toomey, under the GPL3 license.
+ *
+ * $Revision: 1.1 $
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "libctf.h"
+#include "libtdn.h"
+#include "libsession.h"
+
+/* The names of the phases, indented under the search if part of it */
+static char *phasename[CTS_NUMPHASES] = {
+  "open", "search", "  extract", "  probe", "  runs", "  isomorph", "print"
+};
+
+/* Return the time on the given clock in nanoseconds */
+static uint64_t clock_ns(clockid_t id)
+{
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Return the wall clock time in nanoseconds. This is what the walk of
+ * each CTF file uses to time its phases, as it is cheap to read and the
+ * CPU time of a thread is not.
+ */
+uint64_t ctfstats_clock(void)
+{
+  return (clock_ns(CLOCK_MONOTONIC));
+}
+
+/* Make sure that p->stats, if any, can hold the walk times of numctf
+ * CTF files. This must not be called while any thread is walking.
+ */
+void reserve_ctfstats(Ctfparam * p, int numctf)
+{
+  Ctfstats *st;
+
+  if ((p == NULL) || ((st = p->stats) == NULL) || (numctf <= st->numctfwall))
+    return;
+  st->ctfwall = (uint64_t *) realloc(st->ctfwall, numctf * sizeof(uint64_t));
+  if (st->ctfwall == NULL) {
+    fprintf(stderr, "Unable to malloc CTF file times: %s\n", strerror(errno));
+    exit(1);
+  }
+  memset(st->ctfwall + st->numctfwall, 0,
+	 (numctf - st->numctfwall) * sizeof(uint64_t));
+  st->numctfwall = numctf;
+}
+
+/* Free the Ctfstats */
+void free_ctfstats(Ctfstats * stats)
+{
+  if (stats == NULL) return;
+  free(stats->ctfwall);
+  free(stats);
+}
+
+/** Functions to time the phases of a comparison.
+ *
+ * enable_ctfstats(): start keeping statistics about the comparisons done
+ * with p in p->stats: the time spent in each phase, the most incomplete
+ * runs held at once and the time spent walking each CTF file. The walks
+ * are timed with the wall clock, and are a little slower while they are
+ * timed. Returns 0 if OK, or -1 with errno set on error.
+ */
+int enable_ctfstats(Ctfparam * p)
+{
+  if (p == NULL) {
+    errno = EINVAL; return (-1);
+  }
+  if (p->stats != NULL) return (0);
+  p->stats = (Ctfstats *) calloc(1, sizeof(Ctfstats));
+  return ((p->stats == NULL) ? -1 : 0);
+}
+
+/** begin_ctfphase(): if p->stats is not NULL, note the wall clock and
+ * CPU time as the start of the given CTS_ phase. The CPU time is that
+ * of the whole process, so it includes all of its threads.
+ */
+void begin_ctfphase(Ctfparam * p, int phase)
+{
+  if ((p == NULL) || (p->stats == NULL) || (phase < 0) ||
+      (phase >= CTS_NUMPHASES)) return;
+  p->stats->wallstart[phase] = clock_ns(CLOCK_MONOTONIC);
+  p->stats->cpustart[phase] = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/** end_ctfphase(): if p->stats is not NULL, add the wall clock and CPU
+ * time since the call to begin_ctfphase() to the given CTS_ phase.
+ */
+void end_ctfphase(Ctfparam * p, int phase)
+{
+  if ((p == NULL) || (p->stats == NULL) || (phase < 0) ||
+      (phase >= CTS_NUMPHASES)) return;
+  p->stats->wall[phase] += clock_ns(CLOCK_MONOTONIC) -
+    p->stats->wallstart[phase];
+  p->stats->cpu[phase] += clock_ns(CLOCK_PROCESS_CPUTIME_ID) -
+    p->stats->cpustart[phase];
+}
+
+/** print_ctfstats(): if p->stats is not NULL, print the statistics kept
+ * in it to out, along with the counters in p, a histogram of the lengths
+ * of the lists which hold the in-memory TDNs and the rate at which each
+ * CTF file was walked.
+ */
+void print_ctfstats(Ctfparam * p, FILE * out)
+{
+  Ctfstats *st;
+  Ctfhandle *ctf;
+  uint64_t hist[CTS_CHAINBUCKETS], longest, bytes, lo, hi;
+  uint32_t numlists;
+  char label[48];
+  double secs;
+  int i;
+
+  if ((p == NULL) || ((st = p->stats) == NULL) || (out == NULL)) return;
+
+  fprintf(out, "%-12s %12s %12s\n", "Phase", "Wall (s)", "CPU (s)");
+  for (i = 0; i < CTS_NUMPHASES; i++) {
+    fprintf(out, "%-12s %12.3f ", phasename[i], st->wall[i] / 1e9);
+    if (st->cpu[i] != 0)
+      fprintf(out, "%12.3f\n", st->cpu[i] / 1e9);
+    else
+      fprintf(out, "%12s\n", "-");
+  }
+
+  fprintf(out, "Runs completed:             %llu\n",
+	  (unsigned long long) p->runcount);
+  fprintf(out, "Peak incomplete runs:       %llu\n",
+	  (unsigned long long) st->peakruns);
+  fprintf(out, "TDNs used:                  %llu\n",
+	  (unsigned long long) p->tdncount);
+  fprintf(out, "TDN comparisons:            %llu\n",
+	  (unsigned long long) p->tdncmpcnt);
+
+  /* The lengths of the lists, in buckets of 0, 1, 2, 3-4, 5-8 ... */
+  numlists = tdngrp_chainlengths(hist, CTS_CHAINBUCKETS, &longest);
+  fprintf(out, "TDN lists:                  %lu, longest %llu\n",
+	  (unsigned long) numlists, (unsigned long long) longest);
+  for (i = 0; i < CTS_CHAINBUCKETS; i++) {
+    if (hist[i] == 0) continue;
+    lo = (i < 2) ? i : ((uint64_t) 1 << (i - 2)) + 1;
+    hi = (i < 2) ? i : (uint64_t) 1 << (i - 1);
+    if (i == CTS_CHAINBUCKETS - 1)
+      snprintf(label, sizeof(label), "%llu+", (unsigned long long) lo);
+    else if (lo == hi)
+      snprintf(label, sizeof(label), "%llu", (unsigned long long) lo);
+    else
+      snprintf(label, sizeof(label), "%llu-%llu", (unsigned long long) lo,
+	       (unsigned long long) hi);
+    fprintf(out, "  length %-12s %12llu\n", label,
+	    (unsigned long long) hist[i]);
+  }
+
+  /* The rate at which each CTF file was walked */
+  for (i = 1; i < st->numctfwall; i++) {
+    if ((st->ctfwall[i] == 0) || ((ctf = get_ctfhandle(i)) == NULL))
+      continue;
+    bytes = ctf->end - ctf->start;
+    secs = st->ctfwall[i] / 1e9;
+    fprintf(out, "%s: %llu bytes, %lu TDNs in %.3fs, %.1f Mbytes/s, "
+	    "%.0f TDNs/s\n", get_ctfname(i), (unsigned long long) bytes,
+	    (unsigned long) ctf->numtdns, secs, bytes / secs / 1e6,
+	    ctf->numtdns / secs);
+  }
+}
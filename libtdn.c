@@ -11,51 +11,315 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "libctf.h"
 #include "libtokens.h"
 #include "libtdn.h"
+#include "libsession.h"
 #include "crc32.h"
 
-#define BITSINTABLE     24	/* 24-bit table */
+#define BITSINTABLE     24	/* Groups are the top 24 bits of the CRC */
 #define TABLE_SIZE (1 << BITSINTABLE)
+#define MINLISTBITS	10	/* Fewest bits in the index of a list */
 
-TDNgrp *tdngrplist[TABLE_SIZE];	/* Array of TDNgrp list heads */
+/*
+ * The TDNgrp nodes of each group are on one linked list, but a list can
+ * hold several groups: the list for a TDN is given by the top listbits
+ * bits of its CRC. The tdngrplist is sized for the CTF files in the
+ * ctflist by init_libtdn(), and reserve_tdngrps() makes it bigger before
+ * more CTF files are walked if there would be more TDNgrp nodes than
+ * lists, up to one list per group.
+ *
+ * The nodes of a group are in the same order on a list shared with other
+ * groups as they would be on a list of their own: a node is inserted
+ * either after another node of its group, or after the node before the
+ * first one from the tree being walked. As the nodes from each tree are
+ * inserted before the nodes of later trees, the nodes after that point
+ * are all from the tree being walked. The lists are kept in the session.
+ */
+
+/* The number of lists in the tdngrplist */
+#define NUMLISTS	((cursess->tdngrplist == NULL) ? 0 : \
+			 (1 << cursess->listbits))
+
+/* Return the index of the list in the tdngrplist holding the group */
+#define LISTOF(group)	((group) >> (BITSINTABLE - cursess->listbits))
+
+/*
+ * The in-memory TDNs can be saved as an index image with save_index(),
+ * which other processes can mmap() read-only with load_index() instead
+ * of building the TDNs again. The image holds no pointers, so it can be
+ * mapped anywhere, and the page cache holds one copy of it however many
+ * processes have it mapped. It holds, in the native byte order:
+ *  - an Indexhdr,
+ *  - an Indexctf for each CTF file in the image, which are the first
+ *    numctf files in the ctflist, and their names,
+ *  - for each CTF file, an unused TDN, its array of TDNs and its table
+ *    of file records,
+ *  - TABLE_SIZE+1 32-bit indexes into the Idxgrps, where the group of
+ *    TDNs for each top 24 bits of CRC starts,
+ *  - the Idxgrps of each group, in the order of the TDNgrp lists.
+ */
+#define INDEX_MAGIC	"ctfidx1"	/* Includes the NUL to make 8 bytes */
+#define INDEX_FLAGS	(CTP_ISOMORPHIC | CTP_COMPHEUR)	/* Flags which */
+					/* change the CRCs of the TDNs */
+
+typedef struct _indexhdr
+{
+  char magic[8];		/* INDEX_MAGIC */
+  uint32_t tuple_size;		/* The tuple_size and INDEX_FLAGS of the */
+  uint32_t flags;		/* Ctfparam when the image was saved */
+  uint32_t numctf;		/* Number of CTF files in the image */
+  uint32_t tdnsize;		/* sizeof(TDN), to check the image */
+  uint64_t numgrps;		/* Number of Idxgrps */
+  uint64_t ctfoff;		/* Offset of the Indexctfs */
+  uint64_t startoff;		/* Offset of the group start indexes */
+  uint64_t grpoff;		/* Offset of the Idxgrps */
+} Indexhdr;
+
+typedef struct _indexctf
+{
+  uint64_t ctfsize;		/* Size of the CTF file, to check it */
+  uint64_t nameoff;		/* Offset of the CTF file's name */
+  uint64_t tdnoff;		/* Offset of the unused TDN before the array */
+  uint64_t filesoff;		/* Offset of the table of file records */
+  uint32_t numtdns;		/* Number of TDNs in the array */
+  uint32_t numfiles;		/* Number of entries in the table */
+} Indexctf;
+
+/* Return the number of bits in the index of a list, so that there
+ * are at least as many lists as ntdns, up to one list per group.
+ */
+static int listbits_for(uint64_t ntdns)
+{
+  int bits = MINLISTBITS;
+
+  while ((bits < BITSINTABLE) && (((uint64_t) 1 << bits) < ntdns)) bits++;
+  return (bits);
+}
+
+/* Return the number of TDNgrp list heads that ntdns in-memory TDNs
+ * will need.
+ */
+uint32_t tdngrp_listsize(uint64_t ntdns)
+{
+  return ((uint32_t) 1 << listbits_for(ntdns));
+}
+
+/* Return the bucket of the chain length histogram for a list of len
+ * nodes: 0 for none, 1 for one, then a bucket for each power of two,
+ * i.e. 2, 3-4, 5-8 and so on, up to nbuckets-1 for all the longer ones.
+ */
+static int chain_bucket(uint64_t len, int nbuckets)
+{
+  int b = 0;
+
+  while ((len > 0) && (b < nbuckets - 1)) {
+    b++; len = (len == 1) ? 0 : (len + 1) / 2;
+  }
+  return (b);
+}
+
+/* Count the lists in the tdngrplist in hist by their length, which
+ * includes the TDNs in the index image whose groups are on each list.
+ * hist has nbuckets entries, see chain_bucket(). Set longest to the
+ * length of the longest list, and return the number of lists.
+ */
+uint32_t tdngrp_chainlengths(uint64_t * hist, int nbuckets, uint64_t * longest)
+{
+  Ctfsession *s = cursess;
+  TDNgrp *node;
+  uint64_t len;
+  uint32_t i, per = 1 << (BITSINTABLE - s->listbits);
+
+  memset(hist, 0, nbuckets * sizeof(uint64_t));
+  *longest = 0;
+  for (i = 0; i < NUMLISTS; i++) {
+    len = 0;
+    if (s->image != NULL)
+      len = s->idxstart[(i + 1) * per] - s->idxstart[i * per];
+    for (node = s->tdngrplist[i]; node != NULL; node = node->next) len++;
+    hist[chain_bucket(len, nbuckets)]++;
+    if (len > *longest) *longest = len;
+  }
+  return (NUMLISTS);
+}
+
+/* Make the tdngrplist have 2^bits lists, moving the nodes on the old
+ * lists to the new ones. Each old list is split between the new lists
+ * in the same order. Returns 0 if OK, -1 on error.
+ */
+static int grow_tdngrplist(int bits)
+{
+  Ctfsession *s = cursess;
+  TDNgrp **newlist, *node, *prev, *next;
+  uint32_t i, j;
+
+  newlist = (TDNgrp **) calloc((size_t) 1 << bits, sizeof(TDNgrp *));
+  if (newlist == NULL) return (-1);
+
+  for (i = 0; i < NUMLISTS; i++) {
+    /* Reverse the old list, then push each node on the front of its
+     * new list, which puts them back in the same order.
+     */
+    for (prev = NULL, node = s->tdngrplist[i]; node != NULL; node = next) {
+      next = node->next; node->next = prev; prev = node;
+    }
+    for (node = prev; node != NULL; node = next) {
+      next = node->next;
+      j = node->crc >> (32 - bits);
+      node->next = newlist[j];
+      newlist[j] = node;
+    }
+  }
+  free(s->tdngrplist);
+  s->tdngrplist = newlist;
+  s->listbits = bits;
+  return (0);
+}
+
+/* Make sure that the tdngrplist has at least as many lists as there
+ * are TDNgrp nodes after ntdns more are added, up to one list per
+ * group. This must not be called while any other thread is using the
+ * tdngrplist, or while anything holds a TDNgrp pointer it got from the
+ * tdngrplist to insert a TDN after: the node may move to another list.
+ */
+void reserve_tdngrps(uint64_t ntdns)
+{
+  int bits = listbits_for(cursess->numtdngrps + ntdns);
+
+  if (bits > cursess->listbits) grow_tdngrplist(bits);
+}
 
-/* Initialise the TDN global variables */
+/* Initialise the TDN global variables. The tdngrplist is made big
+ * enough for the CTF files in the ctflist, guessing that there is a
+ * TDN for every two octets. With p->numparts > 1 each process holds
+ * only part of the TDNs, and with p->memlimit or CTP_SORTMERGE they
+ * are held a part at a time, so the tdngrplist is made as they go.
+ */
 void init_libtdn(Ctfparam * p)
 {
-  /* Nothing to do */
+  Ctfsession *s = cursess;
+  uint64_t size = 0;
+  int i;
+
+  if ((p == NULL) || p->memlimit || (p->flags & CTP_SORTMERGE)) return;
+  for (i = 1; i < s->ctflistnext; i++)
+    if (s->ctf_handle[i] != NULL)
+      size += s->ctf_handle[i]->end - s->ctf_handle[i]->start;
+  if (p->numparts > 1) size /= p->numparts;
+  reserve_tdngrps(size / 2);
 }
 
 /* Reinitialise the global variables */
 void reinit_libtdn(void)
 {
-  TDNgrp *node, *next;
+  Ctfsession *s = cursess;
+  free_tdngrps(0, TABLE_SIZE);
+  free(s->tdngrplist);
+  s->tdngrplist = NULL;
+  s->listbits = 0;
+  if (s->image != NULL) munmap(s->image, s->imagesize);
+  s->image = NULL;
+}
+
+/* Free the TDNgrp nodes of the groups from first up to last-1, i.e.
+ * those whose top 24 bits of CRC are in that range, and remove them
+ * from the tdngrplist.
+ */
+void free_tdngrps(int first, int last)
+{
+  Ctfsession *s = cursess;
+  TDNgrp *node, *next, **prevnext;
+  uint32_t group;
   int i;
 
-  /* Walk the tdngrplist, find any lists and free all the TDNgrp
-   * nodes on the list.
-   */
-  for (i=0; i < TABLE_SIZE; i++) {
-    if (tdngrplist[i]==NULL) continue;
+  if ((s->tdngrplist == NULL) || (first >= last)) return;
 
-    for (node=tdngrplist[i]; node != NULL; node= next) {
-      next= node->next;
-      free(node->node);
-      free(node);
+  /* Walk the lists which hold the groups, and free all the TDNgrp
+   * nodes in the groups. The TDNs themselves are freed when their
+   * CTF file is closed.
+   */
+  for (i = LISTOF(first); i <= LISTOF(last - 1); i++) {
+    for (prevnext = &s->tdngrplist[i]; (node = *prevnext) != NULL;
+	 node = next) {
+      next = node->next;
+      group = node->crc >> (32 - BITSINTABLE);
+      if ((group >= first) && (group < last)) {
+	*prevnext = next;
+	free(node);
+	s->numtdngrps--;
+      } else
+	prevnext = &(node->next);
     }
-
-    /* And clear the head of the list */
-    tdngrplist[i]= NULL;
   }
 }
 
 
-/* Return a pointer to a malloc'd TDN which contains the next tuple
- * description from the given Ctfhandle. The caller assumes responsibilty
- * for the allocated memory. NULL is return if the Ctfhandle is invalid,
- * or if there are no more tuples in the CTF file. id is the id of the
- * CTF file in the database.
+/*
+ * The TDNs made from a CTF file are stored in order in one array, which
+ * is freed when the CTF file is closed. As the TDNs are never moved, the
+ * array is mmap()d at the largest size it could need: one TDN per token
+ * of the CTF file, which we count first. The unused end of the array is
+ * unmapped when we reach the end of the CTF file. There is an unused TDN
+ * before the first one, so that the TDN before any TDN is always valid
+ * memory.
+ */
+static int alloc_tdnarray(Ctfhandle * ctf)
+{
+  size_t size = (count_tokens(ctf) + 1) * sizeof(TDN);
+  TDN *base;
+
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) return (-1);
+  ctf->tdns = base + 1;
+  ctf->numtdns = 0;
+  ctf->tdnmapsize = size;
+  return (0);
+}
+
+/* Unmap the unused pages at the end of the TDN array */
+static void trim_tdnarray(Ctfhandle * ctf)
+{
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  size_t used = (ctf->numtdns + 1) * sizeof(TDN);
+
+  used = (used + pagesize - 1) & ~(pagesize - 1);
+  if (used >= ctf->tdnmapsize) return;
+  munmap((uint8_t *) (ctf->tdns - 1) + used, ctf->tdnmapsize - used);
+  ctf->tdnmapsize = used;
+}
+
+/* Add an entry to the CTF file's table of file records, for the record
+ * at name_offset. TDN offsets in the entry are relative to base. Returns
+ * 0 if OK, -1 on error.
+ */
+static int add_filerecord(Ctfhandle * ctf, uint64_t name_offset, uint64_t base)
+{
+  Ctffile *ptr;
+
+  if (ctf->numfiles == ctf->maxfiles) {
+    ctf->maxfiles = (ctf->maxfiles == 0) ? 256 : 2 * ctf->maxfiles;
+    ptr = realloc(ctf->files, ctf->maxfiles * sizeof(Ctffile));
+    if (ptr == NULL) return (-1);
+    ctf->files = ptr;
+  }
+  ctf->files[ctf->numfiles].name_offset = name_offset;
+  ctf->files[ctf->numfiles].base = base;
+  ctf->numfiles++;
+  return (0);
+}
+
+/* Return a pointer to a TDN which contains the next tuple description
+ * from the given Ctfhandle. The TDN is the next one in the CTF file's
+ * array of TDNs, so the TDN before it in the CTF file is tdn-1. NULL
+ * is return if the Ctfhandle is invalid, or if there are no more tuples
+ * in the CTF file. id is the id of the CTF file in the database.
  */
 TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p)
 {
@@ -84,8 +348,9 @@ TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p)
   uint8_t token;		/* Token at that position */
   uint8_t ptok, pptok;		/* Previous and previous-previous token */
   uint16_t idvalue;
-  uint32_t linenum, ourlinenum = 0;
-  uint32_t offset = 0;		/* Offset of this tuple */
+  uint64_t offset = 0;		/* Offset of this tuple */
+  uint64_t name_offset;		/* Offset of a file record */
+  Ctffile *file;
   TDN *tdn;
   int i;			/* Index into the tuple array */
 
@@ -95,10 +360,12 @@ TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p)
   /* Error if EOF */
   if (ctf->cursor >= ctf->end) return (NULL);
 
+  /* Make the TDN array if this is the first TDN */
+  if ((ctf->tdns == NULL) && (alloc_tdnarray(ctf) == -1)) return (NULL);
+
   /* Initialise vars for this tuple */
   valhash = (uint16_t *) & tuple[Tuple_size];
   posn = ctf->cursor;
-  linenum = ctf->linenum;
   i = 0;
   ptok= pptok = 0;
 
@@ -114,16 +381,31 @@ TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p)
        * and start with this as the file for this tuple.
        */
       i = 0;
-      ctf->name_offset = (uint32_t) (posn - ctf->start);
-      linenum = ctf->linenum = 1;
+      name_offset = posn - ctf->start;
+      if (((ctf->numfiles == 0) ||
+	   (ctf->files[ctf->numfiles - 1].name_offset < name_offset)) &&
+	  (add_filerecord(ctf, name_offset, name_offset) == -1))
+	return (NULL);
       posn += 5;		/* Skip the token & the timestamp */
 
       /* Move the position up past the name */
       while (((token = *(posn++)) != '\0') && (posn < ctf->end));
       break;
 
+    case DUPFILE:
+      /* A file with no tokens of its own, so discard any tokens we
+       * have so far and skip the token, the timestamp, the two names
+       * and the three 4-byte values.
+       */
+      i = 0;
+      posn += 5;
+      while (((token = *(posn++)) != '\0') && (posn < ctf->end));
+      while (((token = *(posn++)) != '\0') && (posn < ctf->end));
+      posn += 3 * sizeof(uint32_t);
+      break;
+
     case LINE:
-      linenum++; posn++;
+      posn++;
       break;
 
     case STRINGLIT:
@@ -131,16 +413,13 @@ TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p)
     case LABEL:
     case IDENTIFIER:
     case INTVAL:
-      /* Save our offset and line number */
-      if (i == 0) {
-	offset = (uint32_t) (posn - ctf->start);
-	ourlinenum = linenum;
-      }
-      /* Save the cursor and line number for next time */
-      if (i == 1) {
+      /* Save our offset */
+      if (i == 0)
+	offset = posn - ctf->start;
+
+      /* Save the cursor for next time */
+      if (i == 1)
 	ctf->cursor = posn;
-	ctf->linenum = linenum;
-      }
       /* Read in 2 bytes to get the id value */
       posn++;
       idvalue = *(posn++) << 8;
@@ -159,17 +438,13 @@ TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p)
       break;
 
     default:
-      /* Save our offset and line number */
-      if (i == 0) {
-	offset = (uint32_t) (posn - ctf->start);
-	ourlinenum = linenum;
-      }
+      /* Save our offset */
+      if (i == 0)
+	offset = posn - ctf->start;
 
-      /* Save the cursor and line number for next time */
-      if (i == 1) {
+      /* Save the cursor for next time */
+      if (i == 1)
 	ctf->cursor = posn;
-	ctf->linenum = linenum;
-      }
       valhash[i] = 0;
       tuple[i] = token;
       posn++; i++;
@@ -178,11 +453,26 @@ TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p)
   }
 
   /* We now have Tuple_size tokens, or ran out of input */
-  if (i < Tuple_size) return (NULL);
+  if (i < Tuple_size) {
+    ctf->cursor = ctf->end;
+    trim_tdnarray(ctf);
+    return (NULL);
+  }
 
-  /* Build and populate the TDN */
-  tdn = (TDN *) malloc(sizeof(TDN));
-  if (tdn == NULL) return (NULL);
+  /* Tuples before the first file record, if any, get an entry of their own */
+  if ((ctf->numfiles == 0) && (add_filerecord(ctf, 0, 0) == -1)) return (NULL);
+
+  /* If the tuple is too far from the base of the file record's entry,
+   * add another entry for the same file record with the tuple as base.
+   */
+  file = &(ctf->files[ctf->numfiles - 1]);
+  if ((offset - file->base > UINT32_MAX) &&
+      (add_filerecord(ctf, file->name_offset, offset) == -1))
+    return (NULL);
+  file = &(ctf->files[ctf->numfiles - 1]);
+
+  /* Build and populate the next TDN in the array */
+  tdn = &(ctf->tdns[ctf->numtdns++]);
 
   /* Make the checksums */
   if (do_isomorph_comparison)
@@ -191,39 +481,77 @@ TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p)
     tdn->tuple_crc = crc32(tuple, Tuple_size + Tuple_size * sizeof(uint16_t));
 
   /* Fill in the rest of the TDN */
-  tdn->offset = offset;
-  tdn->name_offset = ctf->name_offset;
-  tdn->file_line_id = (fileid << 20) | (ourlinenum & 0xfffff);
-  tdn->previnctf=NULL;
+  tdn->offset = (uint32_t) (offset - file->base);
+  tdn->fileidx = ctf->numfiles - 1;
+  tdn->ctfid = fileid;
 
   return (tdn);
 }
 
 
 /*
- * Given a TDN return a pointer to the
- * TDNgrp which match the top 24 bits of the CRC. Returns NULL on errors.
+ * Given a TDN return a pointer to the first node of the
+ * TDNgrp which match the top 24 bits of the CRC. Returns NULL on errors,
+ * or if there are no nodes in the TDNgrp.
  */
 TDNgrp *get_tdngrp_for(TDN * tdn, Ctfparam * p)
 {
+  TDNgrp *grp;
+
   if (tdn == NULL) return (NULL);
 
-  /* Use the top 24 bits of the CRC to get the index into the tdngrplist */
+  for (grp = get_tdngrp_list(tdn); grp != NULL; grp = grp->next)
+    if (((grp->crc ^ tdn->tuple_crc) >> (32 - BITSINTABLE)) == 0) break;
+  return (grp);
+}
+
+/*
+ * Given a TDN return a pointer to the first node of the list which
+ * holds its TDNgrp, and maybe other TDNgrps. Returns NULL if the list
+ * is empty.
+ */
+TDNgrp *get_tdngrp_list(TDN * tdn)
+{
+  Ctfsession *s = cursess;
+  if (s->tdngrplist == NULL) return (NULL);
+  return (s->tdngrplist[tdn->tuple_crc >> (32 - s->listbits)]);
+}
+
+/*
+ * Given a TDN return a pointer to the Idxgrps in the index image which
+ * match the top 24 bits of the CRC, and set count to the number of them.
+ * These TDNs come before those in the TDNgrp.
+ */
+Idxgrp *get_idxgrps_for(TDN * tdn, uint32_t * count)
+{
+  Ctfsession *s = cursess;
   int index = tdn->tuple_crc >> (32-BITSINTABLE);
-  return (tdngrplist[index]);
+
+  if (s->image == NULL) {
+    *count = 0; return (NULL);
+  }
+  *count = s->idxstart[index + 1] - s->idxstart[index];
+  return (&s->idxgrps[s->idxstart[index]]);
 }
 
 /*
- * Using this_tdn, insert it into the TDNgrp which matches the top 24 bits
- * of the CRC. The grp pointer points a node in the existing TDNgrp, but
- * not the head node. Returns 0 if ok, -1 on error.
+ * Using this_tdn, insert it into the list which holds the TDNgrp which
+ * matches the top 24 bits of the CRC. The grp pointer points the node
+ * on the list to insert it after, or is NULL to insert it at the front.
+ * Returns 0 if ok, -1 on error.
  */
 int append_tdn(TDN * tdn, TDNgrp * grp, Ctfparam * p)
 {
+  Ctfsession *s = cursess;
   TDNgrp *newnode;
+  int index;
 
-  /* Use the top 24 bits of the CRC to get the index into the tdngrplist */
-  int index = tdn->tuple_crc >> (32-BITSINTABLE);
+  /* Make the tdngrplist if we don't have one yet */
+  if ((s->tdngrplist == NULL) && (grow_tdngrplist(MINLISTBITS) == -1))
+    return (-1);
+
+  /* Use the top bits of the CRC to get the index into the tdngrplist */
+  index = tdn->tuple_crc >> (32 - s->listbits);
 
   /* Allocate & fill in the newnode to point to tdn */
   newnode = (TDNgrp *) malloc(sizeof(TDNgrp));
@@ -231,8 +559,8 @@ int append_tdn(TDN * tdn, TDNgrp * grp, Ctfparam * p)
     /* printf("Unable to malloc a TDNgrp: %s\n", strerror(errno)); */
     return (-1);
   }
-  newnode->crcbot = tdn->tuple_crc & 0xff;
-  newnode->ctfid = tdn->file_line_id >> 20;
+  newnode->crc = tdn->tuple_crc;
+  newnode->treeid = get_ctftree(tdn->ctfid);
   newnode->node = tdn;
 
   /* Store tdn into the group's linked list, near the end */
@@ -241,9 +569,309 @@ int append_tdn(TDN * tdn, TDNgrp * grp, Ctfparam * p)
     grp->next = newnode;
   } else {
     /* or if we are the first node, at the front  */
-    newnode->next = tdngrplist[index];
-    tdngrplist[index] = newnode;
+    newnode->next = s->tdngrplist[index];
+    s->tdngrplist[index] = newnode;
   }
+  s->numtdngrps++;
   p->tdncount++;
   return (0);
 }
+
+/* Write size bytes from buf to out, then pad with zeroes up to a
+ * multiple of 16 bytes. offset is the offset in out, which is updated.
+ * Returns 0 if OK, -1 on error.
+ */
+static int write_padded(FILE * out, void *buf, size_t size, uint64_t * offset)
+{
+  static const uint8_t zeroes[16];
+  size_t pad;
+
+  if ((size > 0) && (fwrite(buf, size, 1, out) != 1)) return (-1);
+  *offset += size;
+  pad = (16 - (*offset & 15)) & 15;
+  if ((pad > 0) && (fwrite(zeroes, pad, 1, out) != 1)) return (-1);
+  *offset += pad;
+  return (0);
+}
+
+/** Functions to save and load an index image of the in-memory TDNs.
+ *
+ * save_index(): save the TDNs of all the CTF files in the ctflist, and
+ * the in-memory TDNs that were made from them, in an index image in the
+ * named file. Returns 0 if OK, or sets errno and returns -1 on error.
+ */
+int save_index(char *name, Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  Indexhdr hdr;
+  Indexctf *ic;
+  Ctfhandle *ctf;
+  TDNgrp *grp;
+  Idxgrp *ig, *igs = NULL;
+  TDN unused;
+  FILE *out;
+  uint64_t offset;
+  uint32_t *start = NULL, n;
+  int i, err = 0;
+
+  if ((name == NULL) || (p == NULL) || (s->ctflistnext < 2)) {
+    errno = EINVAL; return (-1);
+  }
+  if ((out = fopen(name, "w")) == NULL) return (-1);
+  ic = (Indexctf *) calloc(s->ctflistnext, sizeof(Indexctf));
+  if (ic == NULL) {
+    fclose(out); return (-1);
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.tuple_size = p->tuple_size;
+  hdr.flags = p->flags & INDEX_FLAGS;
+  hdr.numctf = s->ctflistnext - 1;
+  hdr.tdnsize = sizeof(TDN);
+
+  /* Write the header, the Indexctfs and the names. The header and
+   * the Indexctfs are filled in and written again at the end.
+   */
+  offset = 0;
+  write_padded(out, &hdr, sizeof(hdr), &offset);
+  hdr.ctfoff = offset;
+  if (write_padded(out, ic, hdr.numctf * sizeof(Indexctf), &offset) == -1)
+    err = -1;
+  for (i = 1; (err == 0) && (i < s->ctflistnext); i++) {
+    ic[i].nameoff = offset;
+    if (write_padded(out, get_ctfname(i), strlen(get_ctfname(i)) + 1,
+		     &offset) == -1) err = -1;
+  }
+
+  /* Write each CTF file's TDNs and file records */
+  memset(&unused, 0, sizeof(unused));
+  for (i = 1; (err == 0) && (i < s->ctflistnext); i++) {
+    if ((ctf = s->ctf_handle[i]) == NULL) {
+      errno = EINVAL; err = -1; break;
+    }
+    ic[i].ctfsize = ctf->end - ctf->start;
+    ic[i].tdnoff = offset;
+    ic[i].numtdns = ctf->numtdns;
+    if ((write_padded(out, &unused, sizeof(TDN), &offset) == -1) ||
+	(write_padded(out, ctf->tdns, ctf->numtdns * sizeof(TDN),
+		      &offset) == -1)) err = -1;
+    ic[i].filesoff = offset;
+    ic[i].numfiles = ctf->numfiles;
+    if (write_padded(out, ctf->files, ctf->numfiles * sizeof(Ctffile),
+		     &offset) == -1) err = -1;
+  }
+
+  /* Count the TDNs in each group, to make the start of each group.
+   * The TDNs already in an image come before those in the TDNgrp.
+   */
+  hdr.startoff = offset;
+  start = (uint32_t *) calloc(TABLE_SIZE + 1, sizeof(uint32_t));
+  if (start == NULL) err = -1;
+  for (i = 0; (err == 0) && (i < NUMLISTS); i++)
+    for (grp = s->tdngrplist[i]; grp != NULL; grp = grp->next) {
+      start[(grp->crc >> (32 - BITSINTABLE)) + 1]++;
+      hdr.numgrps++;
+    }
+  for (i = 0; (err == 0) && (i < TABLE_SIZE); i++) {
+    if (s->image != NULL) {
+      start[i + 1] += s->idxstart[i + 1] - s->idxstart[i];
+      hdr.numgrps += s->idxstart[i + 1] - s->idxstart[i];
+    }
+    start[i + 1] += start[i];
+  }
+  if ((err == 0) && (hdr.numgrps > UINT32_MAX)) {
+    errno = EFBIG; err = -1;
+  }
+  if ((err == 0) &&
+      (write_padded(out, start, (TABLE_SIZE + 1) * sizeof(uint32_t),
+		    &offset) == -1)) err = -1;
+
+  /* Put the groups in order, then write them out */
+  hdr.grpoff = offset;
+  if (err == 0) {
+    igs = (Idxgrp *) calloc(hdr.numgrps + 1, sizeof(Idxgrp));
+    if (igs == NULL) err = -1;
+  }
+  for (i = 0; (err == 0) && (s->image != NULL) && (i < TABLE_SIZE); i++) {
+    n = s->idxstart[i + 1] - s->idxstart[i];
+    memcpy(&igs[start[i]], &s->idxgrps[s->idxstart[i]], n * sizeof(Idxgrp));
+    start[i] += n;
+  }
+  for (i = 0; (err == 0) && (i < NUMLISTS); i++)
+    for (grp = s->tdngrplist[i]; grp != NULL; grp = grp->next) {
+      ig = &igs[start[grp->crc >> (32 - BITSINTABLE)]++];
+      ig->ctfid = grp->node->ctfid;
+      ig->idx = grp->node - s->ctf_handle[ig->ctfid]->tdns;
+      ig->crcbot = grp->crc & 0xff;
+    }
+  if ((err == 0) &&
+      (write_padded(out, igs, hdr.numgrps * sizeof(Idxgrp), &offset) == -1))
+    err = -1;
+  free(start);
+  free(igs);
+
+  /* Now fill in the header and the Indexctfs */
+  if ((err == 0) && ((fseeko(out, 0, SEEK_SET) == -1) ||
+		     (fwrite(&hdr, sizeof(hdr), 1, out) != 1) ||
+		     (fseeko(out, hdr.ctfoff, SEEK_SET) == -1) ||
+		     (fwrite(&ic[1], sizeof(Indexctf), hdr.numctf, out)
+		      != hdr.numctf))) err = -1;
+  free(ic);
+  if (fclose(out) != 0) err = -1;
+  if (err == -1) unlink(name);
+  return (err);
+}
+
+/* Check that the file record table of a CTF file of ctfsize octets
+ * only holds offsets inside the CTF file. Returns 0 if OK, -1 if not.
+ */
+static int check_ctffiles(Ctffile * files, uint32_t numfiles, uint64_t ctfsize)
+{
+  uint32_t i;
+
+  for (i = 0; i < numfiles; i++)
+    if ((files[i].name_offset >= ctfsize) || (files[i].base > ctfsize))
+      return (-1);
+  return (0);
+}
+
+/* Check the TDNs and the groups of an index image, once load_index()
+ * has checked where they are. Each TDN must belong to its CTF file and
+ * point at a file record and an offset in it, the groups must start in
+ * order inside the Idxgrps, and each Idxgrp must name a TDN in the
+ * image. Returns 0 if OK, -1 if not.
+ */
+static int check_index(uint8_t * map, Indexhdr * hdr, Indexctf * ic)
+{
+  Ctffile *files;
+  uint32_t *start;
+  Idxgrp *ig;
+  TDN *tdn;
+  uint64_t i, j;
+
+  for (i = 0; i < hdr->numctf; i++) {
+    tdn = (TDN *) (map + ic[i].tdnoff) + 1;
+    files = (Ctffile *) (map + ic[i].filesoff);
+    for (j = 0; j < ic[i].numtdns; j++, tdn++)
+      if ((tdn->ctfid != i + 1) || (tdn->fileidx >= ic[i].numfiles) ||
+	  (files[tdn->fileidx].base + tdn->offset >= ic[i].ctfsize))
+	return (-1);
+  }
+
+  start = (uint32_t *) (map + hdr->startoff);
+  for (i = 0; i < TABLE_SIZE; i++)
+    if (start[i] > start[i + 1]) return (-1);
+  if (start[TABLE_SIZE] > hdr->numgrps) return (-1);
+  ig = (Idxgrp *) (map + hdr->grpoff);
+  for (i = 0; i < hdr->numgrps; i++)
+    if ((ig[i].ctfid < 1) || (ig[i].ctfid > hdr->numctf) ||
+	(ig[i].idx >= ic[ig[i].ctfid - 1].numtdns))
+      return (-1);
+  return (0);
+}
+
+/** load_index(): map the index image in the named file made by
+ * save_index(), and use its TDNs as the in-memory TDNs of the CTF files
+ * in it. These must be the first CTF files in the ctflist, and they must
+ * not have been walked yet. The p->tuple_size and p->flags which change
+ * the TDNs must be the same as when the image was saved. The header,
+ * the tables of the CTF files and the offsets of the parts of the image
+ * are always checked, but the TDNs and the groups, which take time in
+ * proportion to the size of the image, are only checked if p->flags has
+ * CTP_CHECKINDEX. Returns the number of CTF files in the image, or sets
+ * errno and returns -1 on error, with EINVAL if the image is not valid.
+ */
+int load_index(char *name, Ctfparam * p)
+{
+  Ctfsession *s = cursess;
+  Indexhdr *hdr;
+  Indexctf *ic;
+  Ctfhandle *ctf;
+  struct stat sb;
+  uint8_t *map;
+  uint64_t i;
+  int fd;
+
+  if ((name == NULL) || (p == NULL) || (s->image != NULL)) {
+    errno = EINVAL; return (-1);
+  }
+  if ((fd = open(name, O_RDONLY)) == -1) return (-1);
+  if (fstat(fd, &sb) == -1) {
+    close(fd); return (-1);
+  }
+  if ((uint64_t) sb.st_size < sizeof(Indexhdr)) {
+    close(fd); errno = EINVAL; return (-1);
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return (-1);
+
+  /* Check the header and the CTF files against the image. Every
+   * offset and count in them is checked against the size of the image
+   * before it is used.
+   */
+  hdr = (Indexhdr *) map;
+  errno = EINVAL;
+  if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+      (hdr->tdnsize != sizeof(TDN)) ||
+      (hdr->tuple_size != p->tuple_size) ||
+      (hdr->flags != (p->flags & INDEX_FLAGS)) ||
+      (hdr->numctf >= s->ctflistnext) ||
+      (hdr->ctfoff > sb.st_size) ||
+      (hdr->ctfoff + hdr->numctf * sizeof(Indexctf) > sb.st_size) ||
+      (hdr->startoff > sb.st_size) ||
+      (hdr->startoff + (TABLE_SIZE + 1) * sizeof(uint32_t) > sb.st_size) ||
+      (hdr->numgrps > sb.st_size) || (hdr->grpoff > sb.st_size) ||
+      (hdr->grpoff + hdr->numgrps * sizeof(Idxgrp) > sb.st_size) ||
+      ((hdr->numctf + 1 < s->ctflistnext) &&
+       (get_ctftree(hdr->numctf + 1) != hdr->numctf + 1)))
+    goto bad;
+  ic = (Indexctf *) (map + hdr->ctfoff);
+  for (i = 0; i < hdr->numctf; i++) {
+    ctf = s->ctf_handle[i + 1];
+    if ((ctf == NULL) || (ctf->tdns != NULL) ||
+	(ic[i].ctfsize != ctf->end - ctf->start) ||
+	(ic[i].numtdns > sb.st_size) || (ic[i].tdnoff > sb.st_size) ||
+	(ic[i].tdnoff + ((uint64_t) ic[i].numtdns + 1) * sizeof(TDN) >
+	 sb.st_size) ||
+	(ic[i].numfiles > sb.st_size) || (ic[i].filesoff > sb.st_size) ||
+	(ic[i].filesoff + (uint64_t) ic[i].numfiles * sizeof(Ctffile) >
+	 sb.st_size) ||
+	(check_ctffiles((Ctffile *) (map + ic[i].filesoff), ic[i].numfiles,
+			ic[i].ctfsize) == -1) ||
+	(ic[i].nameoff >= sb.st_size) ||
+	(memchr(map + ic[i].nameoff, '\0', sb.st_size - ic[i].nameoff) ==
+	 NULL) ||
+	strcmp((char *) (map + ic[i].nameoff), get_ctfname(i + 1)))
+      goto bad;
+  }
+
+  /* Checking the TDNs and the groups takes time in proportion to the
+   * size of the image, so it is only done when asked for.
+   */
+  if ((p->flags & CTP_CHECKINDEX) && (check_index(map, hdr, ic) == -1))
+    goto bad;
+
+  /* Point the CTF files' TDNs and file records into the image */
+  for (i = 0; i < hdr->numctf; i++) {
+    ctf = s->ctf_handle[i + 1];
+    ctf->tdns = (TDN *) (map + ic[i].tdnoff) + 1;
+    ctf->numtdns = ic[i].numtdns;
+    ctf->files = (Ctffile *) (map + ic[i].filesoff);
+    ctf->numfiles = ctf->maxfiles = ic[i].numfiles;
+    ctf->cursor = ctf->end;
+    ctf->inimage = 1;
+  }
+  s->image = map;
+  s->imagesize = sb.st_size;
+  s->idxstart = (uint32_t *) (map + hdr->startoff);
+  s->idxgrps = (Idxgrp *) (map + hdr->grpoff);
+  p->tdncount += hdr->numgrps;
+  s->any_tdngrps = 1;
+  return (hdr->numctf);
+
+bad:
+  munmap(map, sb.st_size);
+  return (-1);
+}
@@ -5,26 +5,42 @@
  * $Revision: 1.8 $
  */
 
-/* We have a 2^24 bit array of pointers to the head of a 
- * chain of TDNs. Each node in the chain looks like the following.
- * This collects all the TDNs which share the same top 24 bits of CRC
- * into a linked list.
+/* We have an array of pointers to the head of a chain of TDNs.
+ * Each node in the chain looks like the following. This collects all
+ * the TDNs which share the same top 24 bits of CRC (a group) into a
+ * linked list, which may also hold other groups. See libtdn.c.
  */
 #ifndef LIBTDN_H
 #define LIBTDN_H
 
 typedef struct tdngrp
 {
-  uint8_t crcbot;		/* Bottom 8-bits of 32-bit CRC */
-  uint16_t ctfid;		/* Cached copy of the node's CTF file-id */
+  uint32_t crc;			/* 32-bit CRC of the TDN node */
+  uint32_t treeid;		/* Id of the tree the node's CTF file is in */
   TDN *node;			/* Pointer to the TDN node */
   struct tdngrp *next;		/* Next node in the list */
 } TDNgrp;
 
+/* A TDN in an index image, see load_index(). It names the TDN by the
+ * id of its CTF file and its index in the CTF file's array of TDNs.
+ */
+typedef struct idxgrp
+{
+  uint32_t ctfid;		/* Id of the TDN's CTF file */
+  uint32_t idx;			/* Index of the TDN in the CTF file */
+  uint8_t crcbot;		/* Bottom 8-bits of 32-bit CRC */
+} Idxgrp;
+
 void init_libtdn(Ctfparam * p);
 TDN *get_next_tdn(Ctfhandle * ctf, int fileid, Ctfparam * p);
 TDNgrp *get_tdngrp_for(TDN * tdn, Ctfparam * p);
+TDNgrp *get_tdngrp_list(TDN * tdn);
+Idxgrp *get_idxgrps_for(TDN * tdn, uint32_t * count);
 int append_tdn(TDN * tdn, TDNgrp * grp, Ctfparam * p);
+void free_tdngrps(int first, int last);
+void reserve_tdngrps(uint64_t ntdns);
+uint32_t tdngrp_listsize(uint64_t ntdns);
+uint32_t tdngrp_chainlengths(uint64_t * hist, int nbuckets, uint64_t * longest);
 
 #endif /* LIBTDN_H */
 
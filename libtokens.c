@@ -13,11 +13,44 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
 #include "libctf.h"
 #include "libtokens.h"
 
+/*
+ * The line numbers in a CTF file are found with a line table, which is
+ * made the first time that a line number is needed. The table holds
+ * the offset of each line start in the CTF file: the start of each file
+ * record and the position after each LINE token. Each entry is stored as
+ * a varint of the distance from the previous line start, shifted up one
+ * bit, with the bottom bit set if it is the start of a file record. Every
+ * LINECHECK entries there is a checkpoint which holds an entry's offset
+ * and line number in full, so that a lookup only has to decode at most
+ * LINECHECK varints.
+ */
+#define LINECHECK	64
+
+typedef struct _linecheck
+{
+  uint64_t offset;		/* Offset of the line start */
+  uint32_t linenum;		/* and its line number */
+  size_t posn;			/* Position of the next varint in the table */
+} Linecheck;
+
+typedef struct _linetable
+{
+  uint8_t *varints;		/* The varint-encoded line starts */
+  size_t len;			/* Length of the varints in bytes */
+  Linecheck *checks;		/* Array of checkpoints */
+  uint32_t numchecks;		/* Number of checkpoints */
+} Linetable;
+
+/* Lock held while a line table is being made */
+static pthread_mutex_t linetable_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /** Functions dealing with the token stream stored in a CTF file.
  *
  * ctfopen(): open the named CTF file for reading, checking the header
@@ -35,23 +68,44 @@ Ctfhandle *ctfopen(char *name)
   if ((ctf->fd = open(name, O_RDONLY)) == -1)
     return(NULL);
 
-  fstat(ctf->fd, &sb);
-  ctf->start = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, ctf->fd, 0);
+  if (fstat(ctf->fd, &sb) == -1)
+    return(NULL);
+
+  /* A CTF file larger than the address space can't be mmap()d */
+  if ((uint64_t) sb.st_size > SIZE_MAX) {
+    errno= EFBIG;
+    return(NULL);
+  }
+  ctf->start = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE,
+		    ctf->fd, 0);
   if ((ctf->start == NULL) || (ctf->start == MAP_FAILED))
     return(NULL);
 
   /* Initialise ctf */
   ctf->cursor = ctf->start;
   ctf->end = ctf->start + sb.st_size;
-  ctf->linenum = 1;
+  ctf->tdns = NULL;
+  ctf->numtdns = 0;
+  ctf->tdnmapsize = 0;
+  ctf->files = NULL;
+  ctf->numfiles = 0;
+  ctf->maxfiles = 0;
+  ctf->lines = NULL;
+  ctf->inimage = 0;
+  ctf->excluded = NULL;
+  ctf->numexcluded = 0;
 
-  /* Check the ctf header */
-  if ((*(ctf->cursor++) != 'c') || (*(ctf->cursor++) != 't') ||
-      (*(ctf->cursor++) != 'f') || (*(ctf->cursor++) != '2') ||
-      (*(ctf->cursor++) != '.') || (*(ctf->cursor++) != '1')) {
+  /* Check the ctf header. A file which can hold DUPFILE records has a
+   * header of its own, so that older readers reject it.
+   */
+  if ((ctf->end - ctf->start < 6) ||
+      (memcmp(ctf->start, CTF_HEADER, 6) &&
+       memcmp(ctf->start, CTF_DUPHEADER, 6))) {
     errno= EINVAL;
     return(NULL);
   }
+  ctf->hasdups = !memcmp(ctf->start, CTF_DUPHEADER, 6);
+  ctf->cursor += 6;
   return (ctf);
 }
 
@@ -63,11 +117,124 @@ int ctfclose(Ctfhandle * ctf)
   if (ctf == NULL) return (-1);
   int fd= ctf->fd;
   if (munmap(ctf->start, ctf->end - ctf->start) < 0) return (-1);
+  if (!ctf->inimage) {
+    if (ctf->tdns != NULL) munmap(ctf->tdns - 1, ctf->tdnmapsize);
+    free(ctf->files);
+  }
+  if (ctf->lines != NULL) {
+    free(ctf->lines->varints);
+    free(ctf->lines->checks);
+    free(ctf->lines);
+  }
+  free(ctf->excluded);
   free(ctf);
   return (close(fd));
 }
 
 
+/* The length of each token in a CTF file, or 0 for the FILENAME and
+ * DUPFILE tokens, whose length depends on the names which follow them.
+ */
+static uint8_t toklen[256];
+
+/* How format_token() writes each token other than FILENAME and DUPFILE:
+ * the prefix, then for the tokens with a value or a line number, the
+ * number and the suffix. The fixed size fields are copied as one block.
+ */
+typedef struct _tokfmt
+{
+  char prefix[16];		/* Text before any number */
+  char suffix[4];		/* Text after the number */
+  uint8_t prefixlen;		/* Lengths of the prefix */
+  uint8_t suffixlen;		/* and the suffix */
+  uint8_t hasnum;		/* Set if a number follows the prefix */
+  uint8_t width;		/* Width the number is right-justified in */
+} Tokfmt;
+
+static Tokfmt tokfmt[256];
+static pthread_once_t toklen_once = PTHREAD_ONCE_INIT;
+extern char *tokstring[];
+
+/* Set the prefix, suffix and width of a token with a number */
+static void set_tokfmt(unsigned int ch, char *prefix, char *suffix, int width)
+{
+  memset(tokfmt[ch].prefix, 0, sizeof(tokfmt[ch].prefix));
+  tokfmt[ch].prefixlen = strlen(prefix);
+  memcpy(tokfmt[ch].prefix, prefix, tokfmt[ch].prefixlen);
+  tokfmt[ch].suffixlen = strlen(suffix);
+  memcpy(tokfmt[ch].suffix, suffix, tokfmt[ch].suffixlen);
+  tokfmt[ch].hasnum = 1;
+  tokfmt[ch].width = width;
+}
+
+static void make_toklen(void)
+{
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    toklen[i] = 1;
+    tokfmt[i].prefixlen = strlen(tokstring[i]);
+    memcpy(tokfmt[i].prefix, tokstring[i], tokfmt[i].prefixlen);
+  }
+  toklen[STRINGLIT] = toklen[CHARCONST] = toklen[LABEL] = 3;
+  toklen[IDENTIFIER] = toklen[INTVAL] = 3;
+  toklen[FILENAME] = toklen[DUPFILE] = 0;
+
+  set_tokfmt(LINE, "\n", ":   ", 5);
+  set_tokfmt(IDENTIFIER, tokstring[IDENTIFIER], " ", 0);
+  set_tokfmt(INTVAL, tokstring[INTVAL], " ", 0);
+  set_tokfmt(STRINGLIT, "\"str", "\" ", 0);
+  set_tokfmt(LABEL, "L", ": ", 0);
+  set_tokfmt(CHARCONST, "'c", "' ", 0);
+}
+
+/** next_filerecord(): given a Ctfhandle and a file offset, find the next
+ * file record at or after the token at the offset, without decoding the
+ * tokens in between. The offset is updated to point at the record's
+ * FILENAME or DUPFILE token, which is returned, or -1 if there are no more.
+ */
+int next_filerecord(Ctfhandle * ctf, uint64_t * offset)
+{
+  uint8_t *posn;
+
+  if ((ctf == NULL) || (ctf->start == NULL) || (offset == NULL))
+    return (-1);
+  pthread_once(&toklen_once, make_toklen);
+
+  for (posn = ctf->start + *offset; posn < ctf->end; posn += toklen[*posn])
+    if (toklen[*posn] == 0) {
+      *offset = posn - ctf->start;
+      return (*posn);
+    }
+  return (-1);
+}
+
+/** count_tokens(): return the number of tokens in the CTF file other
+ * than line numbers and file records, without decoding them. No more
+ * TDNs than this can be made from the file.
+ */
+uint64_t count_tokens(Ctfhandle * ctf)
+{
+  uint64_t offset, count = 0;
+  uint8_t *posn;
+
+  if ((ctf == NULL) || (ctf->start == NULL)) return (0);
+  pthread_once(&toklen_once, make_toklen);
+
+  for (posn = ctf->start; posn < ctf->end;) {
+    if (toklen[*posn] == 0) {
+      /* Skip over the file record */
+      offset = posn - ctf->start;
+      get_token(ctf, &offset, NULL, NULL);
+      posn = ctf->start + offset;
+      continue;
+    }
+    if (*posn != LINE) count++;
+    posn += toklen[*posn];
+  }
+  return (count);
+}
+
 /** get_token(): given a Ctfhandle and a file offset, return the next
  * token from the file at the given offset. The offset is updated to point
  * at the next token. Any id-value associated with the the token is
@@ -75,23 +242,28 @@ int ctfclose(Ctfhandle * ctf)
  * associated with a FILENAME token is returned in name, and the id
  * parameter is used to return the timestamp. On any error, -1 is returned.
  * The space for the filename is malloc'd here; the caller takes
- * responsibility for freeing it.
+ * responsibility for freeing it. A DUPFILE token is treated like a
+ * FILENAME token, and the name of the file that it duplicates follows
+ * the NUL at the end of the filename.
  */
-int get_token(Ctfhandle * ctf, uint32_t * offset, uint32_t * id, char **name)
+int get_token(Ctfhandle * ctf, uint64_t * offset, uint32_t * id, char **name)
 {
   unsigned int ch, token;
   uint32_t idvalue;
+  uint8_t *posn;
 
   /* Give up if ctf, ctf->start or offset don't exist */
   if ((ctf == NULL) || (ctf->start == NULL) || (offset == NULL))
     return (-1);
 
-  /* EOF handling. */
-  ctf->cursor = ctf->start + *offset;
-  if (ctf->cursor >= ctf->end) return (-1);
+  /* EOF handling. The position is kept locally and not in ctf->cursor,
+   * as several threads may be reading tokens from the same ctf.
+   */
+  posn = ctf->start + *offset;
+  if (posn >= ctf->end) return (-1);
 
   /* Get the token */
-  token = *(ctf->cursor++);
+  token = *(posn++);
 
   /* Set a default id value */
   if (id) *id = 0;
@@ -106,31 +278,208 @@ int get_token(Ctfhandle * ctf, uint32_t * offset, uint32_t * id, char **name)
   case IDENTIFIER:
   case INTVAL:
     /* Read in 2 bytes to get the id value */
-    idvalue = *(ctf->cursor++) << 8;
-    idvalue += *(ctf->cursor++);
+    idvalue = *(posn++) << 8;
+    idvalue += *(posn++);
     if (id)
       *id = idvalue;
     break;
 
   case FILENAME:
+  case DUPFILE:
     /* Read in 4 bytes to get the timestamp value */
-    idvalue = *(ctf->cursor++) << 24;
-    idvalue += *(ctf->cursor++) << 16;
-    idvalue += *(ctf->cursor++) << 8;
-    idvalue += *(ctf->cursor++);
+    idvalue = *(posn++) << 24;
+    idvalue += *(posn++) << 16;
+    idvalue += *(posn++) << 8;
+    idvalue += *(posn++);
     if (id)
       *id = idvalue;
 
-    /* Pass back the pointer to the filename, and move the cursor up */
+    /* Pass back the pointer to the filename, and move the position up */
     if (name)
-      *name = (char *) ctf->cursor;
-    while (((ch = *(ctf->cursor++)) != '\0') && (ctf->cursor < ctf->end));
+      *name = (char *) posn;
+    while (((ch = *(posn++)) != '\0') && (posn < ctf->end));
+    if (token == FILENAME) break;
+
+    /* Skip the earlier file's name and the three 4-byte values */
+    while (((ch = *(posn++)) != '\0') && (posn < ctf->end));
+    posn += 3 * sizeof(uint32_t);
+    if (posn > ctf->end) posn = ctf->end;
   }
 
-  *offset = ctf->cursor - ctf->start;
+  *offset = posn - ctf->start;
   return (token);
 }
 
+/* Add the line start at offset to the line table, as a varint of the
+ * distance from the previous line start. Returns 0 if OK, -1 on error.
+ */
+static int add_linestart(Linetable * lt, size_t * size, uint64_t offset,
+			 uint64_t prevoffset, int isfile)
+{
+  uint64_t val = ((uint64_t) (offset - prevoffset) << 1) | isfile;
+  uint8_t *ptr;
+
+  /* Make sure there is room for the longest varint */
+  if (lt->len + 10 > *size) {
+    *size = (*size == 0) ? 4096 : 2 * *size;
+    if ((ptr = realloc(lt->varints, *size)) == NULL) return (-1);
+    lt->varints = ptr;
+  }
+
+  do {
+    lt->varints[lt->len++] = (val & 0x7f) | ((val > 0x7f) ? 0x80 : 0);
+    val >>= 7;
+  } while (val != 0);
+  return (0);
+}
+
+/* Make the line table for the given CTF file. Returns 0 if OK, -1 on
+ * error.
+ */
+static int make_linetable(Ctfhandle * ctf)
+{
+  Linetable *lt;
+  Linecheck *ptr;
+  uint8_t *posn = ctf->start + 6;	/* Skip the "ctf2.1" header */
+  uint64_t offset, prevoffset = 0, count = 0;
+  uint32_t linenum = 0, maxchecks = 0;
+  size_t size = 0;
+  int isfile;
+
+  if ((lt = (Linetable *) calloc(1, sizeof(Linetable))) == NULL)
+    return (-1);
+
+  while ((posn < ctf->end) && (*posn != EOFTOKEN)) {
+    switch (*posn) {
+    case FILENAME:
+    case DUPFILE:
+      /* A new file record starts at line 1. Skip the token, the
+       * timestamp and the name(s), and the three 4-byte values in
+       * a DUPFILE record.
+       */
+      offset = posn - ctf->start;
+      isfile = 1;
+      linenum = 1;
+      if (*posn == DUPFILE) {
+	posn += 5;
+	while ((posn < ctf->end) && (*(posn++) != '\0'));
+	while ((posn < ctf->end) && (*(posn++) != '\0'));
+	posn += 3 * sizeof(uint32_t);
+      } else {
+	posn += 5;
+	while ((posn < ctf->end) && (*(posn++) != '\0'));
+      }
+      break;
+
+    case LINE:
+      /* The next line starts after the LINE token */
+      posn++;
+      offset = posn - ctf->start;
+      isfile = 0;
+      linenum++;
+      break;
+
+    case STRINGLIT:
+    case CHARCONST:
+    case LABEL:
+    case IDENTIFIER:
+    case INTVAL:
+      posn += 3;		/* Skip the token + the 2-byte id value */
+      continue;
+
+    default:
+      posn++;
+      continue;
+    }
+
+    /* Add a checkpoint every LINECHECK line starts. The checkpoint
+     * holds the line start itself, so it is not stored as a varint.
+     */
+    if ((count++ % LINECHECK) == 0) {
+      if (lt->numchecks == maxchecks) {
+	maxchecks = (maxchecks == 0) ? 256 : 2 * maxchecks;
+	ptr = realloc(lt->checks, maxchecks * sizeof(Linecheck));
+	if (ptr == NULL) goto fail;
+	lt->checks = ptr;
+      }
+      lt->checks[lt->numchecks].offset = offset;
+      lt->checks[lt->numchecks].linenum = linenum;
+      lt->checks[lt->numchecks].posn = lt->len;
+      lt->numchecks++;
+    } else if (add_linestart(lt, &size, offset, prevoffset, isfile) == -1)
+      goto fail;
+    prevoffset = offset;
+  }
+
+  /* Publish the finished table to get_linenum()'s unlocked load */
+  __atomic_store_n(&(ctf->lines), lt, __ATOMIC_RELEASE);
+  return (0);
+
+fail:
+  free(lt->varints);
+  free(lt->checks);
+  free(lt);
+  return (-1);
+}
+
+/** get_linenum(): given a Ctfhandle and the offset of a token in the
+ * CTF file, return the line number in its source file where the token
+ * occurs. Returns 0 on error, e.g. if the offset is before the first
+ * file record.
+ */
+uint32_t get_linenum(Ctfhandle * ctf, uint64_t offset)
+{
+  Linetable *lt;
+  Linecheck *check;
+  uint32_t lo, hi, mid, linenum;
+  uint64_t linestart;
+  uint64_t val;
+  size_t posn;
+  int i, shift;
+
+  if (ctf == NULL) return (0);
+
+  /* Make the line table if we don't have it yet. Once made, it is never
+   * changed, so only the first callers need to take the lock.
+   */
+  if ((lt = __atomic_load_n(&(ctf->lines), __ATOMIC_ACQUIRE)) == NULL) {
+    pthread_mutex_lock(&linetable_lock);
+    if ((ctf->lines == NULL) && (make_linetable(ctf) == -1)) {
+      pthread_mutex_unlock(&linetable_lock);
+      return (0);
+    }
+    lt = ctf->lines;
+    pthread_mutex_unlock(&linetable_lock);
+  }
+
+  /* Find the last checkpoint at or before the offset */
+  if ((lt->numchecks == 0) || (lt->checks[0].offset > offset)) return (0);
+  for (lo = 0, hi = lt->numchecks; hi - lo > 1;) {
+    mid = (lo + hi) / 2;
+    if (lt->checks[mid].offset <= offset) lo = mid;
+    else hi = mid;
+  }
+  check = &(lt->checks[lo]);
+  linestart = check->offset;
+  linenum = check->linenum;
+
+  /* Walk the line starts after the checkpoint until we pass the offset */
+  posn = check->posn;
+  for (i = 1; (i < LINECHECK) && (posn < lt->len); i++) {
+    val = 0; shift = 0;
+    do {
+      val |= (uint64_t) (lt->varints[posn] & 0x7f) << shift;
+      shift += 7;
+    } while (lt->varints[posn++] & 0x80);
+
+    if (linestart + (val >> 1) > offset) break;
+    linestart += val >> 1;
+    linenum = (val & 1) ? 1 : linenum + 1;
+  }
+  return (linenum);
+}
+
+
 char *tokstring[] = {
   "ERR ", "ERR ", "ERR ", "ERR ", "ERR ", "ERR ", "ERR ", "ERR ",	/* 0 */
   "ERR ", "ERR ", "\n", "ERR ", "ERR ", ">>= ", "ERR ", "ERR ",	/* 8 */
@@ -182,30 +531,165 @@ char *tok2str(unsigned int ch)
  * performs no input error checking.
  */
 void print_token(unsigned int ch, uint32_t linenum, uint32_t id, char *filename)
+{
+  fprint_token(stdout, ch, linenum, id, filename);
+}
+
+/** fprint_token(): as for print_token(), but print the token on the
+ * given stdio stream. It can be called by several threads at once.
+ */
+void fprint_token(FILE * out, unsigned int ch, uint32_t linenum, uint32_t id, char *filename)
 {
   time_t time;
+  char timebuf[26];
   switch (ch) {
   case FILENAME:
     time = id;
-    printf("\n\n%s:\t%s\n%5d:   ", filename, ctime(&time), linenum);
+    fprintf(out, "\n\n%s:\t%s\n%5d:   ", filename, ctime_r(&time, timebuf),
+	    linenum);
+    break;
+  case DUPFILE:
+    time = id;
+    fprintf(out, "\n\n%s:\t%s\tidentical to %s\n", filename,
+	    ctime_r(&time, timebuf), filename + strlen(filename) + 1);
     break;
   case LINE:
-    printf("\n%5d:   ", linenum);
+    fprintf(out, "\n%5d:   ", linenum);
     break;
   case IDENTIFIER:
   case INTVAL:
-    printf("%s%d ", tokstring[ch], id);
+    fprintf(out, "%s%d ", tokstring[ch], id);
     break;
   case STRINGLIT:
-    printf("\"str%d\" ", id);
+    fprintf(out, "\"str%d\" ", id);
     break;
   case LABEL:
-    printf("L%d: ", id);
+    fprintf(out, "L%d: ", id);
     break;
   case CHARCONST:
-    printf("'c%d' ", id);
+    fprintf(out, "'c%d' ", id);
     break;
   default:
-    fputs(tokstring[ch], stdout);
+    fputs(tokstring[ch], out);
   }
 }
+
+/* The decimal digits of 00 to 99, to convert numbers two digits at a time */
+static const char digitpairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* Write n in decimal into buf, right-justified in width characters.
+ * Returns the number of characters written.
+ */
+static inline int format_num(char *buf, uint32_t n, int width)
+{
+  uint64_t power;
+  char *out;
+  int len, pad;
+
+  for (len = 1, power = 10; n >= power; len++) power *= 10;
+  pad = (width > len) ? width - len : 0;
+  memset(buf, ' ', pad);
+
+  /* Fill in the digits from the right, two at a time */
+  out = buf + pad + len;
+  while (n >= 100) {
+    out -= 2; memcpy(out, digitpairs + 2 * (n % 100), 2); n /= 100;
+  }
+  if (n >= 10) memcpy(out - 2, digitpairs + 2 * n, 2);
+  else *(out - 1) = '0' + n;
+  return (pad + len);
+}
+
+/* Write the text of a token other than FILENAME or DUPFILE into buf,
+ * and return the number of bytes written.
+ */
+static inline size_t format_plain(char *buf, unsigned int ch,
+				  uint32_t linenum, uint32_t id)
+{
+  Tokfmt *fmt = &tokfmt[ch];
+  char *out = buf;
+
+  memcpy(out, fmt->prefix, sizeof(fmt->prefix));
+  out += fmt->prefixlen;
+  if (fmt->hasnum) {
+    out += format_num(out, (ch == LINE) ? linenum : id, fmt->width);
+    memcpy(out, fmt->suffix, sizeof(fmt->suffix));
+    out += fmt->suffixlen;
+  }
+  return (out - buf);
+}
+
+/** format_token(): as for print_token(), but write the text of the token
+ * into buf, which must have room for MAXTOKENTEXT bytes plus the length of
+ * the filename(s). Returns the number of bytes written; no NUL is added.
+ */
+size_t format_token(char *buf, unsigned int ch, uint32_t linenum, uint32_t id, char *filename)
+{
+  char *out = buf;
+  time_t time;
+
+  pthread_once(&toklen_once, make_toklen);
+  if ((ch != FILENAME) && (ch != DUPFILE))
+    return (format_plain(buf, ch, linenum, id));
+
+  time = id;
+  *(out++) = '\n'; *(out++) = '\n';
+  out = stpcpy(out, filename);
+  *(out++) = ':'; *(out++) = '\t';
+  if (ctime_r(&time, out) == NULL) strcpy(out, "(null)");
+  out += strlen(out);
+  if (ch == DUPFILE) {
+    out = stpcpy(out, "\tidentical to ");
+    out = stpcpy(out, filename + strlen(filename) + 1);
+    *(out++) = '\n';
+  } else {
+    *(out++) = '\n';
+    out += format_num(out, linenum, 5);
+    out = stpcpy(out, ":   ");
+  }
+  return (out - buf);
+}
+
+/** format_tokens(): given a Ctfhandle, a file offset and the line number
+ * there, write the text of the tokens from the offset into buf, which holds
+ * size bytes, as format_token() would. Stops at the next file record, at
+ * the LINE token after lastline, or when buf is full. The offset and line
+ * number are updated, and the number of bytes written is returned.
+ */
+size_t format_tokens(Ctfhandle * ctf, uint64_t * offset, uint32_t * linenum, uint32_t lastline, char *buf, size_t size)
+{
+  uint8_t *posn, *end;
+  char *out = buf;
+  uint32_t id, line;
+  unsigned int ch;
+
+  if ((ctf == NULL) || (ctf->start == NULL) || (size < MAXTOKENTEXT))
+    return (0);
+  pthread_once(&toklen_once, make_toklen);
+
+  posn = ctf->start + *offset;
+  end = ctf->end;
+  line = *linenum;
+  for (; (posn < end) && (out <= buf + size - MAXTOKENTEXT);
+       posn += toklen[ch]) {
+    ch = *posn;
+    if (toklen[ch] == 0) break;
+    if (ch == LINE) {
+      if (line >= lastline) break;
+      line++;
+    }
+    id = 0;
+    if (toklen[ch] == 3) {
+      if (posn + 3 > end) break;
+      id = (posn[1] << 8) + posn[2];
+    }
+    out += format_plain(out, ch, line, id);
+  }
+
+  *offset = posn - ctf->start;
+  *linenum = line;
+  return (out - buf);
+}
@@ -13,6 +13,9 @@
 #define EOFTOKEN	0
 #define FILENAME	9
 #define LINE		10
+#define DUPFILE		11	/* A file identical to an earlier file: */
+				/* timestamp, name, earlier file's name, */
+				/* # tokens, first and last line number */
 
 /* C tokens */
 #define RSassign	13
@@ -178,9 +181,21 @@
 
 
 /* Inline functions */
-static inline uint32_t get_ctf_offset(Ctfhandle * ctf)
+static inline uint64_t get_ctf_offset(Ctfhandle * ctf)
 {
   return (ctf->cursor - ctf->start);
 }
 
+/* Return the offset in its CTF file of the first token in a TDN */
+static inline uint64_t tdn_offset(Ctfhandle * ctf, TDN * tdn)
+{
+  return (ctf->files[tdn->fileidx].base + tdn->offset);
+}
+
+/* Return the offset in its CTF file of the file record holding a TDN */
+static inline uint64_t tdn_name_offset(Ctfhandle * ctf, TDN * tdn)
+{
+  return (ctf->files[tdn->fileidx].name_offset);
+}
+
 #endif /* LIBTOKENS_H */
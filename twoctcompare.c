@@ -59,7 +59,7 @@ int main(int argc, char *argv[])
   }
 
   /* Output the ctf header and version 2.1 */
-  fputs("ctf2.1", zout);
+  fputs(CTF_HEADER, zout);
   tokenize(argv[1]);
   putc(EOFTOKEN, zout);
   fclose(zout);
@@ -76,7 +76,7 @@ int main(int argc, char *argv[])
   }
 
   /* Output the ctf header and version 2.1 */
-  fputs("ctf2.1", zout);
+  fputs(CTF_HEADER, zout);
   tokenize(argv[2]);
   putc(EOFTOKEN, zout);
   fclose(zout);